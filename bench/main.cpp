@@ -0,0 +1,519 @@
+#include "source_generator.h"
+#include "parser.h"
+#include "binary_generator.h"
+#include "IncludeCache.h"
+#include "Logger.h"
+#include "version.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The lines of each generated source at scale 1
+#define DEFAULT_LINE_COUNT 4000
+// The timed batches of each benchmark, the median is reported
+#define DEFAULT_SAMPLE_COUNT 5
+// The shortest batch, the iterations are doubled until a batch takes this long
+#define DEFAULT_MIN_SAMPLE_SECONDS 0.05
+// A benchmark slower than the baseline by more than this is reported as a regression
+#define DEFAULT_REGRESSION_PERCENT 10.0
+// The seed of the generated sources, the same in every run so the results are comparable
+#define SOURCE_SEED 1
+// The target with the most memory, so large sources fit
+#define BENCH_TARGET InstructionTarget::XoChip
+// Increased when the meaning of the fields of the JSON output changes
+#define JSON_SCHEMA_VERSION 1
+
+struct BenchOptions
+{
+    std::string jsonPath;
+    std::string baselinePath;
+    // Only the benchmarks whose name contains this are run
+    std::string filter;
+    // Multiplies the lines of the generated sources
+    double scale{1};
+    int sampleCount{DEFAULT_SAMPLE_COUNT};
+    double minSampleSeconds{DEFAULT_MIN_SAMPLE_SECONDS};
+    double regressionPercent{DEFAULT_REGRESSION_PERCENT};
+    // Print the source of this shape instead of running the benchmarks, empty if not requested
+    std::string generatedShape;
+};
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations{};
+    // The time of an iteration
+    double medianNs{};
+    double minNs{};
+    // The work done by an iteration: calls, input bytes and input lines (0 if not applicable)
+    size_t items{};
+    size_t bytes{};
+    size_t lines{};
+};
+
+// The results of the benchmarks are added to this, so the compiler can't remove the work
+static volatile size_t g_sink;
+
+static void printUsageAndExit(char* progName, int status=1)
+{
+    auto& stream = status ? std::cerr : std::cout;
+    stream
+        << "Usage: " << progName << " [OPTION...]"
+        << "\n       -h                  print help message"
+        << "\n       --json [FILE]       write the results as JSON to FILE (- for stdout)"
+        << "\n       --baseline [FILE]   compare the results with the JSON output of an earlier run"
+        << "\n       --threshold [PCT]   report the benchmarks slower than the baseline by more"
+        << "\n                           than PCT percent as regressions (default: " << DEFAULT_REGRESSION_PERCENT << ')'
+        << "\n       --filter [TEXT]     only run the benchmarks whose name contains TEXT"
+        << "\n       --scale [N]         multiply the size of the generated sources (default: 1, "
+        << DEFAULT_LINE_COUNT << " lines)"
+        << "\n       --samples [N]       the timed batches of each benchmark (default: " << DEFAULT_SAMPLE_COUNT << ')'
+        << "\n       --min-time [SEC]    the shortest timed batch (default: " << DEFAULT_MIN_SAMPLE_SECONDS << ')'
+        << "\n       --generate [SHAPE]  print a generated source and exit, SHAPE is one of:"
+        << "\n                           instructions, data, macros, labels, defines"
+        << '\n';
+    exit(status);
+}
+
+static BenchOptions parseBenchArgs(int argc, char** argv)
+{
+    BenchOptions output;
+    for (int i{1}; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        auto getValue{[&]() -> std::string {
+            if (argc-1 < i+1) printUsageAndExit(*argv);
+            return argv[++i];
+        }};
+        try
+        {
+            if (arg.compare("-h") == 0)
+                printUsageAndExit(*argv, 0);
+            else if (arg.compare("--json") == 0)
+                output.jsonPath = getValue();
+            else if (arg.compare("--baseline") == 0)
+                output.baselinePath = getValue();
+            else if (arg.compare("--threshold") == 0)
+                output.regressionPercent = std::stod(getValue());
+            else if (arg.compare("--filter") == 0)
+                output.filter = getValue();
+            else if (arg.compare("--scale") == 0)
+                output.scale = std::stod(getValue());
+            else if (arg.compare("--samples") == 0)
+                output.sampleCount = std::stoi(getValue());
+            else if (arg.compare("--min-time") == 0)
+                output.minSampleSeconds = std::stod(getValue());
+            else if (arg.compare("--generate") == 0)
+                output.generatedShape = getValue();
+            else
+            {
+                Logger::err << "Unknown option: " << arg << Logger::End;
+                printUsageAndExit(*argv);
+            }
+        }
+        catch (std::exception&)
+        {
+            Logger::err << "Invalid value for option: " << arg << Logger::End;
+            printUsageAndExit(*argv);
+        }
+    }
+
+    if (output.scale <= 0 || output.sampleCount < 1 || output.minSampleSeconds <= 0)
+    {
+        Logger::err << "The scale, the samples and the minimum time must be positive" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+    return output;
+}
+
+/*
+ * Times `function` (which returns a value to keep) in batches of iterations.
+ * The iterations are doubled until a batch takes at least the minimum time,
+ * then `sampleCount` batches are timed.
+ */
+template <typename F>
+static BenchResult runBenchmark(const std::string& name, const BenchOptions& options,
+        size_t items, size_t bytes, size_t lines, F function)
+{
+    using Clock = std::chrono::steady_clock;
+    auto timeBatch{[&](uint64_t iterations){
+        const auto begin = Clock::now();
+        size_t sink{};
+        for (uint64_t i{}; i < iterations; ++i)
+            sink += function();
+        g_sink = g_sink + sink;
+        return std::chrono::duration<double>(Clock::now()-begin).count();
+    }};
+
+    uint64_t iterations = 1;
+    while (timeBatch(iterations) < options.minSampleSeconds)
+        iterations *= 2;
+
+    std::vector<double> samples;
+    for (int i{}; i < options.sampleCount; ++i)
+        samples.push_back(timeBatch(iterations)*1e9/iterations);
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.medianNs = samples[samples.size()/2];
+    result.minNs = samples.front();
+    result.items = items;
+    result.bytes = bytes;
+    result.lines = lines;
+    return result;
+}
+
+static size_t countLines(const std::string& str)
+{
+    return std::count(str.begin(), str.end(), '\n');
+}
+
+static std::vector<std::string> splitLines(const std::string& str)
+{
+    std::vector<std::string> output;
+    std::stringstream ss{str};
+    std::string line;
+    while (std::getline(ss, line))
+        output.push_back(std::move(line));
+    return output;
+}
+
+static std::string getSourcePath(SourceShape shape)
+{
+    return std::string{"bench_"} + shapeToStr(shape) + ".asm";
+}
+
+/*
+ * The inputs of the stages, prepared once so each benchmark only times its own stage.
+ */
+struct ShapeInput
+{
+    SourceShape shape;
+    std::string source;
+    Parser::PreprocessedFile preprocessed;
+    Parser::tokenList_t tokens;
+    Parser::labelMap_t labels;
+    ByteList binary;
+};
+
+/*
+ * Generates and assembles the source of the shape.
+ *
+ * Throws if it doesn't assemble.
+ */
+static ShapeInput prepareShape(SourceShape shape, size_t lineCount)
+{
+    ShapeInput input;
+    input.shape = shape;
+    input.source = generateSource(shape, lineCount, SOURCE_SEED);
+    IncludeCache includeCache;
+    input.preprocessed = Parser::preprocessFile(input.source, getSourcePath(shape), {}, &includeCache);
+    Parser::parseTokens(input.preprocessed, &input.tokens, &input.labels);
+    input.binary = generateBinary(input.tokens, input.labels, BENCH_TARGET);
+    return input;
+}
+
+static void runMicroBenchmarks(const BenchOptions& options, const ShapeInput& instructions,
+        std::vector<BenchResult>* results)
+{
+    auto isSelected{[&](const std::string& name){ return name.find(options.filter) != std::string::npos; }};
+
+    if (isSelected("getWord"))
+    {
+        const std::vector<std::string> lines = splitLines(instructions.source);
+        results->push_back(runBenchmark("getWord", options, lines.size(), instructions.source.size(), lines.size(), [&](){
+            size_t wordCount{};
+            for (const std::string& line : lines)
+            {
+                size_t charI{};
+                while (!Parser::getWord(charI, line).empty())
+                    ++wordCount;
+            }
+            return wordCount;
+        }));
+    }
+
+    if (isSelected("stringToUint"))
+    {
+        const std::vector<std::string> literals{
+            "0", "7", "42", "255", "4095", "0x0", "0xff", "0x1A2", "0XFFF", "0b0",
+            "0b1010", "0b11111111", "017", "0777", "'a'", "'Z'", "65535", "0x8000", "123456", "0b1",
+        };
+        results->push_back(runBenchmark("stringToUint", options, literals.size(), 0, 0, [&](){
+            size_t sum{};
+            for (const std::string& literal : literals)
+                sum += Parser::stringToUint(literal, UINT_MAX);
+            return sum;
+        }));
+    }
+
+    if (isSelected("opcodeStrToEnum"))
+    {
+        std::vector<std::string> names;
+        for (int i{}; i < Parser::OPCODE_INVALID; ++i)
+        {
+            names.push_back(Parser::opcodeNames[i]);
+            std::string upper = Parser::opcodeNames[i];
+            for (char& c : upper)
+                c = std::toupper((unsigned char)c);
+            names.push_back(std::move(upper));
+        }
+        // Labels and macro calls are looked up too before they are found not to be instructions
+        names.insert(names.end(), {"main", "loop", "draw_sprite", "sub_00042", "%%wait"});
+        results->push_back(runBenchmark("opcodeStrToEnum", options, names.size(), 0, 0, [&](){
+            size_t sum{};
+            for (const std::string& name : names)
+                sum += Parser::opcodeStrToEnum(name);
+            return sum;
+        }));
+    }
+}
+
+static void runStageBenchmarks(const BenchOptions& options, const ShapeInput& input,
+        std::vector<BenchResult>* results)
+{
+    auto isSelected{[&](const std::string& name){ return name.find(options.filter) != std::string::npos; }};
+    const std::string shapeName = shapeToStr(input.shape);
+    const std::string path = getSourcePath(input.shape);
+    const size_t bytes = input.source.size();
+    const size_t lines = countLines(input.source);
+
+    if (isSelected("preprocessFile/" + shapeName))
+    {
+        results->push_back(runBenchmark("preprocessFile/" + shapeName, options, 1, bytes, lines, [&](){
+            IncludeCache includeCache;
+            return Parser::preprocessFile(input.source, path, {}, &includeCache).content.size();
+        }));
+    }
+
+    if (isSelected("parseTokens/" + shapeName))
+    {
+        results->push_back(runBenchmark("parseTokens/" + shapeName, options, 1, bytes, lines, [&](){
+            Parser::tokenList_t tokens;
+            Parser::labelMap_t labels;
+            Parser::parseTokens(input.preprocessed, &tokens, &labels);
+            return tokens.size();
+        }));
+    }
+
+    if (isSelected("generateBinary/" + shapeName))
+    {
+        results->push_back(runBenchmark("generateBinary/" + shapeName, options, 1, bytes, lines, [&](){
+            return generateBinary(input.tokens, input.labels, BENCH_TARGET).size();
+        }));
+    }
+
+    if (isSelected("assemble/" + shapeName))
+    {
+        results->push_back(runBenchmark("assemble/" + shapeName, options, 1, bytes, lines, [&](){
+            IncludeCache includeCache;
+            const Parser::PreprocessedFile preprocessed = Parser::preprocessFile(input.source, path, {}, &includeCache);
+            Parser::tokenList_t tokens;
+            Parser::labelMap_t labels;
+            Parser::parseTokens(preprocessed, &tokens, &labels);
+            return generateBinary(tokens, labels, BENCH_TARGET).size();
+        }));
+    }
+}
+
+/*
+ * Reads the median times from the JSON output of an earlier run.
+ * Relies on the layout written by `writeJson`: one benchmark per line.
+ *
+ * Throws on error.
+ */
+static std::map<std::string, double> readBaseline(const std::string& filePath)
+{
+    std::ifstream file{filePath};
+    if (!file.is_open())
+        throw std::runtime_error{"Failed to open file: \"" + filePath + '"'};
+
+    std::map<std::string, double> output;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const size_t nameBegin = line.find("{\"name\": \"");
+        const size_t timePos = line.find("\"median_ns\": ");
+        if (nameBegin == std::string::npos || timePos == std::string::npos)
+            continue;
+        const size_t nameEnd = line.find('"', nameBegin+10);
+        output.emplace(line.substr(nameBegin+10, nameEnd-nameBegin-10), std::stod(line.substr(timePos+13)));
+    }
+    if (output.empty())
+        throw std::runtime_error{"No benchmarks found in the baseline: \"" + filePath + '"'};
+    return output;
+}
+
+static std::string formatFixed(double value, int precision)
+{
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(precision) << value;
+    return ss.str();
+}
+
+static std::string formatTime(double ns)
+{
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(ns < 10 ? 2 : 1);
+    if (ns < 1e3)       ss << ns << " ns";
+    else if (ns < 1e6)  ss << ns/1e3 << " us";
+    else if (ns < 1e9)  ss << ns/1e6 << " ms";
+    else                ss << ns/1e9 << " s";
+    return ss.str();
+}
+
+/*
+ * Prints a table of the results and returns the number of regressions against the baseline.
+ */
+static size_t printResults(const std::vector<BenchResult>& results,
+        const std::map<std::string, double>& baseline, double regressionPercent, std::ostream& output)
+{
+    size_t regressionCount{};
+    output << std::left << std::setw(30) << "benchmark" << std::right
+        << std::setw(12) << "time" << std::setw(12) << "per item"
+        << std::setw(10) << "MB/s" << std::setw(14) << "lines/s"
+        << (baseline.empty() ? "" : "    vs baseline") << '\n';
+    for (const BenchResult& result : results)
+    {
+        const double seconds = result.medianNs/1e9;
+        output << std::left << std::setw(30) << result.name << std::right
+            << std::setw(12) << formatTime(result.medianNs)
+            << std::setw(12) << (result.items > 1 ? formatTime(result.medianNs/result.items) : "")
+            << std::setw(10) << (result.bytes ? formatFixed(result.bytes/seconds/1e6, 2) : "")
+            << std::setw(14) << (result.lines ? formatFixed(result.lines/seconds, 0) : "");
+
+        auto found = baseline.find(result.name);
+        if (found != baseline.end())
+        {
+            const double change = (result.medianNs/found->second-1)*100;
+            output << "    " << (change >= 0 ? "+" : "") << formatFixed(change, 1) << '%';
+            if (change > regressionPercent)
+            {
+                output << "  REGRESSION";
+                ++regressionCount;
+            }
+        }
+        output << '\n';
+    }
+    return regressionCount;
+}
+
+static void writeJson(const std::vector<BenchResult>& results, const BenchOptions& options, std::ostream& output)
+{
+#ifdef __OPTIMIZE__
+    const bool isOptimized = true;
+#else
+    const bool isOptimized = false;
+#endif
+    output << "{\n  \"schema\": " << JSON_SCHEMA_VERSION
+        << ",\n  \"version\": \"" CHIP8ASM_VERSION "\""
+        << ",\n  \"optimized\": " << (isOptimized ? "true" : "false")
+        << ",\n  \"scale\": " << options.scale
+        << ",\n  \"seed\": " << SOURCE_SEED
+        << ",\n  \"samples\": " << options.sampleCount
+        << ",\n  \"benchmarks\": [";
+    output << std::fixed << std::setprecision(1);
+    for (size_t i{}; i < results.size(); ++i)
+    {
+        const BenchResult& result = results[i];
+        const double seconds = result.medianNs/1e9;
+        // One benchmark per line, `readBaseline` depends on it
+        output << (i ? "," : "") << "\n    {\"name\": \"" << result.name << '"'
+            << ", \"median_ns\": " << result.medianNs
+            << ", \"min_ns\": " << result.minNs
+            << ", \"iterations\": " << result.iterations
+            << ", \"items\": " << result.items
+            << ", \"bytes\": " << result.bytes
+            << ", \"lines\": " << result.lines
+            << ", \"mb_per_s\": " << (result.bytes ? result.bytes/seconds/1e6 : 0)
+            << ", \"lines_per_s\": " << (result.lines ? result.lines/seconds : 0)
+            << '}';
+    }
+    output << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    Logger::setLoggerVerbosity(Logger::LoggerVerbosity::Quiet);
+    const BenchOptions options = parseBenchArgs(argc, argv);
+    const size_t lineCount = std::max<size_t>(1, DEFAULT_LINE_COUNT*options.scale);
+
+    if (!options.generatedShape.empty())
+    {
+        try
+        {
+            std::cout << generateSource(shapeFromStr(options.generatedShape), lineCount, SOURCE_SEED);
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+        return 0;
+    }
+
+#ifndef __OPTIMIZE__
+    Logger::warn << "Built without optimizations, configure with -DCMAKE_BUILD_TYPE=Release for meaningful results"
+        << Logger::End;
+#endif
+
+    std::map<std::string, double> baseline;
+    if (!options.baselinePath.empty())
+    {
+        try
+        {
+            baseline = readBaseline(options.baselinePath);
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+
+    std::vector<ShapeInput> inputs;
+    for (SourceShape shape : getSourceShapes())
+    {
+        try
+        {
+            inputs.push_back(prepareShape(shape, lineCount));
+        }
+        catch (std::exception& e)
+        {
+            Logger::fatal << "The generated source \"" << shapeToStr(shape) << "\" doesn't assemble: "
+                << e.what() << Logger::End;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    runMicroBenchmarks(options, inputs.front(), &results);
+    for (const ShapeInput& input : inputs)
+        runStageBenchmarks(options, input, &results);
+    if (results.empty())
+        Logger::fatal << "No benchmarks match the filter: \"" << options.filter << '"' << Logger::End;
+
+    // The table goes to stderr if the JSON goes to stdout
+    const size_t regressionCount = printResults(results, baseline, options.regressionPercent,
+            options.jsonPath.compare("-") == 0 ? std::cerr : std::cout);
+
+    if (!options.jsonPath.empty())
+    {
+        if (options.jsonPath.compare("-") == 0)
+        {
+            writeJson(results, options, std::cout);
+        }
+        else
+        {
+            std::ofstream file{options.jsonPath};
+            if (!file.is_open())
+                Logger::fatal << "Failed to open file: \"" << options.jsonPath << '"' << Logger::End;
+            writeJson(results, options, file);
+        }
+    }
+
+    return regressionCount ? 1 : 0;
+}
@@ -0,0 +1,299 @@
+#include "source_generator.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// The instructions in a subroutine of the instruction-heavy source
+#define INSTRUCTIONS_PER_SUBROUTINE 16
+// The `db` lines between the labels of the data-heavy source
+#define DATA_LINES_PER_LABEL 32
+// The bytes of a `db` line
+#define BYTES_PER_DATA_LINE 8
+// The `%define`s of a chain, the value of its head is this
+#define DEFINE_CHAIN_DEPTH 32
+// The addresses of `call` and `jp` are 12 bits, so only the labels in the first 4 KiB are targets:
+// the first subroutines and the first labels of the label-heavy source
+#define REACHABLE_SUBROUTINE_COUNT 96
+#define REACHABLE_LABEL_COUNT 1536
+
+/*
+ * A xorshift generator, so the sources don't depend on the standard library.
+ */
+class Random final
+{
+private:
+    uint32_t m_state;
+
+public:
+    explicit Random(uint32_t seed)
+        : m_state{seed*2654435761u + 1}
+    {
+        if (!m_state)
+            m_state = 1;
+    }
+
+    uint32_t next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        return m_state;
+    }
+
+    // Returns a number in [0, limit)
+    uint32_t below(uint32_t limit) { return next() % limit; }
+};
+
+const std::vector<SourceShape>& getSourceShapes()
+{
+    static const std::vector<SourceShape> shapes{
+        SourceShape::Instructions,
+        SourceShape::Data,
+        SourceShape::Macros,
+        SourceShape::Labels,
+        SourceShape::Defines,
+    };
+    return shapes;
+}
+
+const char* shapeToStr(SourceShape shape)
+{
+    switch (shape)
+    {
+    case SourceShape::Instructions: return "instructions";
+    case SourceShape::Data:         return "data";
+    case SourceShape::Macros:       return "macros";
+    case SourceShape::Labels:       return "labels";
+    case SourceShape::Defines:      return "defines";
+    }
+    return "???";
+}
+
+SourceShape shapeFromStr(const std::string& name)
+{
+    for (SourceShape shape : getSourceShapes())
+    {
+        if (name.compare(shapeToStr(shape)) == 0)
+            return shape;
+    }
+    throw std::invalid_argument{"Invalid source shape: \"" + name + '"'};
+}
+
+static std::string hexStr(uint32_t value, int width)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string output(width, '0');
+    for (int i{width-1}; i >= 0; --i, value >>= 4)
+        output[i] = digits[value & 0xf];
+    return output;
+}
+
+static std::string decStr(uint32_t value, int width)
+{
+    std::string output = std::to_string(value);
+    if ((int)output.size() < width)
+        output.insert(0, width-output.size(), '0');
+    return output;
+}
+
+// Returns a byte literal in a random base, like the ones written by hand
+static std::string byteLiteral(Random& random)
+{
+    const uint32_t value = random.below(256);
+    switch (random.below(4))
+    {
+    case 0: return std::to_string(value);
+    case 1: return "0x" + hexStr(value, 2);
+    case 2:
+    {
+        std::string output = "0b";
+        for (int bit{7}; bit >= 0; --bit)
+            output += (value >> bit & 1) ? '1' : '0';
+        return output;
+    }
+    default:
+        // A letter
+        return std::string{'\'', char('a' + value%26), '\''};
+    }
+}
+
+static std::string vRegister(Random& random)
+{
+    // VF is the flag register, not used as an operand by hand
+    return "v" + hexStr(random.below(15), 1);
+}
+
+/*
+ * Returns a random instruction. `labelPrefix` and `labelCount` give the labels to call and jump to.
+ */
+static std::string randomInstruction(Random& random, const std::string& labelPrefix, size_t labelCount)
+{
+    const std::string label = labelPrefix + decStr(random.below(labelCount), 5);
+    switch (random.below(14))
+    {
+    case 0:  return "ld " + vRegister(random) + ", " + byteLiteral(random);
+    case 1:  return "add " + vRegister(random) + ", " + std::to_string(random.below(256));
+    case 2:  return "ld " + vRegister(random) + ", " + vRegister(random);
+    case 3:  return "add " + vRegister(random) + ", " + vRegister(random);
+    case 4:  return "sub " + vRegister(random) + ", " + vRegister(random);
+    case 5:  return "xor " + vRegister(random) + ", " + vRegister(random) + " ; flip the bits";
+    case 6:  return "and " + vRegister(random) + ", " + vRegister(random);
+    case 7:  return "se " + vRegister(random) + ", 0x" + hexStr(random.below(256), 2);
+    case 8:  return "sne " + vRegister(random) + ", " + vRegister(random);
+    case 9:  return "ld i, long sprite";
+    case 10: return "drw " + vRegister(random) + ", " + vRegister(random) + ", " + std::to_string(1+random.below(15));
+    case 11: return "call " + label;
+    case 12: return "rnd " + vRegister(random) + ", 0b" + std::string(1+random.below(8), '1');
+    default: return "shr " + vRegister(random) + ", " + vRegister(random);
+    }
+}
+
+static const char* spriteData()
+{
+    return "sprite:\n"
+        "    db 0xf0, 0x90, 0x90, 0x90, 0xf0, 0x00\n";
+}
+
+/*
+ * Appends subroutines of `lineCount` lines in total, their lines are returned by `getLine`
+ * from the random generator and the number of subroutines that can be called.
+ */
+template <typename F>
+static void appendSubroutines(std::string* output, Random& random, size_t lineCount, F getLine)
+{
+    const size_t subroutineCount = std::max<size_t>(1, lineCount/(INSTRUCTIONS_PER_SUBROUTINE+1));
+    for (size_t i{}; i < subroutineCount; ++i)
+    {
+        *output += "sub_" + decStr(i, 5) + ":\n";
+        for (int j{}; j < INSTRUCTIONS_PER_SUBROUTINE-1; ++j)
+            *output += "    " + getLine(random, std::min<size_t>(subroutineCount, REACHABLE_SUBROUTINE_COUNT)) + '\n';
+        *output += "    ret\n";
+    }
+}
+
+static std::string generateInstructions(Random& random, size_t lineCount)
+{
+    std::string output = "; Generated: instruction-heavy\n";
+    appendSubroutines(&output, random, lineCount, [](Random& random, size_t subroutineCount){
+        return randomInstruction(random, "sub_", subroutineCount);
+    });
+    return output + spriteData();
+}
+
+static std::string generateData(Random& random, size_t lineCount)
+{
+    std::string output = "; Generated: data-heavy\n";
+    for (size_t i{}; i < lineCount; ++i)
+    {
+        if (i % DATA_LINES_PER_LABEL == 0)
+            output += "data_" + decStr(i/DATA_LINES_PER_LABEL, 5) + ":\n";
+        output += "    db ";
+        for (int j{}; j < BYTES_PER_DATA_LINE; ++j)
+            output += (j ? ", " : "") + byteLiteral(random);
+        output += '\n';
+    }
+    return output;
+}
+
+static std::string generateMacros(Random& random, size_t lineCount)
+{
+    std::string output =
+        "; Generated: macro-heavy\n"
+        "%macro draw_at x, y, height\n"
+        "    ld va, x\n"
+        "    ld vb, y\n"
+        "    drw va, vb, height\n"
+        "%endmacro\n"
+        "%macro glyph_routine bits\n"
+        "    ld i, long %%glyph\n"
+        "    drw va, vb, 2\n"
+        "    ret\n"
+        "%%glyph:\n"
+        "    db bits, bits\n"
+        "%endmacro\n"
+        "%macro add_wrapped reg, value, limit\n"
+        "    add reg, value\n"
+        "    sne reg, limit\n"
+        "    ld reg, 0\n"
+        "%endmacro\n"
+        "main:\n"
+        "    ld i, long sprite\n";
+    for (size_t i{}; i < lineCount; ++i)
+    {
+        // Few different arguments, like real code, so some expansions are cached
+        switch (random.below(3))
+        {
+        case 0:
+            output += "    draw_at " + std::to_string(random.below(8)*8) + ", "
+                + std::to_string(random.below(4)*8) + ", 5\n";
+            break;
+        case 1:
+            output += "    glyph_routine " + byteLiteral(random) + '\n';
+            break;
+        default:
+            output += "    add_wrapped " + vRegister(random) + ", " + std::to_string(1+random.below(4))
+                + ", " + std::to_string(32+random.below(4)*16) + '\n';
+            break;
+        }
+    }
+    return output + "    exit\n" + spriteData();
+}
+
+static std::string generateLabels(Random& random, size_t lineCount)
+{
+    const size_t labelCount = std::max<size_t>(1, lineCount/2);
+    const size_t targetCount = std::min<size_t>(labelCount, REACHABLE_LABEL_COUNT);
+    std::string output = "; Generated: label-heavy\n";
+    for (size_t i{}; i < labelCount; ++i)
+    {
+        const std::string target = "label_" + decStr(random.below(targetCount), 5);
+        output += "label_" + decStr(i, 5) + ":\n";
+        switch (random.below(4))
+        {
+        case 0:  output += "    jp " + target + '\n'; break;
+        case 1:  output += "    call " + target + '\n'; break;
+        case 2:  output += "    ld i, " + target + '\n'; break;
+        default: output += "    " + randomInstruction(random, "label_", targetCount) + '\n'; break;
+        }
+    }
+    return output + spriteData();
+}
+
+static std::string generateDefines(Random& random, size_t lineCount)
+{
+    // A quarter of the lines are the `%define`s
+    const size_t chainCount = std::max<size_t>(1, lineCount/4/DEFINE_CHAIN_DEPTH);
+    std::string output = "; Generated: %define-heavy\n";
+    auto getName{[](size_t chain, size_t depth){ return "CHAIN_" + decStr(chain, 3) + '_' + decStr(depth, 3); }};
+    for (size_t i{}; i < chainCount; ++i)
+    {
+        // Each value references the next name, which comes later in the order the defines are replaced
+        for (size_t j{}; j < DEFINE_CHAIN_DEPTH-1; ++j)
+            output += "%define " + getName(i, j) + " (" + getName(i, j+1) + "+1)\n";
+        output += "%define " + getName(i, DEFINE_CHAIN_DEPTH-1) + " 1\n";
+    }
+
+    const size_t defineLineCount = chainCount*DEFINE_CHAIN_DEPTH;
+    const size_t codeLineCount = lineCount > defineLineCount ? lineCount-defineLineCount : 1;
+    // Half of the instructions use a define
+    appendSubroutines(&output, random, codeLineCount, [&](Random& random, size_t subroutineCount){
+        if (random.below(2))
+            return randomInstruction(random, "sub_", subroutineCount);
+        return "ld " + vRegister(random) + ", " + getName(random.below(chainCount), random.below(DEFINE_CHAIN_DEPTH));
+    });
+    return output + spriteData();
+}
+
+std::string generateSource(SourceShape shape, size_t lineCount, uint32_t seed)
+{
+    Random random{seed};
+    switch (shape)
+    {
+    case SourceShape::Instructions: return generateInstructions(random, lineCount);
+    case SourceShape::Data:         return generateData(random, lineCount);
+    case SourceShape::Macros:       return generateMacros(random, lineCount);
+    case SourceShape::Labels:       return generateLabels(random, lineCount);
+    case SourceShape::Defines:      return generateDefines(random, lineCount);
+    }
+    throw std::invalid_argument{"Invalid source shape"};
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * The kinds of synthetic sources, each one stresses a different part of the assembler.
+ */
+enum class SourceShape
+{
+    Instructions, // Plain instructions in subroutines, with calls and jumps between them
+    Data,         // `db` lines of literals in every base
+    Macros,       // Calls of parameterized macros with local labels
+    Labels,       // A label before every instruction, jumps to random labels
+    Defines,      // Deep chains of `%define`s that reference the next one
+};
+
+[[nodiscard]] const std::vector<SourceShape>& getSourceShapes();
+
+[[nodiscard]] const char* shapeToStr(SourceShape shape);
+
+/*
+ * Returns the shape with the name ("instructions", "data", "macros", "labels" or "defines").
+ *
+ * Throws if the name is invalid.
+ */
+[[nodiscard]] SourceShape shapeFromStr(const std::string& name);
+
+/*
+ * Generates a source of about `lineCount` lines of the shape.
+ * The same arguments always give the same source, on every platform.
+ * The programs fit in the memory of the XO-CHIP target up to about 7000 lines.
+ */
+[[nodiscard]] std::string generateSource(SourceShape shape, size_t lineCount, uint32_t seed);
@@ -0,0 +1,45 @@
+#include "IncludeCache.h"
+
+#include "InputFile.h"
+#include "Logger.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+std::shared_ptr<const IncludeCache::File> IncludeCache::get(const std::string& path)
+{
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0)
+        throw std::runtime_error{"Failed to read file: \"" + path + "\": " + strerror(errno)};
+
+    auto found = m_entries.find(path);
+    if (found != m_entries.end()
+     && found->second.mtime == st.st_mtime
+     && found->second.size == (uintmax_t)st.st_size)
+    {
+        Logger::dbg << "Include cache hit: " << path << Logger::End;
+        ++m_hitCount;
+        return found->second.file;
+    }
+    ++m_missCount;
+
+    InputFile input;
+    input.open(path);
+    const std::string& content = input.getContent();
+
+    auto file = std::make_shared<File>();
+    file->path = std::make_shared<const std::string>(path);
+    size_t lineStart{};
+    while (lineStart < content.size())
+    {
+        size_t lineEnd = content.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+            lineEnd = content.size();
+        file->lines.push_back(content.substr(lineStart, lineEnd-lineStart));
+        lineStart = lineEnd+1;
+    }
+
+    m_entries.insert_or_assign(path, Entry{st.st_mtime, (uintmax_t)st.st_size, file});
+    return file;
+}
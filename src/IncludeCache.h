@@ -0,0 +1,54 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Holds the files read by the `%include` directive.
+ *
+ * Every file is read and split into lines only once per run, even if it is included
+ * by multiple input files. Entries are keyed by the canonical path and are
+ * reloaded if the modification time or the size of the file changes.
+ * Only the text is cached, the lines are parsed with the file that includes them,
+ * since the defines and macros before the `%include` can change their meaning.
+ */
+class IncludeCache final
+{
+public:
+    struct File
+    {
+        // Canonical path of the file
+        std::shared_ptr<const std::string> path;
+        std::vector<std::string> lines;
+    };
+
+private:
+    struct Entry
+    {
+        time_t mtime{};
+        uintmax_t size{};
+        std::shared_ptr<const File> file;
+    };
+
+    std::map<std::string, Entry> m_entries;
+    size_t m_hitCount{};
+    size_t m_missCount{};
+
+public:
+    IncludeCache() {}
+
+    /*
+     * Returns the contents of the file, reading it if it is not cached yet.
+     * `path` should be canonical.
+     *
+     * Throws on error.
+     */
+    std::shared_ptr<const File> get(const std::string& path);
+
+    size_t getHitCount() const { return m_hitCount; }
+    size_t getMissCount() const { return m_missCount; }
+};
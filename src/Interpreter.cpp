@@ -0,0 +1,577 @@
+#include "Interpreter.h"
+#include "instruction_set.h"
+#include "InputFile.h"
+#include "common.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+static const uint8_t fontSprites[16*5] = {
+    0xf0, 0x90, 0x90, 0x90, 0xf0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xf0, 0x10, 0xf0, 0x80, 0xf0, // 2
+    0xf0, 0x10, 0xf0, 0x10, 0xf0, // 3
+    0x90, 0x90, 0xf0, 0x10, 0x10, // 4
+    0xf0, 0x80, 0xf0, 0x10, 0xf0, // 5
+    0xf0, 0x80, 0xf0, 0x90, 0xf0, // 6
+    0xf0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xf0, 0x90, 0xf0, 0x90, 0xf0, // 8
+    0xf0, 0x90, 0xf0, 0x10, 0xf0, // 9
+    0xf0, 0x90, 0xf0, 0x90, 0x90, // A
+    0xe0, 0x90, 0xe0, 0x90, 0xe0, // B
+    0xf0, 0x80, 0x80, 0x80, 0xf0, // C
+    0xe0, 0x90, 0x90, 0x90, 0xe0, // D
+    0xf0, 0x80, 0xf0, 0x80, 0xf0, // E
+    0xf0, 0x80, 0xf0, 0x80, 0x80, // F
+};
+
+InterpreterQuirks quirksFromStr(const std::string& spec)
+{
+    std::vector<std::string> parts;
+    {
+        std::istringstream stream{spec};
+        std::string part;
+        while (std::getline(stream, part, ','))
+            parts.push_back(strToLower(part));
+    }
+    if (parts.empty())
+        throw std::invalid_argument{"Empty quirk profile"};
+
+    InterpreterQuirks quirks;
+    if (parts[0].compare("vip") == 0)
+    {
+        // The defaults
+    }
+    else if (parts[0].compare("schip") == 0)
+    {
+        quirks.vfReset = false;
+        quirks.memoryIncrementsI = false;
+        quirks.displayWait = false;
+        quirks.shiftUsesVy = false;
+        quirks.jumpUsesVx = true;
+    }
+    else if (parts[0].compare("xochip") == 0)
+    {
+        quirks.vfReset = false;
+        quirks.displayWait = false;
+        quirks.clipSprites = false;
+    }
+    else
+    {
+        throw std::invalid_argument{"Invalid quirk profile: \"" + parts[0] + "\", expected \"vip\", \"schip\" or \"xochip\""};
+    }
+
+    for (size_t i{1}; i < parts.size(); ++i)
+    {
+        const std::string& part = parts[i];
+        if (part.size() < 2 || (part[0] != '+' && part[0] != '-'))
+            throw std::invalid_argument{"Invalid quirk change: \"" + part + "\", expected +name or -name"};
+        const bool value = part[0] == '+';
+        const std::string name = part.substr(1);
+        if (name.compare("vfreset") == 0)       quirks.vfReset = value;
+        else if (name.compare("memory") == 0)   quirks.memoryIncrementsI = value;
+        else if (name.compare("dispwait") == 0) quirks.displayWait = value;
+        else if (name.compare("clip") == 0)     quirks.clipSprites = value;
+        else if (name.compare("shift") == 0)    quirks.shiftUsesVy = value;
+        else if (name.compare("jump") == 0)     quirks.jumpUsesVx = value;
+        else throw std::invalid_argument{"Invalid quirk: \"" + name + '"'};
+    }
+    return quirks;
+}
+
+KeyScript loadKeyScript(const std::string& filePath)
+{
+    InputFile file;
+    file.open(filePath);
+
+    KeyScript script;
+    std::istringstream stream{file.getContent()};
+    std::string line;
+    int lineNumber{};
+    while (std::getline(stream, line))
+    {
+        ++lineNumber;
+        std::istringstream lineStream{line};
+        std::string frameStr;
+        if (!(lineStream >> frameStr) || frameStr[0] == ';' || frameStr[0] == '#')
+            continue;
+
+        const std::string location = filePath + ':' + std::to_string(lineNumber) + ": ";
+        std::string keyStr;
+        std::string action;
+        if (!(lineStream >> keyStr >> action))
+            throw std::runtime_error{location + "Expected `frame key down|up|press`"};
+
+        KeyEvent event;
+        try
+        {
+            size_t end{};
+            event.frame = std::stoull(frameStr, &end);
+            if (end != frameStr.size())
+                throw std::invalid_argument{""};
+        }
+        catch (std::exception&)
+        {
+            throw std::runtime_error{location + "Invalid frame number: \"" + frameStr + '"'};
+        }
+        if (keyStr.size() != 1 || !std::isxdigit(keyStr[0]))
+            throw std::runtime_error{location + "Invalid key: \"" + keyStr + "\", expected 0-F"};
+        event.key = std::stoi(keyStr, nullptr, 16);
+
+        action = strToLower(action);
+        if (action.compare("down") == 0 || action.compare("press") == 0)
+        {
+            event.isDown = true;
+            script.push_back(event);
+            if (action.compare("press") == 0)
+                script.push_back({event.frame+1, event.key, false});
+        }
+        else if (action.compare("up") == 0)
+        {
+            event.isDown = false;
+            script.push_back(event);
+        }
+        else
+        {
+            throw std::runtime_error{location + "Invalid key action: \"" + action + "\", expected down, up or press"};
+        }
+    }
+    Logger::dbg << "Loaded key script with " << script.size() << " events" << Logger::End;
+    return script;
+}
+
+const char* stopReasonToStr(Interpreter::StopReason reason)
+{
+    switch (reason)
+    {
+    case Interpreter::StopReason::InstructionLimit: return "instruction limit reached";
+    case Interpreter::StopReason::FrameLimit: return "frame limit reached";
+    case Interpreter::StopReason::Halted: return "halted (jump to itself)";
+    case Interpreter::StopReason::KeyWait: return "waiting for a key after the end of the key script";
+    }
+    return "";
+}
+
+Interpreter::Interpreter(const InterpreterQuirks& quirks, unsigned int instructionsPerFrame, uint32_t seed)
+    : m_quirks{quirks}, m_instructionsPerFrame{std::max(instructionsPerFrame, 1u)},
+      // Spread the bits of small seeds, xorshift would start with small numbers
+      m_rngState{(seed * 2654435761u) ^ 0x2545f491}
+{
+    if (!m_rngState) // Xorshift doesn't work with 0
+        m_rngState = 1;
+    std::memcpy(m_memory+CHIP8_FONT_ADDRESS, fontSprites, sizeof(fontSprites));
+}
+
+void Interpreter::loadRom(const uint8_t* data, size_t size)
+{
+    if (size > ROM_MAX_SIZE)
+        throw std::runtime_error{"The program is too large to run: " + std::to_string(size)
+            + " bytes, the limit is " + std::to_string(ROM_MAX_SIZE)};
+    std::memcpy(m_memory+ROM_LOAD_OFFSET, data, size);
+}
+
+void Interpreter::setKeyScript(KeyScript script)
+{
+    m_keyScript = std::move(script);
+    std::stable_sort(m_keyScript.begin(), m_keyScript.end(),
+            [](const KeyEvent& a, const KeyEvent& b){ return a.frame < b.frame; });
+    m_nextKeyEvent = 0;
+}
+
+void Interpreter::startFrame()
+{
+    if (m_frameCount)
+    {
+        if (m_delayTimer) --m_delayTimer;
+        if (m_soundTimer) --m_soundTimer;
+    }
+    while (m_nextKeyEvent < m_keyScript.size() && m_keyScript[m_nextKeyEvent].frame <= m_frameCount)
+    {
+        const KeyEvent& event = m_keyScript[m_nextKeyEvent++];
+        if (event.isDown)
+            m_keyStates |= 1u << event.key;
+        else
+            m_keyStates &= ~(1u << event.key);
+    }
+    ++m_frameCount;
+    m_frameInstructionsLeft = m_instructionsPerFrame;
+}
+
+uint8_t Interpreter::nextRandom()
+{
+    m_rngState ^= m_rngState << 13;
+    m_rngState ^= m_rngState >> 17;
+    m_rngState ^= m_rngState << 5;
+    return m_rngState >> 24;
+}
+
+void Interpreter::drawSprite(uint8_t x, uint8_t y, uint8_t height)
+{
+    x %= CHIP8_SCREEN_WIDTH;
+    y %= CHIP8_SCREEN_HEIGHT;
+    bool collided = false;
+    for (uint8_t row{}; row < height; ++row)
+    {
+        size_t line = y+row;
+        if (line >= CHIP8_SCREEN_HEIGHT)
+        {
+            if (m_quirks.clipSprites)
+                break;
+            line %= CHIP8_SCREEN_HEIGHT;
+        }
+        const uint64_t sprite = (uint64_t)m_memory[(m_i+row) % CHIP8_MEMORY_SIZE] << (CHIP8_SCREEN_WIDTH-8);
+        uint64_t bits = sprite >> x;
+        if (!m_quirks.clipSprites && x > CHIP8_SCREEN_WIDTH-8)
+            bits |= sprite << (CHIP8_SCREEN_WIDTH-x);
+        collided |= (m_screen[line] & bits) != 0;
+        m_screen[line] ^= bits;
+    }
+    m_v[0xf] = collided;
+}
+
+template <bool hasObserver>
+bool Interpreter::execute(uint64_t count, StopReason* stopReason)
+{
+    uint16_t pc = m_pc;
+    uint8_t* const v = m_v;
+    uint8_t* const mem = m_memory;
+    const InstructionKind* const decodeTable = getInstructionDecodeTable();
+    auto fail{[&](const std::string& message){
+        m_pc = pc;
+        throw std::runtime_error{"At address 0x" + intToHexStr(pc) + ": " + message};
+    }};
+
+    uint64_t executed{};
+    for (; executed < count; ++executed)
+    {
+        // An instruction at the last address wraps around to the first byte
+        const uint16_t word = mem[pc] << 8 | mem[(pc+1) % CHIP8_MEMORY_SIZE];
+        const uint16_t address = pc;
+        pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+        if constexpr (hasObserver)
+            m_observer->onInstruction(address, word);
+
+        switch (decodeTable[word])
+        {
+        case InstructionKind::Invalid:
+            pc = address;
+            fail("Invalid instruction: 0x" + intToHexStr(word));
+            break;
+
+        case InstructionKind::Cls:
+            std::memset(m_screen, 0, sizeof(m_screen));
+            break;
+
+        case InstructionKind::Ret:
+            if (!m_sp)
+            {
+                pc = address;
+                fail("Return with an empty stack");
+            }
+            pc = m_stack[--m_sp];
+            if constexpr (hasObserver)
+                m_observer->onReturn();
+            break;
+
+        case InstructionKind::Sys:
+            // `nop` is 0000, the other machine code routines can't run here
+            if (word)
+            {
+                pc = address;
+                fail("Machine code routines are not supported: 0x" + intToHexStr(word));
+            }
+            break;
+
+        case InstructionKind::Jp:
+            if (getNnn(word) == address)
+            {
+                m_pc = address;
+                m_instructionCount += executed+1;
+                *stopReason = StopReason::Halted;
+                return false;
+            }
+            pc = getNnn(word);
+            break;
+
+        case InstructionKind::Call:
+            if (m_sp == CHIP8_STACK_SIZE)
+            {
+                pc = address;
+                fail("Stack overflow");
+            }
+            m_stack[m_sp++] = pc;
+            pc = getNnn(word);
+            if constexpr (hasObserver)
+                m_observer->onCall(pc);
+            break;
+
+        case InstructionKind::SeVxByte:
+            if (v[getX(word)] == getKk(word)) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::SneVxByte:
+            if (v[getX(word)] != getKk(word)) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::SeVxVy:
+            if (v[getX(word)] == v[getY(word)]) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::LdVxByte:
+            v[getX(word)] = getKk(word);
+            break;
+
+        case InstructionKind::AddVxByte:
+            v[getX(word)] += getKk(word);
+            break;
+
+        case InstructionKind::LdVxVy:
+            v[getX(word)] = v[getY(word)];
+            break;
+
+        case InstructionKind::OrVxVy:
+            v[getX(word)] |= v[getY(word)];
+            if (m_quirks.vfReset) v[0xf] = 0;
+            break;
+
+        case InstructionKind::AndVxVy:
+            v[getX(word)] &= v[getY(word)];
+            if (m_quirks.vfReset) v[0xf] = 0;
+            break;
+
+        case InstructionKind::XorVxVy:
+            v[getX(word)] ^= v[getY(word)];
+            if (m_quirks.vfReset) v[0xf] = 0;
+            break;
+
+        case InstructionKind::AddVxVy:
+        {
+            const unsigned int sum = v[getX(word)] + v[getY(word)];
+            v[getX(word)] = sum;
+            v[0xf] = sum >> 8;
+            break;
+        }
+
+        case InstructionKind::SubVxVy:
+        {
+            const bool noBorrow = v[getX(word)] >= v[getY(word)];
+            v[getX(word)] -= v[getY(word)];
+            v[0xf] = noBorrow;
+            break;
+        }
+
+        case InstructionKind::ShrVxVy:
+        {
+            const uint8_t value = v[m_quirks.shiftUsesVy ? getY(word) : getX(word)];
+            v[getX(word)] = value >> 1;
+            v[0xf] = value & 1;
+            break;
+        }
+
+        case InstructionKind::SubnVxVy:
+        {
+            const bool noBorrow = v[getY(word)] >= v[getX(word)];
+            v[getX(word)] = v[getY(word)] - v[getX(word)];
+            v[0xf] = noBorrow;
+            break;
+        }
+
+        case InstructionKind::ShlVxVy:
+        {
+            const uint8_t value = v[m_quirks.shiftUsesVy ? getY(word) : getX(word)];
+            v[getX(word)] = value << 1;
+            v[0xf] = value >> 7;
+            break;
+        }
+
+        case InstructionKind::SneVxVy:
+            if (v[getX(word)] != v[getY(word)]) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::LdIAddr:
+            m_i = getNnn(word);
+            break;
+
+        case InstructionKind::JpV0Addr:
+            pc = (getNnn(word) + v[m_quirks.jumpUsesVx ? getX(word) : 0]) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::RndVxByte:
+            v[getX(word)] = nextRandom() & getKk(word);
+            break;
+
+        case InstructionKind::DrwVxVyN:
+            drawSprite(v[getX(word)], v[getY(word)], getN(word));
+            if (m_quirks.displayWait)
+            {
+                // The rest of the frame is spent waiting for the vertical blank
+                m_pc = pc;
+                m_instructionCount += executed+1;
+                m_frameInstructionsLeft = 0;
+                return true;
+            }
+            break;
+
+        case InstructionKind::SkpVx:
+            if (m_keyStates >> (v[getX(word)] & 0xf) & 1) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::SknpVx:
+            if (!(m_keyStates >> (v[getX(word)] & 0xf) & 1)) pc = (pc + 2) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::LdVxDt:
+            v[getX(word)] = m_delayTimer;
+            break;
+
+        case InstructionKind::LdVxK:
+        {
+            // Wait for a key to be pressed and released
+            if (m_waitedKey == -1)
+            {
+                for (int key{}; key < 16; ++key)
+                {
+                    if (m_keyStates >> key & 1)
+                    {
+                        m_waitedKey = key;
+                        break;
+                    }
+                }
+            }
+            if (m_waitedKey != -1 && !(m_keyStates >> m_waitedKey & 1))
+            {
+                v[getX(word)] = m_waitedKey;
+                m_waitedKey = -1;
+                break;
+            }
+
+            m_pc = address;
+            m_instructionCount += executed+1;
+            if (m_nextKeyEvent == m_keyScript.size())
+            {
+                *stopReason = StopReason::KeyWait;
+                return false;
+            }
+            // Nothing happens until the keys change
+            m_frameInstructionsLeft = 0;
+            return true;
+        }
+
+        case InstructionKind::LdDtVx:
+            m_delayTimer = v[getX(word)];
+            break;
+
+        case InstructionKind::LdStVx:
+            m_soundTimer = v[getX(word)];
+            break;
+
+        case InstructionKind::AddIVx:
+            m_i = (m_i + v[getX(word)]) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::LdFVx:
+            m_i = CHIP8_FONT_ADDRESS + (v[getX(word)] & 0xf)*5;
+            break;
+
+        case InstructionKind::LdBVx:
+        {
+            const uint8_t value = v[getX(word)];
+            mem[m_i] = value / 100;
+            mem[(m_i+1) % CHIP8_MEMORY_SIZE] = value / 10 % 10;
+            mem[(m_i+2) % CHIP8_MEMORY_SIZE] = value % 10;
+            break;
+        }
+
+        case InstructionKind::LdIAddrVx:
+            for (uint8_t reg{}; reg <= getX(word); ++reg)
+                mem[(m_i+reg) % CHIP8_MEMORY_SIZE] = v[reg];
+            if (m_quirks.memoryIncrementsI)
+                m_i = (m_i + getX(word) + 1) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::LdVxIAddr:
+            for (uint8_t reg{}; reg <= getX(word); ++reg)
+                v[reg] = mem[(m_i+reg) % CHIP8_MEMORY_SIZE];
+            if (m_quirks.memoryIncrementsI)
+                m_i = (m_i + getX(word) + 1) % CHIP8_MEMORY_SIZE;
+            break;
+
+        case InstructionKind::Scd:
+        case InstructionKind::Scr:
+        case InstructionKind::Scl:
+        case InstructionKind::Exit:
+        case InstructionKind::Low:
+        case InstructionKind::High:
+        case InstructionKind::LdHfVx:
+        case InstructionKind::LdRVx:
+        case InstructionKind::LdVxR:
+        case InstructionKind::SaveVxVy:
+        case InstructionKind::LoadVxVy:
+        case InstructionKind::LdILong:
+        case InstructionKind::Plane:
+        case InstructionKind::Audio:
+            pc = address;
+            fail("The instruction 0x" + intToHexStr(word) + " needs the "
+                    + targetToStr(getInstructionEncoding(decodeTable[word]).target)
+                    + " target, only CHIP-8 programs can run");
+            break;
+
+        case InstructionKind::Count:
+            break;
+        }
+    }
+
+    m_pc = pc;
+    m_instructionCount += executed;
+    m_frameInstructionsLeft -= executed;
+    return true;
+}
+
+Interpreter::StopReason Interpreter::run(uint64_t instructionLimit, uint64_t frameLimit)
+{
+    StopReason stopReason = StopReason::InstructionLimit;
+    while (m_instructionCount < instructionLimit)
+    {
+        if (!m_frameInstructionsLeft)
+        {
+            if (m_frameCount >= frameLimit)
+            {
+                stopReason = StopReason::FrameLimit;
+                break;
+            }
+            startFrame();
+        }
+        const uint64_t count = std::min(m_frameInstructionsLeft, instructionLimit-m_instructionCount);
+        if (!(m_observer ? execute<true>(count, &stopReason) : execute<false>(count, &stopReason)))
+            break;
+    }
+    return stopReason;
+}
+
+void Interpreter::writeRegisterDump(std::ostream& output) const
+{
+    output << std::hex << std::setfill('0')
+        << "PC: 0x" << std::setw(3) << m_pc << "  I: 0x" << std::setw(3) << m_i
+        << "  DT: 0x" << std::setw(2) << +m_delayTimer << "  ST: 0x" << std::setw(2) << +m_soundTimer << '\n';
+    for (size_t i{}; i < 16; ++i)
+        output << 'V' << std::uppercase << i << std::nouppercase << ": 0x" << std::setw(2) << +m_v[i]
+            << (i % 8 == 7 ? '\n' : ' ');
+    output << "Stack:";
+    for (size_t i{}; i < m_sp; ++i)
+        output << " 0x" << std::setw(3) << m_stack[i];
+    output << (m_sp ? "\n" : " empty\n");
+    output << std::dec << std::setfill(' ')
+        << "Instructions: " << m_instructionCount << "  Frames: " << m_frameCount << '\n';
+}
+
+void Interpreter::writeScreenDump(std::ostream& output) const
+{
+    for (size_t y{}; y < CHIP8_SCREEN_HEIGHT; ++y)
+    {
+        for (size_t x{}; x < CHIP8_SCREEN_WIDTH; ++x)
+            output << (getPixel(x, y) ? '#' : '.');
+        output << '\n';
+    }
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "binary_generator.h"
+
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define CHIP8_MEMORY_SIZE   0x1000
+#define CHIP8_STACK_SIZE    16
+#define CHIP8_SCREEN_WIDTH  64
+#define CHIP8_SCREEN_HEIGHT 32
+// Where the built-in hexadecimal font is stored, 5 bytes per digit
+#define CHIP8_FONT_ADDRESS  0x000
+
+/*
+ * The behaviors that differ between interpreters.
+ * The defaults are the ones of the original COSMAC VIP interpreter.
+ */
+struct InterpreterQuirks
+{
+    // `and`, `or` and `xor` set VF to 0
+    bool vfReset = true;
+    // `ld [i], vx` and `ld vx, [i]` leave I after the last register
+    bool memoryIncrementsI = true;
+    // `drw` waits for the next frame
+    bool displayWait = true;
+    // Sprites are clipped at the edges of the screen instead of wrapping around
+    bool clipSprites = true;
+    // `shr` and `shl` shift Vy into Vx instead of shifting Vx
+    bool shiftUsesVy = true;
+    // `jp v0, nnn` jumps to Vx+nnn, where x is the highest nibble of nnn
+    bool jumpUsesVx = false;
+};
+
+/*
+ * Parses a quirk profile ("vip", "schip" or "xochip"), optionally followed by changes,
+ * e.g. "schip,+vfreset,-clip". The quirks are named vfreset, memory, dispwait, clip, shift and jump.
+ *
+ * Throws if the specification is invalid.
+ */
+[[nodiscard]] InterpreterQuirks quirksFromStr(const std::string& spec);
+
+struct KeyEvent
+{
+    // The frame at the start of which the event happens
+    uint64_t frame{};
+    // 0x0-0xF
+    uint8_t key{};
+    bool isDown{};
+};
+
+using KeyScript = std::vector<KeyEvent>;
+
+/*
+ * Loads a key script. Each line is `frame key down|up|press`, where the key is a hexadecimal digit
+ * and `press` releases the key in the next frame. Comments start with `;` or `#`.
+ *
+ * Throws on error.
+ */
+[[nodiscard]] KeyScript loadKeyScript(const std::string& filePath);
+
+/*
+ * Receives the events of a run, e.g. to profile it.
+ */
+class ExecutionObserver
+{
+public:
+    // Called before the instruction is executed
+    virtual void onInstruction(uint16_t address, uint16_t word) = 0;
+    // Called after the instruction `call` has jumped
+    virtual void onCall(uint16_t target) = 0;
+    // Called after the instruction `ret` has jumped
+    virtual void onReturn() = 0;
+
+    virtual ~ExecutionObserver() {}
+};
+
+/*
+ * A headless CHIP-8 interpreter.
+ * Time is measured in frames of a fixed number of instructions, so the runs are deterministic.
+ */
+class Interpreter final
+{
+public:
+    enum class StopReason
+    {
+        InstructionLimit,
+        FrameLimit,
+        // The program jumped to the jump itself, so it can't do anything anymore
+        Halted,
+        // The program waits for a key, but the key script has ended
+        KeyWait,
+    };
+
+private:
+    InterpreterQuirks m_quirks;
+    unsigned int m_instructionsPerFrame{};
+    ExecutionObserver* m_observer{};
+
+    uint8_t m_memory[CHIP8_MEMORY_SIZE]{};
+    uint8_t m_v[16]{};
+    uint16_t m_i{};
+    uint16_t m_pc = ROM_LOAD_OFFSET;
+    uint16_t m_stack[CHIP8_STACK_SIZE]{};
+    uint8_t m_sp{};
+    uint8_t m_delayTimer{};
+    uint8_t m_soundTimer{};
+    // A row per line, the most significant bit is the leftmost pixel
+    uint64_t m_screen[CHIP8_SCREEN_HEIGHT]{};
+
+    // A bit per key
+    uint16_t m_keyStates{};
+    // The key `ld vx, k` waits to be released, or -1
+    int m_waitedKey = -1;
+    KeyScript m_keyScript;
+    size_t m_nextKeyEvent{};
+
+    uint32_t m_rngState{};
+    uint64_t m_instructionCount{};
+    uint64_t m_frameCount{};
+    // The instructions left in the current frame
+    uint64_t m_frameInstructionsLeft{};
+
+    void startFrame();
+    uint8_t nextRandom();
+    void drawSprite(uint8_t x, uint8_t y, uint8_t height);
+    /*
+     * Executes at most `count` instructions, returns false if the program stopped.
+     * A separate instance notifies the observer, so the runs without one are not slowed down.
+     */
+    template <bool hasObserver>
+    bool execute(uint64_t count, StopReason* stopReason);
+
+public:
+    Interpreter(const InterpreterQuirks& quirks, unsigned int instructionsPerFrame, uint32_t seed);
+
+    /*
+     * Loads the program at `ROM_LOAD_OFFSET`.
+     *
+     * Throws if it doesn't fit in the memory.
+     */
+    void loadRom(const uint8_t* data, size_t size);
+
+    void setKeyScript(KeyScript script);
+
+    // The observer must outlive the runs, nullptr to remove it
+    void setObserver(ExecutionObserver* observer) { m_observer = observer; }
+
+    /*
+     * Runs until the program stops, `instructionLimit` instructions are executed in total
+     * or `frameLimit` frames are over.
+     *
+     * Throws if the program does something invalid, e.g. overflows the stack.
+     */
+    StopReason run(uint64_t instructionLimit, uint64_t frameLimit=UINT64_MAX);
+
+    uint16_t getPc() const { return m_pc; }
+    uint16_t getI() const { return m_i; }
+    uint8_t getV(size_t index) const { return m_v[index]; }
+    uint8_t getDelayTimer() const { return m_delayTimer; }
+    uint8_t getSoundTimer() const { return m_soundTimer; }
+    uint8_t getMemory(uint16_t address) const { return m_memory[address % CHIP8_MEMORY_SIZE]; }
+    bool getPixel(size_t x, size_t y) const { return m_screen[y] >> (CHIP8_SCREEN_WIDTH-1-x) & 1; }
+    uint64_t getInstructionCount() const { return m_instructionCount; }
+    uint64_t getFrameCount() const { return m_frameCount; }
+
+    /*
+     * Writes the registers, the stack and the counters.
+     */
+    void writeRegisterDump(std::ostream& output) const;
+
+    /*
+     * Writes the screen, '#' for the pixels that are on and '.' for the ones that are off.
+     */
+    void writeScreenDump(std::ostream& output) const;
+};
+
+[[nodiscard]] const char* stopReasonToStr(Interpreter::StopReason reason);
@@ -1,14 +1,86 @@
 #include "Logger.h"
 
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+
 namespace Logger
 {
 
+// The number of logger types
+#define LOGGER_TYPE_COUNT 5
+
+// The lines being written by the thread, one for each logger type
+static thread_local std::ostringstream t_lineStreams[LOGGER_TYPE_COUNT];
+// The capture of the thread, null if the lines are printed
+static thread_local Capture* t_capture{};
+// Keeps the lines of the threads from mixing
+static std::mutex g_outputMutex;
+
 Logger dbg{Logger::Type::Debug};
 Logger log{Logger::Type::Log};
 Logger warn{Logger::Type::Warning};
 Logger err{Logger::Type::Error};
 Logger fatal{Logger::Type::Fatal};
 
+/*
+ * Prints a line with the prefix of the logger type.
+ */
+static void writeLine(Logger::Type type, const std::string& text)
+{
+    std::lock_guard<std::mutex> lock{g_outputMutex};
+    switch (type)
+    {
+    case Logger::Type::Debug:   std::cout << LOGGER_COLOR_DBG "[DBG]" LOGGER_COLOR_DEF ": " << text << '\n'; break;
+    case Logger::Type::Log:     std::cout << LOGGER_COLOR_LOG "[INFO]" LOGGER_COLOR_DEF ": " << text << '\n'; break;
+    case Logger::Type::Warning: std::cerr << LOGGER_COLOR_WARN "[WARN]" LOGGER_COLOR_DEF ": " << text << '\n'; break;
+    case Logger::Type::Error:   std::cerr << LOGGER_COLOR_ERR "[ERR]" LOGGER_COLOR_DEF ": " << text << '\n'; break;
+    case Logger::Type::Fatal:
+        std::cerr << LOGGER_COLOR_FATAL "[FATAL]" LOGGER_COLOR_DEF ": " << text << '\n';
+        std::cerr << "\n==================== Fatal error. Exiting. ====================\n";
+        break;
+    }
+}
+
+std::ostream& Logger::getLineStream() const
+{
+    return t_lineStreams[(int)m_type];
+}
+
+void Logger::endLine()
+{
+    std::ostringstream& stream = t_lineStreams[(int)m_type];
+    const std::string text = stream.str();
+    // Also resets the formatting, e.g. std::hex, for the next line
+    stream = std::ostringstream{};
+
+    if (t_capture && m_type != Type::Fatal)
+    {
+        t_capture->m_messages.push_back({m_type, text});
+        return;
+    }
+    writeLine(m_type, text);
+    if (m_type == Type::Fatal)
+        exit(1);
+}
+
+Capture::Capture()
+    : m_previous{t_capture}
+{
+    t_capture = this;
+}
+
+Capture::~Capture()
+{
+    t_capture = m_previous;
+}
+
+void writeCaptured(const std::vector<CapturedMessage>& messages, const std::string& prefix)
+{
+    for (const CapturedMessage& message : messages)
+        writeLine(message.type, prefix + message.text);
+}
+
 void setLoggerVerbosity(LoggerVerbosity verbosity)
 {
     switch (verbosity)
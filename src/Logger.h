@@ -1,6 +1,8 @@
 #pragma once
 
 #include <iostream>
+#include <string>
+#include <vector>
 
 #define LOGGER_COLOR_DEF   "\033[0m"
 #define LOGGER_COLOR_DBG   "\033[96m"
@@ -27,6 +29,8 @@ enum Control
     End, // Can be used to mark the end of the line
 };
 
+class Capture;
+
 class Logger final
 {
 public:
@@ -43,8 +47,6 @@ public:
     };
 
 private:
-    // Whether this is the beginning of the line
-    bool m_isBeginning{true};
     // The logger type: info, error, etc.
     Type m_type{};
     // If this logger object is enabled
@@ -52,6 +54,11 @@ private:
 
     friend void setLoggerVerbosity(LoggerVerbosity verbosity);
 
+    // The line being written by the calling thread, each thread has its own
+    std::ostream& getLineStream() const;
+    // Writes the line of the calling thread or adds it to the capture of the thread
+    void endLine();
+
 public:
     Logger(Type type)
         : m_type{type}
@@ -64,19 +71,7 @@ public:
         if (!m_isEnabled)
             return *this;
 
-        // If this is the beginning of the line, print the "initial"
-        // depending on the logger type
-        switch (m_type)
-        {
-        case Type::Debug:   std::cout << (m_isBeginning ? LOGGER_COLOR_DBG "[DBG]" LOGGER_COLOR_DEF ": " : "") << value; break;
-        case Type::Log:     std::cout << (m_isBeginning ? LOGGER_COLOR_LOG "[INFO]" LOGGER_COLOR_DEF ": " : "") << value; break;
-        case Type::Warning: std::cerr << (m_isBeginning ? LOGGER_COLOR_WARN "[WARN]" LOGGER_COLOR_DEF ": " : "")  << value; break;
-        case Type::Error:   std::cerr << (m_isBeginning ? LOGGER_COLOR_ERR "[ERR]" LOGGER_COLOR_DEF ": " : "")   << value; break;
-        case Type::Fatal:   std::cerr << (m_isBeginning ? LOGGER_COLOR_FATAL "[FATAL]" LOGGER_COLOR_DEF ": " : "") << value; break;
-        default: abort();
-        }
-
-        m_isBeginning = false;
+        getLineStream() << value;
 
         // Make the operator chainable
         return *this;
@@ -89,33 +84,50 @@ public:
         if (ctrl != End)
             return *this;
 
-        switch (m_type)
-        {
-        case Type::Debug:
-        case Type::Log:
-            std::cout << '\n';
-            break;
-
-        case Type::Warning:
-        case Type::Error:
-            std::cerr << '\n';
-            break;
-
-        case Type::Fatal:
-            std::cerr << '\n';
-            std::cerr << "\n==================== Fatal error. Exiting. ====================\n";
-            exit(1);
-            break;
-        }
-
-        // We printed the \n, to this is the beginning of the new line
-        m_isBeginning = true;
+        endLine();
 
         // Make the operator chainable
         return *this;
     }
 };
 
+/*
+ * A line written while a `Capture` was active.
+ */
+struct CapturedMessage
+{
+    Logger::Type type{};
+    std::string text;
+};
+
+/*
+ * Collects the lines written by the thread that created it while it exists, instead of printing them.
+ * Used by the worker threads, so their messages are printed together by the main thread.
+ * Fatal messages are not captured, they still exit.
+ */
+class Capture final
+{
+private:
+    std::vector<CapturedMessage> m_messages;
+    // The capture that was active before this one
+    Capture* m_previous{};
+
+    friend class Logger;
+
+public:
+    Capture();
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+    ~Capture();
+
+    [[nodiscard]] std::vector<CapturedMessage> takeMessages() { return std::move(m_messages); }
+};
+
+/*
+ * Writes the captured lines with their loggers, each one prefixed with `prefix`.
+ */
+void writeCaptured(const std::vector<CapturedMessage>& messages, const std::string& prefix);
+
 /*
  * Logger object instances with different types
  */
@@ -0,0 +1,53 @@
+#include "MappedFile.h"
+
+#include "Logger.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdexcept>
+
+void MappedFile::close()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+void MappedFile::open(const std::string& filePath)
+{
+    Logger::dbg << "Mapping file: " << filePath << Logger::End;
+
+    close();
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error{"Failed to open file: \"" + filePath + "\": " + strerror(errno)};
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0)
+    {
+        const int error = errno;
+        ::close(fd);
+        throw std::runtime_error{"Failed to open file: \"" + filePath + "\": " + strerror(error)};
+    }
+
+    // Mapping an empty file fails, but there is nothing to map anyway
+    if (st.st_size > 0)
+    {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error{"Failed to map file: \"" + filePath + "\": " + strerror(error)};
+        }
+        m_data = data;
+        m_size = st.st_size;
+    }
+    ::close(fd);
+    m_filePath = filePath;
+}
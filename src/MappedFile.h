@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * A read-only memory mapping of a file.
+ * Used to embed binary files without reading them through a buffer.
+ */
+class MappedFile final
+{
+private:
+    std::string m_filePath;
+    void* m_data{};
+    size_t m_size{};
+
+    void close();
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    /*
+     * Maps the specified file.
+     *
+     * Throws on error.
+     */
+    void open(const std::string& filePath);
+
+    const uint8_t* getData() const { return (const uint8_t*)m_data; }
+    size_t getSize() const { return m_size; }
+    const std::string& getFilePath() const { return m_filePath; }
+};
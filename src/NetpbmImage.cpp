@@ -0,0 +1,148 @@
+#include "NetpbmImage.h"
+
+#include "InputFile.h"
+#include "Logger.h"
+
+#include <cctype>
+#include <stdexcept>
+
+/*
+ * Reads an unsigned decimal integer from the header or from the ASCII raster.
+ * Skips whitespace and comments before the number.
+ */
+static size_t readAsciiUint(const std::string& data, size_t& pos)
+{
+    while (pos < data.size())
+    {
+        if (data[pos] == '#')
+        {
+            while (pos < data.size() && data[pos] != '\n')
+                ++pos;
+        }
+        else if (isspace((unsigned char)data[pos]))
+        {
+            ++pos;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (pos >= data.size() || !isdigit((unsigned char)data[pos]))
+        throw std::runtime_error{"Unexpected end of file or invalid character"};
+
+    size_t value{};
+    while (pos < data.size() && isdigit((unsigned char)data[pos]))
+    {
+        value = value*10 + (data[pos++]-'0');
+        if (value > 0xffffff)
+            throw std::runtime_error{"Value too large"};
+    }
+    return value;
+}
+
+/*
+ * Reads a single 0/1 digit from a P1 raster, where digits don't need to be separated.
+ */
+static bool readAsciiBit(const std::string& data, size_t& pos)
+{
+    while (pos < data.size() && (isspace((unsigned char)data[pos]) || data[pos] == '#'))
+    {
+        if (data[pos] == '#')
+        {
+            while (pos < data.size() && data[pos] != '\n')
+                ++pos;
+        }
+        else
+        {
+            ++pos;
+        }
+    }
+
+    if (pos >= data.size() || (data[pos] != '0' && data[pos] != '1'))
+        throw std::runtime_error{"Unexpected end of file or invalid character"};
+    return data[pos++] == '1';
+}
+
+void NetpbmImage::open(const std::string& filePath)
+{
+    Logger::dbg << "Loading image: " << filePath << Logger::End;
+
+    InputFile file;
+    file.open(filePath);
+    const std::string& data = file.getContent();
+
+    try
+    {
+        if (data.size() < 2 || data[0] != 'P' || data[1] < '1' || data[1] > '5' || data[1] == '3')
+            throw std::runtime_error{"Not a PBM or PGM file"};
+        const char format = data[1];
+        const bool isBitmap = (format == '1' || format == '4');
+
+        size_t pos{2};
+        const size_t width = readAsciiUint(data, pos);
+        const size_t height = readAsciiUint(data, pos);
+        const size_t maxVal = isBitmap ? 1 : readAsciiUint(data, pos);
+        if (width == 0 || height == 0)
+            throw std::runtime_error{"Empty image"};
+        if (maxVal == 0 || maxVal > 0xffff)
+            throw std::runtime_error{"Invalid maximum gray value"};
+
+        std::vector<uint8_t> pixels(width*height);
+        switch (format)
+        {
+        case '1': // ASCII bitmap
+            for (size_t i{}; i < pixels.size(); ++i)
+                pixels[i] = readAsciiBit(data, pos);
+            break;
+
+        case '2': // ASCII graymap
+            for (size_t i{}; i < pixels.size(); ++i)
+                pixels[i] = readAsciiUint(data, pos) < (maxVal+1)/2;
+            break;
+
+        case '4': // Binary bitmap, rows are padded to whole bytes
+        {
+            ++pos; // Single whitespace after the header
+            const size_t rowBytes = (width+7)/8;
+            if (data.size() < pos+rowBytes*height)
+                throw std::runtime_error{"Unexpected end of file"};
+            for (size_t y{}; y < height; ++y)
+            {
+                for (size_t x{}; x < width; ++x)
+                {
+                    const uint8_t byte = data[pos+y*rowBytes+x/8];
+                    pixels[y*width+x] = (byte >> (7-x%8)) & 1;
+                }
+            }
+            break;
+        }
+
+        case '5': // Binary graymap, 1 or 2 bytes per pixel
+        {
+            ++pos; // Single whitespace after the header
+            const size_t bytesPerPixel = maxVal > 255 ? 2 : 1;
+            if (data.size() < pos+pixels.size()*bytesPerPixel)
+                throw std::runtime_error{"Unexpected end of file"};
+            for (size_t i{}; i < pixels.size(); ++i)
+            {
+                size_t value = (uint8_t)data[pos+i*bytesPerPixel];
+                if (bytesPerPixel == 2)
+                    value = (value << 8) | (uint8_t)data[pos+i*bytesPerPixel+1];
+                pixels[i] = value < (maxVal+1)/2;
+            }
+            break;
+        }
+        }
+
+        m_width = width;
+        m_height = height;
+        m_pixels = std::move(pixels);
+    }
+    catch (std::exception& e)
+    {
+        throw std::runtime_error{"Failed to load image: \"" + filePath + "\": " + e.what()};
+    }
+    m_filePath = filePath;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * A black and white image loaded from a PBM (P1, P4) or PGM (P2, P5) file.
+ * Black (or dark gray) pixels are set, white (or light gray) pixels are cleared.
+ */
+class NetpbmImage final
+{
+private:
+    std::string m_filePath;
+    size_t m_width{};
+    size_t m_height{};
+    // One byte per pixel, row by row, 1 if set
+    std::vector<uint8_t> m_pixels;
+
+public:
+    NetpbmImage() {}
+
+    /*
+     * Loads the specified file.
+     *
+     * Throws on error.
+     */
+    void open(const std::string& filePath);
+
+    size_t getWidth() const { return m_width; }
+    size_t getHeight() const { return m_height; }
+    bool getPixel(size_t x, size_t y) const { return m_pixels[y*m_width+x]; }
+    const std::string& getFilePath() const { return m_filePath; }
+};
@@ -0,0 +1,208 @@
+#include "Profiler.h"
+#include "InputFile.h"
+#include "common.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+
+Profiler::Profiler(const Parser::tokenList_t& tokens, CostProfile costProfile)
+    : m_tokens{tokens}, m_costProfile{costProfile},
+      m_instructions(CHIP8_MEMORY_SIZE), m_hits(CHIP8_MEMORY_SIZE), m_costs(CHIP8_MEMORY_SIZE)
+{
+    size_t address = ROM_LOAD_OFFSET;
+    std::string currentLabel;
+    for (size_t i{}; i < tokens.size() && address < CHIP8_MEMORY_SIZE; ++i)
+    {
+        if (auto label = dynamic_cast<const Parser::Label*>(tokens[i].get()))
+        {
+            m_labelsByAddress.emplace(address, label->name);
+            currentLabel = label->name;
+        }
+        else if (auto opcode = dynamic_cast<const Parser::Opcode*>(tokens[i].get()))
+        {
+            InstructionInfo& info = m_instructions[address];
+            info.tokenIndex = i;
+            info.label = currentLabel;
+            const CostRange cost = getInstructionCost(*opcode, costProfile);
+            const bool isSkip = opcode->opcode == Parser::OPCODE_SE || opcode->opcode == Parser::OPCODE_SNE
+                || opcode->opcode == Parser::OPCODE_SKP || opcode->opcode == Parser::OPCODE_SKNP;
+            info.cost = isSkip ? cost.best : cost.worst;
+            info.skipExtraCost = isSkip ? cost.worst-cost.best : 0;
+            info.isDraw = opcode->opcode == Parser::OPCODE_DRW;
+        }
+        address += tokens[i]->getSize();
+    }
+
+    StackNode root;
+    root.name = getFunctionName(ROM_LOAD_OFFSET);
+    m_stackNodes.push_back(std::move(root));
+}
+
+std::string Profiler::getFunctionName(uint16_t address) const
+{
+    auto found = m_labelsByAddress.find(address);
+    if (found != m_labelsByAddress.end())
+        return found->second;
+    return "0x" + intToHexStr(address);
+}
+
+void Profiler::onInstruction(uint16_t address, uint16_t)
+{
+    if (m_pendingSkip != -1)
+    {
+        // The skip doesn't change the function, so the current one is charged
+        if (address != (m_pendingSkip+2) % CHIP8_MEMORY_SIZE)
+        {
+            const uint64_t extraCost = m_instructions[m_pendingSkip].skipExtraCost;
+            m_costs[m_pendingSkip] += extraCost;
+            m_stackNodes[m_currentNode].cost += extraCost;
+            m_totalCost += extraCost;
+        }
+        m_pendingSkip = -1;
+    }
+
+    const InstructionInfo& info = m_instructions[address];
+    ++m_hits[address];
+    m_costs[address] += info.cost;
+    m_stackNodes[m_currentNode].cost += info.cost;
+    m_totalCost += info.cost;
+    if (info.skipExtraCost)
+        m_pendingSkip = address;
+}
+
+void Profiler::onCall(uint16_t target)
+{
+    ++m_callCounts[target];
+    auto found = m_stackNodes[m_currentNode].children.find(target);
+    if (found != m_stackNodes[m_currentNode].children.end())
+    {
+        m_currentNode = found->second;
+        return;
+    }
+
+    StackNode node;
+    node.parent = m_currentNode;
+    node.name = getFunctionName(target);
+    m_stackNodes.push_back(std::move(node));
+    m_stackNodes[m_currentNode].children.emplace(target, m_stackNodes.size()-1);
+    m_currentNode = m_stackNodes.size()-1;
+}
+
+void Profiler::onReturn()
+{
+    if (m_currentNode)
+        m_currentNode = m_stackNodes[m_currentNode].parent;
+}
+
+struct ProfileCounts
+{
+    uint64_t hits{};
+    uint64_t cost{};
+    uint64_t draws{};
+    uint64_t calls{};
+};
+
+static void writeCounts(std::ostream& output, const ProfileCounts& counts, uint64_t totalCost)
+{
+    output << std::setw(10) << counts.hits << ' ' << std::setw(12) << counts.cost << ' '
+        << std::setw(6) << std::fixed << std::setprecision(1)
+        << (totalCost ? counts.cost*100.0/totalCost : 0.0) << "% " << std::setw(8) << counts.draws;
+}
+
+void Profiler::writeListing(std::ostream& output) const
+{
+    // Sum the counts of the source lines and the labels
+    std::vector<std::string> filePaths;
+    std::map<std::string, std::map<int, ProfileCounts>> lineCounts;
+    std::map<std::string, ProfileCounts> labelCounts;
+    for (size_t address{}; address < CHIP8_MEMORY_SIZE; ++address)
+    {
+        const InstructionInfo& info = m_instructions[address];
+        if (info.tokenIndex == SIZE_MAX)
+            continue;
+        const Parser::Token& token = *m_tokens[info.tokenIndex];
+        const std::string filePath = token.getFilePath() ? *token.getFilePath() : "?";
+        if (!lineCounts.count(filePath))
+            filePaths.push_back(filePath);
+
+        const uint64_t hits = m_hits[address];
+        for (ProfileCounts* counts : {&lineCounts[filePath][token.getLineNumber()], &labelCounts[info.label]})
+        {
+            counts->hits += hits;
+            counts->cost += m_costs[address];
+            counts->draws += info.isDraw ? hits : 0;
+        }
+    }
+    for (const auto& call : m_callCounts)
+    {
+        auto label = m_labelsByAddress.find(call.first);
+        if (label != m_labelsByAddress.end())
+            labelCounts[label->second].calls += call.second;
+    }
+
+    output << "; Profile, total cost: " << m_totalCost << ' ' << costProfileToStr(m_costProfile) << '\n'
+        << ";     Hits         Cost   Cost%    Draws | Source\n";
+    for (const auto& filePath : filePaths)
+    {
+        output << "; ----- " << filePath << " -----\n";
+        const std::map<int, ProfileCounts>& counts = lineCounts.at(filePath);
+
+        std::vector<std::string> lines;
+        try
+        {
+            InputFile file;
+            file.open(filePath);
+            std::istringstream stream{file.getContent()};
+            std::string line;
+            while (std::getline(stream, line))
+                lines.push_back(line);
+        }
+        catch (std::exception& e)
+        {
+            Logger::warn << e.what() << Logger::End;
+        }
+
+        const int lineCount = std::max<int>(lines.size(), counts.empty() ? 0 : counts.rbegin()->first);
+        for (int lineNumber{1}; lineNumber <= lineCount; ++lineNumber)
+        {
+            auto found = counts.find(lineNumber);
+            if (found != counts.end())
+                writeCounts(output, found->second, m_totalCost);
+            else
+                output << std::string(10+1+12+1+6+2+8, ' ');
+            output << " | ";
+            if ((size_t)lineNumber <= lines.size())
+                output << lines[lineNumber-1];
+            output << '\n';
+        }
+    }
+
+    std::vector<std::pair<std::string, ProfileCounts>> labels{labelCounts.begin(), labelCounts.end()};
+    std::stable_sort(labels.begin(), labels.end(), [](const auto& a, const auto& b){
+        return a.second.cost > b.second.cost;
+    });
+    output << "\n; ----- Labels -----\n"
+        << ";     Hits         Cost   Cost%    Draws    Calls | Label\n";
+    for (const auto& label : labels)
+    {
+        writeCounts(output, label.second, m_totalCost);
+        output << ' ' << std::setw(8) << label.second.calls << " | "
+            << (label.first.empty() ? "(before the first label)" : label.first) << '\n';
+    }
+}
+
+void Profiler::writeFoldedStacks(std::ostream& output) const
+{
+    std::function<void(size_t, const std::string&)> writeNode{[&](size_t nodeI, const std::string& parentPath){
+        const StackNode& node = m_stackNodes[nodeI];
+        const std::string path = parentPath.empty() ? node.name : parentPath + ';' + node.name;
+        if (node.cost)
+            output << path << ' ' << node.cost << '\n';
+        for (const auto& child : node.children)
+            writeNode(child.second, path);
+    }};
+    writeNode(0, "");
+}
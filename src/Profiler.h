@@ -0,0 +1,87 @@
+#pragma once
+
+#include "Interpreter.h"
+#include "cycle_analysis.h"
+#include "parser.h"
+
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Collects the hit counts, costs and `drw` counts of the instructions of a run,
+ * and maps them back to the source lines and labels.
+ *
+ * The cost of an instruction is its worst case cost in the cost profile,
+ * except for the skips, whose extra cost is only charged when they skip.
+ */
+class Profiler final : public ExecutionObserver
+{
+private:
+    struct InstructionInfo
+    {
+        // Index of the token, `SIZE_MAX` if no instruction starts at the address
+        size_t tokenIndex = SIZE_MAX;
+        // The closest label before the instruction, empty if none
+        std::string label;
+        // The cost when a skip doesn't skip
+        uint64_t cost{};
+        // What a skip costs more when it skips, 0 for the other instructions
+        uint64_t skipExtraCost{};
+        bool isDraw{};
+    };
+
+    // A function in the call tree, the root is the code that runs without a call
+    struct StackNode
+    {
+        size_t parent{};
+        // The name of the called function
+        std::string name;
+        // Called address -> child node
+        std::map<uint16_t, size_t> children;
+        uint64_t cost{};
+    };
+
+    const Parser::tokenList_t& m_tokens;
+    CostProfile m_costProfile;
+    // Indexed by address
+    std::vector<InstructionInfo> m_instructions;
+    std::vector<uint64_t> m_hits;
+    std::vector<uint64_t> m_costs;
+    // Address -> the first label at the address
+    std::map<uint16_t, std::string> m_labelsByAddress;
+    // Called address -> number of calls
+    std::map<uint16_t, uint64_t> m_callCounts;
+
+    std::vector<StackNode> m_stackNodes;
+    size_t m_currentNode{};
+    uint64_t m_totalCost{};
+    // The address of the last skip if it was the previous instruction, the next address tells if it skipped
+    int m_pendingSkip = -1;
+
+    std::string getFunctionName(uint16_t address) const;
+
+public:
+    /*
+     * The token list must outlive the profiler and must be the one the program was generated from.
+     */
+    Profiler(const Parser::tokenList_t& tokens, CostProfile costProfile);
+
+    void onInstruction(uint16_t address, uint16_t word) override;
+    void onCall(uint16_t target) override;
+    void onReturn() override;
+
+    /*
+     * Writes the source files with the counts of every line,
+     * followed by the counts of every label.
+     */
+    void writeListing(std::ostream& output) const;
+
+    /*
+     * Writes the costs of the call stacks in the folded format of flame graph tools,
+     * one `caller;callee cost` line per stack.
+     */
+    void writeFoldedStacks(std::ostream& output) const;
+};
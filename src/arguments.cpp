@@ -1,4 +1,6 @@
 #include "arguments.h"
+#include "build_variants.h"
+#include "rom_patch.h"
 #include "Logger.h"
 #include "version.h"
 
@@ -34,13 +36,87 @@ static void printUsageAndExit(char* progName, int status=1)
 {
     auto& stream = status ? std::cerr : std::cout;
     stream
-        << "Usage: " << progName << " [OPTION...] [FILE]"
+        << "Usage: " << progName << " [OPTION...] [FILE...]"
         << "\n       -h                  print help message"
         << "\n       -v                  print version and exit"
         << "\n       -l                  print license and exit"
         << "\n       -o [FILE]           write output to specified file"
+        << "\n                           (only with a single input file, the default is output.ch8,"
+        << "\n                           with multiple input files each is written next to its input"
+        << "\n                           with a .ch8 extension)"
+        << "\n       -I [DIR]            add a directory to the %include search path"
+        << "\n       -D [NAME[=VALUE]]   define NAME as VALUE (default: 1), replacing a %define of the source"
+        << "\n       --variants [FILE]   assemble a build for each line of `name NAME=VALUE...`, with the"
+        << "\n                           defines of the line, in parallel; each is written to the output"
+        << "\n                           path with -name before the extension"
         << "\n       -                   print the raw output to stdout"
         << "\n       -x                  output a hexdump"
+        << "\n       -MD                 write a Makefile rule of the files the output depends on"
+        << "\n                           (the input, the included and embedded files) to the output"
+        << "\n                           path with a .d extension"
+        << "\n       -MF [FILE]          write the rule of -MD to FILE (only with a single input file)"
+        << "\n       -O0                 disable optimizations (default)"
+        << "\n       -O1                 enable peephole optimizations"
+        << "\n       -O2                 also remove unreachable code, dead stores, redundant loads"
+        << "\n                           and unreferenced data"
+        << "\n       -O3                 also inline small leaf subroutines"
+        << "\n       --inline-budget [N] let the inliner grow the program by at most N bytes"
+        << "\n                           (default: the remaining ROM space)"
+        << "\n       --inline-profile [FILE]"
+        << "\n                           inline the subroutines by call counts"
+        << "\n                           (lines of `label count`)"
+        << "\n       --pack-data         merge the identical data blocks and overlap the ones where the"
+        << "\n                           end of one is the start of another (works at every -O level)"
+        << "\n       --analyze-cycles    print the cost of the blocks, subroutines, loops and frames"
+        << "\n                           and warn about frames over budget and deep calls"
+        << "\n       --cost-profile [NAME]"
+        << "\n                           cost model of the analysis: vip (COSMAC VIP timings,"
+        << "\n                           default) or modern (instructions per frame)"
+        << "\n       --frame-budget [N]  the cost that fits in a frame (default depends on the profile)"
+        << "\n       --target [NAME]     instruction set and memory size: chip8 (default), schip"
+        << "\n                           (SUPER-CHIP) or xochip (XO-CHIP, 64 KiB)"
+        << "\n       --rom-limit [N]     fail if the program is larger than N bytes (default: the memory"
+        << "\n                           of the target above 0x200, 3584 for chip8, 0 for no limit)"
+        << "\n       --size-report       print the ROM space used by the code and data of each label"
+        << "\n       -L [FILE]           write a listing of the addresses, encoded bytes and source lines"
+        << "\n                           (only with a single input file)"
+        << "\n       --debug-map [FILE]  write the map of the address ranges to the source lines and"
+        << "\n                           the symbol table for tools (only with a single input file)"
+        << "\n       --cfg-dot [FILE]    write the control-flow graph in Graphviz DOT format"
+        << "\n                           (only with a single input file)"
+        << "\n       --patch-against [FILE]"
+        << "\n                           write a patch from the ROM FILE to the output (with --patch-out)"
+        << "\n       --patch-out [FILE]  where to write the patch, the format is chosen by the extension:"
+        << "\n                           .ips or .bps (BPS copies moved code, so its patches are smaller)"
+        << "\n       --stable-layout [FILE]"
+        << "\n                           keep the labels at their addresses in the debug map FILE of the"
+        << "\n                           previous build where possible, padding the code after jumps"
+        << "\n                           (for smaller patches)"
+        << "\n       --disasm            disassemble the input ROMs to source that reassembles to the same"
+        << "\n                           bytes (written to stdout if -o is not given)"
+        << "\n       --run               run the program (a source or a .ch8/.c8 ROM) in the built-in"
+        << "\n                           interpreter and print the registers and the screen at exit"
+        << "\n                           (the output is only written if -o is given; the interpreter,"
+        << "\n                           also used by --profile, --folded and --test, runs only CHIP-8)"
+        << "\n       --quirks [SPEC]     quirk profile of the interpreter: vip (default), schip or xochip,"
+        << "\n                           followed by changes, e.g. schip,+vfreset,-clip (quirks: vfreset,"
+        << "\n                           memory, dispwait, clip, shift, jump)"
+        << "\n       --seed [N]          seed of the random numbers of the interpreter (default: 0)"
+        << "\n       --keys [FILE]       key presses of the interpreter (lines of `frame key down|up|press`)"
+        << "\n       --cycles [N]        stop the interpreter after N instructions (default: 10000000)"
+        << "\n       --ipf [N]           instructions per frame of the interpreter (default: 15)"
+        << "\n       --frames [N]        stop the interpreter after N frames"
+        << "\n       --profile [FILE]    run the program and write the source annotated with the hits,"
+        << "\n                           costs (of --cost-profile) and draws of the lines and labels"
+        << "\n                           (- for stdout, the output is only written if -o is given)"
+        << "\n       --folded [FILE]     run the program and write the costs of the call stacks"
+        << "\n                           in the folded format of flame graph tools"
+        << "\n       --test              assemble and run the inputs as tests, checking their %assert_at"
+        << "\n                           and %expect_screen directives (nothing is written)"
+        << "\n       -j, --jobs [N]      number of tests or variants assembled in parallel"
+        << "\n                           (default: one per core)"
+        << "\n       --junit [FILE]      write the test results in JUnit XML format (- for stdout)"
+        << "\n       --json [FILE]       write the test results in JSON format (- for stdout)"
         << "\n       -q                  be quiet (default verbosity)"
         << "\n       -V                  be verbose"
         << "\n       -d                  print debug messages"
@@ -79,6 +155,44 @@ Options parseArgs(int argc, char** argv)
                 if (argc-1 < i+1) printUsageAndExit(*argv);
                 output.outputFilePath = argv[++i];
             }
+            else if (arg.compare("-I") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.includeDirs.push_back(argv[++i]);
+            }
+            else if (arg.size() > 2 && arg.compare(0, 2, "-I") == 0)
+            {
+                output.includeDirs.push_back(arg.substr(2));
+            }
+            else if (arg.compare("-D") == 0 || (arg.size() > 2 && arg.compare(0, 2, "-D") == 0))
+            {
+                if (arg.size() == 2 && argc-1 < i+1) printUsageAndExit(*argv);
+                const std::string define = (arg.size() == 2 ? argv[++i] : arg.substr(2));
+                try
+                {
+                    parseDefine(define, &output.defines);
+                }
+                catch (std::exception& e)
+                {
+                    Logger::err << e.what() << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("-MD") == 0)
+            {
+                output.shouldWriteDepFile = true;
+            }
+            else if (arg.compare("-MF") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.depFilePath = argv[++i];
+                output.shouldWriteDepFile = true;
+            }
+            else if (arg.compare("--variants") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.variantsFilePath = argv[++i];
+            }
             else if (arg.compare("-") == 0)
             {
                 output.outputFilePath = "-"; // stdout
@@ -99,6 +213,242 @@ Options parseArgs(int argc, char** argv)
             {
                 output.shouldOutputHexdump = true;
             }
+            else if (arg.compare("-O0") == 0)
+            {
+                output.optimizationLevel = 0;
+            }
+            else if (arg.compare("-O1") == 0)
+            {
+                output.optimizationLevel = 1;
+            }
+            else if (arg.compare("-O2") == 0)
+            {
+                output.optimizationLevel = 2;
+            }
+            else if (arg.compare("-O3") == 0)
+            {
+                output.optimizationLevel = 3;
+            }
+            else if (arg.compare("--pack-data") == 0)
+            {
+                output.shouldPackData = true;
+            }
+            else if (arg.compare("--inline-budget") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.inlineBudget = std::stoi(argv[++i]);
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid inline budget: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--inline-profile") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.inlineProfilePath = argv[++i];
+            }
+            else if (arg.compare("--analyze-cycles") == 0)
+            {
+                output.shouldAnalyzeCycles = true;
+            }
+            else if (arg.compare("--cost-profile") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.costProfile = argv[++i];
+            }
+            else if (arg.compare("--frame-budget") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.frameBudget = std::stoull(argv[++i]);
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid frame budget: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--target") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.target = targetFromStr(argv[++i]);
+                }
+                catch (std::exception& e)
+                {
+                    Logger::err << e.what() << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--rom-limit") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.romLimit = std::stoull(argv[++i], nullptr, 0);
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid ROM limit: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--size-report") == 0)
+            {
+                output.shouldReportSize = true;
+            }
+            else if (arg.compare("-L") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.listingFilePath = argv[++i];
+            }
+            else if (arg.compare("--debug-map") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.debugMapFilePath = argv[++i];
+            }
+            else if (arg.compare("--cfg-dot") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.cfgDotFilePath = argv[++i];
+            }
+            else if (arg.compare("--patch-against") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.patchBasePath = argv[++i];
+            }
+            else if (arg.compare("--patch-out") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.patchOutputPath = argv[++i];
+            }
+            else if (arg.compare("--stable-layout") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.stableLayoutPath = argv[++i];
+            }
+            else if (arg.compare("--disasm") == 0)
+            {
+                output.shouldDisassemble = true;
+            }
+            else if (arg.compare("--run") == 0)
+            {
+                output.shouldRun = true;
+            }
+            else if (arg.compare("--quirks") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.quirks = argv[++i];
+            }
+            else if (arg.compare("--seed") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    const unsigned long long value = std::stoull(argv[++i]);
+                    if (value > UINT32_MAX)
+                        throw std::out_of_range{""};
+                    output.seed = value;
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid seed: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--keys") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.keyScriptPath = argv[++i];
+            }
+            else if (arg.compare("--cycles") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.instructionLimit = std::stoull(argv[++i]);
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid instruction limit: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--frames") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    output.frameLimit = std::stoull(argv[++i]);
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid frame limit: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--profile") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.profileListingPath = argv[++i];
+            }
+            else if (arg.compare("--folded") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.foldedStacksPath = argv[++i];
+            }
+            else if (arg.compare("--test") == 0)
+            {
+                output.shouldTest = true;
+            }
+            else if (arg.compare("-j") == 0 || arg.compare("--jobs") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    const int value = std::stoi(argv[++i]);
+                    if (value <= 0)
+                        throw std::out_of_range{""};
+                    output.jobCount = value;
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid job count: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
+            else if (arg.compare("--junit") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.junitReportPath = argv[++i];
+            }
+            else if (arg.compare("--json") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                output.jsonReportPath = argv[++i];
+            }
+            else if (arg.compare("--ipf") == 0)
+            {
+                if (argc-1 < i+1) printUsageAndExit(*argv);
+                try
+                {
+                    const int value = std::stoi(argv[++i]);
+                    if (value <= 0)
+                        throw std::out_of_range{""};
+                    output.instructionsPerFrame = value;
+                }
+                catch (std::exception&)
+                {
+                    Logger::err << "Invalid instructions per frame: \"" << argv[i] << '"' << Logger::End;
+                    printUsageAndExit(*argv);
+                }
+            }
             else
             {
                 Logger::err << "Invalid argument: \"" << arg << '"' << Logger::End;
@@ -107,25 +457,120 @@ Options parseArgs(int argc, char** argv)
         }
         else // Input file
         {
-            if (!output.inputFilePath.empty())
-            {
-                // We've already found an input file
-                Logger::err << "Multiple input files specified" << Logger::End;
-                printUsageAndExit(*argv);
-            }
-            else
-            {
-                output.inputFilePath = arg;
-            }
+            output.inputFilePaths.push_back(arg);
         }
     }
 
-    if (output.inputFilePath.empty())
+    if (output.inputFilePaths.empty())
     {
         Logger::err << "No input file specified" << Logger::End;
         printUsageAndExit(*argv);
     }
 
+    if (output.inputFilePaths.size() > 1 && !output.outputFilePath.empty())
+    {
+        Logger::err << "The output file can't be specified with multiple input files" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.inputFilePaths.size() > 1 && (!output.listingFilePath.empty() || !output.debugMapFilePath.empty()))
+    {
+        Logger::err << "The listing and the debug map can't be written with multiple input files" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.romLimit == SIZE_MAX)
+        output.romLimit = getTargetMemorySize(output.target)-ROM_LOAD_OFFSET;
+
+    if (output.inputFilePaths.size() > 1 && !output.cfgDotFilePath.empty())
+    {
+        Logger::err << "The control-flow graph can't be written with multiple input files" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.inputFilePaths.size() > 1 && (!output.profileListingPath.empty() || !output.foldedStacksPath.empty()))
+    {
+        Logger::err << "The profile can't be written with multiple input files" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.shouldDisassemble && (output.shouldRun || output.shouldTest
+     || !output.profileListingPath.empty() || !output.foldedStacksPath.empty()))
+    {
+        Logger::err << "--disasm can't be combined with running the program" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    // The interpreter has the memory and the screen of CHIP-8
+    if (output.target != InstructionTarget::Chip8 && (output.shouldRun || output.shouldTest
+     || !output.profileListingPath.empty() || !output.foldedStacksPath.empty()))
+    {
+        Logger::err << "The built-in interpreter only runs CHIP-8 programs, --run, --test, --profile and --folded "
+            "can't be used with --target " << targetToStr(output.target) << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.patchBasePath.empty() != output.patchOutputPath.empty())
+    {
+        Logger::err << "--patch-against and --patch-out must be given together" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (!output.patchOutputPath.empty())
+    {
+        try
+        {
+            (void)patchFormatFromPath(output.patchOutputPath);
+        }
+        catch (std::exception& e)
+        {
+            Logger::err << e.what() << Logger::End;
+            printUsageAndExit(*argv);
+        }
+    }
+
+    if ((output.inputFilePaths.size() > 1 || !output.variantsFilePath.empty() || output.shouldTest
+     || output.shouldDisassemble) && (!output.patchOutputPath.empty() || !output.stableLayoutPath.empty()))
+    {
+        Logger::err << "The patch and the stable layout need a single program to assemble" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.inputFilePaths.size() > 1 && !output.depFilePath.empty())
+    {
+        Logger::err << "The dependency file can't be specified with multiple input files" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (output.shouldWriteDepFile && (output.outputFilePath.compare("-") == 0 || output.shouldTest
+     || output.shouldDisassemble || (output.outputFilePath.empty() && (output.shouldRun
+     || !output.profileListingPath.empty() || !output.foldedStacksPath.empty()))))
+    {
+        Logger::err << "The dependency file needs an output file" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (!output.variantsFilePath.empty() && (output.shouldRun || output.shouldTest || output.shouldDisassemble
+     || !output.profileListingPath.empty() || !output.foldedStacksPath.empty()))
+    {
+        Logger::err << "--variants can't be combined with running or disassembling the program" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (!output.variantsFilePath.empty() && (output.outputFilePath.compare("-") == 0
+     || !output.listingFilePath.empty() || !output.debugMapFilePath.empty() || !output.cfgDotFilePath.empty()
+     || output.shouldReportSize || output.shouldAnalyzeCycles))
+    {
+        Logger::err << "--variants only writes the programs, not stdout or the reports" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
+    if (!output.shouldTest && (!output.junitReportPath.empty() || !output.jsonReportPath.empty()))
+    {
+        Logger::err << "The test reports can only be written with --test" << Logger::End;
+        printUsageAndExit(*argv);
+    }
+
     return output;
 }
 
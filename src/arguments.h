@@ -1,13 +1,84 @@
 #pragma once
 
 #include "Logger.h"
+#include "binary_generator.h"
+#include "instruction_set.h"
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 struct Options
 {
-    std::string inputFilePath;
-    std::string outputFilePath = "output.ch8";
+    std::vector<std::string> inputFilePaths;
+    // Empty if not specified, in that case a default is chosen
+    std::string outputFilePath;
+    std::vector<std::string> includeDirs;
+    // Given with -D, replace the `%define`s with the same name
+    Parser::defineMap_t defines;
+    // The list of the builds with different defines, empty if not specified
+    std::string variantsFilePath;
     bool shouldOutputHexdump = false;
+    // Write a Makefile rule of the files the output depends on
+    bool shouldWriteDepFile = false;
+    // Where to write it, empty for the output path with a .d extension
+    std::string depFilePath;
+    // 0: no optimizations, 1: peephole optimizations, 2: dataflow optimizations, 3: inlining
+    int optimizationLevel = 0;
+    // The most bytes the inliner may add, negative for the remaining ROM space
+    int inlineBudget = -1;
+    // The call counts for the inliner, empty if not specified
+    std::string inlineProfilePath;
+    // Merge the identical and overlapping data blocks
+    bool shouldPackData = false;
+    // The instruction set and the memory size
+    InstructionTarget target = InstructionTarget::Chip8;
+    // The most bytes the program may take up, 0 for no limit
+    // (the default is the memory of the target above ROM_LOAD_OFFSET)
+    size_t romLimit = SIZE_MAX;
+    // Print the ROM space used by each label
+    bool shouldReportSize = false;
+    bool shouldAnalyzeCycles = false;
+    // "vip" or "modern"
+    std::string costProfile = "vip";
+    // 0 to use the default of the cost profile
+    uint64_t frameBudget{};
+    // Where to write the listing, empty if not requested
+    std::string listingFilePath;
+    // Where to write the address to source line map, empty if not requested
+    std::string debugMapFilePath;
+    // Where to write the control-flow graph in DOT format, empty if not requested
+    std::string cfgDotFilePath;
+    // The previous build to write a patch against, empty if not requested
+    std::string patchBasePath;
+    // Where to write the patch (.ips or .bps)
+    std::string patchOutputPath;
+    // The debug map of the previous build, to keep its label addresses, empty if not requested
+    std::string stableLayoutPath;
+    // Write the source of the input ROMs instead of assembling them
+    bool shouldDisassemble = false;
+    // Run the program in the built-in interpreter instead of writing it
+    bool shouldRun = false;
+    // The quirk profile of the interpreter, e.g. "vip" or "schip,-clip"
+    std::string quirks = "vip";
+    uint32_t seed{};
+    // Scripted key presses for the interpreter, empty if not specified
+    std::string keyScriptPath;
+    // The number of instructions after which the interpreter stops
+    uint64_t instructionLimit = 10000000;
+    unsigned int instructionsPerFrame = 15;
+    // The number of frames after which the interpreter stops, 0 for no limit
+    uint64_t frameLimit{};
+    // Where to write the annotated listing of the profile, empty if not requested
+    std::string profileListingPath;
+    // Where to write the folded call stacks of the profile, empty if not requested
+    std::string foldedStacksPath;
+    // Assemble and run the inputs as tests instead of writing them
+    bool shouldTest = false;
+    // The number of tests or variants assembled in parallel, 0 for one per core
+    unsigned int jobCount{};
+    // Where to write the test results, empty if not requested
+    std::string junitReportPath;
+    std::string jsonReportPath;
     Logger::LoggerVerbosity verbosity = Logger::LoggerVerbosity::Quiet;
 };
 
@@ -0,0 +1,46 @@
+#include "assembler.h"
+#include "optimizer.h"
+#include "register_allocator.h"
+#include "source_map.h"
+#include "stable_layout.h"
+#include "Logger.h"
+
+AssembledProgram assembleProgram(
+        const Parser::PreprocessedFile& file, const Options& options, const InlineProfile* inlineProfile,
+        Parser::TestDirectives* testDirectives, Parser::ParseCache* parseCache, SourceMap* sourceMap)
+{
+    AssembledProgram program;
+
+    Parser::parseTokens(file, &program.tokens, &program.labels, testDirectives, parseCache);
+    Logger::dbg << "Found " << program.tokens.size() << " tokens and " << program.labels.size() << " labels" << Logger::End;
+
+    allocateRegisters(&program.tokens, &program.labels);
+
+    OptimizerOptions optimizerOptions;
+    optimizerOptions.level = options.optimizationLevel;
+    optimizerOptions.inlineBudget = options.inlineBudget;
+    optimizerOptions.shouldPackData = options.shouldPackData;
+    optimizerOptions.inlineProfile = inlineProfile;
+    optimize(&program.tokens, &program.labels, optimizerOptions);
+
+    if (!options.stableLayoutPath.empty())
+    {
+        const size_t size = calculateSizeReport(program.tokens).getTotal();
+        const size_t sizeBudget = (!options.romLimit ? SIZE_MAX : options.romLimit > size ? options.romLimit-size : 0);
+        pinLabelAddresses(&program.tokens, &program.labels, readDebugMapSymbols(options.stableLayoutPath), sizeBudget);
+    }
+
+    program.sizeReport = calculateSizeReport(program.tokens);
+    const size_t size = program.sizeReport.getTotal();
+    Logger::log << "ROM usage: " << size << " bytes (code: " << program.sizeReport.codeBytes
+        << ", data: " << program.sizeReport.dataBytes << ')' << Logger::End;
+    if (options.romLimit && size > options.romLimit)
+    {
+        throw RomLimitError{"The program is " + std::to_string(size) + " bytes, "
+            + std::to_string(size-options.romLimit) + " bytes over the limit of "
+            + std::to_string(options.romLimit) + " bytes", program.sizeReport};
+    }
+
+    program.output = generateBinary(program.tokens, program.labels, options.target, sourceMap);
+    return program;
+}
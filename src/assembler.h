@@ -0,0 +1,51 @@
+#pragma once
+
+#include "arguments.h"
+#include "binary_generator.h"
+#include "inliner.h"
+#include "parser.h"
+#include "size_report.h"
+
+#include <stdexcept>
+#include <string>
+
+struct SourceMap;
+
+/*
+ * Thrown when the program doesn't fit in the ROM limit.
+ * Has the size report, so the caller can show what uses the space.
+ */
+class RomLimitError final : public std::runtime_error
+{
+public:
+    SizeReport sizeReport;
+
+    RomLimitError(const std::string& message, SizeReport report)
+        : std::runtime_error{message}, sizeReport{std::move(report)}
+    {
+    }
+};
+
+struct AssembledProgram
+{
+    Parser::tokenList_t tokens;
+    Parser::labelMap_t labels;
+    SizeReport sizeReport;
+    ByteList output;
+};
+
+/*
+ * Assembles the preprocessed file: parses it, allocates the virtual registers, optimizes,
+ * keeps the label addresses of the previous build (`--stable-layout`), checks the size
+ * against the ROM limit and generates the output.
+ * The same for a build, the variants and the tests, so a test can't pass on a program
+ * that doesn't build.
+ * `inlineProfile`, `testDirectives`, `parseCache` and `sourceMap` are passed to the stages
+ * that use them, and may be null.
+ *
+ * Throws on error, a `RomLimitError` if the program is too large.
+ */
+[[nodiscard]] AssembledProgram assembleProgram(
+        const Parser::PreprocessedFile& file, const Options& options, const InlineProfile* inlineProfile,
+        Parser::TestDirectives* testDirectives=nullptr, Parser::ParseCache* parseCache=nullptr,
+        SourceMap* sourceMap=nullptr);
@@ -1,12 +1,13 @@
 #include "binary_generator.h"
+#include "instruction_set.h"
+#include "source_map.h"
 #include "Logger.h"
 #include "common.h"
 #include <utility>
 #include <map>
+#include <algorithm>
 #include <cassert>
 
-#define ROM_LOAD_OFFSET 0x200
-
 using labelMap_t = std::map<std::string, uint16_t>;
 
 // Clangd can't find as_const()
@@ -14,6 +15,41 @@ using labelMap_t = std::map<std::string, uint16_t>;
 namespace std { template <typename T> add_const_t<T>& as_const(T&) noexcept; }
 #endif
 
+/*
+ * Calculates the value of an expression now that the labels are known.
+ *
+ * Throws on error.
+ */
+static int32_t evaluateExpression(const Parser::Expression& expr, const labelMap_t& labels, size_t offset)
+{
+    return expr.evaluate(
+            [&labels](const std::string& name, int32_t* value){
+                auto it = labels.find(name);
+                if (it == labels.end())
+                    return false;
+                *value = ROM_LOAD_OFFSET + it->second;
+                return true;
+            },
+            ROM_LOAD_OFFSET + offset);
+}
+
+/*
+ * Replaces the expression operands with their values.
+ *
+ * Throws on error.
+ */
+static void resolveOperandExpressions(Parser::Opcode* opcode, const labelMap_t& labels, size_t offset)
+{
+    for (Parser::OpcodeOperand* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+    {
+        if (operand->getType() == Parser::OpcodeOperand::Type::Expression)
+        {
+            const unsigned int limit = (opcode->isLongAddress && operand == &opcode->operand1 ? 0xffff : 0x0fff);
+            operand->setInt(evaluateExpression(operand->getAsExpression(), labels, offset), limit);
+        }
+    }
+}
+
 static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const labelMap_t& labels)
 {
     auto printErrorIfWrongNumOfOps{
@@ -55,43 +91,69 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
         }
     };
 
+    // The addresses of the instructions are 12 bits, except the one of `ld i, long`
     auto getLabelAddress{
-        [&labels](const std::string& name){
+        [&labels](const std::string& name, unsigned int limit=0x0fff){
             auto it = labels.find(name);
             if (it == labels.end())
                 throw std::runtime_error{"Reference to undefined label: " + name};
+            if (ROM_LOAD_OFFSET + it->second > (int)limit)
+            {
+                throw std::runtime_error{"The label \"" + name + "\" at 0x" + intToHexStr(ROM_LOAD_OFFSET + it->second)
+                    + " is out of the reach of the instruction"};
+            }
             return ROM_LOAD_OFFSET + it->second;
         }
     };
+    auto getNibble{[](const Parser::OpcodeOperand& operand){
+        if (operand.getAsUint() > 0xf)
+            throw std::runtime_error{"The operand must be 0-15"};
+        return operand.getAsUint();
+    }};
+    // The operands are stored in 12 bits, the negative ones in two's complement: -128 to -1 are 0xf80 to 0xfff
+    auto getByte{[](const Parser::OpcodeOperand& operand){
+        const unsigned int value = operand.getAsUint();
+        if (operand.isNegative() ? value < 0xf80 : value > 0xff)
+        {
+            throw std::runtime_error{"The operand must be -128 to 255, got "
+                + std::to_string(operand.isNegative() ? int(value)-0x1000 : int(value))};
+        }
+        return value & 0xff;
+    }};
+
+    for (const Parser::OpcodeOperand* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+    {
+        if (operand->getType() == Parser::OpcodeOperand::Type::VirtualRegister)
+            throw std::runtime_error{"The virtual register \"" + operand->getAsVirtualRegister() + "\" has no V register"};
+    }
 
     Logger::dbg << "Opcode: " << opcode->opcode << Logger::End;
     switch (opcode->opcode)
     {
     case Parser::OPCODE_NOP:
         printErrorIfWrongNumOfOps(0);
-        output.append16(0x0000);
+        output.append16(encodeInstruction(InstructionKind::Sys));
         break;
 
     case Parser::OPCODE_SYS:
         if (opcode->operand0.getType() == Parser::OpcodeOperand::Type::Uint)
         {
-            output.append16(0x0000 |
-                    (opcode->operand0.getAsUint() & 0x0fff));
+            output.append16(encodeInstruction(InstructionKind::Sys, opcode->operand0.getAsUint()));
         }
         else
         {
-            output.append16(0x0000);
+            output.append16(encodeInstruction(InstructionKind::Sys));
         }
         break;
 
     case Parser::OPCODE_CLS:
         printErrorIfWrongNumOfOps(0);
-        output.append16(0x00e0);
+        output.append16(encodeInstruction(InstructionKind::Cls));
         break;
 
     case Parser::OPCODE_RET:
         printErrorIfWrongNumOfOps(0);
-        output.append16(0x00ee);
+        output.append16(encodeInstruction(InstructionKind::Ret));
         break;
 
     case Parser::OPCODE_JP:
@@ -106,13 +168,13 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
                 throw std::runtime_error{"Register-relative jump is only possible with register V0"};
             if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint)
             {
-                output.append16(0xb000 |
-                        (opcode->operand1.getAsUint() & 0x0fff));
+                output.append16(encodeInstruction(InstructionKind::JpV0Addr,
+                        opcode->operand1.getAsUint()));
             }
             else if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::LabelReference)
             {
-                output.append16(0xb000 |
-                        (getLabelAddress(opcode->operand0.getAsLabel().name) & 0x0fff));
+                output.append16(encodeInstruction(InstructionKind::JpV0Addr,
+                        getLabelAddress(opcode->operand1.getAsLabel().name)));
             }
             else
             {
@@ -122,19 +184,22 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
 
         case Parser::OpcodeOperand::Type::Uint: // JP addr
             printErrorIfWrongNumOfOps(1);
-            output.append16(0x1000 |
-                    (opcode->operand0.getAsUint() & 0x0fff));
+            output.append16(encodeInstruction(InstructionKind::Jp, opcode->operand0.getAsUint()));
             break;
 
         case Parser::OpcodeOperand::Type::LabelReference: // JP addr
             printErrorIfWrongNumOfOps(1);
-            output.append16(0x1000 |
-                    (getLabelAddress(opcode->operand0.getAsLabel().name) & 0x0fff));
+            output.append16(encodeInstruction(InstructionKind::Jp,
+                    getLabelAddress(opcode->operand0.getAsLabel().name)));
             break;
 
         case Parser::OpcodeOperand::Type::F:
         case Parser::OpcodeOperand::Type::B:
         case Parser::OpcodeOperand::Type::K:
+        case Parser::OpcodeOperand::Type::HF:
+        case Parser::OpcodeOperand::Type::R:
+        case Parser::OpcodeOperand::Type::Expression:
+        case Parser::OpcodeOperand::Type::VirtualRegister:
             // Already handled
             break;
         }
@@ -144,13 +209,12 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
         printErrorIfWrongNumOfOps(1);
         if (opcode->operand0.getType() == Parser::OpcodeOperand::Type::Uint)
         {
-            output.append16(0x2000 |
-                    (opcode->operand0.getAsUint() & 0x0fff));
+            output.append16(encodeInstruction(InstructionKind::Call, opcode->operand0.getAsUint()));
         }
         else if (opcode->operand0.getType() == Parser::OpcodeOperand::Type::LabelReference)
         {
-            output.append16(0x2000 |
-                    (getLabelAddress(opcode->operand0.getAsLabel().name) & 0x0fff));
+            output.append16(encodeInstruction(InstructionKind::Call,
+                    getLabelAddress(opcode->operand0.getAsLabel().name)));
         }
         else
         {
@@ -164,15 +228,15 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
             throw std::runtime_error{"SE opcode requires a register name as left argument"};
         if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint) // SE Vx, byte
         {
-            output.append16(0x3000 |
-                    (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                    (opcode->operand1.getAsUint() & 0xff));
+            output.append16(encodeInstruction(InstructionKind::SeVxByte,
+                    Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                    getByte(opcode->operand1)));
         }
         else // SE Vx, Vy
         {
-            output.append16(0x5000 |
-                    (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4);
+            output.append16(encodeInstruction(InstructionKind::SeVxVy,
+                    Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         }
         break;
 
@@ -182,15 +246,15 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
             throw std::runtime_error{"SNE opcode requires a register name as left argument"};
         if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint) // SNE Vx, byte
         {
-            output.append16(0x4000 |
-                    (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                    (opcode->operand1.getAsUint() & 0xff));
+            output.append16(encodeInstruction(InstructionKind::SneVxByte,
+                    Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                    getByte(opcode->operand1)));
         }
         else // SNE Vx, Vy
         {
-            output.append16(0x9000 |
-                    (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4);
+            output.append16(encodeInstruction(InstructionKind::SneVxVy,
+                    Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         }
         break;
 
@@ -200,17 +264,27 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
         {
         case Parser::OpcodeOperand::Type::Register:
         {
-            if (opcode->operand0.getAsRegister() == Parser::REGISTER_I) // LD I, addr
+            if (opcode->operand0.getAsRegister() == Parser::REGISTER_I && opcode->isLongAddress) // LD I, LONG addr
+            {
+                output.append16(encodeInstruction(InstructionKind::LdILong));
+                if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint)
+                    output.append16(opcode->operand1.getAsUint());
+                else if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::LabelReference)
+                    output.append16(getLabelAddress(opcode->operand1.getAsLabel().name, 0xffff));
+                else
+                    throw std::runtime_error{"LD can only load constant value to I"};
+            }
+            else if (opcode->operand0.getAsRegister() == Parser::REGISTER_I) // LD I, addr
             {
                 if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint)
                 {
-                    output.append16(0xa000 |
-                            (opcode->operand1.getAsUint() & 0x0fff));
+                    output.append16(encodeInstruction(InstructionKind::LdIAddr,
+                            opcode->operand1.getAsUint()));
                 }
                 else if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::LabelReference)
                 {
-                    output.append16(0xa000 |
-                            (getLabelAddress(opcode->operand1.getAsLabel().name) & 0x0fff));
+                    output.append16(encodeInstruction(InstructionKind::LdIAddr,
+                            getLabelAddress(opcode->operand1.getAsLabel().name)));
                 }
                 else
                 {
@@ -219,27 +293,27 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
             }
             else if (opcode->operand0.getAsRegister() == Parser::REGISTER_I_ADDR) // LD [I], Vx
             {
-                output.append16(0xa055 |
-                        (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+                output.append16(encodeInstruction(InstructionKind::LdIAddrVx,
+                        Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             }
             else if (opcode->operand0.getAsRegister() == Parser::REGISTER_DT) // LD DT, Vx
             {
-                output.append16(0xf015 |
-                        (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+                output.append16(encodeInstruction(InstructionKind::LdDtVx,
+                        Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             }
             else if (opcode->operand0.getAsRegister() == Parser::REGISTER_ST) // LD ST, Vx
             {
-                output.append16(0xf018 |
-                        (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+                output.append16(encodeInstruction(InstructionKind::LdStVx,
+                        Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             }
             else // Operand 0: Vx register
             {
                 switch (opcode->operand1.getType()) // Decide opcode using operand 1
                 {
                 case Parser::OpcodeOperand::Type::Uint: // LD Vx, byte
-                    output.append16(0x6000 |
-                            (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                            (opcode->operand1.getAsUint() & 0xff));
+                    output.append16(encodeInstruction(InstructionKind::LdVxByte,
+                            Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                            getByte(opcode->operand1)));
                     break;
 
                 case Parser::OpcodeOperand::Type::Register:
@@ -249,25 +323,34 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
                     }
                     else if (opcode->operand1.getAsRegister() == Parser::REGISTER_I_ADDR) // LD Vx, [I]
                     {
-                        output.append16(0xf065 |
-                                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8));
+                        output.append16(encodeInstruction(InstructionKind::LdVxIAddr,
+                                Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
                     }
                     else if (opcode->operand1.getAsRegister() == Parser::REGISTER_DT) // LD Vx, DT
                     {
-                        output.append16(0xf007 |
-                                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8));
+                        output.append16(encodeInstruction(InstructionKind::LdVxDt,
+                                Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
                     }
                     else // LD Vx, Vy
                     {
-                        output.append16(0x8000 |
-                                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+                        output.append16(encodeInstruction(InstructionKind::LdVxVy,
+                                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
                     }
                     break;
 
                 case Parser::OpcodeOperand::Type::K: // LD Vx, K
-                        output.append16(0xf00a |
-                                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8));
+                        output.append16(encodeInstruction(InstructionKind::LdVxK,
+                                Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
+                    break;
+
+                case Parser::OpcodeOperand::Type::R: // LD Vx, R
+                    output.append16(encodeInstruction(InstructionKind::LdVxR,
+                            Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
+                    break;
+
+                case Parser::OpcodeOperand::Type::HF:
+                    throw std::runtime_error{"LD: Right-side operand can't be HF"};
                     break;
 
                 case Parser::OpcodeOperand::Type::F:
@@ -283,6 +366,8 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
                     break;
 
                 case Parser::OpcodeOperand::Type::Empty:
+                case Parser::OpcodeOperand::Type::Expression:
+                case Parser::OpcodeOperand::Type::VirtualRegister:
                     // Already handled
                     break;
                 }
@@ -296,18 +381,33 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
 
         case Parser::OpcodeOperand::Type::Uint:
         case Parser::OpcodeOperand::Type::LabelReference:
+        case Parser::OpcodeOperand::Type::Expression:
         case Parser::OpcodeOperand::Type::Empty: // Make the compiler happy
             throw std::runtime_error{"LD: Destination can't be a constant value"};
             break;
 
+        case Parser::OpcodeOperand::Type::VirtualRegister:
+            // Already handled
+            break;
+
         case Parser::OpcodeOperand::Type::F: // LD F, Vx
-            output.append16(0xf029 |
-                    (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+            output.append16(encodeInstruction(InstructionKind::LdFVx,
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             break;
 
         case Parser::OpcodeOperand::Type::B: // LD B, Vx
-            output.append16(0xf033 |
-                    (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+            output.append16(encodeInstruction(InstructionKind::LdBVx,
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
+            break;
+
+        case Parser::OpcodeOperand::Type::HF: // LD HF, Vx
+            output.append16(encodeInstruction(InstructionKind::LdHfVx,
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
+            break;
+
+        case Parser::OpcodeOperand::Type::R: // LD R, Vx
+            output.append16(encodeInstruction(InstructionKind::LdRVx,
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             break;
         }
         break;
@@ -315,89 +415,143 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
     case Parser::OPCODE_ADD:
         if (opcode->operand0.getAsRegister() == Parser::REGISTER_I) // ADD I, Vx
         {
-            output.append16(0xf01e |
-                    (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 8));
+            output.append16(encodeInstruction(InstructionKind::AddIVx,
+                    Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         }
         else
         {
             if (opcode->operand1.getType() == Parser::OpcodeOperand::Type::Uint) // ADD Vx, byte
             {
-                output.append16(0x7000 |
-                        (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                        (opcode->operand1.getAsUint() & 0xff));
+                output.append16(encodeInstruction(InstructionKind::AddVxByte,
+                        Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                        getByte(opcode->operand1)));
             }
             else // ADD Vx, Vy
             {
-                output.append16(0x8004 |
-                        (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                        (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+                output.append16(encodeInstruction(InstructionKind::AddVxVy,
+                        Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                        Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
             }
         }
         break;
 
     case Parser::OPCODE_OR:
-        output.append16(0x8001 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::OrVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_AND:
-        output.append16(0x8002 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::AndVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_XOR:
-        output.append16(0x8003 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::XorVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_SUB:
-        output.append16(0x8005 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::SubVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_SHR:
-        output.append16(0x8006 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::ShrVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_SUBN:
-        output.append16(0x8007 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::SubnVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_SHL:
-        output.append16(0x800e |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4));
+        output.append16(encodeInstruction(InstructionKind::ShlVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
         break;
 
     case Parser::OPCODE_RND:
-        output.append16(0xc000 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (opcode->operand1.getAsUint() & 0xff));
+        output.append16(encodeInstruction(InstructionKind::RndVxByte,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                getByte(opcode->operand1)));
         break;
 
     case Parser::OPCODE_DRW:
-        output.append16(0xd000 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8) |
-                (Parser::vRegisterToNibble(opcode->operand1.getAsRegister()) << 4) |
-                (opcode->operand2.getAsUint() & 0x0f));
+        output.append16(encodeInstruction(InstructionKind::DrwVxVyN,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister()),
+                opcode->operand2.getAsUint()));
         break;
 
     case Parser::OPCODE_SKP:
-        output.append16(0xe09e |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8));
+        output.append16(encodeInstruction(InstructionKind::SkpVx,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
         break;
 
     case Parser::OPCODE_SKNP:
-        output.append16(0xe0a1 |
-                (Parser::vRegisterToNibble(opcode->operand0.getAsRegister()) << 8));
+        output.append16(encodeInstruction(InstructionKind::SknpVx,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister())));
+        break;
+
+    case Parser::OPCODE_SCD:
+        printErrorIfWrongNumOfOps(1);
+        output.append16(encodeInstruction(InstructionKind::Scd, getNibble(opcode->operand0)));
+        break;
+
+    case Parser::OPCODE_SCR:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::Scr));
+        break;
+
+    case Parser::OPCODE_SCL:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::Scl));
+        break;
+
+    case Parser::OPCODE_EXIT:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::Exit));
+        break;
+
+    case Parser::OPCODE_LOW:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::Low));
+        break;
+
+    case Parser::OPCODE_HIGH:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::High));
+        break;
+
+    case Parser::OPCODE_SAVE:
+        printErrorIfWrongNumOfOps(2);
+        output.append16(encodeInstruction(InstructionKind::SaveVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
+        break;
+
+    case Parser::OPCODE_LOAD:
+        printErrorIfWrongNumOfOps(2);
+        output.append16(encodeInstruction(InstructionKind::LoadVxVy,
+                Parser::vRegisterToNibble(opcode->operand0.getAsRegister()),
+                Parser::vRegisterToNibble(opcode->operand1.getAsRegister())));
+        break;
+
+    case Parser::OPCODE_PLANE:
+        printErrorIfWrongNumOfOps(1);
+        output.append16(encodeInstruction(InstructionKind::Plane, getNibble(opcode->operand0)));
+        break;
+
+    case Parser::OPCODE_AUDIO:
+        printErrorIfWrongNumOfOps(0);
+        output.append16(encodeInstruction(InstructionKind::Audio));
         break;
 
     case Parser::OPCODE_INVALID:
@@ -405,43 +559,146 @@ static void handleOpcode(const Parser::Opcode* opcode, ByteList& output, const l
     }
 }
 
-static void handleDbInst(const Parser::DbInst* db, ByteList& output)
+/*
+ * Checks that the instruction the opcode was encoded to exists on the target.
+ *
+ * Throws if it doesn't.
+ */
+static void checkTarget(const Parser::Opcode& opcode, const uint8_t* encoded, InstructionTarget target)
+{
+    // `sys` can encode anything below 0x1000, e.g. 00FF is both `sys 0xff` and `high`
+    if (opcode.opcode == Parser::OPCODE_SYS || opcode.opcode == Parser::OPCODE_NOP)
+        return;
+
+    const uint16_t word = encoded[0] << 8 | encoded[1];
+    const InstructionTarget required = getRequiredTarget(decodeInstruction(word), word);
+    if (required > target)
+    {
+        throw std::runtime_error{"The instruction needs the " + std::string{targetToStr(required)}
+            + " target, the current one is " + targetToStr(target) + " (use --target)"};
+    }
+}
+
+static void handleDbInst(const Parser::DbInst* db, ByteList& output, const labelMap_t& labels)
 {
+    const size_t startOffset = output.size();
     for (uint8_t data : db->arguments)
         output.append8(data);
+    for (const auto& arg : db->deferredArguments)
+    {
+        output[startOffset+arg.first] = Parser::expressionValueToUint(
+                evaluateExpression(arg.second, labels, startOffset+arg.first), 0xff);
+    }
 
     if (output.size() % 2)
         Logger::warn << "Unaligned data. Instructions should only be at even addresses." << Logger::End;
 }
 
-static void handleDwInst(const Parser::DwInst* dw, ByteList& output)
+static void handleDwInst(const Parser::DwInst* dw, ByteList& output, const labelMap_t& labels)
 {
+    const size_t startOffset = output.size();
     for (uint16_t data : dw->arguments)
         output.append16(data);
+    for (const auto& arg : dw->deferredArguments)
+    {
+        const size_t offset = startOffset+arg.first*2;
+        const uint16_t value = Parser::expressionValueToUint(evaluateExpression(arg.second, labels, offset), 0xffff);
+        output[offset] = value >> 8;
+        output[offset+1] = value & 0xff;
+    }
 }
 
-ByteList generateBinary(const Parser::tokenList_t& tokens, const Parser::labelMap_t& labels)
+static void handleIncbinInst(const Parser::IncbinInst* incbin, ByteList& output)
+{
+    output.appendBytes(incbin->file->getData()+incbin->offset, incbin->length);
+
+    if (output.size() % 2)
+        Logger::warn << "Unaligned data. Instructions should only be at even addresses." << Logger::End;
+}
+
+/*
+ * Records the bytes the token generated, merging them with the previous range if they come from the same line.
+ */
+static void addSourceRange(SourceMap* map, const Parser::Token& token, size_t offset, size_t size)
+{
+    if (!size)
+        return;
+    if (!map->ranges.empty())
+    {
+        SourceRange& last = map->ranges.back();
+        if (last.offset+last.size == offset && last.location.lineNumber == token.getLineNumber()
+         && last.location.filePath == token.getFilePath())
+        {
+            last.size += size;
+            return;
+        }
+    }
+    auto incbin = dynamic_cast<const Parser::IncbinInst*>(&token);
+    map->ranges.push_back({offset, size, token.getLocation(), (incbin ? incbin->file->getFilePath() : "")});
+}
+
+/*
+ * Calculates the sizes of the symbols from the offset of the next one.
+ */
+static void calculateSymbolSizes(SourceMap* map, size_t outputSize)
+{
+    size_t nextOffset = outputSize;
+    for (size_t i = map->symbols.size(); i-- > 0;)
+    {
+        SymbolInfo& symbol = map->symbols[i];
+        symbol.size = nextOffset-symbol.offset;
+        if (i && map->symbols[i-1].offset < symbol.offset)
+            nextOffset = symbol.offset;
+    }
+}
+
+ByteList generateBinary(const Parser::tokenList_t& tokens, const Parser::labelMap_t& labels,
+        InstructionTarget target, SourceMap* sourceMap)
 {
     ByteList output;
 
     for (auto& token : tokens)
     {
+        const size_t startOffset = output.size();
         try
         {
             auto opcode = dynamic_cast<Parser::Opcode*>(token.get());
             auto dbInst = dynamic_cast<Parser::DbInst*>(token.get());
             auto dwInst = dynamic_cast<Parser::DwInst*>(token.get());
+            auto incbinInst = dynamic_cast<Parser::IncbinInst*>(token.get());
             if (opcode)
             {
-                handleOpcode(opcode, output, labels);
+                if (opcode->operand0.getType() == Parser::OpcodeOperand::Type::Expression
+                 || opcode->operand1.getType() == Parser::OpcodeOperand::Type::Expression
+                 || opcode->operand2.getType() == Parser::OpcodeOperand::Type::Expression)
+                {
+                    Parser::Opcode resolved = *opcode;
+                    resolveOperandExpressions(&resolved, labels, output.size());
+                    handleOpcode(&resolved, output, labels);
+                }
+                else
+                {
+                    handleOpcode(opcode, output, labels);
+                }
+                checkTarget(*opcode, output.data()+startOffset, target);
             }
             else if (dbInst)
             {
-                handleDbInst(dbInst, output);
+                handleDbInst(dbInst, output, labels);
             }
             else if (dwInst)
             {
-                handleDwInst(dwInst, output);
+                handleDwInst(dwInst, output, labels);
+            }
+            else if (incbinInst)
+            {
+                handleIncbinInst(incbinInst, output);
+            }
+            else if (auto label = dynamic_cast<Parser::Label*>(token.get()))
+            {
+                // Labels don't take up space
+                if (sourceMap)
+                    sourceMap->symbols.push_back({label->name, output.size(), 0});
             }
             else
             {
@@ -453,9 +710,13 @@ ByteList generateBinary(const Parser::tokenList_t& tokens, const Parser::labelMa
         catch (std::exception& e)
         {
             // Rethrown the exception with more info
-            throw std::runtime_error{"Line " + token->getLineNumberStr() + ": " + e.what()};
+            throw std::runtime_error{token->getLocationStr() + ": " + e.what()};
         }
+        if (sourceMap)
+            addSourceRange(sourceMap, *token, startOffset, output.size()-startOffset);
     }
+    if (sourceMap)
+        calculateSymbolSizes(sourceMap, output.size());
     return output;
 }
 
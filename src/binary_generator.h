@@ -1,10 +1,16 @@
 #pragma once
 
 #include "parser.h"
+#include "instruction_set.h"
 #include "Logger.h"
 #include <stdint.h>
 #include <vector>
 
+// The address where the program is loaded
+#define ROM_LOAD_OFFSET 0x200
+// The largest program that fits in the memory
+#define ROM_MAX_SIZE (0x1000-ROM_LOAD_OFFSET)
+
 class ByteList final : public std::vector<uint8_t>
 {
 public:
@@ -20,12 +26,22 @@ public:
         this->push_back(value & 0xff);
         Logger::dbg << "Wrote 0x" << std::hex << value << std::dec << " to output buffer" << Logger::End;
     }
+
+    inline void appendBytes(const uint8_t* data, size_t size)
+    {
+        this->insert(this->end(), data, data+size);
+        Logger::dbg << "Wrote " << size << " bytes to output buffer" << Logger::End;
+    }
 };
 
+struct SourceMap;
+
 /*
  * Generates the output from the tokens.
+ * If `sourceMap` is not null, the source line of every byte and the labels are recorded in it.
  *
- * Throws on error.
+ * Throws on error, e.g. if an instruction doesn't exist on the target.
  */
-ByteList generateBinary(const Parser::tokenList_t& tokens, const Parser::labelMap_t& labels);
+ByteList generateBinary(const Parser::tokenList_t& tokens, const Parser::labelMap_t& labels,
+        InstructionTarget target, SourceMap* sourceMap=nullptr);
 
@@ -0,0 +1,136 @@
+#include "build_variants.h"
+#include "InputFile.h"
+#include "Logger.h"
+#include "assembler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <set>
+#include <sstream>
+#include <thread>
+
+void parseDefine(const std::string& str, Parser::defineMap_t* defines)
+{
+    const size_t equalSign = str.find('=');
+    const std::string name = str.substr(0, equalSign);
+    if (name.empty() || std::any_of(name.begin(), name.end(), [](char c){ return std::isspace((unsigned char)c); }))
+        throw std::runtime_error{"Invalid define: \"" + str + '"'};
+    (*defines)[name] = (equalSign == std::string::npos ? "1" : str.substr(equalSign+1));
+}
+
+std::vector<BuildVariant> loadVariants(const std::string& filePath)
+{
+    InputFile file;
+    file.open(filePath);
+
+    std::vector<BuildVariant> variants;
+    std::set<std::string> names;
+    std::istringstream stream{file.getContent()};
+    std::string line;
+    int lineNumber{};
+    while (std::getline(stream, line))
+    {
+        ++lineNumber;
+        std::istringstream lineStream{line};
+        BuildVariant variant;
+        if (!(lineStream >> variant.name) || variant.name[0] == ';' || variant.name[0] == '#')
+            continue;
+
+        const std::string location = filePath + ':' + std::to_string(lineNumber) + ": ";
+        // The name becomes a part of the output file name
+        if (!std::all_of(variant.name.begin(), variant.name.end(),
+                    [](char c){ return std::isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.'; }))
+            throw std::runtime_error{location + "Invalid variant name: \"" + variant.name + '"'};
+        if (!names.insert(variant.name).second)
+            throw std::runtime_error{location + "Duplicate variant: \"" + variant.name + '"'};
+
+        std::string define;
+        while (lineStream >> define)
+        {
+            try
+            {
+                parseDefine(define, &variant.defines);
+            }
+            catch (std::exception& e)
+            {
+                throw std::runtime_error{location + e.what()};
+            }
+        }
+        variants.push_back(std::move(variant));
+    }
+    if (variants.empty())
+        throw std::runtime_error{filePath + ": No variants"};
+    Logger::dbg << "Loaded " << variants.size() << " variants" << Logger::End;
+    return variants;
+}
+
+std::string getVariantOutputPath(const std::string& outputFilePath, const std::string& name)
+{
+    const std::filesystem::path path{outputFilePath};
+    return (path.parent_path() / (path.stem().string() + '-' + name + path.extension().string())).string();
+}
+
+/*
+ * Assembles a variant. The errors and the messages are stored in the result.
+ */
+static VariantResult assembleVariant(const Parser::SourceFiles& sources, const BuildVariant& variant,
+        const Options& options, const InlineProfile* inlineProfile, Parser::ParseCache* parseCache)
+{
+    VariantResult result;
+    result.name = variant.name;
+    const auto startTime = std::chrono::steady_clock::now();
+    Logger::Capture capture;
+    try
+    {
+        Parser::defineMap_t defines = options.defines;
+        for (const auto& define : variant.defines)
+            defines.insert_or_assign(define.first, define.second);
+        const Parser::PreprocessedFile preprocessed = Parser::expandDefines(sources, defines);
+
+        result.output = assembleProgram(preprocessed, options, inlineProfile, nullptr, parseCache).output;
+    }
+    catch (std::exception& e)
+    {
+        result.error = e.what();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+    result.messages = capture.takeMessages();
+    return result;
+}
+
+std::vector<VariantResult> assembleVariants(
+        const Parser::SourceFiles& sources, const std::vector<BuildVariant>& variants,
+        const Options& options, unsigned int jobCount)
+{
+    InlineProfile inlineProfile;
+    if (!options.inlineProfilePath.empty())
+        inlineProfile = loadInlineProfile(options.inlineProfilePath);
+    const InlineProfile* inlineProfilePtr = options.inlineProfilePath.empty() ? nullptr : &inlineProfile;
+
+    if (!jobCount)
+        jobCount = std::max(std::thread::hardware_concurrency(), 1u);
+    jobCount = std::min<size_t>(jobCount, variants.size());
+    Logger::log << "Assembling " << variants.size() << " variants on " << jobCount << " threads" << Logger::End;
+
+    // The lines without the defines that change are parsed by the first variant that gets to them
+    Parser::ParseCache parseCache;
+    std::vector<VariantResult> results(variants.size());
+    std::atomic<size_t> nextVariant{};
+    auto work{[&](){
+        for (size_t i = nextVariant++; i < variants.size(); i = nextVariant++)
+            results[i] = assembleVariant(sources, variants[i], options, inlineProfilePtr, &parseCache);
+    }};
+
+    std::vector<std::thread> threads;
+    for (unsigned int i{1}; i < jobCount; ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& thread : threads)
+        thread.join();
+    Logger::dbg << "Parse cache: " << parseCache.getHitCount() << " hits, "
+        << parseCache.getMissCount() << " misses" << Logger::End;
+    return results;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "arguments.h"
+#include "binary_generator.h"
+#include "Logger.h"
+#include "parser.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * A build of the program with its own defines, e.g. a debug build.
+ */
+struct BuildVariant
+{
+    std::string name;
+    // Added to the defines of the command line, replacing the ones with the same name
+    Parser::defineMap_t defines;
+};
+
+struct VariantResult
+{
+    std::string name;
+    ByteList output;
+    // The reason of the failure, empty if the variant was assembled
+    std::string error;
+    // The messages of the assembler, printed by the caller so the variants don't mix
+    std::vector<Logger::CapturedMessage> messages;
+    double seconds{};
+};
+
+/*
+ * Parses a `NAME` or `NAME=VALUE` define (the value of `NAME` is 1) and stores it in `defines`.
+ *
+ * Throws on error.
+ */
+void parseDefine(const std::string& str, Parser::defineMap_t* defines);
+
+/*
+ * Reads a variant list. Each line is a variant name followed by its `NAME=VALUE` defines,
+ * separated by whitespace. Empty lines and lines starting with `;` or `#` are ignored.
+ *
+ * Throws on error.
+ */
+[[nodiscard]] std::vector<BuildVariant> loadVariants(const std::string& filePath);
+
+/*
+ * Returns the output path of a variant: `name` appended to the file name before the extension,
+ * e.g. game.ch8 -> game-debug.ch8.
+ */
+[[nodiscard]] std::string getVariantOutputPath(const std::string& outputFilePath, const std::string& name);
+
+/*
+ * Assembles the variants of a program on `jobCount` threads (0 for one per core).
+ * The source files are read once and the instructions are parsed once for all the variants
+ * that have the same text for them, only the defines are replaced and the rest of the pipeline
+ * (parsing the other lines, register allocation, optimization, encoding) runs for each variant.
+ * The errors, including a program over the ROM limit, and the messages are stored in the results.
+ *
+ * Returns the results in the order of the variants.
+ */
+[[nodiscard]] std::vector<VariantResult> assembleVariants(
+        const Parser::SourceFiles& sources, const std::vector<BuildVariant>& variants,
+        const Options& options, unsigned int jobCount);
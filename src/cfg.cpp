@@ -0,0 +1,419 @@
+#include "cfg.h"
+
+#include <algorithm>
+#include <map>
+
+using Type = Parser::OpcodeOperand::Type;
+
+static inline const Parser::Opcode* asOpcode(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Opcode*>(token.get());
+}
+
+static inline const Parser::Label* asLabel(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Label*>(token.get());
+}
+
+/*
+ * Returns true if the instruction ends its basic block.
+ */
+static bool isBlockTerminator(const Parser::Opcode& opcode)
+{
+    switch (opcode.opcode)
+    {
+    case Parser::OPCODE_JP:
+    case Parser::OPCODE_CALL:
+    case Parser::OPCODE_SYS:
+    case Parser::OPCODE_RET:
+    case Parser::OPCODE_EXIT:
+    case Parser::OPCODE_INVALID:
+        return true;
+    default:
+        return isSkipInstruction(opcode);
+    }
+}
+
+ControlFlowGraph::ControlFlowGraph(const Parser::tokenList_t& tokens)
+    : m_tokens{tokens}, m_tokenBlocks(tokens.size(), npos)
+{
+    splitBlocks();
+    connectBlocks();
+    findReachableBlocks();
+}
+
+void ControlFlowGraph::splitBlocks()
+{
+    // The first label of a sequence of labels, `npos` if the previous token is not a label
+    size_t firstLabel = npos;
+    bool isBlockOpen = false;
+    bool isAfterSkip = false;
+
+    for (size_t i{}; i < m_tokens.size(); ++i)
+    {
+        if (asLabel(m_tokens[i]))
+        {
+            isBlockOpen = false;
+            if (firstLabel == npos)
+                firstLabel = i;
+            continue;
+        }
+
+        const Parser::Opcode* opcode = asOpcode(m_tokens[i]);
+        if (!opcode) // Data
+        {
+            isBlockOpen = false;
+            isAfterSkip = false;
+            firstLabel = npos;
+            continue;
+        }
+
+        if (!isBlockOpen)
+        {
+            BasicBlock block;
+            block.firstToken = (firstLabel == npos ? i : firstLabel);
+            for (size_t j{block.firstToken}; j < i; ++j)
+                m_tokenBlocks[j] = m_blocks.size();
+            m_blocks.push_back(block);
+            isBlockOpen = true;
+        }
+        firstLabel = npos;
+        m_blocks.back().endToken = i+1;
+        m_tokenBlocks[i] = m_blocks.size()-1;
+
+        // The skipped instruction is a block of its own
+        if (isAfterSkip || isBlockTerminator(*opcode))
+            isBlockOpen = false;
+        isAfterSkip = isSkipInstruction(*opcode);
+    }
+}
+
+size_t ControlFlowGraph::getLabelBlock(
+        const std::string& labelName, const std::map<std::string, size_t>& labelTokens) const
+{
+    auto found = labelTokens.find(labelName);
+    if (found == labelTokens.end())
+        return npos;
+    return m_tokenBlocks[found->second];
+}
+
+void ControlFlowGraph::connectBlocks()
+{
+    std::map<std::string, size_t> labelTokens;
+    for (size_t i{}; i < m_tokens.size(); ++i)
+    {
+        if (const Parser::Label* label = asLabel(m_tokens[i]))
+            labelTokens.emplace(label->name, i);
+    }
+
+    // Returns the block right after the block or `npos` if it is followed by data
+    auto getNextBlock{[this](size_t blockI){
+        if (blockI+1 < m_blocks.size() && m_blocks[blockI+1].firstToken == m_blocks[blockI].endToken)
+            return blockI+1;
+        return npos;
+    }};
+
+    // Returns true if the block is a single `jp`, like the entries of a jump table
+    auto isSingleJump{[this](const BasicBlock& block){
+        for (size_t i{block.firstToken}; i < block.endToken-1; ++i)
+        {
+            if (!asLabel(m_tokens[i]))
+                return false;
+        }
+        return asOpcode(m_tokens[block.endToken-1])->opcode == Parser::OPCODE_JP;
+    }};
+
+    for (size_t blockI{}; blockI < m_blocks.size(); ++blockI)
+    {
+        BasicBlock& block = m_blocks[blockI];
+        const Parser::Opcode& last = *asOpcode(m_tokens[block.endToken-1]);
+
+        auto addSuccessor{[&block](size_t target, BasicBlock::EdgeKind kind){
+            if (target == npos)
+                block.hasUnknownSuccessors = true;
+            else
+                block.successors.push_back({target, kind});
+        }};
+
+        switch (last.opcode)
+        {
+        case Parser::OPCODE_RET:
+        case Parser::OPCODE_EXIT: // Stops the interpreter
+            break;
+
+        case Parser::OPCODE_JP:
+            if (last.operand0.getType() == Type::LabelReference) // JP addr
+            {
+                addSuccessor(getLabelBlock(last.operand0.getAsLabel().name, labelTokens), BasicBlock::EdgeKind::Jump);
+            }
+            else if (last.operand0.getType() == Type::Register
+                  && last.operand1.getType() == Type::LabelReference) // JP V0, addr
+            {
+                // Assume a table of jumps, every entry is a block of a single `jp`
+                size_t target = getLabelBlock(last.operand1.getAsLabel().name, labelTokens);
+                addSuccessor(target, BasicBlock::EdgeKind::Jump);
+                while (target != npos && isSingleJump(m_blocks[target]))
+                {
+                    target = getNextBlock(target);
+                    if (target != npos)
+                        addSuccessor(target, BasicBlock::EdgeKind::Jump);
+                }
+            }
+            else
+            {
+                block.hasUnknownSuccessors = true;
+                m_hasUnknownJumps = true;
+            }
+            break;
+
+        case Parser::OPCODE_CALL:
+            if (last.operand0.getType() == Type::LabelReference)
+            {
+                const size_t callee = getLabelBlock(last.operand0.getAsLabel().name, labelTokens);
+                if (callee == npos)
+                    m_hasUnknownJumps = true;
+                else
+                    block.callees.push_back(callee);
+            }
+            else
+            {
+                m_hasUnknownJumps = true;
+            }
+            addSuccessor(getNextBlock(blockI), BasicBlock::EdgeKind::Fallthrough);
+            break;
+
+        case Parser::OPCODE_SYS:
+        case Parser::OPCODE_INVALID:
+            m_hasUnknownJumps = true;
+            addSuccessor(getNextBlock(blockI), BasicBlock::EdgeKind::Fallthrough);
+            break;
+
+        default:
+            addSuccessor(getNextBlock(blockI), BasicBlock::EdgeKind::Fallthrough);
+            if (isSkipInstruction(last))
+            {
+                const size_t skipped = getNextBlock(blockI);
+                addSuccessor((skipped == npos ? npos : getNextBlock(skipped)), BasicBlock::EdgeKind::Skip);
+            }
+            break;
+        }
+    }
+
+    // The program starts at the first token
+    if (!m_tokens.empty() && m_tokenBlocks[0] != npos)
+        m_entryBlocks.push_back(m_tokenBlocks[0]);
+    else
+        m_hasUnknownJumps = true;
+
+    // Code whose address is used can be entered in unknown ways
+    for (const auto& token : m_tokens)
+    {
+        forEachAddressReference(*token, [&](const std::string& name, bool isInExpression){
+            size_t blockI = getLabelBlock(name, labelTokens);
+            if (blockI == npos)
+                return;
+            m_entryBlocks.push_back(blockI);
+            // With an offset, the following blocks can be referenced too
+            while (isInExpression && (blockI = getNextBlock(blockI)) != npos)
+                m_entryBlocks.push_back(blockI);
+        });
+    }
+
+    if (m_hasUnknownJumps)
+    {
+        for (size_t i{}; i < m_blocks.size(); ++i)
+            m_entryBlocks.push_back(i);
+    }
+
+    std::sort(m_entryBlocks.begin(), m_entryBlocks.end());
+    m_entryBlocks.erase(std::unique(m_entryBlocks.begin(), m_entryBlocks.end()), m_entryBlocks.end());
+}
+
+void ControlFlowGraph::findReachableBlocks()
+{
+    std::vector<size_t> worklist = m_entryBlocks;
+    while (!worklist.empty())
+    {
+        const size_t blockI = worklist.back();
+        worklist.pop_back();
+        if (m_blocks[blockI].isReachable)
+            continue;
+        m_blocks[blockI].isReachable = true;
+
+        for (const auto& edge : m_blocks[blockI].successors)
+            worklist.push_back(edge.block);
+        for (size_t callee : m_blocks[blockI].callees)
+            worklist.push_back(callee);
+    }
+}
+
+std::vector<uint32_t> ControlFlowGraph::computeLiveness() const
+{
+    // The registers live at the start of each block
+    std::vector<uint32_t> blockLiveIn(m_blocks.size());
+
+    auto getLiveOut{[&](const BasicBlock& block){
+        const Parser::Opcode& last = *asOpcode(m_tokens[block.endToken-1]);
+        if (block.hasUnknownSuccessors || last.opcode == Parser::OPCODE_RET)
+            return REGMASK_ALL;
+        uint32_t live{};
+        for (const auto& edge : block.successors)
+            live |= blockLiveIn[edge.block];
+        return live;
+    }};
+
+    // Iterate backwards until nothing changes
+    bool hasChanged = true;
+    while (hasChanged)
+    {
+        hasChanged = false;
+        for (size_t blockI{m_blocks.size()}; blockI-- > 0;)
+        {
+            const BasicBlock& block = m_blocks[blockI];
+            uint32_t live = getLiveOut(block);
+            for (size_t i{block.endToken}; i-- > block.firstToken;)
+            {
+                if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+                {
+                    const InstructionEffects effects = getInstructionEffects(*opcode);
+                    live = (live & ~getCertainWrites(effects)) | effects.reads;
+                }
+            }
+            if (live != blockLiveIn[blockI])
+            {
+                blockLiveIn[blockI] = live;
+                hasChanged = true;
+            }
+        }
+    }
+
+    std::vector<uint32_t> liveAfter(m_tokens.size(), REGMASK_ALL);
+    for (const BasicBlock& block : m_blocks)
+    {
+        uint32_t live = getLiveOut(block);
+        for (size_t i{block.endToken}; i-- > block.firstToken;)
+        {
+            liveAfter[i] = live;
+            if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+            {
+                const InstructionEffects effects = getInstructionEffects(*opcode);
+                live = (live & ~getCertainWrites(effects)) | effects.reads;
+            }
+        }
+    }
+    return liveAfter;
+}
+
+std::vector<KnownRegisterValues> ControlFlowGraph::computeKnownValues() const
+{
+    std::vector<KnownRegisterValues> blockIn(m_blocks.size());
+    // False until the first value reaches the block
+    std::vector<bool> isVisited(m_blocks.size());
+
+    std::vector<size_t> worklist;
+    for (size_t blockI : m_entryBlocks)
+    {
+        isVisited[blockI] = true;
+        worklist.push_back(blockI);
+    }
+
+    auto propagate{[&](size_t target, const KnownRegisterValues& values){
+        KnownRegisterValues merged = values;
+        if (isVisited[target])
+            merged.meet(blockIn[target]);
+        if (!isVisited[target] || merged != blockIn[target])
+        {
+            isVisited[target] = true;
+            blockIn[target] = merged;
+            worklist.push_back(target);
+        }
+    }};
+
+    while (!worklist.empty())
+    {
+        const size_t blockI = worklist.back();
+        worklist.pop_back();
+        const BasicBlock& block = m_blocks[blockI];
+
+        KnownRegisterValues values = blockIn[blockI];
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+                values.apply(*opcode);
+        }
+
+        // Skipping doesn't change the registers, so the skip edges get the same values
+        for (const auto& edge : block.successors)
+            propagate(edge.block, values);
+        // Subroutines can be called from anywhere with anything
+        for (size_t callee : block.callees)
+            propagate(callee, KnownRegisterValues{});
+    }
+
+    std::vector<KnownRegisterValues> before(m_tokens.size());
+    for (size_t blockI{}; blockI < m_blocks.size(); ++blockI)
+    {
+        const BasicBlock& block = m_blocks[blockI];
+        KnownRegisterValues values = blockIn[blockI];
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            before[i] = values;
+            if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+                values.apply(*opcode);
+        }
+    }
+    return before;
+}
+
+/*
+ * Escapes a string for a DOT label.
+ */
+static std::string escapeDotString(const std::string& str)
+{
+    std::string output;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            output += '\\';
+        output += c;
+    }
+    return output;
+}
+
+void ControlFlowGraph::writeDot(std::ostream& output) const
+{
+    output << "digraph cfg {\n";
+    output << "    node [shape=box, fontname=\"monospace\"];\n";
+    for (size_t blockI{}; blockI < m_blocks.size(); ++blockI)
+    {
+        const BasicBlock& block = m_blocks[blockI];
+        std::string label;
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (const Parser::Label* labelToken = asLabel(m_tokens[i]))
+                label += escapeDotString(labelToken->name) + ":\\l";
+            else if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+                label += "    " + escapeDotString(opcodeToString(*opcode)) + "\\l";
+        }
+        output << "    b" << blockI << " [label=\"" << label << '"';
+        if (!block.isReachable)
+            output << ", style=filled, fillcolor=lightgray, fontcolor=gray40";
+        output << "];\n";
+
+        for (const auto& edge : block.successors)
+        {
+            output << "    b" << blockI << " -> b" << edge.block;
+            if (edge.kind == BasicBlock::EdgeKind::Skip)
+                output << " [style=dashed, label=\"skip\"]";
+            output << ";\n";
+        }
+        for (size_t callee : block.callees)
+            output << "    b" << blockI << " -> b" << callee << " [style=dotted, label=\"call\"];\n";
+        if (block.hasUnknownSuccessors)
+        {
+            output << "    b" << blockI << "_unknown [label=\"?\", shape=circle];\n";
+            output << "    b" << blockI << " -> b" << blockI << "_unknown;\n";
+        }
+    }
+    output << "}\n";
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "parser.h"
+#include "instruction_info.h"
+
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Calls `callback(const std::string& labelName, bool isInExpression)` for every label
+ * whose address the token uses as a value, i.e. every label reference except
+ * the targets of `jp label` and `call label`.
+ */
+template <typename Callback>
+void forEachAddressReference(const Parser::Token& token, Callback&& callback)
+{
+    using Type = Parser::OpcodeOperand::Type;
+
+    if (auto opcode = dynamic_cast<const Parser::Opcode*>(&token))
+    {
+        const bool isDirectJump = (opcode->opcode == Parser::OPCODE_JP || opcode->opcode == Parser::OPCODE_CALL)
+                && opcode->operand0.getType() == Type::LabelReference;
+        for (const auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+        {
+            if (operand->getType() == Type::LabelReference && !(isDirectJump && operand == &opcode->operand0))
+                callback(operand->getAsLabel().name, false);
+            else if (operand->getType() == Type::Expression)
+                for (const auto& symbol : operand->getAsExpression().getSymbols())
+                    callback(symbol, true);
+        }
+    }
+    else if (auto db = dynamic_cast<const Parser::DbInst*>(&token))
+    {
+        for (const auto& arg : db->deferredArguments)
+            for (const auto& symbol : arg.second.getSymbols())
+                callback(symbol, true);
+    }
+    else if (auto dw = dynamic_cast<const Parser::DwInst*>(&token))
+    {
+        for (const auto& arg : dw->deferredArguments)
+            for (const auto& symbol : arg.second.getSymbols())
+                callback(symbol, true);
+    }
+}
+
+/*
+ * A sequence of instructions that is only entered at the first one
+ * and only left after the last one.
+ */
+struct BasicBlock
+{
+    enum class EdgeKind
+    {
+        Fallthrough,
+        Jump,
+        Skip, // The instruction after the skipped one
+    };
+
+    struct Edge
+    {
+        size_t block;
+        EdgeKind kind;
+    };
+
+    // Index of the first token, the labels before the first instruction are included
+    size_t firstToken{};
+    // One past the index of the last instruction
+    size_t endToken{};
+    std::vector<Edge> successors;
+    // The blocks the `call` at the end of the block calls
+    std::vector<size_t> callees;
+    // True if the block may continue at an address that is not known
+    bool hasUnknownSuccessors{};
+    bool isReachable{};
+};
+
+/*
+ * The control-flow graph of the instructions of a token list.
+ *
+ * Data tokens are not part of any block.
+ * A skip instruction ends its block, and the skipped instruction is a block of its own.
+ * `jp v0, table` has an edge to every `jp` of the table.
+ * Blocks that are referenced by address (e.g. `ld i, label`) are entry points.
+ */
+class ControlFlowGraph final
+{
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+private:
+    const Parser::tokenList_t& m_tokens;
+    std::vector<BasicBlock> m_blocks;
+    // Token index -> index of the containing block or `npos`
+    std::vector<size_t> m_tokenBlocks;
+    // The blocks where execution may start, e.g. the first block
+    std::vector<size_t> m_entryBlocks;
+    // True if the code jumps to numeric addresses, so every block may be reachable
+    bool m_hasUnknownJumps{};
+
+    void splitBlocks();
+    size_t getLabelBlock(const std::string& labelName, const std::map<std::string, size_t>& labelTokens) const;
+    void connectBlocks();
+    void findReachableBlocks();
+
+public:
+    /*
+     * Builds the graph. The token list must outlive the graph.
+     */
+    explicit ControlFlowGraph(const Parser::tokenList_t& tokens);
+
+    const std::vector<BasicBlock>& getBlocks() const { return m_blocks; }
+    const std::vector<size_t>& getEntryBlocks() const { return m_entryBlocks; }
+    // Returns the index of the block containing the token or `npos`
+    size_t getBlockOfToken(size_t tokenIndex) const { return m_tokenBlocks[tokenIndex]; }
+    bool hasUnknownJumps() const { return m_hasUnknownJumps; }
+
+    /*
+     * Returns the registers that are live (may be read before written) after each token.
+     * Registers are considered live at `ret` and at unknown successors.
+     */
+    std::vector<uint32_t> computeLiveness() const;
+
+    /*
+     * Returns the register values that are known before each token.
+     * Entry blocks start with every register unknown.
+     */
+    std::vector<KnownRegisterValues> computeKnownValues() const;
+
+    /*
+     * Writes the graph in Graphviz DOT format.
+     * Unreachable blocks are grayed out.
+     */
+    void writeDot(std::ostream& output) const;
+};
@@ -0,0 +1,791 @@
+#include "cycle_analysis.h"
+#include "cfg.h"
+#include "instruction_info.h"
+#include "common.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+
+using Type = Parser::OpcodeOperand::Type;
+
+CostProfile costProfileFromStr(const std::string& name)
+{
+    const std::string lower = strToLower(name);
+    if (lower.compare("vip") == 0)
+        return CostProfile::Vip;
+    if (lower.compare("modern") == 0)
+        return CostProfile::Modern;
+    throw std::invalid_argument{"Invalid cost profile: \"" + name + "\", expected \"vip\" or \"modern\""};
+}
+
+const char* costProfileToStr(CostProfile profile)
+{
+    switch (profile)
+    {
+    case CostProfile::Vip: return "vip (microseconds)";
+    case CostProfile::Modern: return "modern (instructions)";
+    }
+    return "";
+}
+
+uint64_t getDefaultFrameBudget(CostProfile profile)
+{
+    switch (profile)
+    {
+    // About half of the 16667 us frame goes to the display DMA and the interrupt routine
+    case CostProfile::Vip: return 8000;
+    // The default speed of many interpreters
+    case CostProfile::Modern: return 20;
+    }
+    return 0;
+}
+
+static inline uint64_t addCost(uint64_t a, uint64_t b)
+{
+    if (a == COST_UNBOUNDED || b == COST_UNBOUNDED || a > COST_UNBOUNDED-b)
+        return COST_UNBOUNDED;
+    return a+b;
+}
+
+static inline uint64_t mulCost(uint64_t a, uint64_t count)
+{
+    if (a == COST_UNBOUNDED || (count && a > COST_UNBOUNDED/count))
+        return COST_UNBOUNDED;
+    return a*count;
+}
+
+static inline CostRange addCost(const CostRange& a, const CostRange& b)
+{
+    return {addCost(a.best, b.best), addCost(a.worst, b.worst)};
+}
+
+static std::string costToStr(uint64_t cost)
+{
+    return cost == COST_UNBOUNDED ? "unbounded" : std::to_string(cost);
+}
+
+static std::string costToStr(const CostRange& cost)
+{
+    if (cost.best == cost.worst)
+        return costToStr(cost.best);
+    return costToStr(cost.best) + ".." + costToStr(cost.worst);
+}
+
+/*
+ * Returns the index of the last register of `ld [i], vx`, `ld vx, [i]`, `save` and `load`.
+ */
+static unsigned getLastRegister(const Parser::OpcodeOperand& operand)
+{
+    const uint32_t mask = operandToRegMask(operand);
+    for (unsigned i{}; i < 16; ++i)
+    {
+        if (mask == REGMASK_V(i))
+            return i;
+    }
+    return 15;
+}
+
+/*
+ * Returns the approximate cost of an instruction on the COSMAC VIP, in microseconds.
+ * Where the time depends on the data, the range is given.
+ */
+static CostRange getVipCost(const Parser::Opcode& opcode)
+{
+    const bool isRegOperand1 = opcode.operand1.getType() == Type::Register;
+
+    switch (opcode.opcode)
+    {
+    case Parser::OPCODE_NOP:
+        return {0, 0};
+
+    case Parser::OPCODE_CLS:
+        return {3078, 3078};
+
+    case Parser::OPCODE_SYS:
+    case Parser::OPCODE_JP:
+    case Parser::OPCODE_CALL:
+    case Parser::OPCODE_RET:
+        return {105, 105};
+
+    case Parser::OPCODE_SE:
+    case Parser::OPCODE_SNE:
+        // Skipping takes longer
+        return isRegOperand1 ? CostRange{64, 73} : CostRange{55, 64};
+
+    case Parser::OPCODE_SKP:
+    case Parser::OPCODE_SKNP:
+        return {64, 73};
+
+    case Parser::OPCODE_LD:
+    {
+        const uint32_t dest = operandToRegMask(opcode.operand0);
+        if (opcode.operand0.getType() == Type::F || opcode.operand0.getType() == Type::HF)
+            return {91, 91};
+        if (opcode.operand0.getType() == Type::R || opcode.operand1.getType() == Type::R)
+            return {64+34*8, 64+34*8};
+        if (opcode.isLongAddress) // Fetches a second word
+            return {110, 110};
+        if (opcode.operand0.getType() == Type::B) // Depends on the number of digits
+            return {364, 1100};
+        if (opcode.operand0.getType() == Type::Register && opcode.operand0.getAsRegister() == Parser::REGISTER_I_ADDR)
+            return {64+34*(getLastRegister(opcode.operand1)+1), 64+34*(getLastRegister(opcode.operand1)+1)};
+        if (isRegOperand1 && opcode.operand1.getAsRegister() == Parser::REGISTER_I_ADDR)
+            return {64+34*(getLastRegister(opcode.operand0)+1), 64+34*(getLastRegister(opcode.operand0)+1)};
+        if (dest == REGMASK_I)
+            return {55, 55};
+        if ((dest & REGMASK_ALL_V) && (operandToRegMask(opcode.operand1) & REGMASK_ALL_V)) // LD Vx, Vy
+            return {200, 200};
+        if (dest & REGMASK_ALL_V && !isRegOperand1 && opcode.operand1.getType() != Type::K) // LD Vx, byte
+            return {27, 27};
+        return {45, 45}; // Timers and keys
+    }
+
+    case Parser::OPCODE_ADD:
+        if (operandToRegMask(opcode.operand0) == REGMASK_I)
+            return {86, 86};
+        return isRegOperand1 ? CostRange{200, 200} : CostRange{45, 45};
+
+    case Parser::OPCODE_OR:
+    case Parser::OPCODE_AND:
+    case Parser::OPCODE_XOR:
+    case Parser::OPCODE_SUB:
+    case Parser::OPCODE_SHR:
+    case Parser::OPCODE_SUBN:
+    case Parser::OPCODE_SHL:
+        return {200, 200};
+
+    case Parser::OPCODE_RND:
+        return {164, 164};
+
+    case Parser::OPCODE_DRW:
+    {
+        // Depends on the height and the horizontal position of the sprite
+        uint64_t rows = 15;
+        if (opcode.operand2.getType() == Type::Uint)
+            rows = opcode.operand2.getAsUint() ? opcode.operand2.getAsUint() : 16;
+        return {68+200*rows, 68+446*rows};
+    }
+
+    // The VIP doesn't have the SUPER-CHIP and XO-CHIP instructions, these are estimates from the similar ones
+    case Parser::OPCODE_SCD:
+    case Parser::OPCODE_SCR:
+    case Parser::OPCODE_SCL:
+    case Parser::OPCODE_LOW:
+    case Parser::OPCODE_HIGH:
+        return {3078, 3078};
+
+    case Parser::OPCODE_EXIT:
+    case Parser::OPCODE_PLANE:
+    case Parser::OPCODE_AUDIO:
+        return {45, 45};
+
+    case Parser::OPCODE_SAVE:
+    case Parser::OPCODE_LOAD:
+    {
+        const unsigned first = getLastRegister(opcode.operand0);
+        const unsigned last = getLastRegister(opcode.operand1);
+        const unsigned count = (first > last ? first-last : last-first)+1;
+        return {64+34*count, 64+34*count};
+    }
+
+    case Parser::OPCODE_INVALID:
+        break;
+    }
+    return {0, COST_UNBOUNDED};
+}
+
+CostRange getInstructionCost(const Parser::Opcode& opcode, CostProfile profile)
+{
+    switch (profile)
+    {
+    case CostProfile::Vip: return getVipCost(opcode);
+    case CostProfile::Modern: return {1, 1};
+    }
+    return {};
+}
+
+/*
+ * Returns true if the instruction waits for the next frame (reads the delay timer or waits for a key).
+ */
+static bool isFrameWaitInstruction(const Parser::Opcode& opcode)
+{
+    return opcode.opcode == Parser::OPCODE_LD
+        && (opcode.operand1.getType() == Type::K
+            || (opcode.operand1.getType() == Type::Register && opcode.operand1.getAsRegister() == Parser::REGISTER_DT));
+}
+
+class CycleAnalyzer
+{
+private:
+    struct LoopInfo
+    {
+        size_t headerBlock{};
+        unsigned int tripCount{};
+        CostRange iterationCost;
+        CostRange totalCost;
+        bool hasFrameWait{};
+    };
+
+    static constexpr size_t npos = ControlFlowGraph::npos;
+
+    const Parser::tokenList_t& m_tokens;
+    const ControlFlowGraph m_cfg;
+    const CostProfile m_profile;
+
+    // Entry block of a subroutine -> the cost of the subroutine
+    std::map<size_t, CostRange> m_subroutineCosts;
+    std::set<size_t> m_subroutinesInProgress;
+    // The entry blocks of the subroutines that wait for a frame, directly or by calling others
+    std::set<size_t> m_waitingSubroutines;
+    // Header block -> loop
+    std::map<size_t, LoopInfo> m_loops;
+
+    const Parser::Opcode* getOpcode(size_t tokenI) const
+    {
+        return dynamic_cast<const Parser::Opcode*>(m_tokens[tokenI].get());
+    }
+
+    // Returns the subroutine the `call` at the end of the block calls, or `npos`
+    size_t getCallee(size_t blockI) const
+    {
+        const auto& callees = m_cfg.getBlocks()[blockI].callees;
+        return callees.empty() ? npos : callees[0];
+    }
+
+    bool isFrameWait(size_t tokenI) const
+    {
+        const Parser::Opcode* opcode = getOpcode(tokenI);
+        if (!opcode)
+            return false;
+        if (opcode->opcode == Parser::OPCODE_CALL)
+        {
+            const size_t blockI = m_cfg.getBlockOfToken(tokenI);
+            return blockI != npos && m_waitingSubroutines.count(getCallee(blockI));
+        }
+        return isFrameWaitInstruction(*opcode);
+    }
+
+public:
+    bool hasFrameWait(size_t blockI) const
+    {
+        const BasicBlock& block = m_cfg.getBlocks()[blockI];
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (isFrameWait(i))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    /*
+     * Returns the blocks reachable from the block without following calls.
+     */
+    std::vector<size_t> getRegion(size_t entryBlock) const
+    {
+        std::vector<size_t> region;
+        std::vector<bool> isVisited(m_cfg.getBlocks().size());
+        std::vector<size_t> worklist{entryBlock};
+        while (!worklist.empty())
+        {
+            const size_t blockI = worklist.back();
+            worklist.pop_back();
+            if (isVisited[blockI])
+                continue;
+            isVisited[blockI] = true;
+            region.push_back(blockI);
+            for (const auto& edge : m_cfg.getBlocks()[blockI].successors)
+                worklist.push_back(edge.block);
+        }
+        return region;
+    }
+
+    void findWaitingSubroutines()
+    {
+        std::set<size_t> subroutines;
+        for (const BasicBlock& block : m_cfg.getBlocks())
+            subroutines.insert(block.callees.begin(), block.callees.end());
+
+        bool hasChanged = true;
+        while (hasChanged)
+        {
+            hasChanged = false;
+            for (size_t sub : subroutines)
+            {
+                if (m_waitingSubroutines.count(sub))
+                    continue;
+                for (size_t blockI : getRegion(sub))
+                {
+                    if (hasFrameWait(blockI))
+                    {
+                        m_waitingSubroutines.insert(sub);
+                        hasChanged = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Returns the cost of the tokens in the range, including the subroutines they call.
+     */
+    CostRange getTokenRangeCost(size_t first, size_t end)
+    {
+        CostRange cost;
+        for (size_t i{first}; i < end; ++i)
+        {
+            const Parser::Opcode* opcode = getOpcode(i);
+            if (!opcode)
+                continue;
+            cost = addCost(cost, getInstructionCost(*opcode, m_profile));
+            if (opcode->opcode == Parser::OPCODE_CALL)
+            {
+                const size_t callee = getCallee(m_cfg.getBlockOfToken(i));
+                cost = addCost(cost, callee == npos ? CostRange{0, COST_UNBOUNDED} : getSubroutineCost(callee));
+            }
+        }
+        return cost;
+    }
+
+    /*
+     * Returns the index of the first or the last frame wait in the block.
+     */
+    size_t findFrameWait(size_t blockI, bool isLast) const
+    {
+        const BasicBlock& block = m_cfg.getBlocks()[blockI];
+        size_t found = npos;
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (isFrameWait(i))
+            {
+                found = i;
+                if (!isLast)
+                    break;
+            }
+        }
+        return found;
+    }
+
+    unsigned int getTripCount(size_t blockI) const
+    {
+        const BasicBlock& block = m_cfg.getBlocks()[blockI];
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (auto label = dynamic_cast<const Parser::Label*>(m_tokens[i].get()); label && label->tripCount)
+                return label->tripCount;
+        }
+        return 0;
+    }
+
+public:
+    CycleAnalyzer(const Parser::tokenList_t& tokens, CostProfile profile)
+        : m_tokens{tokens}, m_cfg{tokens}, m_profile{profile}
+    {
+        findWaitingSubroutines();
+    }
+
+    const ControlFlowGraph& getCfg() const { return m_cfg; }
+    const std::map<size_t, LoopInfo>& getLoops() const { return m_loops; }
+    const std::map<size_t, CostRange>& getSubroutineCosts() const { return m_subroutineCosts; }
+
+    CostRange getBlockCost(size_t blockI)
+    {
+        const BasicBlock& block = m_cfg.getBlocks()[blockI];
+        return getTokenRangeCost(block.firstToken, block.endToken);
+    }
+
+    CostRange getSubroutineCost(size_t entryBlock)
+    {
+        if (auto found = m_subroutineCosts.find(entryBlock); found != m_subroutineCosts.end())
+            return found->second;
+        if (m_subroutinesInProgress.count(entryBlock)) // Recursion
+            return {0, COST_UNBOUNDED};
+
+        m_subroutinesInProgress.insert(entryBlock);
+        const CostRange cost = analyzePaths(entryBlock, false);
+        m_subroutinesInProgress.erase(entryBlock);
+        m_subroutineCosts[entryBlock] = cost;
+        return cost;
+    }
+
+    /*
+     * Calculates the cost of the paths from the block to a `ret` or to the end of the code.
+     * If `stopAtFrameWaits` is set, the paths start after the last frame wait of the block
+     * and end at the next frame wait.
+     * Loops are collapsed from the innermost one, their cost is the cost of an iteration
+     * multiplied by the trip count.
+     */
+    CostRange analyzePaths(size_t entryBlock, bool stopAtFrameWaits)
+    {
+        // ----- Build the graph of the region -----
+        std::vector<size_t> nodeBlocks;
+        std::map<size_t, size_t> blockNodes;
+        {
+            std::vector<size_t> worklist{entryBlock};
+            while (!worklist.empty())
+            {
+                const size_t blockI = worklist.back();
+                worklist.pop_back();
+                if (blockNodes.count(blockI))
+                    continue;
+                blockNodes[blockI] = nodeBlocks.size();
+                nodeBlocks.push_back(blockI);
+                if (stopAtFrameWaits && blockI != entryBlock && hasFrameWait(blockI))
+                    continue;
+                for (const auto& edge : m_cfg.getBlocks()[blockI].successors)
+                    worklist.push_back(edge.block);
+            }
+        }
+
+        const bool hasVirtualStart = stopAtFrameWaits && hasFrameWait(entryBlock);
+        const size_t nodeCount = nodeBlocks.size() + hasVirtualStart;
+        const size_t startNode = (hasVirtualStart ? nodeCount-1 : 0);
+        std::vector<CostRange> weights(nodeCount);
+        std::vector<std::set<size_t>> successors(nodeCount);
+        std::vector<bool> leadsToUnknown(nodeCount);
+
+        for (size_t node{}; node < nodeBlocks.size(); ++node)
+        {
+            const size_t blockI = nodeBlocks[node];
+            const BasicBlock& block = m_cfg.getBlocks()[blockI];
+            if (stopAtFrameWaits && hasFrameWait(blockI)) // Ends a path
+            {
+                weights[node] = getTokenRangeCost(block.firstToken, findFrameWait(blockI, false)+1);
+                continue;
+            }
+            weights[node] = getBlockCost(blockI);
+            for (const auto& edge : block.successors)
+                successors[node].insert(blockNodes.at(edge.block));
+            leadsToUnknown[node] = block.hasUnknownSuccessors;
+        }
+        if (hasVirtualStart)
+        {
+            const BasicBlock& block = m_cfg.getBlocks()[entryBlock];
+            weights[startNode] = getTokenRangeCost(findFrameWait(entryBlock, true)+1, block.endToken);
+            for (const auto& edge : block.successors)
+                successors[startNode].insert(blockNodes.at(edge.block));
+            leadsToUnknown[startNode] = block.hasUnknownSuccessors;
+        }
+
+        // ----- Find the loops -----
+        // Header node -> nodes that jump back to it
+        std::map<size_t, std::set<size_t>> latches;
+        {
+            enum class State : uint8_t { New, OnStack, Done };
+            std::vector<State> states(nodeCount, State::New);
+            // Node, iterator to the next successor
+            std::vector<std::pair<size_t, std::set<size_t>::const_iterator>> stack;
+            stack.emplace_back(startNode, successors[startNode].begin());
+            states[startNode] = State::OnStack;
+            while (!stack.empty())
+            {
+                auto& [node, it] = stack.back();
+                if (it == successors[node].end())
+                {
+                    states[node] = State::Done;
+                    stack.pop_back();
+                    continue;
+                }
+                const size_t next = *it++;
+                if (states[next] == State::OnStack)
+                    latches[next].insert(node);
+                else if (states[next] == State::New)
+                {
+                    states[next] = State::OnStack;
+                    stack.emplace_back(next, successors[next].begin());
+                }
+            }
+        }
+
+        std::vector<std::set<size_t>> predecessors(nodeCount);
+        for (size_t node{}; node < nodeCount; ++node)
+        {
+            for (size_t next : successors[node])
+                predecessors[next].insert(node);
+        }
+
+        // Header node -> nodes of the loop
+        std::vector<std::pair<size_t, std::set<size_t>>> loops;
+        for (const auto& [header, loopLatches] : latches)
+        {
+            std::set<size_t> body{header};
+            std::vector<size_t> worklist(loopLatches.begin(), loopLatches.end());
+            while (!worklist.empty())
+            {
+                const size_t node = worklist.back();
+                worklist.pop_back();
+                if (!body.insert(node).second)
+                    continue;
+                for (size_t prev : predecessors[node])
+                    worklist.push_back(prev);
+            }
+            loops.emplace_back(header, std::move(body));
+        }
+        // Innermost first
+        std::sort(loops.begin(), loops.end(),
+                [](const auto& a, const auto& b){ return a.second.size() < b.second.size(); });
+
+        // ----- Collapse the loops -----
+        std::vector<size_t> reps(nodeCount);
+        for (size_t i{}; i < nodeCount; ++i)
+            reps[i] = i;
+        auto findRep{[&](size_t node){
+            while (reps[node] != node)
+                node = reps[node];
+            return node;
+        }};
+
+        /*
+         * Returns the shortest and longest paths from the node to an end.
+         * `isEnd` tells if a node can end the path, `canContinue` filters the successors.
+         * A cycle makes the longest path unbounded.
+         */
+        auto findPaths{[&](size_t start, const auto& isEnd, const auto& canContinue) -> std::optional<CostRange> {
+            std::map<size_t, std::optional<CostRange>> memo;
+            std::set<size_t> inProgress;
+            std::function<std::optional<CostRange>(size_t)> solve = [&](size_t node) -> std::optional<CostRange> {
+                if (auto found = memo.find(node); found != memo.end())
+                    return found->second;
+                if (inProgress.count(node))
+                    return CostRange{0, COST_UNBOUNDED};
+                inProgress.insert(node);
+
+                std::optional<CostRange> rest;
+                auto merge{[&](const CostRange& option){
+                    if (!rest)
+                        rest = option;
+                    else
+                        rest = CostRange{std::min(rest->best, option.best), std::max(rest->worst, option.worst)};
+                }};
+                if (isEnd(node))
+                    merge({0, 0});
+                if (leadsToUnknown[node])
+                    merge({0, COST_UNBOUNDED});
+                for (size_t next : successors[node])
+                {
+                    next = findRep(next);
+                    if (!canContinue(next))
+                        continue;
+                    if (auto path = solve(next))
+                        merge(*path);
+                }
+
+                inProgress.erase(node);
+                std::optional<CostRange> result;
+                if (rest)
+                    result = addCost(weights[node], *rest);
+                memo[node] = result;
+                return result;
+            };
+            return solve(start);
+        }};
+
+        for (const auto& [header, body] : loops)
+        {
+            if (findRep(header) != header) // Irreducible, shares nodes with a loop with another header
+                continue;
+            std::set<size_t> members;
+            for (size_t node : body)
+                members.insert(findRep(node));
+
+            auto jumpsBack{[&](size_t node){
+                for (size_t next : successors[node])
+                {
+                    if (findRep(next) == header)
+                        return true;
+                }
+                return false;
+            }};
+            std::optional<CostRange> iteration = findPaths(header,
+                    [&](size_t node){ return jumpsBack(node); },
+                    [&](size_t node){ return node != header && members.count(node); });
+            if (!iteration)
+                iteration = weights[header];
+
+            LoopInfo info;
+            info.headerBlock = (header < nodeBlocks.size() ? nodeBlocks[header] : entryBlock);
+            info.tripCount = getTripCount(info.headerBlock);
+            info.iterationCost = *iteration;
+            for (size_t node : body)
+            {
+                if (node < nodeBlocks.size() && hasFrameWait(nodeBlocks[node]))
+                    info.hasFrameWait = true;
+            }
+            if (info.tripCount)
+                info.totalCost = {mulCost(iteration->best, info.tripCount), mulCost(iteration->worst, info.tripCount)};
+            else
+                info.totalCost = {iteration->best, COST_UNBOUNDED};
+            m_loops.emplace(info.headerBlock, info);
+
+            // Replace the loop with its header
+            std::set<size_t> exits;
+            for (size_t node : members)
+            {
+                for (size_t next : successors[node])
+                {
+                    next = findRep(next);
+                    if (!members.count(next))
+                        exits.insert(next);
+                }
+                if (leadsToUnknown[node])
+                    leadsToUnknown[header] = true;
+                if (node != header)
+                    reps[node] = header;
+            }
+            successors[header] = std::move(exits);
+            weights[header] = info.totalCost;
+        }
+
+        // ----- The paths through the remaining graph -----
+        std::optional<CostRange> total = findPaths(findRep(startNode),
+                [&](size_t node){ return successors[node].empty(); },
+                [](size_t){ return true; });
+        return total ? *total : CostRange{weights[startNode].best, COST_UNBOUNDED};
+    }
+
+    /*
+     * Returns the deepest nesting of calls from the block, `SIZE_MAX` for recursion.
+     */
+    size_t getCallDepth(size_t entryBlock, std::map<size_t, size_t>& memo, std::set<size_t>& inProgress)
+    {
+        if (auto found = memo.find(entryBlock); found != memo.end())
+            return found->second;
+        if (inProgress.count(entryBlock))
+            return SIZE_MAX;
+        inProgress.insert(entryBlock);
+
+        size_t depth{};
+        for (size_t blockI : getRegion(entryBlock))
+        {
+            const size_t callee = getCallee(blockI);
+            if (callee == npos)
+                continue;
+            const size_t calleeDepth = getCallDepth(callee, memo, inProgress);
+            depth = std::max(depth, calleeDepth == SIZE_MAX ? SIZE_MAX : calleeDepth+1);
+        }
+
+        inProgress.erase(entryBlock);
+        memo[entryBlock] = depth;
+        return depth;
+    }
+
+    /*
+     * Returns the location and the name of the first label of the block.
+     */
+    std::string describeBlock(size_t blockI) const
+    {
+        const BasicBlock& block = m_cfg.getBlocks()[blockI];
+        std::string output = m_tokens[block.endToken-1]->getLocationStr();
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (auto label = dynamic_cast<const Parser::Label*>(m_tokens[i].get()))
+            {
+                output = m_tokens[i]->getLocationStr() + " " + label->name;
+                break;
+            }
+            if (getOpcode(i))
+            {
+                output = m_tokens[i]->getLocationStr();
+                break;
+            }
+        }
+        return output;
+    }
+};
+
+size_t analyzeCycles(const Parser::tokenList_t& tokens, const CycleAnalysisOptions& options, std::ostream& report)
+{
+    const uint64_t frameBudget = (options.frameBudget ? options.frameBudget : getDefaultFrameBudget(options.profile));
+    CycleAnalyzer analyzer{tokens, options.profile};
+    const ControlFlowGraph& cfg = analyzer.getCfg();
+    size_t problemCount{};
+
+    report << "Cycle analysis, profile: " << costProfileToStr(options.profile)
+        << ", frame budget: " << frameBudget << '\n';
+    if (cfg.getBlocks().empty())
+    {
+        report << "No code to analyze\n";
+        return 0;
+    }
+
+    report << "\nBasic blocks (best..worst):\n";
+    for (size_t blockI{}; blockI < cfg.getBlocks().size(); ++blockI)
+    {
+        if (!cfg.getBlocks()[blockI].isReachable)
+            continue;
+        report << "    " << analyzer.describeBlock(blockI) << ": " << costToStr(analyzer.getBlockCost(blockI)) << '\n';
+    }
+
+    const size_t entryBlock = cfg.getBlockOfToken(0);
+    CostRange programCost{0, COST_UNBOUNDED};
+    if (entryBlock != ControlFlowGraph::npos)
+        programCost = analyzer.analyzePaths(entryBlock, false);
+
+    std::map<size_t, size_t> depthMemo;
+    std::set<size_t> inProgress;
+    report << "\nSubroutines (best..worst, call depth):\n";
+    for (const auto& [entry, cost] : std::map<size_t, CostRange>{analyzer.getSubroutineCosts()})
+    {
+        const size_t depth = analyzer.getCallDepth(entry, depthMemo, inProgress);
+        report << "    " << analyzer.describeBlock(entry) << ": " << costToStr(cost)
+            << ", depth " << (depth == SIZE_MAX ? "unbounded" : std::to_string(depth+1)) << '\n';
+    }
+
+    report << "\nLoops:\n";
+    for (const auto& [header, loop] : analyzer.getLoops())
+    {
+        report << "    " << analyzer.describeBlock(header) << ": "
+            << (loop.tripCount ? std::to_string(loop.tripCount) + " trips" : std::string{"no %trips"})
+            << ", " << costToStr(loop.iterationCost) << " per iteration, " << costToStr(loop.totalCost) << " total"
+            << (loop.hasFrameWait ? " (waits for frames)" : "") << '\n';
+        if (!loop.tripCount && !loop.hasFrameWait)
+        {
+            Logger::warn << analyzer.describeBlock(header)
+                << ": Loop without a %trips annotation, its cost is unbounded" << Logger::End;
+        }
+    }
+
+    report << "\nFrames (from a frame wait to the next one, best..worst):\n";
+    std::vector<size_t> frameStarts;
+    if (entryBlock != ControlFlowGraph::npos)
+        frameStarts.push_back(entryBlock);
+    for (size_t blockI{}; blockI < cfg.getBlocks().size(); ++blockI)
+    {
+        if (blockI != entryBlock && cfg.getBlocks()[blockI].isReachable && analyzer.hasFrameWait(blockI))
+            frameStarts.push_back(blockI);
+    }
+    for (size_t blockI : frameStarts)
+    {
+        const CostRange cost = analyzer.analyzePaths(blockI, true);
+        const bool isOverBudget = cost.worst > frameBudget;
+        report << "    " << analyzer.describeBlock(blockI) << (blockI == entryBlock ? " (start)" : "")
+            << ": " << costToStr(cost) << (isOverBudget ? " OVER BUDGET" : "") << '\n';
+        if (isOverBudget)
+        {
+            if (cost.worst == COST_UNBOUNDED)
+                Logger::warn << analyzer.describeBlock(blockI) << ": The code until the next frame wait "
+                    "can't be bounded, annotate its loops with %trips" << Logger::End;
+            else
+                Logger::warn << analyzer.describeBlock(blockI) << ": The code until the next frame wait can take "
+                    << cost.worst << ", the frame budget is " << frameBudget << Logger::End;
+            ++problemCount;
+        }
+    }
+
+    const size_t depth = (entryBlock == ControlFlowGraph::npos ? 0 : analyzer.getCallDepth(entryBlock, depthMemo, inProgress));
+    report << "\nProgram: " << costToStr(programCost) << '\n';
+    report << "Deepest call nesting: " << (depth == SIZE_MAX ? "unbounded (recursion)" : std::to_string(depth))
+        << " of " << CALL_STACK_SIZE << '\n';
+    if (depth > CALL_STACK_SIZE)
+    {
+        Logger::warn << "The calls can nest " << (depth == SIZE_MAX ? "without a limit" : std::to_string(depth)+" deep")
+            << ", the call stack only has " << CALL_STACK_SIZE << " entries" << Logger::End;
+        ++problemCount;
+    }
+    return problemCount;
+}
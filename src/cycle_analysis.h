@@ -0,0 +1,64 @@
+#pragma once
+
+#include "parser.h"
+
+#include <iostream>
+#include <stdint.h>
+#include <string>
+
+// The cost of code that may run forever, e.g. a loop without a `%trips` annotation
+#define COST_UNBOUNDED UINT64_MAX
+// The depth of the CHIP-8 call stack
+#define CALL_STACK_SIZE 16
+
+enum class CostProfile
+{
+    Vip,    // Approximate timings of the COSMAC VIP interpreter in microseconds
+    Modern, // One unit per instruction, for interpreters that run N instructions per frame
+};
+
+/*
+ * Returns the profile with the name ("vip" or "modern").
+ *
+ * Throws if the name is invalid.
+ */
+[[nodiscard]] CostProfile costProfileFromStr(const std::string& name);
+
+[[nodiscard]] const char* costProfileToStr(CostProfile profile);
+
+/*
+ * Returns the cost of a frame (1/60 s) that can be spent on the program.
+ */
+[[nodiscard]] uint64_t getDefaultFrameBudget(CostProfile profile);
+
+struct CostRange
+{
+    uint64_t best{};
+    uint64_t worst{};
+};
+
+/*
+ * Returns the cost of executing the instruction once.
+ * Subroutine calls don't include the cost of the subroutine.
+ */
+[[nodiscard]] CostRange getInstructionCost(const Parser::Opcode& opcode, CostProfile profile);
+
+struct CycleAnalysisOptions
+{
+    CostProfile profile = CostProfile::Vip;
+    // 0 to use the default of the profile
+    uint64_t frameBudget{};
+};
+
+/*
+ * Calculates the best and worst case costs of the basic blocks, subroutines and loops,
+ * and writes a report.
+ *
+ * Loops are bounded by the `%trips` annotation of their first label.
+ * The code between two frame waits (reads of DT, `ld vx, k` and calls to subroutines
+ * that wait) is checked against the frame budget, and the deepest call chain
+ * is checked against the size of the call stack. The problems are reported as warnings.
+ *
+ * Returns the number of problems found.
+ */
+size_t analyzeCycles(const Parser::tokenList_t& tokens, const CycleAnalysisOptions& options, std::ostream& report);
@@ -0,0 +1,605 @@
+#include "data_packer.h"
+#include "cfg.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <set>
+#include <string>
+#include <vector>
+
+// The blocks tried as the continuation of a suffix, on each side of it in the suffix array
+#define PACK_MAX_CANDIDATES 4
+
+static constexpr size_t npos = SIZE_MAX;
+
+/*
+ * Labels followed by data, up to the next label or instruction.
+ */
+struct DataBlock
+{
+    // Index of the first label token
+    size_t regionStart{};
+    // Index of the first data token
+    size_t dataStart{};
+    // Index after the last data token
+    size_t regionEnd{};
+    std::vector<uint8_t> bytes;
+    // The block may be read past its end, so it can't be moved, removed or extended.
+    // Other blocks can still use its bytes.
+    bool isPinned{};
+
+    // The block that holds the bytes after the identical and contained blocks are merged,
+    // and the offset in it. The block itself if it holds its own bytes.
+    size_t container{};
+    size_t containerOffset{};
+
+    // The next block in the overlapped chain and the number of shared bytes, npos at the end of the chain
+    size_t next = npos;
+    size_t overlap{};
+    size_t prev = npos;
+    // The first block of the chain and the offset in the chain
+    size_t chainHead{};
+    size_t chainOffset{};
+};
+
+/*
+ * A suffix array of the bytes of the blocks, with the longest common prefixes of the neighbours.
+ * Every block is followed by a unique separator, so a common prefix never crosses the end of a block.
+ */
+class SuffixArray
+{
+private:
+    std::vector<uint32_t> m_text;
+    // m_lcpTable[j][r]: the smallest common prefix of the suffixes at ranks r-1..r+2^j-1
+    std::vector<std::vector<uint32_t>> m_lcpTable;
+
+    void buildSuffixes();
+    void buildLcp();
+
+public:
+    std::vector<uint32_t> suffixes;
+    std::vector<uint32_t> ranks;
+    // The offset of each block in the text
+    std::vector<size_t> blockStarts;
+
+    explicit SuffixArray(const std::vector<const std::vector<uint8_t>*>& blocks);
+
+    /*
+     * Returns the length of the common prefix of the suffixes at the two ranks.
+     */
+    size_t getCommonPrefix(size_t rankA, size_t rankB) const;
+
+    size_t size() const { return m_text.size(); }
+};
+
+SuffixArray::SuffixArray(const std::vector<const std::vector<uint8_t>*>& blocks)
+{
+    for (size_t i{}; i < blocks.size(); ++i)
+    {
+        blockStarts.push_back(m_text.size());
+        m_text.insert(m_text.end(), blocks[i]->begin(), blocks[i]->end());
+        m_text.push_back(256+i);
+    }
+    buildSuffixes();
+    buildLcp();
+}
+
+/*
+ * Sorts the suffixes by prefix doubling with counting sorts, O(n log n).
+ */
+void SuffixArray::buildSuffixes()
+{
+    const size_t n = m_text.size();
+    suffixes.resize(n);
+    ranks.resize(n);
+    std::iota(suffixes.begin(), suffixes.end(), 0);
+    std::sort(suffixes.begin(), suffixes.end(), [this](uint32_t a, uint32_t b){ return m_text[a] < m_text[b]; });
+    for (size_t r{}; r < n; ++r)
+        ranks[suffixes[r]] = (r && m_text[suffixes[r]] == m_text[suffixes[r-1]]) ? ranks[suffixes[r-1]] : r;
+
+    std::vector<uint32_t> sorted(n);
+    std::vector<uint32_t> newRanks(n);
+    std::vector<uint32_t> counts(n+1);
+    for (size_t k{1}; k < n; k *= 2)
+    {
+        // The suffixes that are sorted by the first k characters have unique ranks
+        bool isDone = true;
+        for (size_t r{1}; r < n && isDone; ++r)
+            isDone = ranks[suffixes[r]] != ranks[suffixes[r-1]];
+        if (isDone)
+            break;
+
+        // Sort by the rank of the second half, the suffixes without one first
+        size_t count{};
+        for (size_t i = (n > k ? n-k : 0); i < n; ++i)
+            sorted[count++] = i;
+        for (size_t r{}; r < n; ++r)
+        {
+            if (suffixes[r] >= k)
+                sorted[count++] = suffixes[r]-k;
+        }
+
+        // Then stable by the rank of the first half
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i{}; i < n; ++i)
+            ++counts[ranks[i]+1];
+        for (size_t i{1}; i <= n; ++i)
+            counts[i] += counts[i-1];
+        for (size_t j{}; j < n; ++j)
+            suffixes[counts[ranks[sorted[j]]]++] = sorted[j];
+
+        auto getSecondRank{[&](size_t i){ return i+k < n ? ranks[i+k]+1 : 0; }};
+        newRanks[suffixes[0]] = 0;
+        for (size_t r{1}; r < n; ++r)
+        {
+            const bool isSame = ranks[suffixes[r]] == ranks[suffixes[r-1]]
+                && getSecondRank(suffixes[r]) == getSecondRank(suffixes[r-1]);
+            newRanks[suffixes[r]] = isSame ? newRanks[suffixes[r-1]] : r;
+        }
+        ranks.swap(newRanks);
+    }
+}
+
+/*
+ * Kasai's algorithm and a sparse table for the range minimums.
+ */
+void SuffixArray::buildLcp()
+{
+    const size_t n = m_text.size();
+    std::vector<uint32_t> lcp(n);
+    size_t length{};
+    for (size_t i{}; i < n; ++i)
+    {
+        if (ranks[i] == 0)
+        {
+            length = 0;
+            continue;
+        }
+        const size_t j = suffixes[ranks[i]-1];
+        while (i+length < n && j+length < n && m_text[i+length] == m_text[j+length])
+            ++length;
+        lcp[ranks[i]] = length;
+        if (length)
+            --length;
+    }
+
+    m_lcpTable.push_back(std::move(lcp));
+    for (size_t width{2}; width <= n; width *= 2)
+    {
+        const std::vector<uint32_t>& previous = m_lcpTable.back();
+        std::vector<uint32_t> level(n-width+1);
+        for (size_t r{}; r < level.size(); ++r)
+            level[r] = std::min(previous[r], previous[r+width/2]);
+        m_lcpTable.push_back(std::move(level));
+    }
+}
+
+size_t SuffixArray::getCommonPrefix(size_t rankA, size_t rankB) const
+{
+    if (rankA == rankB)
+        return size()-suffixes[rankA];
+    if (rankA > rankB)
+        std::swap(rankA, rankB);
+    // The minimum of lcp[rankA+1..rankB]
+    size_t level{};
+    while ((size_t(2) << level) <= rankB-rankA)
+        ++level;
+    return std::min(m_lcpTable[level][rankA+1], m_lcpTable[level][rankB-(size_t(1) << level)+1]);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Finds the blocks whose bytes are known before the labels are.
+ */
+static std::vector<DataBlock> findBlocks(const Parser::tokenList_t& tokens)
+{
+    std::set<std::string> referencedWithOffset;
+    for (const auto& token : tokens)
+    {
+        forEachAddressReference(*token, [&](const std::string& name, bool isInExpression){
+            if (isInExpression)
+                referencedWithOffset.insert(name);
+        });
+    }
+
+    std::vector<DataBlock> blocks;
+    bool isPinning = false;
+    size_t i{};
+    while (i < tokens.size())
+    {
+        if (dynamic_cast<const Parser::Opcode*>(tokens[i].get()))
+        {
+            isPinning = false;
+            ++i;
+            continue;
+        }
+        if (!dynamic_cast<const Parser::Label*>(tokens[i].get())) // Data without a label
+        {
+            ++i;
+            continue;
+        }
+
+        DataBlock block;
+        block.regionStart = i;
+        for (; i < tokens.size(); ++i)
+        {
+            auto label = dynamic_cast<const Parser::Label*>(tokens[i].get());
+            if (!label)
+                break;
+            isPinning |= (referencedWithOffset.count(label->name) != 0);
+        }
+        block.dataStart = i;
+        bool isKnown = true;
+        for (; i < tokens.size(); ++i)
+        {
+            const Parser::Token* token = tokens[i].get();
+            if (dynamic_cast<const Parser::Label*>(token) || dynamic_cast<const Parser::Opcode*>(token))
+                break;
+            if (auto db = dynamic_cast<const Parser::DbInst*>(token); db && db->deferredArguments.empty())
+            {
+                block.bytes.insert(block.bytes.end(), db->arguments.begin(), db->arguments.end());
+            }
+            else if (auto dw = dynamic_cast<const Parser::DwInst*>(token); dw && dw->deferredArguments.empty())
+            {
+                for (uint16_t word : dw->arguments)
+                {
+                    block.bytes.push_back(word >> 8);
+                    block.bytes.push_back(word & 0xff);
+                }
+            }
+            else // Depends on labels or `%incbin`
+            {
+                isKnown = false;
+            }
+        }
+        block.regionEnd = i;
+        if (block.bytes.empty() || !isKnown) // Code labels or unknown bytes
+            continue;
+
+        // The data at the start of the ROM is executed
+        block.isPinned = isPinning || block.regionStart == 0;
+        block.container = blocks.size();
+        blocks.push_back(std::move(block));
+    }
+    return blocks;
+}
+
+/*
+ * Points the identical blocks to the first one, or to the first pinned one.
+ */
+static void mergeIdenticalBlocks(std::vector<DataBlock>* blocks)
+{
+    std::map<std::vector<uint8_t>, size_t> firstBlocks;
+    for (size_t i{}; i < blocks->size(); ++i)
+    {
+        auto found = firstBlocks.emplace((*blocks)[i].bytes, i);
+        if (!found.second && (*blocks)[i].isPinned && !(*blocks)[found.first->second].isPinned)
+            found.first->second = i;
+    }
+    for (size_t i{}; i < blocks->size(); ++i)
+    {
+        DataBlock& block = (*blocks)[i];
+        if (!block.isPinned)
+            block.container = firstBlocks.at(block.bytes);
+    }
+}
+
+/*
+ * Points the blocks that are a part of another block into that one.
+ */
+static void mergeContainedBlocks(std::vector<DataBlock>* blocks)
+{
+    std::vector<size_t> hosts;
+    for (size_t i{}; i < blocks->size(); ++i)
+    {
+        if ((*blocks)[i].container == i)
+            hosts.push_back(i);
+    }
+    std::vector<const std::vector<uint8_t>*> texts;
+    for (size_t host : hosts)
+        texts.push_back(&(*blocks)[host].bytes);
+    const SuffixArray suffixArray{texts};
+
+    // Maps a position in the text to the host and the offset in it
+    auto findPosition{[&](size_t position){
+        const size_t index = std::upper_bound(suffixArray.blockStarts.begin(), suffixArray.blockStarts.end(), position)
+            - suffixArray.blockStarts.begin() - 1;
+        return std::make_pair(hosts[index], position-suffixArray.blockStarts[index]);
+    }};
+
+    // The longer blocks are resolved first, so a block is never moved into one that moves later
+    std::vector<size_t> order(hosts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        return (*blocks)[hosts[a]].bytes.size() > (*blocks)[hosts[b]].bytes.size();
+    });
+    for (size_t index : order)
+    {
+        DataBlock& block = (*blocks)[hosts[index]];
+        if (block.isPinned)
+            continue;
+        // The other occurrences are next to the block in the suffix array
+        const size_t rank = suffixArray.ranks[suffixArray.blockStarts[index]];
+        size_t otherRank = npos;
+        if (rank > 0 && suffixArray.getCommonPrefix(rank-1, rank) >= block.bytes.size())
+            otherRank = rank-1;
+        else if (rank+1 < suffixArray.size() && suffixArray.getCommonPrefix(rank, rank+1) >= block.bytes.size())
+            otherRank = rank+1;
+        if (otherRank == npos)
+            continue;
+
+        const auto [other, offset] = findPosition(suffixArray.suffixes[otherRank]);
+        const DataBlock& otherBlock = (*blocks)[other];
+        block.container = otherBlock.container;
+        block.containerOffset = otherBlock.containerOffset+offset;
+    }
+
+    // The identical blocks follow their first block
+    for (DataBlock& block : *blocks)
+    {
+        const DataBlock& container = (*blocks)[block.container];
+        if (&container != &block && container.container != block.container)
+        {
+            block.containerOffset += container.containerOffset;
+            block.container = container.container;
+        }
+    }
+}
+
+/*
+ * Chains the blocks where the end of one is the start of another,
+ * taking the longest overlaps first (the greedy shortest common superstring).
+ */
+static void overlapBlocks(std::vector<DataBlock>* blocks)
+{
+    std::vector<size_t> hosts;
+    for (size_t i{}; i < blocks->size(); ++i)
+    {
+        if ((*blocks)[i].container == i && !(*blocks)[i].isPinned)
+            hosts.push_back(i);
+    }
+    if (hosts.size() < 2)
+        return;
+    std::vector<const std::vector<uint8_t>*> texts;
+    for (size_t host : hosts)
+        texts.push_back(&(*blocks)[host].bytes);
+    const SuffixArray suffixArray{texts};
+
+    // The ranks of the whole blocks, sorted
+    std::vector<std::pair<size_t, size_t>> startRanks; // Rank, host index
+    for (size_t i{}; i < hosts.size(); ++i)
+        startRanks.emplace_back(suffixArray.ranks[suffixArray.blockStarts[i]], i);
+    std::sort(startRanks.begin(), startRanks.end());
+
+    struct Candidate
+    {
+        size_t overlap;
+        size_t first;
+        size_t second;
+    };
+    std::vector<Candidate> candidates;
+    for (size_t i{}; i < hosts.size(); ++i)
+    {
+        const size_t start = suffixArray.blockStarts[i];
+        const size_t end = start+(*blocks)[hosts[i]].bytes.size();
+        for (size_t position{start+1}; position < end; ++position)
+        {
+            // The blocks that start with the rest of this block
+            const size_t overlap = end-position;
+            const size_t rank = suffixArray.ranks[position];
+            const auto middle = std::lower_bound(startRanks.begin(), startRanks.end(), std::make_pair(rank, size_t{}));
+            auto below = middle;
+            for (int count{}; count < PACK_MAX_CANDIDATES && below != startRanks.begin(); ++count)
+            {
+                --below;
+                if (suffixArray.getCommonPrefix(below->first, rank) < overlap)
+                    break;
+                if (below->second != i)
+                    candidates.push_back({overlap, i, below->second});
+            }
+            for (auto above = middle; above != startRanks.end() && above-middle < PACK_MAX_CANDIDATES; ++above)
+            {
+                if (suffixArray.getCommonPrefix(above->first, rank) < overlap)
+                    break;
+                if (above->second != i)
+                    candidates.push_back({overlap, i, above->second});
+            }
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b){
+        return a.overlap > b.overlap;
+    });
+
+    // The chains are tracked with a union-find, so no cycle is made
+    std::vector<size_t> parents(hosts.size());
+    std::iota(parents.begin(), parents.end(), 0);
+    auto findRoot{[&](size_t i){
+        while (parents[i] != i)
+            i = parents[i] = parents[parents[i]];
+        return i;
+    }};
+    for (const Candidate& candidate : candidates)
+    {
+        DataBlock& first = (*blocks)[hosts[candidate.first]];
+        DataBlock& second = (*blocks)[hosts[candidate.second]];
+        if (first.next != npos || second.prev != npos)
+            continue;
+        const size_t firstRoot = findRoot(candidate.first);
+        const size_t secondRoot = findRoot(candidate.second);
+        if (firstRoot == secondRoot)
+            continue;
+        parents[secondRoot] = firstRoot;
+        first.next = hosts[candidate.second];
+        first.overlap = candidate.overlap;
+        second.prev = hosts[candidate.first];
+    }
+}
+
+/*
+ * Sets the chain of every block and returns the bytes of the chains by their first block.
+ */
+static std::map<size_t, std::vector<uint8_t>> buildChains(std::vector<DataBlock>* blocks)
+{
+    std::map<size_t, std::vector<uint8_t>> chains;
+    for (size_t i{}; i < blocks->size(); ++i)
+    {
+        if ((*blocks)[i].container != i || (*blocks)[i].prev != npos)
+            continue;
+        std::vector<uint8_t>& bytes = chains[i];
+        size_t overlap{};
+        for (size_t member{i}; member != npos; member = (*blocks)[member].next)
+        {
+            DataBlock& block = (*blocks)[member];
+            block.chainHead = i;
+            block.chainOffset = bytes.size()-overlap;
+            bytes.insert(bytes.end(), block.bytes.begin()+overlap, block.bytes.end());
+            overlap = block.overlap;
+        }
+    }
+    for (DataBlock& block : *blocks)
+    {
+        const DataBlock& container = (*blocks)[block.container];
+        block.chainHead = container.chainHead;
+        block.chainOffset = container.chainOffset+block.containerOffset;
+    }
+    return chains;
+}
+
+static std::string getBlockName(const Parser::tokenList_t& tokens, const DataBlock& block)
+{
+    return static_cast<const Parser::Label*>(tokens[block.regionStart].get())->name;
+}
+
+static std::shared_ptr<Parser::Token> makeDbInst(const uint8_t* bytes, size_t size, const Parser::Token& location)
+{
+    auto db = std::make_shared<Parser::DbInst>();
+    db->arguments.assign(bytes, bytes+size);
+    db->setLocation(location.getLocation());
+    return db;
+}
+
+size_t packData(Parser::tokenList_t* tokens)
+{
+    std::vector<DataBlock> blocks = findBlocks(*tokens);
+    if (blocks.size() < 2)
+        return 0;
+    mergeIdenticalBlocks(&blocks);
+    mergeContainedBlocks(&blocks);
+    overlapBlocks(&blocks);
+    const std::map<size_t, std::vector<uint8_t>> chains = buildChains(&blocks);
+
+    // The blocks of each chain, by their first block
+    std::map<size_t, std::vector<size_t>> chainBlocks;
+    for (size_t i{}; i < blocks.size(); ++i)
+        chainBlocks[blocks[i].chainHead].push_back(i);
+
+    // The merged bytes replace the first block of the chain, or the pinned one, which can't move
+    std::map<size_t, size_t> placements; // Token index -> chain
+    std::vector<bool> isRemoved(tokens->size());
+    for (const auto& [head, members] : chainBlocks)
+    {
+        if (members.size() < 2)
+            continue;
+        size_t placement = blocks[members.front()].regionStart;
+        for (size_t member : members)
+        {
+            if (blocks[member].isPinned)
+                placement = blocks[member].regionStart;
+            for (size_t i{blocks[member].regionStart}; i < blocks[member].regionEnd; ++i)
+                isRemoved[i] = true;
+
+            if (member == head)
+                continue;
+            const DataBlock& block = blocks[member];
+            const DataBlock& container = blocks[block.container];
+            const size_t saved = (block.container != member ? block.bytes.size() : blocks[block.prev].overlap);
+            Logger::log << (*tokens)[block.dataStart]->getLocationStr() << ": Data packing: \""
+                << getBlockName(*tokens, block) << "\" "
+                << (block.container != member
+                        ? "shares the bytes of \"" + getBlockName(*tokens, container) + "\" at +"
+                            + std::to_string(block.containerOffset)
+                        : "overlaps the end of \"" + getBlockName(*tokens, blocks[block.prev]) + '"')
+                << " (" << saved << " bytes saved)" << Logger::End;
+        }
+        placements[placement] = head;
+    }
+    if (placements.empty())
+        return 0;
+
+    // The instructions that were at even addresses must stay there
+    std::set<const Parser::Token*> alignedOpcodes;
+    size_t oldSize{};
+    for (const auto& token : *tokens)
+    {
+        if (dynamic_cast<const Parser::Opcode*>(token.get()) && oldSize % 2 == 0)
+            alignedOpcodes.insert(token.get());
+        oldSize += token->getSize();
+    }
+
+    Parser::tokenList_t output;
+    output.reserve(tokens->size());
+    size_t newSize{};
+    size_t paddingSize{};
+    for (size_t i{}; i < tokens->size(); ++i)
+    {
+        auto placement = placements.find(i);
+        if (placement != placements.end())
+        {
+            const size_t head = placement->second;
+            const std::vector<uint8_t>& bytes = chains.at(head);
+
+            // The labels of the blocks at their offsets, the data is split between them
+            std::vector<size_t> members = chainBlocks.at(head);
+            std::stable_sort(members.begin(), members.end(), [&](size_t a, size_t b){
+                return blocks[a].chainOffset < blocks[b].chainOffset;
+            });
+            size_t written{};
+            const Parser::Token* location = (*tokens)[blocks[head].dataStart].get();
+            for (size_t member : members)
+            {
+                const DataBlock& block = blocks[member];
+                if (block.chainOffset > written)
+                {
+                    output.push_back(makeDbInst(bytes.data()+written, block.chainOffset-written, *location));
+                    written = block.chainOffset;
+                }
+                for (size_t j{block.regionStart}; j < block.dataStart; ++j)
+                    output.push_back((*tokens)[j]);
+                // The bytes are defined by the blocks of the chain, not by the ones moved into them
+                if (block.container == member)
+                    location = (*tokens)[block.dataStart].get();
+            }
+            output.push_back(makeDbInst(bytes.data()+written, bytes.size()-written, *location));
+            newSize += bytes.size();
+        }
+        if (isRemoved[i])
+            continue;
+
+        const auto& token = (*tokens)[i];
+        if (alignedOpcodes.count(token.get()) && newSize % 2)
+        {
+            // Before the labels of the instruction
+            auto position = output.end();
+            while (position != output.begin() && dynamic_cast<const Parser::Label*>((position-1)->get()))
+                --position;
+            const uint8_t zero{};
+            const Parser::Token& location = (position == output.begin() ? *token : **(position-1));
+            output.insert(position, makeDbInst(&zero, 1, location));
+            Logger::warn << location.getLocationStr() << ": Data packing: added 1 padding byte to keep the "
+                "instruction after it aligned" << Logger::End;
+            ++newSize;
+            ++paddingSize;
+        }
+        output.push_back(token);
+        newSize += token->getSize();
+    }
+    *tokens = std::move(output);
+
+    if (paddingSize)
+        Logger::log << "Data packing: added " << paddingSize << " padding bytes to keep the instructions aligned"
+            << Logger::End;
+    return oldSize > newSize ? oldSize-newSize : 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stddef.h>
+
+/*
+ * Shrinks the labelled data of `db` and `dw` by sharing the bytes of the blocks.
+ * A block is the data between a label and the next label or instruction.
+ *
+ *   - Identical blocks are merged and their labels point to the same bytes.
+ *   - A block that is a part of another block is removed and its labels point into the other one.
+ *   - Blocks where the end of one is the start of another are overlapped
+ *     (greedy shortest common superstring, using the longest overlaps first).
+ *
+ * The merged bytes are placed where the first of the blocks was. Blocks with values
+ * that depend on labels are left alone. The blocks after a label used in an expression
+ * (e.g. `ld i, sprites+8`) until the next instruction may be read past their end, so they are
+ * neither moved nor extended, but other blocks can still point into them.
+ * If the removed bytes would move an instruction to an odd address, a padding byte is added.
+ *
+ * Logs the bytes saved by each block. Returns the total number of bytes saved.
+ */
+size_t packData(Parser::tokenList_t* tokens);
@@ -0,0 +1,243 @@
+#include "disassembler.h"
+#include "instruction_set.h"
+#include "binary_generator.h"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using Kind = InstructionKind;
+
+enum class ByteRole : uint8_t
+{
+    Data,
+    InstructionStart,
+    // The other bytes of an instruction, can't have a label
+    InstructionEnd,
+};
+
+// Why an address is referenced, decides the name of its label
+enum LabelFlags : uint8_t
+{
+    LABEL_NONE = 0,
+    LABEL_DATA = 1,
+    LABEL_JUMP = 2,
+    LABEL_CALL = 4,
+};
+
+static std::string formatHex(unsigned int value, int width)
+{
+    std::stringstream ss;
+    ss << "0x" << std::hex << std::setfill('0') << std::setw(width) << value;
+    return ss.str();
+}
+
+/*
+ * Decodes the instruction as the target does. The instructions of the later targets in the
+ * 0nnn range are `sys` on the earlier ones, the rest are invalid.
+ */
+static Kind decodeForTarget(const InstructionKind* decodeTable, uint16_t word, InstructionTarget target)
+{
+    const Kind kind = decodeTable[word];
+    if (getRequiredTarget(kind, word) <= target)
+        return kind;
+    return word < 0x1000 ? Kind::Sys : Kind::Invalid;
+}
+
+/*
+ * Follows the control flow from the start of the ROM, marks the bytes of the reached instructions
+ * and the addresses that need a label.
+ * A path ends at an invalid instruction, at the end of the ROM or where it would overlap
+ * an instruction of another path with a different alignment.
+ */
+static void findCode(const uint8_t* rom, size_t size, InstructionTarget target,
+        std::vector<ByteRole>* roles, std::vector<uint8_t>* labels)
+{
+    const InstructionKind* decodeTable = getInstructionDecodeTable();
+
+    // Returns the offset of the address, or SIZE_MAX if it is outside the ROM
+    auto markLabel{[&](uint16_t address, LabelFlags flag){
+        if (address < ROM_LOAD_OFFSET || size_t(address-ROM_LOAD_OFFSET) >= size)
+            return SIZE_MAX;
+        (*labels)[address-ROM_LOAD_OFFSET] |= flag;
+        return size_t(address-ROM_LOAD_OFFSET);
+    }};
+
+    // Each instruction adds at most two paths, so every byte is visited a constant number of times
+    std::vector<size_t> paths{0};
+    while (!paths.empty())
+    {
+        size_t offset = paths.back();
+        paths.pop_back();
+        bool hasEnded = false;
+        while (!hasEnded && offset != SIZE_MAX && offset+1 < size
+            && (*roles)[offset] == ByteRole::Data && (*roles)[offset+1] == ByteRole::Data)
+        {
+            const uint16_t word = rom[offset] << 8 | rom[offset+1];
+            const Kind kind = decodeForTarget(decodeTable, word, target);
+            if (kind == Kind::Invalid)
+                break;
+            const size_t instructionSize = getInstructionSize(kind);
+            if (instructionSize > 2 && (offset+3 >= size
+                        || (*roles)[offset+2] != ByteRole::Data || (*roles)[offset+3] != ByteRole::Data))
+                break;
+            (*roles)[offset] = ByteRole::InstructionStart;
+            for (size_t i{1}; i < instructionSize; ++i)
+                (*roles)[offset+i] = ByteRole::InstructionEnd;
+
+            switch (kind)
+            {
+            case Kind::Jp:
+                // A jump to itself halts the program
+                paths.push_back(markLabel(getNnn(word), LABEL_JUMP));
+                hasEnded = true;
+                break;
+
+            case Kind::Call:
+                paths.push_back(markLabel(getNnn(word), LABEL_CALL));
+                break;
+
+            case Kind::Ret:
+            case Kind::Exit:
+                hasEnded = true;
+                break;
+
+            case Kind::JpV0Addr:
+                // The target is only known at runtime, so it is only labeled
+                markLabel(getNnn(word), LABEL_JUMP);
+                hasEnded = true;
+                break;
+
+            case Kind::LdIAddr:
+                markLabel(getNnn(word), LABEL_DATA);
+                break;
+
+            case Kind::LdILong:
+                markLabel(rom[offset+2] << 8 | rom[offset+3], LABEL_DATA);
+                break;
+
+            case Kind::SeVxByte:
+            case Kind::SneVxByte:
+            case Kind::SeVxVy:
+            case Kind::SneVxVy:
+            case Kind::SkpVx:
+            case Kind::SknpVx:
+            {
+                // XO-CHIP skips the whole `ld i, long`
+                const bool isNextLong = (target == InstructionTarget::XoChip && offset+3 < size
+                        && decodeTable[rom[offset+2] << 8 | rom[offset+3]] == Kind::LdILong);
+                paths.push_back(offset + (isNextLong ? 6 : 4));
+                break;
+            }
+
+            default:
+                break;
+            }
+            offset += instructionSize;
+        }
+    }
+}
+
+static std::string getLabelName(size_t offset, uint8_t flags)
+{
+    if (offset == 0)
+        return "start";
+    std::stringstream ss;
+    ss << ((flags & LABEL_CALL) ? "sub_" : (flags & LABEL_JUMP) ? "label_" : "data_")
+        << std::hex << std::setfill('0') << std::setw(3) << ROM_LOAD_OFFSET+offset;
+    return ss.str();
+}
+
+/*
+ * Fills the placeholders of the syntax of the instruction.
+ * `addressStr` replaces `{nnn}` and `{nnnn}`.
+ */
+static std::string formatInstruction(uint16_t word, const InstructionEncoding& encoding,
+        const std::string& addressStr)
+{
+    std::string output;
+    for (const char* c = encoding.syntax; *c; ++c)
+    {
+        if (*c != '{')
+        {
+            output += *c;
+            continue;
+        }
+        const char* end = std::strchr(c, '}');
+        const std::string name{c+1, end};
+        if (name.compare("nnn") == 0 || name.compare("nnnn") == 0)
+            output += addressStr;
+        else if (name.compare("x") == 0)
+            output += "0123456789abcdef"[getX(word)];
+        else if (name.compare("y") == 0)
+            output += "0123456789abcdef"[getY(word)];
+        else if (name.compare("kk") == 0)
+            output += formatHex(getKk(word), 2);
+        else if (name.compare("n") == 0)
+            output += std::to_string(encoding.format == InstructionFormat::XN ? getX(word) : getN(word));
+        c = end;
+    }
+    return output;
+}
+
+void disassemble(const uint8_t* rom, size_t size, InstructionTarget target, std::ostream& output)
+{
+    std::vector<ByteRole> roles(size);
+    std::vector<uint8_t> labels(size);
+    findCode(rom, size, target, &roles, &labels);
+    const InstructionKind* decodeTable = getInstructionDecodeTable();
+
+    // The labels that would be inside an instruction are written as numbers
+    auto hasLabel{[&](size_t offset){
+        return offset < size && (labels[offset] || offset == 0) && roles[offset] != ByteRole::InstructionEnd;
+    }};
+    auto getAddressStr{[&](uint16_t address){
+        if (address >= ROM_LOAD_OFFSET && hasLabel(address-ROM_LOAD_OFFSET))
+            return getLabelName(address-ROM_LOAD_OFFSET, labels[address-ROM_LOAD_OFFSET]);
+        return formatHex(address, 3);
+    }};
+
+    output << "; Disassembled by chip8asm, " << size << " bytes\n";
+    size_t offset{};
+    while (offset < size)
+    {
+        if (hasLabel(offset))
+            output << '\n' << getLabelName(offset, labels[offset]) << ":\n";
+
+        if (roles[offset] == ByteRole::InstructionStart)
+        {
+            const uint16_t word = rom[offset] << 8 | rom[offset+1];
+            const Kind kind = decodeForTarget(decodeTable, word, target);
+            std::string addressStr;
+            if (kind == Kind::Sys) // The address of `sys` is machine code, not a part of the ROM
+                addressStr = formatHex(getNnn(word), 3);
+            else if (kind == Kind::LdILong)
+                addressStr = getAddressStr(rom[offset+2] << 8 | rom[offset+3]);
+            else
+                addressStr = getAddressStr(getNnn(word));
+            const std::string line = "    " + formatInstruction(word, getInstructionEncoding(kind), addressStr);
+            output << std::left << std::setw(32) << line << std::right << "; "
+                << std::hex << std::setfill('0') << std::setw(3) << ROM_LOAD_OFFSET+offset << ": "
+                << std::setw(4) << word;
+            if (kind == Kind::LdILong)
+                output << ' ' << std::setw(4) << (rom[offset+2] << 8 | rom[offset+3]);
+            output << std::dec << std::setfill(' ') << '\n';
+            offset += getInstructionSize(kind);
+            continue;
+        }
+
+        // The data runs until the next instruction or label, 16 bytes per line
+        output << "    db";
+        const size_t lineStart = offset;
+        do
+        {
+            output << (offset == lineStart ? " " : ", ") << formatHex(rom[offset], 2);
+            ++offset;
+        }
+        while (offset < size && offset-lineStart < 16
+            && roles[offset] != ByteRole::InstructionStart && !hasLabel(offset));
+        output << '\n';
+    }
+}
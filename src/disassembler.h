@@ -0,0 +1,18 @@
+#pragma once
+
+#include "instruction_set.h"
+
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Writes the source of a ROM loaded at `ROM_LOAD_OFFSET`, which assembles to the same bytes.
+ *
+ * The code is found by following the control flow from the start of the ROM,
+ * the bytes that are never reached are written as data. Labels are generated for the targets
+ * of `jp`, `call` and `ld i` inside the ROM. Every byte is visited a constant number of times,
+ * so large ROMs are disassembled in linear time.
+ * The instructions that are not on `target` are treated as data, or as `sys` in the 0nnn range.
+ */
+void disassemble(const uint8_t* rom, size_t size, InstructionTarget target, std::ostream& output);
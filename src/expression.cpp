@@ -0,0 +1,509 @@
+#include "expression.h"
+#include "parser.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cmath>
+
+namespace Parser
+{
+
+struct ExpressionFunction
+{
+    const char* name;
+    Expression::Op op;
+    int argCount;
+};
+
+static constexpr ExpressionFunction expressionFunctions[] = {
+    {"lo", Expression::Op::Lo, 1},
+    {"hi", Expression::Op::Hi, 1},
+    {"min", Expression::Op::Min, 2},
+    {"max", Expression::Op::Max, 2},
+    {"clamp", Expression::Op::Clamp, 3},
+    {"sin", Expression::Op::Sin, 3},
+    {"cos", Expression::Op::Cos, 3},
+};
+
+static const ExpressionFunction* getExpressionFunction(Expression::Op op)
+{
+    for (const auto& func : expressionFunctions)
+    {
+        if (func.op == op)
+            return &func;
+    }
+    return nullptr;
+}
+
+/*
+ * Returns the number of values the operation takes from the stack.
+ */
+static int getOperandCount(Expression::Op op)
+{
+    if (const ExpressionFunction* func = getExpressionFunction(op))
+        return func->argCount;
+    switch (op)
+    {
+    case Expression::Op::Number:
+    case Expression::Op::Symbol:
+    case Expression::Op::CurrentAddress:
+        return 0;
+    case Expression::Op::Neg:
+    case Expression::Op::Not:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+static int getPrecedence(Expression::Op op)
+{
+    switch (op)
+    {
+    case Expression::Op::Neg:
+    case Expression::Op::Not:
+        return 7;
+    case Expression::Op::Mul:
+    case Expression::Op::Div:
+    case Expression::Op::Mod:
+        return 6;
+    case Expression::Op::Add:
+    case Expression::Op::Sub:
+        return 5;
+    case Expression::Op::Shl:
+    case Expression::Op::Shr:
+        return 4;
+    case Expression::Op::And:
+        return 3;
+    case Expression::Op::Xor:
+        return 2;
+    case Expression::Op::Or:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static bool isUnary(Expression::Op op)
+{
+    return op == Expression::Op::Neg || op == Expression::Op::Not;
+}
+
+Expression Expression::parse(const std::string& str)
+{
+    // An entry on the operator stack
+    struct StackEntry
+    {
+        enum class Kind : uint8_t { Operator, Paren, Function } kind;
+        Op op;
+        // Function: the expected argument count, Paren: the index of the function entry or -1
+        int argCount;
+    };
+
+    Expression expr;
+    expr.m_items.reserve(str.size());
+    std::vector<StackEntry> opStack;
+    // The number of arguments seen so far for each open parenthesis
+    std::vector<int> argCounts;
+
+    auto popOperator{
+        [&](){
+            expr.m_items.push_back({opStack.back().op, 0});
+            opStack.pop_back();
+        }
+    };
+
+    auto addSymbol{
+        [&expr](const std::string& name){
+            for (size_t i{}; i < expr.m_symbols.size(); ++i)
+            {
+                if (expr.m_symbols[i].compare(name) == 0)
+                    return (int32_t)i;
+            }
+            expr.m_symbols.push_back(name);
+            return (int32_t)expr.m_symbols.size()-1;
+        }
+    };
+
+    bool expectOperand = true;
+    size_t i{};
+    while (i < str.size())
+    {
+        const char c = str[i];
+        if (std::isspace((unsigned char)c))
+        {
+            ++i;
+            continue;
+        }
+
+        if (expectOperand)
+        {
+            if (std::isdigit((unsigned char)c) || c == '\'') // Number or character
+            {
+                size_t end = i+1;
+                if (c == '\'')
+                {
+                    end = (i+1 < str.size() && str[i+1] == '\\') ? i+4 : i+3;
+                    if (end > str.size())
+                        throw std::invalid_argument{"Unterminated character literal"};
+                }
+                else
+                {
+                    while (end < str.size() && (std::isalnum((unsigned char)str[end]) || str[end] == '_'))
+                        ++end;
+                }
+                const unsigned int value = stringToUint(str.substr(i, end-i), INT_MAX);
+                expr.m_items.push_back({Op::Number, (int32_t)value});
+                i = end;
+                expectOperand = false;
+            }
+            else if (std::isalpha((unsigned char)c) || c == '_') // Symbol or function
+            {
+                size_t end = i+1;
+                while (end < str.size() && (std::isalnum((unsigned char)str[end]) || str[end] == '_'))
+                    ++end;
+                const std::string name = str.substr(i, end-i);
+                i = end;
+
+                size_t afterName = end;
+                while (afterName < str.size() && std::isspace((unsigned char)str[afterName]))
+                    ++afterName;
+                if (afterName < str.size() && str[afterName] == '(')
+                {
+                    const ExpressionFunction* func{};
+                    for (const auto& f : expressionFunctions)
+                    {
+                        if (strToLower(name).compare(f.name) == 0)
+                            func = &f;
+                    }
+                    if (!func)
+                        throw std::invalid_argument{"Unknown function: " + name};
+                    opStack.push_back({StackEntry::Kind::Function, func->op, func->argCount});
+                    opStack.push_back({StackEntry::Kind::Paren, Op::Number, (int)opStack.size()-1});
+                    argCounts.push_back(1);
+                    i = afterName+1;
+                    // Still expecting the first argument
+                }
+                else
+                {
+                    expr.m_items.push_back({Op::Symbol, addSymbol(name)});
+                    expectOperand = false;
+                }
+            }
+            else if (c == '$')
+            {
+                expr.m_items.push_back({Op::CurrentAddress, 0});
+                ++i;
+                expectOperand = false;
+            }
+            else if (c == '(')
+            {
+                opStack.push_back({StackEntry::Kind::Paren, Op::Number, -1});
+                argCounts.push_back(1);
+                ++i;
+            }
+            else if (c == '-' || c == '~' || c == '+')
+            {
+                if (c != '+') // Unary plus does nothing
+                    opStack.push_back({StackEntry::Kind::Operator, (c == '-' ? Op::Neg : Op::Not), 0});
+                ++i;
+            }
+            else
+            {
+                throw std::invalid_argument{std::string{"Unexpected character in expression: '"} + c + '\''};
+            }
+            continue;
+        }
+
+        // Expecting an operator
+        if (c == ')' || c == ',')
+        {
+            while (!opStack.empty() && opStack.back().kind == StackEntry::Kind::Operator)
+                popOperator();
+            if (opStack.empty())
+                throw std::invalid_argument{std::string{"Unexpected '"} + c + "' in expression"};
+
+            if (c == ',')
+            {
+                if (opStack.back().argCount < 0)
+                    throw std::invalid_argument{"Unexpected ',' in expression"};
+                ++argCounts.back();
+                expectOperand = true;
+            }
+            else
+            {
+                const int funcIndex = opStack.back().argCount;
+                opStack.pop_back();
+                if (funcIndex >= 0)
+                {
+                    if (opStack.back().argCount != argCounts.back())
+                        throw std::invalid_argument{"Invalid number of arguments for function"};
+                    popOperator();
+                }
+                argCounts.pop_back();
+            }
+            ++i;
+            continue;
+        }
+
+        Op op;
+        size_t opLen = 1;
+        switch (c)
+        {
+        case '*': op = Op::Mul; break;
+        case '/': op = Op::Div; break;
+        case '%': op = Op::Mod; break;
+        case '+': op = Op::Add; break;
+        case '-': op = Op::Sub; break;
+        case '&': op = Op::And; break;
+        case '^': op = Op::Xor; break;
+        case '|': op = Op::Or; break;
+        case '<':
+        case '>':
+            if (i+1 >= str.size() || str[i+1] != c)
+                throw std::invalid_argument{std::string{"Unexpected character in expression: '"} + c + '\''};
+            op = (c == '<' ? Op::Shl : Op::Shr);
+            opLen = 2;
+            break;
+        default:
+            throw std::invalid_argument{std::string{"Unexpected character in expression: '"} + c + '\''};
+        }
+
+        // All binary operators are left-associative
+        while (!opStack.empty() && opStack.back().kind == StackEntry::Kind::Operator
+                && getPrecedence(opStack.back().op) >= getPrecedence(op))
+            popOperator();
+        opStack.push_back({StackEntry::Kind::Operator, op, 0});
+        i += opLen;
+        expectOperand = true;
+    }
+
+    if (expectOperand)
+        throw std::invalid_argument{"Unexpected end of expression"};
+    while (!opStack.empty())
+    {
+        if (opStack.back().kind != StackEntry::Kind::Operator)
+            throw std::invalid_argument{"Missing ')' in expression"};
+        popOperator();
+    }
+
+    // Check the stack depth now, so evaluation can't fail because of it
+    {
+        size_t depth{};
+        for (const Item& item : expr.m_items)
+        {
+            switch (item.op)
+            {
+            case Op::Number:
+            case Op::Symbol:
+            case Op::CurrentAddress:
+                if (++depth > EXPRESSION_MAX_STACK)
+                    throw std::invalid_argument{"Expression is too complex"};
+                break;
+            default:
+                depth -= getOperandCount(item.op)-1;
+                break;
+            }
+        }
+    }
+
+    return expr;
+}
+
+bool Expression::isConstant() const
+{
+    for (const Item& item : m_items)
+    {
+        if (item.op == Op::Symbol || item.op == Op::CurrentAddress)
+            return false;
+    }
+    return true;
+}
+
+bool Expression::replaceSymbol(const std::string& name, int32_t value)
+{
+    auto found = std::find(m_symbols.begin(), m_symbols.end(), name);
+    if (found == m_symbols.end())
+        return false;
+
+    const int32_t index = found-m_symbols.begin();
+    m_symbols.erase(found);
+    for (Item& item : m_items)
+    {
+        if (item.op != Op::Symbol)
+            continue;
+        if (item.value == index)
+            item = {Op::Number, value};
+        else if (item.value > index)
+            --item.value;
+    }
+    return true;
+}
+
+bool Expression::usesCurrentAddress() const
+{
+    for (const Item& item : m_items)
+    {
+        if (item.op == Op::CurrentAddress)
+            return true;
+    }
+    return false;
+}
+
+std::string Expression::toString() const
+{
+    static constexpr const char* binaryOpStrs[] = {
+        "*", "/", "%", "+", "-", "<<", ">>", "&", "^", "|",
+    };
+
+    std::vector<std::string> stack;
+    for (const Item& item : m_items)
+    {
+        switch (item.op)
+        {
+        case Op::Number:
+            stack.push_back(std::to_string(item.value));
+            break;
+        case Op::Symbol:
+            stack.push_back(m_symbols[item.value]);
+            break;
+        case Op::CurrentAddress:
+            stack.push_back("$");
+            break;
+        case Op::Neg:
+            stack.back() = "-" + stack.back();
+            break;
+        case Op::Not:
+            stack.back() = "~" + stack.back();
+            break;
+        case Op::Lo:
+            stack.back() = "lo(" + stack.back() + ")";
+            break;
+        case Op::Hi:
+            stack.back() = "hi(" + stack.back() + ")";
+            break;
+        case Op::Min:
+        case Op::Max:
+        case Op::Clamp:
+        case Op::Sin:
+        case Op::Cos:
+        {
+            const int argCount = getOperandCount(item.op);
+            std::string call = std::string{getExpressionFunction(item.op)->name} + "(";
+            for (int i{}; i < argCount; ++i)
+                call += (i ? ", " : "") + stack[stack.size()-argCount+i];
+            stack.resize(stack.size()-argCount);
+            stack.push_back(call + ")");
+            break;
+        }
+        default:
+        {
+            const std::string right = std::move(stack.back());
+            stack.pop_back();
+            stack.back() = "(" + stack.back() + binaryOpStrs[(int)item.op-(int)Op::Mul] + right + ")";
+            break;
+        }
+        }
+    }
+    return stack.empty() ? "" : stack.back();
+}
+
+int32_t Expression::evaluateConstant() const
+{
+    return evaluate([](const std::string&, int32_t*){ return false; }, 0);
+}
+
+/*
+ * Returns the result of an operation computed in 64 bits.
+ *
+ * Throws if it doesn't fit in 32 bits.
+ */
+static int32_t checkOverflow(int64_t result)
+{
+    if (result < INT32_MIN || result > INT32_MAX)
+        throw std::runtime_error{"Integer overflow: " + std::to_string(result) + " doesn't fit in 32 bits"};
+    return int32_t(result);
+}
+
+void applyExpressionOp(Expression::Op op, int32_t* stack, size_t& stackSize)
+{
+    using Op = Expression::Op;
+
+    if (isUnary(op) || op == Op::Lo || op == Op::Hi)
+    {
+        if (stackSize < 1)
+            throw std::runtime_error{"Invalid expression"};
+        int32_t& value = stack[stackSize-1];
+        switch (op)
+        {
+        case Op::Neg: value = checkOverflow(-int64_t(value)); break;
+        case Op::Not: value = ~value; break;
+        case Op::Lo:  value = value & 0xff; break;
+        case Op::Hi:  value = (value >> 8) & 0xff; break;
+        default: break;
+        }
+        return;
+    }
+
+    if (op == Op::Clamp || op == Op::Sin || op == Op::Cos)
+    {
+        if (stackSize < 3)
+            throw std::runtime_error{"Invalid expression"};
+        stackSize -= 2;
+        int32_t& value = stack[stackSize-1];
+        const int32_t arg1 = stack[stackSize];
+        const int32_t arg2 = stack[stackSize+1];
+        if (op == Op::Clamp)
+        {
+            if (arg1 > arg2)
+                throw std::runtime_error{"The minimum of clamp() is larger than the maximum"};
+            value = std::clamp(value, arg1, arg2);
+        }
+        else
+        {
+            if (arg1 <= 0)
+                throw std::runtime_error{"The period of sin() and cos() must be positive"};
+            // Reduce the angle first, so large values stay exact
+            const double angle = 2*M_PI*((int64_t)value % arg1)/arg1;
+            value = std::lround((op == Op::Sin ? std::sin(angle) : std::cos(angle))*arg2);
+        }
+        return;
+    }
+
+    if (stackSize < 2)
+        throw std::runtime_error{"Invalid expression"};
+    const int32_t right = stack[--stackSize];
+    int32_t& left = stack[stackSize-1];
+    switch (op)
+    {
+    case Op::Mul: left = checkOverflow(int64_t(left) * right); break;
+    case Op::Div:
+        if (right == 0)
+            throw std::runtime_error{"Division by zero"};
+        left = checkOverflow(int64_t(left) / right);
+        break;
+    case Op::Mod:
+        if (right == 0)
+            throw std::runtime_error{"Division by zero"};
+        // The quotient of INT32_MIN % -1 overflows
+        if (left == INT32_MIN && right == -1)
+            throw std::runtime_error{"Integer overflow: " + std::to_string(left) + " % -1"};
+        left = left % right;
+        break;
+    case Op::Add: left = checkOverflow(int64_t(left) + right); break;
+    case Op::Sub: left = checkOverflow(int64_t(left) - right); break;
+    case Op::Shl: left = (right >= 0 && right < 32) ? int32_t(uint32_t(left) << right) : 0; break;
+    case Op::Shr: left = (right >= 0 && right < 32) ? (left >> right) : 0; break;
+    case Op::And: left = left & right; break;
+    case Op::Xor: left = left ^ right; break;
+    case Op::Or:  left = left | right; break;
+    case Op::Min: left = std::min(left, right); break;
+    case Op::Max: left = std::max(left, right); break;
+    default:
+        throw std::runtime_error{"Invalid expression"};
+    }
+}
+
+} // namespace Parser
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Parser
+{
+
+// The most values an expression can have on its evaluation stack
+#define EXPRESSION_MAX_STACK 32
+
+/*
+ * An integer expression, stored in postfix order.
+ *
+ * Supports the `+ - * / % & | ^ ~ << >>` operators, parentheses,
+ * the `lo(x)`, `hi(x)`, `min(a, b)`, `max(a, b)` and `clamp(x, min, max)` functions,
+ * `sin(x, period, amplitude)` and `cos(x, period, amplitude)` (rounded, e.g. `sin(i, 256, 127)`),
+ * symbols (labels) and `$` (the current address).
+ * Both parsing and evaluation are iterative and evaluation doesn't allocate.
+ */
+class Expression
+{
+public:
+    enum class Op : uint8_t
+    {
+        Number,
+        Symbol,
+        CurrentAddress,
+        Neg,
+        Not,
+        Mul,
+        Div,
+        Mod,
+        Add,
+        Sub,
+        Shl,
+        Shr,
+        And,
+        Xor,
+        Or,
+        Lo,
+        Hi,
+        Min,
+        Max,
+        Clamp,
+        Sin,
+        Cos,
+    };
+
+    struct Item
+    {
+        Op op;
+        // The value of a number or the index of a symbol in `m_symbols`
+        int32_t value;
+    };
+
+private:
+    std::vector<Item> m_items;
+    std::vector<std::string> m_symbols;
+
+public:
+    inline Expression() {}
+
+    /*
+     * Parses an expression.
+     *
+     * Throws on error.
+     */
+    static Expression parse(const std::string& str);
+
+    // True if the expression has no symbols and doesn't use `$`
+    bool isConstant() const;
+    // True if the expression uses `$`
+    bool usesCurrentAddress() const;
+
+    // Returns the expression in infix form, with every operation parenthesized
+    std::string toString() const;
+
+    const std::vector<std::string>& getSymbols() const { return m_symbols; }
+    // Renames every occurrence of a symbol
+    void renameSymbol(size_t index, const std::string& newName) { m_symbols[index] = newName; }
+    // Replaces every occurrence of a symbol with a number, returns false if the symbol is not used
+    bool replaceSymbol(const std::string& name, int32_t value);
+
+    /*
+     * Calculates the value.
+     * `resolveSymbol` is called as `bool(const std::string& name, int32_t* value)`
+     * and returns false if the symbol is not defined.
+     *
+     * Throws on error.
+     */
+    template <typename Resolver>
+    int32_t evaluate(Resolver&& resolveSymbol, int32_t currentAddress) const;
+
+    /*
+     * Calculates the value of a constant expression.
+     *
+     * Throws on error.
+     */
+    int32_t evaluateConstant() const;
+};
+
+/*
+ * Converts the value of an expression to an unsigned field.
+ * `limit` is the largest value of the field, it must be a power of 2 minus 1.
+ * Negative values are stored in two's complement.
+ *
+ * Throws if the value doesn't fit.
+ */
+[[nodiscard]] inline unsigned int expressionValueToUint(int32_t value, unsigned int limit)
+{
+    if (value > (int64_t)limit || value < -((int64_t)limit+1)/2)
+        throw std::out_of_range{"Expression value " + std::to_string(value) + " is out of range"};
+    return (unsigned int)value & limit;
+}
+
+/*
+ * Applies an operator to the values on the top of the stack.
+ *
+ * Throws on error.
+ */
+void applyExpressionOp(Expression::Op op, int32_t* stack, size_t& stackSize);
+
+template <typename Resolver>
+int32_t Expression::evaluate(Resolver&& resolveSymbol, int32_t currentAddress) const
+{
+    int32_t stack[EXPRESSION_MAX_STACK];
+    size_t stackSize{};
+    for (const Item& item : m_items)
+    {
+        switch (item.op)
+        {
+        case Op::Number:
+        case Op::Symbol:
+        case Op::CurrentAddress:
+        {
+            if (stackSize >= EXPRESSION_MAX_STACK)
+                throw std::runtime_error{"Expression is too complex"};
+            int32_t value = item.value;
+            if (item.op == Op::CurrentAddress)
+            {
+                value = currentAddress;
+            }
+            else if (item.op == Op::Symbol && !resolveSymbol(m_symbols[item.value], &value))
+            {
+                throw std::runtime_error{"Reference to undefined label: " + m_symbols[item.value]};
+            }
+            stack[stackSize++] = value;
+            break;
+        }
+
+        default:
+            applyExpressionOp(item.op, stack, stackSize);
+            break;
+        }
+    }
+    if (stackSize != 1)
+        throw std::runtime_error{"Invalid expression"};
+    return stack[0];
+}
+
+} // namespace Parser
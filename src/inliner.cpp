@@ -0,0 +1,345 @@
+#include "inliner.h"
+#include "instruction_info.h"
+#include "cfg.h"
+#include "InputFile.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <optional>
+#include <set>
+#include <sstream>
+
+using Type = Parser::OpcodeOperand::Type;
+
+// The largest body (without the `ret`) in bytes that is inlined without a profile
+#define INLINE_MAX_BODY_SIZE 8
+// The largest body in bytes that is inlined if the profile shows that the subroutine is called
+#define INLINE_MAX_HOT_BODY_SIZE 32
+
+InlineProfile loadInlineProfile(const std::string& filePath)
+{
+    InputFile file;
+    file.open(filePath);
+
+    InlineProfile profile;
+    std::istringstream stream{file.getContent()};
+    std::string line;
+    int lineNumber{};
+    while (std::getline(stream, line))
+    {
+        ++lineNumber;
+        std::istringstream lineStream{line};
+        std::string name;
+        if (!(lineStream >> name) || name[0] == ';' || name[0] == '#')
+            continue;
+        uint64_t count{};
+        if (!(lineStream >> count))
+            throw std::runtime_error{filePath + ':' + std::to_string(lineNumber) + ": Expected a call count"};
+        profile[name] += count;
+    }
+    Logger::dbg << "Loaded inline profile with " << profile.size() << " entries" << Logger::End;
+    return profile;
+}
+
+static inline const Parser::Opcode* asOpcode(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Opcode*>(token.get());
+}
+
+static inline const Parser::Label* asLabel(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Label*>(token.get());
+}
+
+struct Subroutine
+{
+    std::string name;
+    // Index of the label token
+    size_t labelIndex{};
+    // Index of the final `ret`
+    size_t retIndex{};
+    // The size of the instructions without the final `ret`
+    size_t bodySize{};
+    // The labels of the body, including the name
+    std::set<std::string> labels;
+    bool hasConditionalRet{};
+    // The call sites that can be inlined
+    std::vector<size_t> callSites;
+    // False if the body is referenced by something other than the inlinable call sites
+    bool canRemove = true;
+
+    // The size change of the program if every call site is inlined
+    int64_t getGrowth() const
+    {
+        const int64_t growth = (int64_t)callSites.size()*((int64_t)bodySize-2);
+        return growth - (canRemove ? (int64_t)bodySize+2 : 0);
+    }
+};
+
+/*
+ * Checks whether the code after the label is an inlinable subroutine.
+ */
+static std::optional<Subroutine> findSubroutine(const Parser::tokenList_t& tokens, size_t labelIndex)
+{
+    Subroutine sub;
+    sub.name = asLabel(tokens[labelIndex])->name;
+    sub.labelIndex = labelIndex;
+    sub.labels.insert(sub.name);
+
+    std::vector<std::string> jumpTargets;
+    std::vector<const Parser::Expression*> expressions;
+    size_t i{labelIndex+1};
+    for (; i < tokens.size(); ++i)
+    {
+        if (const Parser::Label* label = asLabel(tokens[i]))
+        {
+            sub.labels.insert(label->name);
+            continue;
+        }
+        const Parser::Opcode* opcode = asOpcode(tokens[i]);
+        if (!opcode) // Data
+            return {};
+
+        switch (opcode->opcode)
+        {
+        case Parser::OPCODE_RET:
+            if (followsSkip(tokens, i))
+            {
+                sub.hasConditionalRet = true;
+                sub.bodySize += 2;
+                continue;
+            }
+            break;
+
+        case Parser::OPCODE_CALL:
+        case Parser::OPCODE_SYS:
+        case Parser::OPCODE_INVALID:
+            return {};
+
+        case Parser::OPCODE_JP:
+            if (opcode->operand0.getType() != Type::LabelReference) // JP V0 or to a number
+                return {};
+            jumpTargets.push_back(opcode->operand0.getAsLabel().name);
+            sub.bodySize += 2;
+            continue;
+
+        default:
+            for (const auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+            {
+                if (operand->getType() == Type::Expression)
+                    expressions.push_back(&operand->getAsExpression());
+            }
+            sub.bodySize += opcode->getSize();
+            continue;
+        }
+        break;
+    }
+    if (i >= tokens.size()) // No `ret`
+        return {};
+    sub.retIndex = i;
+
+    // Jumping out of the subroutine would leave without returning
+    for (const auto& target : jumpTargets)
+    {
+        if (!sub.labels.count(target))
+            return {};
+    }
+    // Offsets from the inner labels would be wrong in the copies
+    for (const auto* expr : expressions)
+    {
+        for (const auto& symbol : expr->getSymbols())
+        {
+            if (sub.labels.count(symbol))
+                return {};
+        }
+    }
+    return sub;
+}
+
+/*
+ * Finds the call sites of the subroutine and checks whether the original can be removed.
+ */
+static void findCallSites(const Parser::tokenList_t& tokens, Subroutine* sub)
+{
+    // The body can only be removed if it can't be reached by falling through
+    if (sub->labelIndex == 0)
+    {
+        sub->canRemove = false;
+    }
+    else
+    {
+        const Parser::Opcode* prev = asOpcode(tokens[sub->labelIndex-1]);
+        if (!prev || (prev->opcode != Parser::OPCODE_JP && prev->opcode != Parser::OPCODE_RET
+                   && prev->opcode != Parser::OPCODE_EXIT)
+         || followsSkip(tokens, sub->labelIndex-1))
+            sub->canRemove = false;
+    }
+
+    for (size_t i{}; i < tokens.size(); ++i)
+    {
+        if (i == sub->labelIndex)
+            i = sub->retIndex+1;
+        if (i >= tokens.size())
+            break;
+
+        const Parser::Opcode* opcode = asOpcode(tokens[i]);
+        if (opcode && opcode->opcode == Parser::OPCODE_CALL && opcode->operand0.getType() == Type::LabelReference
+         && opcode->operand0.getAsLabel().name.compare(sub->name) == 0)
+        {
+            // Only a single instruction can replace a skipped instruction
+            if (!followsSkip(tokens, i) || (sub->bodySize == 2 && sub->labels.size() == 1 && !sub->hasConditionalRet))
+                sub->callSites.push_back(i);
+            else
+                sub->canRemove = false;
+            continue;
+        }
+
+        if (opcode && (opcode->opcode == Parser::OPCODE_JP || opcode->opcode == Parser::OPCODE_CALL)
+         && opcode->operand0.getType() == Type::LabelReference
+         && sub->labels.count(opcode->operand0.getAsLabel().name))
+            sub->canRemove = false;
+        forEachAddressReference(*tokens[i], [&](const std::string& name, bool){
+            if (sub->labels.count(name))
+                sub->canRemove = false;
+        });
+    }
+}
+
+/*
+ * Returns a copy of the body with renamed labels, to replace a call.
+ */
+static Parser::tokenList_t copyBody(const Parser::tokenList_t& tokens, const Subroutine& sub, size_t copyIndex)
+{
+    const std::string prefix = "__inline_" + std::to_string(copyIndex) + "__";
+    auto rename{[&](Parser::OpcodeOperand* operand){
+        if (operand->getType() == Type::LabelReference && sub.labels.count(operand->getAsLabel().name))
+            operand->setAsLabel(prefix + operand->getAsLabel().name);
+    }};
+    const std::string endLabelName = prefix + sub.name + "__end";
+
+    Parser::tokenList_t copy;
+    for (size_t i{sub.labelIndex}; i < sub.retIndex; ++i)
+    {
+        auto token = tokens[i]->clone();
+        if (auto label = dynamic_cast<Parser::Label*>(token.get()))
+        {
+            label->name = prefix + label->name;
+        }
+        else if (auto opcode = dynamic_cast<Parser::Opcode*>(token.get()))
+        {
+            if (opcode->opcode == Parser::OPCODE_RET) // Conditional return
+            {
+                opcode->opcode = Parser::OPCODE_JP;
+                opcode->operand0.setAsLabel(endLabelName);
+            }
+            rename(&opcode->operand0);
+            rename(&opcode->operand1);
+            rename(&opcode->operand2);
+        }
+        copy.push_back(std::move(token));
+    }
+
+    if (sub.hasConditionalRet)
+    {
+        auto endLabel = std::make_shared<Parser::Label>();
+        endLabel->name = endLabelName;
+        endLabel->setLocation(tokens[sub.retIndex]->getLocation());
+        copy.push_back(std::move(endLabel));
+    }
+    return copy;
+}
+
+size_t inlineSubroutines(Parser::tokenList_t* tokens, size_t sizeBudget, const InlineProfile* profile)
+{
+    auto getCallCount{[&](const std::string& name) -> uint64_t {
+        if (!profile)
+            return 0;
+        auto found = profile->find(name);
+        return found == profile->end() ? 0 : found->second;
+    }};
+
+    size_t inlinedCount{};
+    size_t copyCount{};
+    std::set<std::string> processed;
+    while (true)
+    {
+        // Find the candidates
+        std::vector<Subroutine> candidates;
+        for (size_t i{}; i < tokens->size(); ++i)
+        {
+            const Parser::Label* label = asLabel((*tokens)[i]);
+            if (!label || processed.count(label->name))
+                continue;
+            std::optional<Subroutine> sub = findSubroutine(*tokens, i);
+            if (!sub)
+                continue;
+            findCallSites(*tokens, &*sub);
+            if (sub->callSites.empty())
+                continue;
+
+            const int64_t growth = sub->getGrowth();
+            const uint64_t callCount = getCallCount(sub->name);
+            const bool isSmallEnough = (profile && callCount)
+                ? sub->bodySize <= INLINE_MAX_HOT_BODY_SIZE
+                : (!profile && sub->bodySize <= INLINE_MAX_BODY_SIZE);
+            if (growth <= 0 || isSmallEnough)
+                candidates.push_back(std::move(*sub));
+        }
+        if (candidates.empty())
+            break;
+
+        // The most called ones first, otherwise the ones that make the program the smallest
+        const Subroutine& sub = *std::min_element(candidates.begin(), candidates.end(),
+            [&](const Subroutine& a, const Subroutine& b){
+                const uint64_t countA = getCallCount(a.name);
+                const uint64_t countB = getCallCount(b.name);
+                if (countA != countB)
+                    return countA > countB;
+                return a.getGrowth() < b.getGrowth();
+            });
+        processed.insert(sub.name);
+
+        // Inline as many call sites as the budget allows
+        size_t siteCount = sub.callSites.size();
+        int64_t growth = sub.getGrowth();
+        if (growth > (int64_t)sizeBudget)
+        {
+            // Without inlining every call site, the original is kept
+            siteCount = std::min(siteCount, sizeBudget/(sub.bodySize-2));
+            growth = (int64_t)siteCount*((int64_t)sub.bodySize-2);
+            if (!siteCount)
+            {
+                Logger::log << "Not inlining \"" << sub.name << "\", it doesn't fit in the size budget" << Logger::End;
+                continue;
+            }
+        }
+        const bool shouldRemove = sub.canRemove && siteCount == sub.callSites.size();
+        sizeBudget -= std::max<int64_t>(growth, 0);
+
+        Parser::tokenList_t output;
+        output.reserve(tokens->size());
+        size_t nextSite{};
+        for (size_t i{}; i < tokens->size(); ++i)
+        {
+            if (shouldRemove && i == sub.labelIndex)
+            {
+                Logger::log << (*tokens)[i]->getLocationStr() << ": Removed subroutine \"" << sub.name
+                    << "\", it is inlined everywhere" << Logger::End;
+                i = sub.retIndex;
+                continue;
+            }
+            if (nextSite < siteCount && i == sub.callSites[nextSite])
+            {
+                Logger::log << (*tokens)[i]->getLocationStr() << ": Inlined call to \"" << sub.name << '"' << Logger::End;
+                Parser::tokenList_t copy = copyBody(*tokens, sub, copyCount++);
+                output.insert(output.end(), copy.begin(), copy.end());
+                ++nextSite;
+                ++inlinedCount;
+                continue;
+            }
+            output.push_back((*tokens)[i]);
+        }
+        *tokens = std::move(output);
+    }
+    return inlinedCount;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "parser.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+/*
+ * How many times each subroutine is called at run time, keyed by the label name.
+ */
+using InlineProfile = std::map<std::string, uint64_t>;
+
+/*
+ * Reads a profile for the inliner.
+ * Each line is a label name and a call count separated by whitespace,
+ * empty lines and lines starting with `;` or `#` are ignored.
+ *
+ * Throws on error.
+ */
+[[nodiscard]] InlineProfile loadInlineProfile(const std::string& filePath);
+
+/*
+ * Inlines small leaf subroutines into their call sites.
+ *
+ * A subroutine can be inlined if it ends with an unconditional `ret`, doesn't call anything,
+ * doesn't contain data and only jumps inside itself. Conditional `ret`s become jumps
+ * to the end of the inlined copy and the labels of the copies are renamed.
+ * The original body is removed when every call site was inlined and nothing else refers to it.
+ *
+ * `sizeBudget` is the most the program may grow in bytes.
+ * Without a profile, only small subroutines or ones that get smaller by inlining are inlined.
+ * With a profile, the most called subroutines are inlined first and larger bodies are allowed
+ * for them, subroutines missing from the profile are only inlined if the program gets smaller.
+ *
+ * Returns the number of inlined call sites.
+ */
+size_t inlineSubroutines(Parser::tokenList_t* tokens, size_t sizeBudget, const InlineProfile* profile);
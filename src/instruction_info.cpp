@@ -0,0 +1,342 @@
+#include "instruction_info.h"
+
+#include <algorithm>
+#include <cstdio>
+
+using Type = Parser::OpcodeOperand::Type;
+
+uint32_t operandToRegMask(const Parser::OpcodeOperand& operand)
+{
+    if (operand.getType() != Type::Register)
+        return 0;
+    const Parser::RegisterEnum reg = operand.getAsRegister();
+    if (Parser::isVRegister(reg))
+        return REGMASK_V(Parser::vRegisterToNibble(reg));
+    if (reg == Parser::REGISTER_I)
+        return REGMASK_I;
+    return 0;
+}
+
+std::string operandToString(const Parser::OpcodeOperand& operand)
+{
+    switch (operand.getType())
+    {
+    case Type::Empty:
+        return "";
+    case Type::Uint:
+    {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "0x%x", (unsigned)operand.getAsUint());
+        return buffer;
+    }
+    case Type::Register:
+        return Parser::registerNames[operand.getAsRegister()];
+    case Type::LabelReference:
+        return operand.getAsLabel().name;
+    case Type::Expression:
+        return operand.getAsExpression().toString();
+    case Type::F:
+        return "f";
+    case Type::B:
+        return "b";
+    case Type::K:
+        return "k";
+    case Type::HF:
+        return "hf";
+    case Type::R:
+        return "r";
+    case Type::VirtualRegister:
+        return operand.getAsVirtualRegister();
+    }
+    return "";
+}
+
+std::string opcodeToString(const Parser::Opcode& opcode)
+{
+    std::string output = (opcode.opcode < Parser::OPCODE_INVALID ? Parser::opcodeNames[opcode.opcode] : "???");
+    if (opcode.opcode == Parser::OPCODE_SAVE || opcode.opcode == Parser::OPCODE_LOAD)
+        return output + " " + operandToString(opcode.operand0) + "-" + operandToString(opcode.operand1);
+    if (opcode.isLongAddress)
+        return output + " " + operandToString(opcode.operand0) + ", long " + operandToString(opcode.operand1);
+
+    bool isFirst = true;
+    for (const auto* operand : {&opcode.operand0, &opcode.operand1, &opcode.operand2})
+    {
+        if (operand->getType() == Type::Empty)
+            break;
+        output += (isFirst ? " " : ", ") + operandToString(*operand);
+        isFirst = false;
+    }
+    return output;
+}
+
+/*
+ * Returns the mask of V0..Vx, used by the register range loads and stores.
+ */
+static uint32_t getRegRangeMask(const Parser::OpcodeOperand& operand)
+{
+    const uint32_t lastReg = operandToRegMask(operand);
+    if (!(lastReg & REGMASK_ALL_V))
+        return REGMASK_ALL_V;
+    return (lastReg << 1)-1;
+}
+
+/*
+ * Returns the mask of Vx..Vy or Vy..Vx, used by `save` and `load`.
+ */
+static uint32_t getRegPairRangeMask(const Parser::OpcodeOperand& first, const Parser::OpcodeOperand& last)
+{
+    const uint32_t a = operandToRegMask(first);
+    const uint32_t b = operandToRegMask(last);
+    if (!(a & REGMASK_ALL_V) || !(b & REGMASK_ALL_V))
+        return REGMASK_ALL_V;
+    const uint32_t low = std::min(a, b);
+    const uint32_t high = std::max(a, b);
+    return ((high << 1)-1) & ~(low-1);
+}
+
+InstructionEffects getInstructionEffects(const Parser::Opcode& opcode)
+{
+    InstructionEffects effects;
+    const uint32_t op0 = operandToRegMask(opcode.operand0);
+    const uint32_t op1 = operandToRegMask(opcode.operand1);
+
+    switch (opcode.opcode)
+    {
+    case Parser::OPCODE_NOP:
+    case Parser::OPCODE_CLS:
+    case Parser::OPCODE_RET:
+    case Parser::OPCODE_SCD:
+    case Parser::OPCODE_SCR:
+    case Parser::OPCODE_SCL:
+    case Parser::OPCODE_EXIT:
+    case Parser::OPCODE_LOW:
+    case Parser::OPCODE_HIGH:
+    case Parser::OPCODE_PLANE:
+        break;
+
+    case Parser::OPCODE_AUDIO:
+        effects.reads = REGMASK_I;
+        effects.readsMemory = true;
+        break;
+
+    case Parser::OPCODE_SAVE:
+        effects.reads = getRegPairRangeMask(opcode.operand0, opcode.operand1) | REGMASK_I;
+        effects.writesMemory = true;
+        break;
+
+    case Parser::OPCODE_LOAD:
+        effects.reads = REGMASK_I;
+        effects.writes = getRegPairRangeMask(opcode.operand0, opcode.operand1);
+        effects.readsMemory = true;
+        break;
+
+    case Parser::OPCODE_SYS:
+    case Parser::OPCODE_CALL:
+    case Parser::OPCODE_INVALID:
+        effects.reads = REGMASK_ALL;
+        effects.writes = REGMASK_ALL;
+        effects.readsMemory = true;
+        effects.writesMemory = true;
+        break;
+
+    case Parser::OPCODE_JP:
+        effects.reads = op0; // JP V0, addr
+        break;
+
+    case Parser::OPCODE_SE:
+    case Parser::OPCODE_SNE:
+    case Parser::OPCODE_SKP:
+    case Parser::OPCODE_SKNP:
+        effects.reads = op0 | op1;
+        break;
+
+    case Parser::OPCODE_LD:
+        if (opcode.operand0.getType() == Type::F || opcode.operand0.getType() == Type::HF) // LD F/HF, Vx
+        {
+            effects.reads = op1;
+            effects.writes = REGMASK_I;
+        }
+        else if (opcode.operand0.getType() == Type::B) // LD B, Vx
+        {
+            effects.reads = op1 | REGMASK_I;
+            effects.writesMemory = true;
+        }
+        else if (opcode.operand0.getType() == Type::R) // LD R, Vx
+        {
+            effects.reads = getRegRangeMask(opcode.operand1);
+        }
+        else if (opcode.operand1.getType() == Type::R) // LD Vx, R
+        {
+            effects.writes = getRegRangeMask(opcode.operand0);
+        }
+        else if (opcode.operand0.getType() == Type::Register
+              && opcode.operand0.getAsRegister() == Parser::REGISTER_I_ADDR) // LD [I], Vx
+        {
+            effects.reads = getRegRangeMask(opcode.operand1) | REGMASK_I;
+            effects.writes = REGMASK_I;
+            effects.quirkWrites = REGMASK_I;
+            effects.writesMemory = true;
+        }
+        else if (opcode.operand1.getType() == Type::Register
+              && opcode.operand1.getAsRegister() == Parser::REGISTER_I_ADDR) // LD Vx, [I]
+        {
+            effects.reads = REGMASK_I;
+            effects.writes = getRegRangeMask(opcode.operand0) | REGMASK_I;
+            effects.quirkWrites = REGMASK_I;
+            effects.readsMemory = true;
+        }
+        else // LD Vx, byte; LD Vx, Vy; LD I, [long] addr; LD DT/ST, Vx; LD Vx, DT; LD Vx, K
+        {
+            effects.reads = op1;
+            effects.writes = op0;
+        }
+        break;
+
+    case Parser::OPCODE_ADD:
+        effects.reads = op0 | op1;
+        effects.writes = op0;
+        if (op1 && op0 != REGMASK_I) // ADD Vx, Vy sets the carry
+            effects.writes |= REGMASK_VF;
+        break;
+
+    case Parser::OPCODE_OR:
+    case Parser::OPCODE_AND:
+    case Parser::OPCODE_XOR:
+        effects.reads = op0 | op1;
+        effects.writes = op0 | REGMASK_VF;
+        effects.quirkWrites = REGMASK_VF & ~op0; // VF reset quirk
+        break;
+
+    case Parser::OPCODE_SUB:
+    case Parser::OPCODE_SUBN:
+    case Parser::OPCODE_SHR:
+    case Parser::OPCODE_SHL:
+        effects.reads = op0 | op1;
+        effects.writes = op0 | REGMASK_VF;
+        break;
+
+    case Parser::OPCODE_RND:
+        effects.writes = op0;
+        break;
+
+    case Parser::OPCODE_DRW:
+        effects.reads = op0 | op1 | REGMASK_I;
+        effects.writes = REGMASK_VF;
+        effects.readsMemory = true;
+        break;
+    }
+    return effects;
+}
+
+bool followsSkip(const Parser::tokenList_t& tokens, size_t index)
+{
+    for (size_t i{index}; i-- > 0;)
+    {
+        if (!tokens[i] || dynamic_cast<const Parser::Label*>(tokens[i].get()))
+            continue;
+        auto opcode = dynamic_cast<const Parser::Opcode*>(tokens[i].get());
+        return opcode && isSkipInstruction(*opcode);
+    }
+    return false;
+}
+
+bool isSameAddress(const Parser::OpcodeOperand& a, const Parser::OpcodeOperand& b)
+{
+    if (a.getType() != b.getType())
+        return false;
+    if (a.getType() == Type::Uint)
+        return a.getAsUint() == b.getAsUint();
+    if (a.getType() == Type::LabelReference)
+        return a.getAsLabel().name.compare(b.getAsLabel().name) == 0;
+    return false;
+}
+
+void KnownRegisterValues::apply(const Parser::Opcode& opcode)
+{
+    const uint32_t dest = operandToRegMask(opcode.operand0);
+    switch (opcode.opcode)
+    {
+    case Parser::OPCODE_LD:
+        if ((dest & REGMASK_ALL_V) && opcode.operand1.getType() == Type::Uint) // LD Vx, byte
+        {
+            knownMask |= dest;
+            vValues[Parser::vRegisterToNibble(opcode.operand0.getAsRegister())] = opcode.operand1.getAsUint() & 0xff;
+            return;
+        }
+        if ((dest & REGMASK_ALL_V) && (operandToRegMask(opcode.operand1) & REGMASK_ALL_V)) // LD Vx, Vy
+        {
+            const size_t src = Parser::vRegisterToNibble(opcode.operand1.getAsRegister());
+            if (knownMask & REGMASK_V(src))
+            {
+                knownMask |= dest;
+                vValues[Parser::vRegisterToNibble(opcode.operand0.getAsRegister())] = vValues[src];
+            }
+            else
+            {
+                forget(dest);
+            }
+            return;
+        }
+        if (dest == REGMASK_I && (opcode.operand1.getType() == Type::Uint
+                || opcode.operand1.getType() == Type::LabelReference)) // LD I, addr
+        {
+            knownMask |= REGMASK_I;
+            iValue = opcode.operand1;
+            return;
+        }
+        break;
+
+    case Parser::OPCODE_ADD:
+        if ((dest & REGMASK_ALL_V) && opcode.operand1.getType() == Type::Uint) // ADD Vx, byte (doesn't change VF)
+        {
+            const size_t reg = Parser::vRegisterToNibble(opcode.operand0.getAsRegister());
+            vValues[reg] = uint8_t(vValues[reg] + opcode.operand1.getAsUint());
+            return;
+        }
+        break;
+
+    case Parser::OPCODE_XOR:
+        if (dest != REGMASK_VF && dest == operandToRegMask(opcode.operand1)) // XOR Vx, Vx
+        {
+            forget(REGMASK_VF);
+            knownMask |= dest;
+            vValues[Parser::vRegisterToNibble(opcode.operand0.getAsRegister())] = 0;
+            return;
+        }
+        break;
+
+    case Parser::OPCODE_CALL:
+    case Parser::OPCODE_SYS:
+        clear();
+        return;
+
+    default:
+        break;
+    }
+    forget(getInstructionEffects(opcode).writes);
+}
+
+void KnownRegisterValues::meet(const KnownRegisterValues& other)
+{
+    knownMask &= other.knownMask;
+    for (size_t i{}; i < 16; ++i)
+    {
+        if ((knownMask & REGMASK_V(i)) && vValues[i] != other.vValues[i])
+            forget(REGMASK_V(i));
+    }
+    if ((knownMask & REGMASK_I) && !isSameAddress(iValue, other.iValue))
+        forget(REGMASK_I);
+}
+
+bool KnownRegisterValues::operator==(const KnownRegisterValues& other) const
+{
+    if (knownMask != other.knownMask)
+        return false;
+    for (size_t i{}; i < 16; ++i)
+    {
+        if ((knownMask & REGMASK_V(i)) && vValues[i] != other.vValues[i])
+            return false;
+    }
+    return !(knownMask & REGMASK_I) || isSameAddress(iValue, other.iValue);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "parser.h"
+#include <stdint.h>
+#include <string>
+
+// Bits of a register mask
+#define REGMASK_V(index) (1u << (index))
+#define REGMASK_VF       (1u << 15)
+#define REGMASK_ALL_V    0xffffu
+#define REGMASK_I        (1u << 16)
+#define REGMASK_ALL      (REGMASK_ALL_V | REGMASK_I)
+
+/*
+ * The registers and memory an instruction reads and writes.
+ * Assumes the most pessimistic behavior of the common interpreter quirks,
+ * e.g. `ld [i], vx` changing I and the logical instructions clearing VF.
+ */
+struct InstructionEffects
+{
+    uint32_t reads{};
+    uint32_t writes{};
+    // The part of `writes` that is only written by some interpreters
+    uint32_t quirkWrites{};
+    bool readsMemory{};
+    bool writesMemory{};
+};
+
+/*
+ * Returns a mask with the bit of the register set, or 0 if the operand is not V0-VF or I.
+ */
+[[nodiscard]] uint32_t operandToRegMask(const Parser::OpcodeOperand& operand);
+
+/*
+ * Returns the operand as it would be written in the source.
+ */
+[[nodiscard]] std::string operandToString(const Parser::OpcodeOperand& operand);
+
+/*
+ * Returns the instruction as it would be written in the source, e.g. "ld v0, 0x12".
+ */
+[[nodiscard]] std::string opcodeToString(const Parser::Opcode& opcode);
+
+/*
+ * Returns what the instruction reads and writes.
+ * Subroutine calls and SYS are treated as reading and writing everything.
+ */
+[[nodiscard]] InstructionEffects getInstructionEffects(const Parser::Opcode& opcode);
+
+/*
+ * Returns the registers the instruction writes on every interpreter.
+ */
+[[nodiscard]] inline uint32_t getCertainWrites(const InstructionEffects& effects)
+{
+    return effects.writes & ~effects.quirkWrites;
+}
+
+/*
+ * Returns true if the instruction skips the next instruction on some condition.
+ */
+[[nodiscard]] inline bool isSkipInstruction(const Parser::Opcode& opcode)
+{
+    return opcode.opcode == Parser::OPCODE_SE || opcode.opcode == Parser::OPCODE_SNE
+        || opcode.opcode == Parser::OPCODE_SKP || opcode.opcode == Parser::OPCODE_SKNP;
+}
+
+/*
+ * Returns true if the instruction at `index` directly follows a skip instruction,
+ * so it is executed conditionally. Labels and removed (null) tokens are ignored.
+ */
+[[nodiscard]] bool followsSkip(const Parser::tokenList_t& tokens, size_t index);
+
+/*
+ * Returns true if the operands refer to the same address.
+ * Only numbers and label references are compared, everything else is considered different.
+ */
+[[nodiscard]] bool isSameAddress(const Parser::OpcodeOperand& a, const Parser::OpcodeOperand& b);
+
+/*
+ * The register values known at a point of the program.
+ */
+struct KnownRegisterValues
+{
+    uint32_t knownMask{};
+    uint8_t vValues[16]{};
+    // A number or a label reference
+    Parser::OpcodeOperand iValue;
+
+    void clear() { knownMask = 0; }
+    void forget(uint32_t mask) { knownMask &= ~mask; }
+
+    bool hasV(size_t index, uint8_t value) const
+    {
+        return (knownMask & REGMASK_V(index)) && vValues[index] == value;
+    }
+    bool hasI(const Parser::OpcodeOperand& address) const
+    {
+        return (knownMask & REGMASK_I) && isSameAddress(iValue, address);
+    }
+
+    /*
+     * Updates the values with the effects of the instruction.
+     */
+    void apply(const Parser::Opcode& opcode);
+
+    /*
+     * Keeps only the values that are the same in both.
+     */
+    void meet(const KnownRegisterValues& other);
+
+    bool operator==(const KnownRegisterValues& other) const;
+    bool operator!=(const KnownRegisterValues& other) const { return !(*this == other); }
+};
@@ -0,0 +1,174 @@
+#include "instruction_set.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stddef.h>
+#include <stdexcept>
+#include <string>
+
+using Kind = InstructionKind;
+using Format = InstructionFormat;
+using Target = InstructionTarget;
+
+InstructionTarget targetFromStr(const std::string& name)
+{
+    if (name.compare("chip8") == 0)
+        return Target::Chip8;
+    if (name.compare("schip") == 0)
+        return Target::Schip;
+    if (name.compare("xochip") == 0)
+        return Target::XoChip;
+    throw std::invalid_argument{"Invalid target: \"" + name + "\", expected \"chip8\", \"schip\" or \"xochip\""};
+}
+
+const char* targetToStr(InstructionTarget target)
+{
+    switch (target)
+    {
+    case Target::Chip8: return "chip8";
+    case Target::Schip: return "schip";
+    case Target::XoChip: return "xochip";
+    }
+    return "?";
+}
+
+size_t getTargetMemorySize(InstructionTarget target)
+{
+    return target == Target::XoChip ? 0x10000 : 0x1000;
+}
+
+// Indexed by `InstructionKind`
+static const InstructionEncoding instructionEncodings[(size_t)Kind::Count] = {
+    {Kind::Invalid,   Format::None, 0x0000, 0x0000, "invalid",              Target::Chip8},
+    {Kind::Cls,       Format::None, 0x00e0, 0xffff, "cls",                  Target::Chip8},
+    {Kind::Ret,       Format::None, 0x00ee, 0xffff, "ret",                  Target::Chip8},
+    {Kind::Sys,       Format::Nnn,  0x0000, 0xf000, "sys {nnn}",            Target::Chip8},
+    {Kind::Jp,        Format::Nnn,  0x1000, 0xf000, "jp {nnn}",             Target::Chip8},
+    {Kind::Call,      Format::Nnn,  0x2000, 0xf000, "call {nnn}",           Target::Chip8},
+    {Kind::SeVxByte,  Format::XKk,  0x3000, 0xf000, "se v{x}, {kk}",        Target::Chip8},
+    {Kind::SneVxByte, Format::XKk,  0x4000, 0xf000, "sne v{x}, {kk}",       Target::Chip8},
+    {Kind::SeVxVy,    Format::XY,   0x5000, 0xf00f, "se v{x}, v{y}",        Target::Chip8},
+    {Kind::LdVxByte,  Format::XKk,  0x6000, 0xf000, "ld v{x}, {kk}",        Target::Chip8},
+    {Kind::AddVxByte, Format::XKk,  0x7000, 0xf000, "add v{x}, {kk}",       Target::Chip8},
+    {Kind::LdVxVy,    Format::XY,   0x8000, 0xf00f, "ld v{x}, v{y}",        Target::Chip8},
+    {Kind::OrVxVy,    Format::XY,   0x8001, 0xf00f, "or v{x}, v{y}",        Target::Chip8},
+    {Kind::AndVxVy,   Format::XY,   0x8002, 0xf00f, "and v{x}, v{y}",       Target::Chip8},
+    {Kind::XorVxVy,   Format::XY,   0x8003, 0xf00f, "xor v{x}, v{y}",       Target::Chip8},
+    {Kind::AddVxVy,   Format::XY,   0x8004, 0xf00f, "add v{x}, v{y}",       Target::Chip8},
+    {Kind::SubVxVy,   Format::XY,   0x8005, 0xf00f, "sub v{x}, v{y}",       Target::Chip8},
+    {Kind::ShrVxVy,   Format::XY,   0x8006, 0xf00f, "shr v{x}, v{y}",       Target::Chip8},
+    {Kind::SubnVxVy,  Format::XY,   0x8007, 0xf00f, "subn v{x}, v{y}",      Target::Chip8},
+    {Kind::ShlVxVy,   Format::XY,   0x800e, 0xf00f, "shl v{x}, v{y}",       Target::Chip8},
+    {Kind::SneVxVy,   Format::XY,   0x9000, 0xf00f, "sne v{x}, v{y}",       Target::Chip8},
+    {Kind::LdIAddr,   Format::Nnn,  0xa000, 0xf000, "ld i, {nnn}",          Target::Chip8},
+    {Kind::JpV0Addr,  Format::Nnn,  0xb000, 0xf000, "jp v0, {nnn}",         Target::Chip8},
+    {Kind::RndVxByte, Format::XKk,  0xc000, 0xf000, "rnd v{x}, {kk}",       Target::Chip8},
+    {Kind::DrwVxVyN,  Format::XYN,  0xd000, 0xf000, "drw v{x}, v{y}, {n}",  Target::Chip8},
+    {Kind::SkpVx,     Format::X,    0xe09e, 0xf0ff, "skp v{x}",             Target::Chip8},
+    {Kind::SknpVx,    Format::X,    0xe0a1, 0xf0ff, "sknp v{x}",            Target::Chip8},
+    {Kind::LdVxDt,    Format::X,    0xf007, 0xf0ff, "ld v{x}, dt",          Target::Chip8},
+    {Kind::LdVxK,     Format::X,    0xf00a, 0xf0ff, "ld v{x}, k",           Target::Chip8},
+    {Kind::LdDtVx,    Format::X,    0xf015, 0xf0ff, "ld dt, v{x}",          Target::Chip8},
+    {Kind::LdStVx,    Format::X,    0xf018, 0xf0ff, "ld st, v{x}",          Target::Chip8},
+    {Kind::AddIVx,    Format::X,    0xf01e, 0xf0ff, "add i, v{x}",          Target::Chip8},
+    {Kind::LdFVx,     Format::X,    0xf029, 0xf0ff, "ld f, v{x}",           Target::Chip8},
+    {Kind::LdBVx,     Format::X,    0xf033, 0xf0ff, "ld b, v{x}",           Target::Chip8},
+    {Kind::LdIAddrVx, Format::X,    0xf055, 0xf0ff, "ld [i], v{x}",         Target::Chip8},
+    {Kind::LdVxIAddr, Format::X,    0xf065, 0xf0ff, "ld v{x}, [i]",         Target::Chip8},
+    {Kind::Scd,       Format::N,    0x00c0, 0xfff0, "scd {n}",              Target::Schip},
+    {Kind::Scr,       Format::None, 0x00fb, 0xffff, "scr",                  Target::Schip},
+    {Kind::Scl,       Format::None, 0x00fc, 0xffff, "scl",                  Target::Schip},
+    {Kind::Exit,      Format::None, 0x00fd, 0xffff, "exit",                 Target::Schip},
+    {Kind::Low,       Format::None, 0x00fe, 0xffff, "low",                  Target::Schip},
+    {Kind::High,      Format::None, 0x00ff, 0xffff, "high",                 Target::Schip},
+    {Kind::LdHfVx,    Format::X,    0xf030, 0xf0ff, "ld hf, v{x}",          Target::Schip},
+    {Kind::LdRVx,     Format::X,    0xf075, 0xf0ff, "ld r, v{x}",           Target::Schip},
+    {Kind::LdVxR,     Format::X,    0xf085, 0xf0ff, "ld v{x}, r",           Target::Schip},
+    {Kind::SaveVxVy,  Format::XY,   0x5002, 0xf00f, "save v{x}-v{y}",       Target::XoChip},
+    {Kind::LoadVxVy,  Format::XY,   0x5003, 0xf00f, "load v{x}-v{y}",       Target::XoChip},
+    {Kind::LdILong,   Format::Long, 0xf000, 0xffff, "ld i, long {nnnn}",    Target::XoChip},
+    {Kind::Plane,     Format::XN,   0xf001, 0xf0ff, "plane {n}",            Target::XoChip},
+    {Kind::Audio,     Format::None, 0xf002, 0xffff, "audio",                Target::XoChip},
+};
+
+const InstructionEncoding& getInstructionEncoding(InstructionKind kind)
+{
+    assert(kind < Kind::Count);
+    assert(instructionEncodings[(size_t)kind].kind == kind);
+    return instructionEncodings[(size_t)kind];
+}
+
+InstructionTarget getRequiredTarget(InstructionKind kind, uint16_t word)
+{
+    const InstructionTarget target = getInstructionEncoding(kind).target;
+    if (kind == Kind::DrwVxVyN && getN(word) == 0)
+        return std::max(target, InstructionTarget::Schip);
+    return target;
+}
+
+/*
+ * Builds the table that maps every word to its instruction.
+ * The encodings with more bits in their mask win, so 00E0 is `cls`, not `sys`.
+ */
+static std::array<InstructionKind, 0x10000> buildDecodeTable()
+{
+    std::array<InstructionKind, 0x10000> table{};
+    std::array<int, 0x10000> matchedBits{};
+    for (const auto& encoding : instructionEncodings)
+    {
+        if (encoding.kind == Kind::Invalid)
+            continue;
+        const int bits = __builtin_popcount(encoding.mask);
+        for (uint32_t word{}; word < 0x10000; ++word)
+        {
+            if ((word & encoding.mask) == encoding.pattern && bits > matchedBits[word])
+            {
+                table[word] = encoding.kind;
+                matchedBits[word] = bits;
+            }
+        }
+    }
+    return table;
+}
+
+const InstructionKind* getInstructionDecodeTable()
+{
+    static const std::array<InstructionKind, 0x10000> table = buildDecodeTable();
+    return table.data();
+}
+
+/*
+ * Returns the operand if it fits in a field of the instruction, `limit` is the largest value.
+ *
+ * Throws if it doesn't fit.
+ */
+static uint16_t checkField(uint16_t value, uint16_t limit, const InstructionEncoding& encoding)
+{
+    if (value > limit)
+    {
+        throw std::out_of_range{"The operand " + std::to_string(value) + " of \"" + encoding.syntax
+            + "\" is out of range, the limit is " + std::to_string(limit)};
+    }
+    return value;
+}
+
+uint16_t encodeInstruction(InstructionKind kind, uint16_t op0, uint16_t op1, uint16_t op2)
+{
+    const InstructionEncoding& encoding = getInstructionEncoding(kind);
+    assert(kind != Kind::Invalid);
+    auto nibble{[&encoding](uint16_t value){ return checkField(value, 0x0f, encoding); }};
+    switch (encoding.format)
+    {
+    case Format::None: return encoding.pattern;
+    case Format::Nnn:  return encoding.pattern | checkField(op0, 0x0fff, encoding);
+    case Format::X:    return encoding.pattern | nibble(op0) << 8;
+    case Format::XY:   return encoding.pattern | nibble(op0) << 8 | nibble(op1) << 4;
+    case Format::XKk:  return encoding.pattern | nibble(op0) << 8 | checkField(op1, 0xff, encoding);
+    case Format::XYN:  return encoding.pattern | nibble(op0) << 8 | nibble(op1) << 4 | nibble(op2);
+    case Format::N:    return encoding.pattern | nibble(op0);
+    case Format::XN:   return encoding.pattern | nibble(op0) << 8;
+    case Format::Long: return encoding.pattern;
+    }
+    return encoding.pattern;
+}
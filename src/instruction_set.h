@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * The instruction sets, each one extends the previous one.
+ */
+enum class InstructionTarget : uint8_t
+{
+    Chip8,
+    Schip,  // SUPER-CHIP 1.1
+    XoChip,
+};
+
+/*
+ * Returns the target with the name ("chip8", "schip" or "xochip").
+ *
+ * Throws if the name is invalid.
+ */
+[[nodiscard]] InstructionTarget targetFromStr(const std::string& name);
+
+[[nodiscard]] const char* targetToStr(InstructionTarget target);
+
+/*
+ * Returns the size of the memory the programs of the target can address.
+ */
+[[nodiscard]] size_t getTargetMemorySize(InstructionTarget target);
+
+/*
+ * The machine instructions, one for every encoding.
+ */
+enum class InstructionKind : uint8_t
+{
+    Invalid,
+    Cls,        // 00E0
+    Ret,        // 00EE
+    Sys,        // 0nnn
+    Jp,         // 1nnn
+    Call,       // 2nnn
+    SeVxByte,   // 3xkk
+    SneVxByte,  // 4xkk
+    SeVxVy,     // 5xy0
+    LdVxByte,   // 6xkk
+    AddVxByte,  // 7xkk
+    LdVxVy,     // 8xy0
+    OrVxVy,     // 8xy1
+    AndVxVy,    // 8xy2
+    XorVxVy,    // 8xy3
+    AddVxVy,    // 8xy4
+    SubVxVy,    // 8xy5
+    ShrVxVy,    // 8xy6
+    SubnVxVy,   // 8xy7
+    ShlVxVy,    // 8xyE
+    SneVxVy,    // 9xy0
+    LdIAddr,    // Annn
+    JpV0Addr,   // Bnnn
+    RndVxByte,  // Cxkk
+    DrwVxVyN,   // Dxyn
+    SkpVx,      // Ex9E
+    SknpVx,     // ExA1
+    LdVxDt,     // Fx07
+    LdVxK,      // Fx0A
+    LdDtVx,     // Fx15
+    LdStVx,     // Fx18
+    AddIVx,     // Fx1E
+    LdFVx,      // Fx29
+    LdBVx,      // Fx33
+    LdIAddrVx,  // Fx55
+    LdVxIAddr,  // Fx65
+    // SUPER-CHIP
+    Scd,        // 00Cn
+    Scr,        // 00FB
+    Scl,        // 00FC
+    Exit,       // 00FD
+    Low,        // 00FE
+    High,       // 00FF
+    LdHfVx,     // Fx30
+    LdRVx,      // Fx75
+    LdVxR,      // Fx85
+    // XO-CHIP
+    SaveVxVy,   // 5xy2
+    LoadVxVy,   // 5xy3
+    LdILong,    // F000 nnnn
+    Plane,      // Fn01
+    Audio,      // F002
+
+    Count,
+};
+
+/*
+ * Where the operands are in the instruction word.
+ */
+enum class InstructionFormat : uint8_t
+{
+    None, // No operands
+    Nnn,  // A 12-bit address
+    X,    // A register in the second nibble
+    XY,   // Registers in the second and the third nibble
+    XKk,  // A register and a byte
+    XYN,  // Two registers and a nibble
+    N,    // A nibble in the last nibble
+    XN,   // A nibble in the second nibble
+    Long, // A 16-bit address in the next word
+};
+
+struct InstructionEncoding
+{
+    InstructionKind kind;
+    InstructionFormat format;
+    // The bits that identify the instruction
+    uint16_t pattern;
+    // The bits of the pattern, the rest are operands
+    uint16_t mask;
+    // The syntax in the source, with the operands as placeholders, e.g. "ld v{x}, {kk}".
+    // {nnn} and {nnnn} are addresses, {x} and {y} are register numbers, {kk} is a byte and {n} is a nibble
+    const char* syntax;
+    // The first instruction set that has the instruction
+    InstructionTarget target;
+};
+
+/*
+ * Returns the encoding of the instruction.
+ */
+[[nodiscard]] const InstructionEncoding& getInstructionEncoding(InstructionKind kind);
+
+/*
+ * Returns the table that maps every instruction word to the instruction it encodes,
+ * or `InstructionKind::Invalid`. Made for the hot loops that decode every executed instruction.
+ */
+[[nodiscard]] const InstructionKind* getInstructionDecodeTable();
+
+/*
+ * Returns the size of the instruction in bytes, 4 for the ones with a 16-bit address.
+ */
+[[nodiscard]] inline size_t getInstructionSize(InstructionKind kind)
+{
+    return kind == InstructionKind::LdILong ? 4 : 2;
+}
+
+/*
+ * Returns the instruction the word encodes, or `InstructionKind::Invalid`.
+ * The instructions of every target are decoded, see `InstructionEncoding::target`.
+ */
+[[nodiscard]] inline InstructionKind decodeInstruction(uint16_t word)
+{
+    return getInstructionDecodeTable()[word];
+}
+
+/*
+ * Builds the instruction word from the operands in the order of the format,
+ * e.g. x, y and n for `InstructionFormat::XYN`.
+ * For `InstructionFormat::Long` only the first word is returned, the address is the next word.
+ *
+ * Throws if an operand doesn't fit in its field.
+ */
+[[nodiscard]] uint16_t encodeInstruction(InstructionKind kind, uint16_t op0=0, uint16_t op1=0, uint16_t op2=0);
+
+// Operand fields of an instruction word
+[[nodiscard]] inline uint16_t getNnn(uint16_t word) { return word & 0x0fff; }
+[[nodiscard]] inline uint8_t getX(uint16_t word) { return (word >> 8) & 0x0f; }
+[[nodiscard]] inline uint8_t getY(uint16_t word) { return (word >> 4) & 0x0f; }
+[[nodiscard]] inline uint8_t getKk(uint16_t word) { return word & 0xff; }
+[[nodiscard]] inline uint8_t getN(uint16_t word) { return word & 0x0f; }
+
+/*
+ * Returns the first target that has the instruction `word` decodes to (`kind`):
+ * the one of its encoding, but SUPER-CHIP for `drw vx, vy, 0`, which draws a 16x16 sprite.
+ */
+[[nodiscard]] InstructionTarget getRequiredTarget(InstructionKind kind, uint16_t word);
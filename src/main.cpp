@@ -1,11 +1,29 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <filesystem>
+#include <chrono>
+#include <memory>
 #include "InputFile.h"
+#include "IncludeCache.h"
 #include "Logger.h"
 #include "parser.h"
 #include "binary_generator.h"
+#include "assembler.h"
+#include "cfg.h"
+#include "cycle_analysis.h"
+#include "Interpreter.h"
+#include "Profiler.h"
+#include "test_runner.h"
+#include "build_variants.h"
+#include "output_files.h"
+#include "rom_patch.h"
+#include "disassembler.h"
+#include "source_map.h"
+#include "size_report.h"
+#include "MappedFile.h"
 #include "arguments.h"
+#include "common.h"
 
 /*
  * Writes the output to the output file.
@@ -39,87 +57,451 @@ static void writeOutput(const ByteList& output, const std::string& outputFilePat
     }
     else // File
     {
-        std::ofstream outputFile{outputFilePath, std::ios_base::out |
-            (shouldOutputHexdump ? std::ios_base::out : std::ios_base::binary)};
+        std::string content;
         if (shouldOutputHexdump) // Hexdump
         {
             std::stringstream ss;
+            ss << std::hex << std::setfill('0');
+            for (size_t i{}; i < output.size(); ++i)
             {
-                ss << std::hex << std::setfill('0');
-                for (size_t i{}; i < output.size(); ++i)
-                {
-                    if (i != 0 && i % 16 == 0)
-                        ss << '\n';
-                    ss << std::setw(2) << +output[i] << ' ';
-                }
-                ss << '\n';
+                if (i != 0 && i % 16 == 0)
+                    ss << '\n';
+                ss << std::setw(2) << +output[i] << ' ';
             }
-            outputFile.write(ss.str().data(), ss.str().size());
+            ss << '\n';
+            content = ss.str();
         }
         else // Raw bytes
         {
-            outputFile.write((const char*)output.data(), output.size());
-        }
-
-        if (outputFile.fail())
-        {
-            outputFile.close();
-            throw std::runtime_error{"Failed to write to file: \"" + outputFilePath + '"'};
+            content.assign((const char*)output.data(), output.size());
         }
-        outputFile.close();
 
-        Logger::log << "Wrote output to file \"" << outputFilePath << '"' << Logger::End;
+        // Keep the modification time if nothing changed, so the build tools don't redo the steps after this
+        if (writeFileIfChanged(outputFilePath, content))
+            Logger::log << "Wrote output to file \"" << outputFilePath << '"' << Logger::End;
     }
 }
 
-int main(int argc, char** argv)
+/*
+ * Returns the files the output of an input file depends on.
+ */
+static std::vector<std::string> getDependencies(
+        const std::string& inputFilePath, const Parser::PreprocessedFile& preprocessed, const Options& args)
 {
-    auto args = parseArgs(argc, argv);
-    Logger::setLoggerVerbosity(args.verbosity);
+    std::vector<std::string> dependencies{inputFilePath};
+    dependencies.insert(dependencies.end(), preprocessed.dependencies.begin(), preprocessed.dependencies.end());
+    if (!args.inlineProfilePath.empty())
+        dependencies.push_back(args.inlineProfilePath);
+    if (!args.variantsFilePath.empty())
+        dependencies.push_back(args.variantsFilePath);
+    if (!args.patchBasePath.empty())
+        dependencies.push_back(args.patchBasePath);
+    if (!args.stableLayoutPath.empty())
+        dependencies.push_back(args.stableLayoutPath);
+    return dependencies;
+}
+
+/*
+ * Returns the output path for an input file in batch mode: the input path with a .ch8 extension.
+ */
+static std::string getDefaultOutputPath(const std::string& inputFilePath)
+{
+    return std::filesystem::path{inputFilePath}.replace_extension(".ch8").string();
+}
 
+/*
+ * Returns true if the file is a program to run instead of a source to assemble.
+ */
+static bool isRomFile(const std::string& filePath)
+{
+    const std::string extension = strToLower(std::filesystem::path{filePath}.extension().string());
+    return extension.compare(".ch8") == 0 || extension.compare(".c8") == 0;
+}
+
+/*
+ * Opens a file for a report, "-" is stdout.
+ *
+ * Throws on error.
+ */
+static std::unique_ptr<std::ostream> openReportFile(const std::string& filePath)
+{
+    if (filePath.compare("-") == 0)
+        return std::make_unique<std::ostream>(std::cout.rdbuf());
+    auto file = std::make_unique<std::ofstream>(filePath);
+    if (!file->is_open())
+        throw std::runtime_error{"Failed to open file: \"" + filePath + '"'};
+    return file;
+}
+
+/*
+ * Assembles a single input file and writes the output if `outputFilePath` is not empty.
+ * The final tokens are stored in `tokensOut`.
+ * Exits on error.
+ */
+static ByteList assembleFile(
+        const std::string& inputFilePath, const std::string& outputFilePath,
+        const Options& args, IncludeCache* includeCache, Parser::tokenList_t* tokensOut)
+{
     // ----- Read the input file -----
     std::string fileContent;
     try
     {
         InputFile file;
-        file.open(args.inputFilePath);
+        file.open(inputFilePath);
         fileContent = file.getContent();
     }
     catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
 
     // ----- Call the preprocessor -----
+    Parser::PreprocessedFile preprocessed;
     try
     {
-        fileContent = Parser::preprocessFile(fileContent, args.inputFilePath);
+        preprocessed = Parser::preprocessFile(fileContent, inputFilePath, args.includeDirs, includeCache, args.defines);
     }
     catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
 
-    // ----- Parse the file -----
-    Parser::tokenList_t tokenList;
-    Parser::labelMap_t labelMap;
+    // ----- Assemble -----
+    AssembledProgram program;
+    const bool shouldMapSource = !args.listingFilePath.empty() || !args.debugMapFilePath.empty();
+    SourceMap sourceMap;
+    // Keep stdout clean if the output goes there
+    std::ostream& reportStream = (outputFilePath.compare("-") == 0 ? std::cerr : std::cout);
     try
     {
-        Parser::parseTokens(fileContent, args.inputFilePath, &tokenList, &labelMap);
+        InlineProfile inlineProfile;
+        if (!args.inlineProfilePath.empty())
+            inlineProfile = loadInlineProfile(args.inlineProfilePath);
+        program = assembleProgram(preprocessed, args, (args.inlineProfilePath.empty() ? nullptr : &inlineProfile),
+                nullptr, nullptr, (shouldMapSource ? &sourceMap : nullptr));
+    }
+    catch (RomLimitError& e)
+    {
+        if (args.shouldReportSize)
+            writeSizeReport(e.sizeReport, args.romLimit, reportStream);
+        else
+            writeSizeReport(e.sizeReport, args.romLimit, std::cerr, 10);
+        Logger::fatal << inputFilePath << ": " << e.what() << Logger::End;
     }
     catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
-    Logger::dbg << "Found " << tokenList.size() << " tokens and " << labelMap.size() << " labels" << Logger::End;
+    const Parser::tokenList_t& tokenList = program.tokens;
+    const ByteList& output = program.output;
+    Logger::log << "Assembled to " << output.size() << " bytes" << Logger::End;
+
+    // ----- Report the size -----
+    if (args.shouldReportSize)
+        writeSizeReport(program.sizeReport, args.romLimit, reportStream);
 
-    // ----- Generate the output -----
-    ByteList output;
+    // ----- Analyze the timing -----
+    if (args.shouldAnalyzeCycles)
+    {
+        try
+        {
+            CycleAnalysisOptions options;
+            options.profile = costProfileFromStr(args.costProfile);
+            options.frameBudget = args.frameBudget;
+            analyzeCycles(tokenList, options, reportStream);
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+
+    // ----- Write the control-flow graph -----
+    if (!args.cfgDotFilePath.empty())
+    {
+        std::ofstream dotFile{args.cfgDotFilePath};
+        ControlFlowGraph{tokenList}.writeDot(dotFile);
+        if (dotFile.fail())
+            Logger::fatal << "Failed to write to file: \"" << args.cfgDotFilePath << '"' << Logger::End;
+        Logger::log << "Wrote control-flow graph to file \"" << args.cfgDotFilePath << '"' << Logger::End;
+    }
+
+    // ----- Write the listing and the debug map -----
     try
     {
-        output = generateBinary(tokenList, labelMap);
+        if (!args.listingFilePath.empty())
+        {
+            writeListing(sourceMap, output, *openReportFile(args.listingFilePath));
+            Logger::log << "Wrote listing to file \"" << args.listingFilePath << '"' << Logger::End;
+        }
+        if (!args.debugMapFilePath.empty())
+        {
+            writeDebugMap(sourceMap, *openReportFile(args.debugMapFilePath));
+            Logger::log << "Wrote debug map to file \"" << args.debugMapFilePath << '"' << Logger::End;
+        }
     }
     catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
-    Logger::log << "Assembled to " << output.size() << " bytes" << Logger::End;
 
     // ----- Write to the output file -----
+    if (!outputFilePath.empty())
+    {
+        try
+        {
+            writeOutput(output, outputFilePath, args.shouldOutputHexdump);
+            if (args.shouldWriteDepFile)
+            {
+                writeDepFile((args.depFilePath.empty() ? getDepFilePath(outputFilePath) : args.depFilePath),
+                        {outputFilePath}, getDependencies(inputFilePath, preprocessed, args));
+            }
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+    // ----- Write the patch -----
+    if (!args.patchOutputPath.empty())
+    {
+        try
+        {
+            MappedFile oldRomFile;
+            oldRomFile.open(args.patchBasePath);
+            const std::vector<uint8_t> oldRom(oldRomFile.getData(), oldRomFile.getData()+oldRomFile.getSize());
+            const std::vector<uint8_t> patch = createPatch(
+                    patchFormatFromPath(args.patchOutputPath), oldRom, output);
+            writeFileIfChanged(args.patchOutputPath, std::string(patch.begin(), patch.end()));
+            Logger::log << "Wrote a " << patch.size() << " byte patch from \"" << args.patchBasePath << "\" to \""
+                << args.patchOutputPath << '"' << Logger::End;
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+
+    *tokensOut = std::move(program.tokens);
+    return std::move(program.output);
+}
+
+/*
+ * Runs the program in the interpreter. Prints the state at exit if requested with --run,
+ * and writes the profile if requested with --profile. `tokens` is the source of the program,
+ * nullptr if it is a ROM.
+ * Exits on error.
+ */
+static void runProgram(const uint8_t* program, size_t size, const std::string& filePath, const Options& args,
+        const Parser::tokenList_t* tokens)
+{
     try
     {
-        writeOutput(output, args.outputFilePath, args.shouldOutputHexdump);
+        Interpreter interpreter{quirksFromStr(args.quirks), args.instructionsPerFrame, args.seed};
+        interpreter.loadRom(program, size);
+        if (!args.keyScriptPath.empty())
+            interpreter.setKeyScript(loadKeyScript(args.keyScriptPath));
+
+        std::unique_ptr<Profiler> profiler;
+        if (!args.profileListingPath.empty() || !args.foldedStacksPath.empty())
+        {
+            if (!tokens)
+                throw std::runtime_error{"Profiling needs the source of the program, not a ROM"};
+            profiler = std::make_unique<Profiler>(*tokens, costProfileFromStr(args.costProfile));
+            interpreter.setObserver(profiler.get());
+        }
+
+        Interpreter::StopReason reason{};
+        const auto startTime = std::chrono::steady_clock::now();
+        try
+        {
+            reason = interpreter.run(args.instructionLimit, args.frameLimit ? args.frameLimit : UINT64_MAX);
+        }
+        catch (std::exception& e)
+        {
+            if (args.shouldRun)
+            {
+                interpreter.writeRegisterDump(std::cout);
+                interpreter.writeScreenDump(std::cout);
+            }
+            throw;
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+        Logger::log << "Executed " << interpreter.getInstructionCount() << " instructions in " << seconds << " s ("
+            << (seconds > 0 ? interpreter.getInstructionCount()/seconds/1e6 : 0) << " million/s)" << Logger::End;
+
+        if (args.shouldRun)
+        {
+            std::cout << filePath << ": Stopped: " << stopReasonToStr(reason) << '\n';
+            interpreter.writeRegisterDump(std::cout);
+            interpreter.writeScreenDump(std::cout);
+        }
+        else
+        {
+            Logger::log << filePath << ": Stopped after " << interpreter.getFrameCount() << " frames: "
+                << stopReasonToStr(reason) << Logger::End;
+        }
+
+        if (!args.profileListingPath.empty())
+        {
+            profiler->writeListing(*openReportFile(args.profileListingPath));
+            Logger::log << "Wrote profile to \"" << args.profileListingPath << '"' << Logger::End;
+        }
+        if (!args.foldedStacksPath.empty())
+        {
+            profiler->writeFoldedStacks(*openReportFile(args.foldedStacksPath));
+            Logger::log << "Wrote folded stacks to \"" << args.foldedStacksPath << '"' << Logger::End;
+        }
+    }
+    catch (std::exception& e) { Logger::fatal << filePath << ": " << e.what() << Logger::End; }
+}
+
+/*
+ * Assembles the variants of the input file and writes them next to the output path.
+ * Returns the exit status.
+ */
+static int assembleFileVariants(const std::string& inputFilePath, const std::string& outputFilePath,
+        const std::vector<BuildVariant>& variants, const Options& args, IncludeCache* includeCache)
+{
+    // The files are read and the directives found only once for all the variants
+    Parser::SourceFiles sources;
+    try
+    {
+        InputFile file;
+        file.open(inputFilePath);
+        sources = Parser::readSourceFiles(file.getContent(), inputFilePath, args.includeDirs, includeCache);
+    }
+    catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    const auto results = assembleVariants(sources, variants, args, args.jobCount);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+
+    size_t failureCount{};
+    for (const auto& result : results)
+    {
+        Logger::writeCaptured(result.messages, '[' + result.name + "] ");
+        if (!result.error.empty())
+        {
+            Logger::err << inputFilePath << " (" << result.name << "): " << result.error << Logger::End;
+            ++failureCount;
+            continue;
+        }
+        try
+        {
+            writeOutput(result.output, getVariantOutputPath(outputFilePath, result.name), args.shouldOutputHexdump);
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+        Logger::log << result.name << ": " << result.output.size() << " bytes in " << result.seconds << " s" << Logger::End;
+    }
+    Logger::log << "Assembled " << results.size()-failureCount << " of " << results.size() << " variants in "
+        << seconds << " s" << Logger::End;
+
+    // One rule for all the variants, so they are rebuilt together
+    if (args.shouldWriteDepFile && !failureCount)
+    {
+        std::vector<std::string> targets;
+        for (const auto& variant : variants)
+            targets.push_back(getVariantOutputPath(outputFilePath, variant.name));
+        try
+        {
+            writeDepFile((args.depFilePath.empty() ? getDepFilePath(outputFilePath) : args.depFilePath),
+                    targets, getDependencies(inputFilePath, sources.file, args));
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+    return failureCount ? 1 : 0;
+}
+
+/*
+ * Runs the inputs as tests, prints the results and writes the requested reports.
+ * Returns the exit status.
+ */
+static int runTestFiles(const Options& args)
+{
+    const auto results = runTests(args.inputFilePaths, args, args.jobCount);
+
+    size_t failureCount{};
+    for (const auto& result : results)
+    {
+        Logger::writeCaptured(result.messages, '[' + result.filePath + "] ");
+        std::cout << (result.hasPassed ? "PASS " : "FAIL ") << result.filePath << " (" << result.frameCount
+            << " frames, " << result.checkCount << " checks, " << std::fixed << std::setprecision(3)
+            << result.seconds << " s)\n";
+        for (const auto& failure : result.failures)
+            std::cout << "    " << failure << '\n';
+        failureCount += !result.hasPassed;
+    }
+    std::cout << results.size()-failureCount << " of " << results.size() << " tests passed" << std::endl;
+
+    try
+    {
+        if (!args.junitReportPath.empty())
+        {
+            writeJUnitReport(results, *openReportFile(args.junitReportPath));
+            Logger::log << "Wrote JUnit report to \"" << args.junitReportPath << '"' << Logger::End;
+        }
+        if (!args.jsonReportPath.empty())
+        {
+            writeJsonReport(results, *openReportFile(args.jsonReportPath));
+            Logger::log << "Wrote JSON report to \"" << args.jsonReportPath << '"' << Logger::End;
+        }
     }
     catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
 
-    return 0;
+    return failureCount ? 1 : 0;
 }
 
+int main(int argc, char** argv)
+{
+    auto args = parseArgs(argc, argv);
+    Logger::setLoggerVerbosity(args.verbosity);
+
+    if (args.shouldTest)
+        return runTestFiles(args);
+
+    // Shared by all the input files, so the common includes are only read once
+    IncludeCache includeCache;
+
+    std::vector<BuildVariant> variants;
+    if (!args.variantsFilePath.empty())
+    {
+        try
+        {
+            variants = loadVariants(args.variantsFilePath);
+        }
+        catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+    }
+
+    int status{};
+    for (const auto& inputFilePath : args.inputFilePaths)
+    {
+        if (!variants.empty())
+        {
+            const std::string outputFilePath = (args.outputFilePath.empty()
+                    ? getDefaultOutputPath(inputFilePath) : args.outputFilePath);
+            status |= assembleFileVariants(inputFilePath, outputFilePath, variants, args, &includeCache);
+            continue;
+        }
+
+        if (args.shouldDisassemble)
+        {
+            try
+            {
+                MappedFile rom;
+                rom.open(inputFilePath);
+                disassemble(rom.getData(), rom.getSize(), args.target,
+                        *openReportFile(args.outputFilePath.empty() ? "-" : args.outputFilePath));
+            }
+            catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+            continue;
+        }
+
+        const bool shouldExecute = args.shouldRun
+            || !args.profileListingPath.empty() || !args.foldedStacksPath.empty();
+        if (shouldExecute && isRomFile(inputFilePath))
+        {
+            MappedFile rom;
+            try
+            {
+                rom.open(inputFilePath);
+            }
+            catch (std::exception& e) { Logger::fatal << e.what() << Logger::End; }
+            runProgram(rom.getData(), rom.getSize(), inputFilePath, args, nullptr);
+            continue;
+        }
+
+        // When running, the output is only written if requested
+        std::string outputFilePath = args.outputFilePath;
+        if (outputFilePath.empty() && !shouldExecute)
+            outputFilePath = (args.inputFilePaths.size() > 1 ? getDefaultOutputPath(inputFilePath) : "output.ch8");
+
+        Parser::tokenList_t tokens;
+        const ByteList output = assembleFile(inputFilePath, outputFilePath, args, &includeCache, &tokens);
+        if (shouldExecute)
+            runProgram(output.data(), output.size(), inputFilePath, args, &tokens);
+    }
+    Logger::dbg << "Include cache: " << includeCache.getHitCount() << " hits, "
+        << includeCache.getMissCount() << " misses" << Logger::End;
+
+    return status;
+}
@@ -0,0 +1,583 @@
+#include "optimizer.h"
+#include "data_packer.h"
+#include "instruction_info.h"
+#include "cfg.h"
+#include "binary_generator.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using Type = Parser::OpcodeOperand::Type;
+
+// The passes are repeated until nothing changes, but at most this many times
+#define OPTIMIZER_MAX_PASSES 16
+
+static inline Parser::Opcode* asOpcode(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<Parser::Opcode*>(token.get());
+}
+
+static inline bool isLabel(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<Parser::Label*>(token.get());
+}
+
+static bool isAbsoluteRomAddress(const Parser::OpcodeOperand& operand)
+{
+    if (operand.getType() == Type::Uint)
+        return operand.getAsUint() >= ROM_LOAD_OFFSET;
+    if (operand.getType() == Type::Expression)
+        return operand.getAsExpression().usesCurrentAddress();
+    return false;
+}
+
+bool usesAbsoluteRomAddresses(const Parser::tokenList_t& tokens)
+{
+    for (const auto& token : tokens)
+    {
+        if (const Parser::Opcode* opcode = asOpcode(token))
+        {
+            switch (opcode->opcode)
+            {
+            case Parser::OPCODE_JP:
+            case Parser::OPCODE_CALL:
+            case Parser::OPCODE_SYS:
+                if (isAbsoluteRomAddress(opcode->operand0) || isAbsoluteRomAddress(opcode->operand1))
+                    return true;
+                break;
+
+            case Parser::OPCODE_LD:
+                if (operandToRegMask(opcode->operand0) == REGMASK_I && isAbsoluteRomAddress(opcode->operand1))
+                    return true;
+                break;
+
+            default:
+                break;
+            }
+            for (const auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+            {
+                if (operand->getType() == Type::Expression && operand->getAsExpression().usesCurrentAddress())
+                    return true;
+            }
+        }
+        else if (auto db = dynamic_cast<const Parser::DbInst*>(token.get()))
+        {
+            for (const auto& arg : db->deferredArguments)
+            {
+                if (arg.second.usesCurrentAddress())
+                    return true;
+            }
+        }
+        else if (auto dw = dynamic_cast<const Parser::DwInst*>(token.get()))
+        {
+            for (const auto& arg : dw->deferredArguments)
+            {
+                if (arg.second.usesCurrentAddress())
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+class PeepholePass
+{
+private:
+    Parser::tokenList_t& m_tokens;
+    const bool m_canResize;
+    // Label name -> index of the label token
+    std::map<std::string, size_t> m_labelIndices;
+    // The `jp`s of the tables of `jp v0, table`, their size must stay the same
+    std::set<size_t> m_tableEntries;
+    size_t m_rewriteCount{};
+
+    void report(const Parser::Token& token, const std::string& message)
+    {
+        Logger::log << token.getLocationStr() << ": " << message << Logger::End;
+        ++m_rewriteCount;
+    }
+
+    /*
+     * Returns the index of the first instruction or data at or after `index`.
+     */
+    size_t skipLabels(size_t index) const
+    {
+        while (index < m_tokens.size() && (!m_tokens[index] || isLabel(m_tokens[index])))
+            ++index;
+        return index;
+    }
+
+    /*
+     * Returns the index of the first instruction or data after the label.
+     */
+    size_t getTargetIndex(const std::string& labelName) const
+    {
+        auto found = m_labelIndices.find(labelName);
+        if (found == m_labelIndices.end())
+            return m_tokens.size();
+        return skipLabels(found->second);
+    }
+
+    /*
+     * Follows the chain of `jp`s from the label, returns the final target
+     * or an empty string if the label is not followed by a `jp`.
+     */
+    std::string getThreadedTarget(const std::string& labelName) const
+    {
+        std::string target;
+        std::string current = labelName;
+        std::set<std::string> visited{current};
+        while (true)
+        {
+            const size_t index = getTargetIndex(current);
+            if (index >= m_tokens.size())
+                break;
+            const Parser::Opcode* opcode = asOpcode(m_tokens[index]);
+            if (!opcode || opcode->opcode != Parser::OPCODE_JP
+             || opcode->operand0.getType() != Type::LabelReference)
+                break;
+            current = opcode->operand0.getAsLabel().name;
+            if (!visited.insert(current).second) // Infinite loop
+                break;
+            target = current;
+        }
+        return target;
+    }
+
+    /*
+     * Returns true if one of the labels between the token and the next instruction is `labelName`.
+     */
+    bool isLabelRightAfter(size_t index, const std::string& labelName) const
+    {
+        for (size_t i{index+1}; i < m_tokens.size() && (!m_tokens[i] || isLabel(m_tokens[i])); ++i)
+        {
+            if (m_tokens[i] && static_cast<const Parser::Label*>(m_tokens[i].get())->name.compare(labelName) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void threadJump(Parser::Opcode* opcode)
+    {
+        const std::string target = getThreadedTarget(opcode->operand0.getAsLabel().name);
+        if (target.empty())
+            return;
+        report(*opcode, "Jump threading: " + std::string{Parser::opcodeNames[opcode->opcode]} + " to \""
+                + opcode->operand0.getAsLabel().name + "\" goes to \"" + target + "\" directly");
+        opcode->operand0.setAsLabel(target);
+    }
+
+public:
+    PeepholePass(Parser::tokenList_t& tokens, bool canResize)
+        : m_tokens{tokens}, m_canResize{canResize}
+    {
+        for (size_t i{}; i < m_tokens.size(); ++i)
+        {
+            if (isLabel(m_tokens[i]))
+                m_labelIndices.emplace(static_cast<const Parser::Label*>(m_tokens[i].get())->name, i);
+        }
+        for (const auto& token : m_tokens)
+        {
+            const Parser::Opcode* opcode = asOpcode(token);
+            if (!opcode || opcode->opcode != Parser::OPCODE_JP || opcode->operand0.getType() != Type::Register
+             || opcode->operand1.getType() != Type::LabelReference)
+                continue;
+            // Like the control-flow graph, assume that the table is the `jp`s after the label
+            for (size_t i{getTargetIndex(opcode->operand1.getAsLabel().name)}; i < m_tokens.size(); i = skipLabels(i+1))
+            {
+                const Parser::Opcode* entry = asOpcode(m_tokens[i]);
+                if (!entry || entry->opcode != Parser::OPCODE_JP || entry->operand0.getType() != Type::LabelReference)
+                    break;
+                m_tableEntries.insert(i);
+            }
+        }
+    }
+
+    /*
+     * Runs the pass, sets the removed tokens to null.
+     * Returns the number of rewrites.
+     */
+    size_t run()
+    {
+        KnownRegisterValues known;
+        for (size_t i{}; i < m_tokens.size(); ++i)
+        {
+            if (!m_tokens[i])
+                continue;
+
+            Parser::Opcode* opcode = asOpcode(m_tokens[i]);
+            if (!opcode) // Labels start a new basic block, data ends it
+            {
+                known.clear();
+                continue;
+            }
+
+            const bool isConditional = followsSkip(m_tokens, i);
+            const bool canRemove = m_canResize && !isConditional;
+
+            switch (opcode->opcode)
+            {
+            case Parser::OPCODE_CALL:
+            {
+                if (opcode->operand0.getType() == Type::LabelReference)
+                    threadJump(opcode);
+
+                Parser::Opcode* next = (i+1 < m_tokens.size() ? asOpcode(m_tokens[i+1]) : nullptr);
+                if (next && next->opcode == Parser::OPCODE_RET)
+                {
+                    opcode->opcode = Parser::OPCODE_JP;
+                    if (canRemove)
+                    {
+                        report(*opcode, "Tail call: replaced call and ret with jp");
+                        m_tokens[i+1] = nullptr;
+                    }
+                    else
+                    {
+                        report(*opcode, "Tail call: replaced call with jp");
+                    }
+                }
+                known.clear();
+                continue;
+            }
+
+            case Parser::OPCODE_JP:
+                if (opcode->operand0.getType() == Type::LabelReference)
+                {
+                    threadJump(opcode);
+                    if (canRemove && !m_tableEntries.count(i) && isLabelRightAfter(i, opcode->operand0.getAsLabel().name))
+                    {
+                        report(*opcode, "Removed jump to the next instruction");
+                        m_tokens[i] = nullptr;
+                        continue;
+                    }
+                }
+                known.clear();
+                continue;
+
+            case Parser::OPCODE_LD:
+            {
+                const uint32_t dest = operandToRegMask(opcode->operand0);
+                if (canRemove && (dest & REGMASK_ALL_V) && opcode->operand1.getType() == Type::Uint // LD Vx, byte
+                 && known.hasV(Parser::vRegisterToNibble(opcode->operand0.getAsRegister()), opcode->operand1.getAsUint()))
+                {
+                    report(*opcode, "Removed load of a value the register already has");
+                    m_tokens[i] = nullptr;
+                    continue;
+                }
+                if (canRemove && dest == REGMASK_I && known.hasI(opcode->operand1)) // LD I, addr
+                {
+                    report(*opcode, "Removed load of the address I already has");
+                    m_tokens[i] = nullptr;
+                    continue;
+                }
+                break;
+            }
+
+            case Parser::OPCODE_RET:
+                known.clear();
+                continue;
+
+            default:
+                break;
+            }
+
+            if (isConditional)
+                known.forget(getInstructionEffects(*opcode).writes);
+            else
+                known.apply(*opcode);
+        }
+        return m_rewriteCount;
+    }
+};
+
+/*
+ * Removes the tokens that were set to null.
+ */
+static void removeDeletedTokens(Parser::tokenList_t* tokens)
+{
+    Parser::tokenList_t remaining;
+    remaining.reserve(tokens->size());
+    for (auto& token : *tokens)
+    {
+        if (token)
+            remaining.push_back(std::move(token));
+    }
+    *tokens = std::move(remaining);
+}
+
+/*
+ * Runs the peephole pass until nothing changes.
+ */
+static size_t optimizePeephole(Parser::tokenList_t* tokens, bool canResize)
+{
+    size_t rewriteCount{};
+    for (int pass{}; pass < OPTIMIZER_MAX_PASSES; ++pass)
+    {
+        const size_t passRewrites = PeepholePass{*tokens, canResize}.run();
+        if (!passRewrites)
+            break;
+        rewriteCount += passRewrites;
+        removeDeletedTokens(tokens);
+    }
+    return rewriteCount;
+}
+
+static void reportRemoval(const Parser::Token& token, const std::string& message)
+{
+    Logger::log << token.getLocationStr() << ": " << message << Logger::End;
+}
+
+/*
+ * Removes the instructions of the blocks that can't be reached.
+ * Labels are kept, so references from other unreachable code stay valid.
+ */
+static size_t removeUnreachableCode(Parser::tokenList_t* tokens)
+{
+    const ControlFlowGraph cfg{*tokens};
+    size_t removedCount{};
+    for (const BasicBlock& block : cfg.getBlocks())
+    {
+        if (block.isReachable)
+            continue;
+        size_t blockRemovedCount{};
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            if (!asOpcode((*tokens)[i]))
+                continue;
+            if (!blockRemovedCount)
+                reportRemoval(*(*tokens)[i], "Removed unreachable code");
+            (*tokens)[i] = nullptr;
+            ++blockRemovedCount;
+        }
+        removedCount += blockRemovedCount;
+    }
+    return removedCount;
+}
+
+/*
+ * Removes the loads of values that the register already has on every path.
+ */
+static size_t removeRedundantLoads(Parser::tokenList_t* tokens)
+{
+    const ControlFlowGraph cfg{*tokens};
+    const std::vector<KnownRegisterValues> known = cfg.computeKnownValues();
+    size_t removedCount{};
+    for (size_t i{}; i < tokens->size(); ++i)
+    {
+        const Parser::Opcode* opcode = asOpcode((*tokens)[i]);
+        if (!opcode || opcode->opcode != Parser::OPCODE_LD || followsSkip(*tokens, i))
+            continue;
+        const size_t blockI = cfg.getBlockOfToken(i);
+        if (blockI == ControlFlowGraph::npos || !cfg.getBlocks()[blockI].isReachable)
+            continue;
+
+        const uint32_t dest = operandToRegMask(opcode->operand0);
+        if ((dest & REGMASK_ALL_V) && opcode->operand1.getType() == Type::Uint // LD Vx, byte
+         && known[i].hasV(Parser::vRegisterToNibble(opcode->operand0.getAsRegister()), opcode->operand1.getAsUint()))
+        {
+            reportRemoval(*opcode, "Removed load of a value the register always has here");
+        }
+        else if (dest == REGMASK_I && known[i].hasI(opcode->operand1)) // LD I, addr
+        {
+            reportRemoval(*opcode, "Removed load of the address I always has here");
+        }
+        else
+        {
+            continue;
+        }
+        (*tokens)[i] = nullptr;
+        ++removedCount;
+    }
+    return removedCount;
+}
+
+/*
+ * Returns true if the only effect of the instruction is writing registers.
+ */
+static bool isPureRegisterWrite(const Parser::Opcode& opcode, const InstructionEffects& effects)
+{
+    if (!effects.writes || effects.writesMemory)
+        return false;
+    if (opcode.opcode == Parser::OPCODE_DRW) // Draws to the screen
+        return false;
+    if (opcode.operand1.getType() == Type::K) // Waits for a key press
+        return false;
+    return true;
+}
+
+/*
+ * Removes the instructions whose results are never read.
+ */
+static size_t removeDeadStores(Parser::tokenList_t* tokens)
+{
+    const ControlFlowGraph cfg{*tokens};
+    const std::vector<uint32_t> liveAfter = cfg.computeLiveness();
+    size_t removedCount{};
+    for (size_t i{}; i < tokens->size(); ++i)
+    {
+        const Parser::Opcode* opcode = asOpcode((*tokens)[i]);
+        if (!opcode || followsSkip(*tokens, i))
+            continue;
+        const size_t blockI = cfg.getBlockOfToken(i);
+        if (blockI == ControlFlowGraph::npos || !cfg.getBlocks()[blockI].isReachable)
+            continue;
+
+        const InstructionEffects effects = getInstructionEffects(*opcode);
+        if (isPureRegisterWrite(*opcode, effects) && !(effects.writes & liveAfter[i]))
+        {
+            reportRemoval(*opcode, "Removed dead store: \"" + opcodeToString(*opcode) + '"');
+            (*tokens)[i] = nullptr;
+            ++removedCount;
+        }
+    }
+    return removedCount;
+}
+
+/*
+ * Removes the labelled data that is never referenced.
+ * Data after a label that is used with an offset is kept until the next instruction.
+ */
+static size_t removeDeadData(Parser::tokenList_t* tokens)
+{
+    std::set<std::string> referenced;
+    std::set<std::string> referencedWithOffset;
+    for (const auto& token : *tokens)
+    {
+        forEachAddressReference(*token, [&](const std::string& name, bool isInExpression){
+            referenced.insert(name);
+            if (isInExpression)
+                referencedWithOffset.insert(name);
+        });
+        if (const Parser::Opcode* opcode = asOpcode(token))
+        {
+            if (opcode->operand0.getType() == Type::LabelReference)
+                referenced.insert(opcode->operand0.getAsLabel().name);
+        }
+    }
+
+    size_t removedCount{};
+    bool isKeepingData = false;
+    size_t i{};
+    while (i < tokens->size())
+    {
+        if (asOpcode((*tokens)[i]))
+        {
+            isKeepingData = false;
+            ++i;
+            continue;
+        }
+
+        // Find the labels and the data after them
+        const size_t regionStart = i;
+        bool hasLabels = false;
+        bool isReferenced = (regionStart == 0);
+        while (i < tokens->size() && isLabel((*tokens)[i]))
+        {
+            const std::string& name = static_cast<const Parser::Label*>((*tokens)[i].get())->name;
+            hasLabels = true;
+            isReferenced |= (referenced.count(name) != 0);
+            isKeepingData |= (referencedWithOffset.count(name) != 0);
+            ++i;
+        }
+        const size_t dataStart = i;
+        while (i < tokens->size() && !isLabel((*tokens)[i]) && !asOpcode((*tokens)[i]))
+            ++i;
+        if (dataStart == i || !hasLabels || isReferenced || isKeepingData) // Code labels or used data
+            continue;
+
+        size_t byteCount{};
+        for (size_t j{dataStart}; j < i; ++j)
+            byteCount += (*tokens)[j]->getSize();
+        reportRemoval(*(*tokens)[dataStart], "Removed unreferenced data (" + std::to_string(byteCount) + " bytes)");
+        for (size_t j{regionStart}; j < i; ++j)
+            (*tokens)[j] = nullptr;
+        removedCount += i-dataStart;
+    }
+    return removedCount;
+}
+
+/*
+ * Runs the optimizations that use the control-flow graph until nothing changes.
+ */
+static size_t optimizeDataflow(Parser::tokenList_t* tokens)
+{
+    size_t removedCount{};
+    for (int pass{}; pass < OPTIMIZER_MAX_PASSES; ++pass)
+    {
+        size_t passRemovedCount{};
+        // The steps are separate, because the removals of one step can invalidate the analysis of another
+        for (auto step : {removeUnreachableCode, removeRedundantLoads, removeDeadStores, removeDeadData})
+        {
+            const size_t stepRemovedCount = step(tokens);
+            if (stepRemovedCount)
+                removeDeletedTokens(tokens);
+            passRemovedCount += stepRemovedCount;
+        }
+        if (!passRemovedCount)
+            break;
+        removedCount += passRemovedCount;
+    }
+    return removedCount;
+}
+
+/*
+ * Returns the size of the program in bytes.
+ */
+static size_t getProgramSize(const Parser::tokenList_t& tokens)
+{
+    size_t size{};
+    for (const auto& token : tokens)
+        size += token->getSize();
+    return size;
+}
+
+size_t optimize(Parser::tokenList_t* tokens, Parser::labelMap_t* labels, const OptimizerOptions& options)
+{
+    const int level = options.level;
+    if (level < 1 && !options.shouldPackData)
+        return 0;
+
+    const bool canResize = !usesAbsoluteRomAddresses(*tokens);
+    if (!canResize)
+        Logger::warn << "The code uses absolute ROM addresses, optimizations that move code are disabled" << Logger::End;
+
+    size_t rewriteCount{};
+    if (level >= 1)
+    {
+        rewriteCount = optimizePeephole(tokens, canResize);
+        Logger::log << "Peephole optimizer: " << rewriteCount << " rewrites" << Logger::End;
+    }
+
+    if (level >= 3 && canResize)
+    {
+        const size_t programSize = getProgramSize(*tokens);
+        size_t budget = (programSize < ROM_MAX_SIZE ? ROM_MAX_SIZE-programSize : 0);
+        if (options.inlineBudget >= 0)
+            budget = std::min(budget, (size_t)options.inlineBudget);
+        const size_t inlinedCount = inlineSubroutines(tokens, budget, options.inlineProfile);
+        Logger::log << "Inliner: " << inlinedCount << " call sites inlined, program size: "
+            << programSize << " -> " << getProgramSize(*tokens) << " bytes" << Logger::End;
+        rewriteCount += inlinedCount;
+    }
+
+    if (level >= 2 && canResize)
+    {
+        const size_t removedCount = optimizeDataflow(tokens);
+        Logger::log << "Dataflow optimizer: " << removedCount << " removals" << Logger::End;
+        rewriteCount += removedCount;
+        // The removals can make new peephole optimizations possible
+        if (removedCount)
+            rewriteCount += optimizePeephole(tokens, canResize);
+    }
+
+    if (options.shouldPackData && canResize)
+    {
+        const size_t savedSize = packData(tokens);
+        Logger::log << "Data packing: " << savedSize << " bytes saved" << Logger::End;
+    }
+
+    Parser::layoutLabels(*tokens, labels);
+    return rewriteCount;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "parser.h"
+#include "inliner.h"
+
+struct OptimizerOptions
+{
+    int level{};
+    // The most bytes inlining may add to the program, negative to use all the remaining ROM space
+    int inlineBudget = -1;
+    // The call counts used by the inliner, may be null
+    const InlineProfile* inlineProfile{};
+    // Share the bytes of identical and overlapping data blocks, at any level
+    bool shouldPackData{};
+};
+
+/*
+ * Optimizes the token list and lays out the labels again.
+ *
+ * -O1 runs the peephole optimizations:
+ *   - `call x` directly followed by `ret` becomes `jp x` (tail call)
+ *   - `jp` to the next instruction is removed
+ *   - `jp` or `call` to a `jp` goes to the final target instead (jump threading)
+ *   - `ld vx, byte` is removed if vx is known to already have that value
+ *   - `ld i, addr` is removed if I is known to already have that value
+ *
+ * -O2 also runs the optimizations based on the control-flow graph:
+ *   - removal of unreachable code
+ *   - removal of `ld vx, byte` and `ld i, addr` that are redundant on every path
+ *   - removal of instructions whose results are never read (dead stores)
+ *   - removal of labelled data that is never referenced
+ *
+ * -O3 also inlines small leaf subroutines before the dataflow optimizations (see `inlineSubroutines()`).
+ *
+ * `shouldPackData` merges the data blocks last (see `packData()`), also at -O0.
+ *
+ * Instructions following a skip instruction are never removed or resized.
+ * If the code uses absolute ROM addresses, nothing is removed, because the code must not move.
+ *
+ * Returns the number of rewrites.
+ */
+size_t optimize(Parser::tokenList_t* tokens, Parser::labelMap_t* labels, const OptimizerOptions& options);
+
+/*
+ * Returns true if the code refers to addresses inside the ROM by number (or with `$`),
+ * which would be wrong if an optimization moved the code.
+ */
+[[nodiscard]] bool usesAbsoluteRomAddresses(const Parser::tokenList_t& tokens);
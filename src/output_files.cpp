@@ -0,0 +1,92 @@
+#include "output_files.h"
+#include "Logger.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+bool writeFileIfChanged(const std::string& filePath, const std::string& content)
+{
+    {
+        std::ifstream oldFile{filePath, std::ios_base::in | std::ios_base::binary};
+        if (oldFile.is_open())
+        {
+            const std::string oldContent{std::istreambuf_iterator<char>{oldFile}, std::istreambuf_iterator<char>{}};
+            if (!oldFile.bad() && oldContent == content)
+            {
+                Logger::log << "File \"" << filePath << "\" is unchanged, not written" << Logger::End;
+                return false;
+            }
+        }
+    }
+
+    // In the same directory, so the rename doesn't cross file systems
+    const std::string tempPath = filePath + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream tempFile{tempPath, std::ios_base::out | std::ios_base::binary};
+        tempFile.write(content.data(), content.size());
+        tempFile.close();
+        if (tempFile.fail())
+        {
+            std::error_code ec;
+            std::filesystem::remove(tempPath, ec);
+            throw std::runtime_error{"Failed to write to file: \"" + filePath + '"'};
+        }
+    }
+    if (rename(tempPath.c_str(), filePath.c_str()))
+    {
+        const std::string error = strerror(errno);
+        std::error_code ec;
+        std::filesystem::remove(tempPath, ec);
+        throw std::runtime_error{"Failed to write to file: \"" + filePath + "\": " + error};
+    }
+    return true;
+}
+
+std::string getDepFilePath(const std::string& outputFilePath)
+{
+    return std::filesystem::path{outputFilePath}.replace_extension(".d").string();
+}
+
+/*
+ * Escapes the characters that are special in a Makefile rule.
+ */
+static std::string escapeMakePath(const std::string& path)
+{
+    std::string output;
+    for (char c : path)
+    {
+        switch (c)
+        {
+        case ' ':  output += "\\ "; break;
+        case '#':  output += "\\#"; break;
+        case '$':  output += "$$"; break;
+        default:   output += c; break;
+        }
+    }
+    return output;
+}
+
+void writeDepFile(const std::string& depFilePath,
+        const std::vector<std::string>& targets, const std::vector<std::string>& dependencies)
+{
+    std::string content;
+    for (size_t i{}; i < targets.size(); ++i)
+        content += (i ? " " : "") + escapeMakePath(targets[i]);
+    content += ':';
+
+    std::set<std::string> written;
+    for (const std::string& dependency : dependencies)
+    {
+        if (written.insert(dependency).second)
+            content += " \\\n  " + escapeMakePath(dependency);
+    }
+    content += '\n';
+
+    if (writeFileIfChanged(depFilePath, content))
+        Logger::log << "Wrote dependencies to file \"" << depFilePath << '"' << Logger::End;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * Writes the file only if its content is different, so its modification time
+ * only changes when the content does and the build tools can skip the steps that use it.
+ * The content is written to a temporary file that is renamed to the path,
+ * so the file is never seen half-written.
+ *
+ * Returns true if the file was written.
+ * Throws on error.
+ */
+bool writeFileIfChanged(const std::string& filePath, const std::string& content);
+
+/*
+ * Returns the default path of the dependency file of an output: the extension replaced with .d.
+ */
+[[nodiscard]] std::string getDepFilePath(const std::string& outputFilePath);
+
+/*
+ * Writes a Makefile rule (the format of `gcc -MD`) that makes the targets depend
+ * on the files, each only once. Only written if it changed.
+ *
+ * Throws on error.
+ */
+void writeDepFile(const std::string& depFilePath,
+        const std::vector<std::string>& targets, const std::vector<std::string>& dependencies);
@@ -1,10 +1,19 @@
 #include "parser.h"
 #include "Logger.h"
 #include "common.h"
+#include "NetpbmImage.h"
+#include "sprite_import.h"
+#include "switch_dispatch.h"
+#include <algorithm>
 #include <cctype>
+#include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <filesystem>
 #include <memory>
+#include <optional>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <sstream>
@@ -97,18 +106,22 @@ static char escapedCharToChar(char character, bool isString=false)
     }
 }
 
-static unsigned int stringToUint(const std::string& str, unsigned int limit)
+unsigned int stringToUint(const std::string& str, unsigned int limit)
 {
     Logger::dbg << "Converting \"" + str + "\" to integer" << Logger::End;
 
-    unsigned int integer{};
+    // Wider than the result, so the values that don't fit are caught by the limit check
+    unsigned long long integer{};
     if (str.length() > 2 && str[0] == '0' && str[1] == 'b')
     {
         for (size_t i{str.length()-1}; i >= 2; --i)
         {
             if (str[i] == '1')
             {
-                integer |= 1 << ((str.length()-1)-i);
+                const size_t bit = (str.length()-1)-i;
+                if (bit >= sizeof(integer)*8)
+                    throw std::out_of_range{"Integer value \"" + str + "\" is out of range."};
+                integer |= 1ull << bit;
             }
             else if (str[i] != '0')
             {
@@ -137,19 +150,47 @@ static unsigned int stringToUint(const std::string& str, unsigned int limit)
     {
         try
         {
-            integer = std::stoul(str, 0, 0);
+            integer = std::stoull(str, 0, 0);
+        }
+        catch (std::out_of_range&)
+        {
+            throw std::out_of_range{"Integer value \"" + str + "\" is out of range."};
         }
         catch (...)
         {
             throw std::runtime_error{"Integer conversion failed, value: "+str};
         }
     }
-    if ((unsigned int)integer > limit)
+    if (integer > limit)
         throw std::out_of_range{"Integer value \"" + str + "\" is out of range."};
     return integer;
 }
 
-static void processOperand(const std::string& operandStr, OpcodeOperand* operand)
+/*
+ * Returns true if the string is a single integer or character literal.
+ */
+static bool isSimpleLiteral(const std::string& str)
+{
+    if (str.empty())
+        return false;
+    if (str[0] == '\'')
+        return str.size() <= 4 && str.back() == '\'';
+    if (!std::isdigit((unsigned char)str[0]))
+        return false;
+    for (char c : str)
+    {
+        if (!std::isalnum((unsigned char)c) && c != '_')
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Parses an operand. The integers can be at most `limit`.
+ *
+ * Throws on error.
+ */
+static void processOperand(const std::string& operandStr, OpcodeOperand* operand, unsigned int limit=0x0fff)
 {
     if (isComment(operandStr))
         return;
@@ -175,9 +216,19 @@ static void processOperand(const std::string& operandStr, OpcodeOperand* operand
         operand->setK();
         Logger::dbg << "Operand: K operand" << Logger::End;
     }
-    else if (std::isdigit(operandStr[0]) || operandStr[0] == '\'') // Probably an integer constant or a character
+    else if (strToLower(operandStr).compare("hf") == 0)
+    {
+        operand->setHF();
+        Logger::dbg << "Operand: HF operand" << Logger::End;
+    }
+    else if (strToLower(operandStr).compare("r") == 0)
+    {
+        operand->setR();
+        Logger::dbg << "Operand: R operand" << Logger::End;
+    }
+    else if (isSimpleLiteral(operandStr)) // Probably an integer constant or a character
     {
-        unsigned int integer = stringToUint(operandStr, 0x0fff);
+        unsigned int integer = stringToUint(operandStr, limit);
         Logger::dbg << "Operand: Integer: " << integer << Logger::End;
         operand->setUint(integer);
     }
@@ -186,13 +237,61 @@ static void processOperand(const std::string& operandStr, OpcodeOperand* operand
         Logger::dbg << "Operand: Label reference to \"" << operandStr << '"' << Logger::End;
         operand->setAsLabel(operandStr);
     }
+    else // Probably an expression
+    {
+        Expression expr;
+        try
+        {
+            expr = Expression::parse(operandStr);
+        }
+        catch (std::exception& e)
+        {
+            throw std::runtime_error{"Invalid operand value: \"" + operandStr + "\": " + e.what()};
+        }
+
+        if (expr.isConstant())
+        {
+            const int32_t value = expr.evaluateConstant();
+            Logger::dbg << "Operand: Folded expression: " << value << Logger::End;
+            operand->setInt(value, limit);
+        }
+        else
+        {
+            Logger::dbg << "Operand: Expression: \"" << operandStr << '"' << Logger::End;
+            operand->setExpression(expr);
+        }
+    }
+}
+
+/*
+ * Parses an argument of DB or DW.
+ * Constant values are stored directly, the others are added to the deferred arguments.
+ *
+ * Throws on error.
+ */
+template <typename T>
+static void processDataArgument(const std::string& word, DataStoreInst<T>* def)
+{
+    constexpr unsigned int limit = (sizeof(T) == 1 ? 0xff : 0xffff);
+    if (isSimpleLiteral(word))
+    {
+        def->arguments.push_back(stringToUint(word, limit));
+        return;
+    }
+
+    Expression expr = Expression::parse(word);
+    if (expr.isConstant())
+    {
+        def->arguments.push_back(expressionValueToUint(expr.evaluateConstant(), limit));
+    }
     else
     {
-        throw std::runtime_error{"Invalid operand value"};
+        def->deferredArguments.emplace_back(def->arguments.size(), std::move(expr));
+        def->arguments.push_back(0);
     }
 }
 
-static std::string getWord(size_t& charI, const std::string& line)
+std::string getWord(size_t& charI, const std::string& line)
 {
     std::string word;
     auto isSpace{
@@ -219,18 +318,21 @@ static std::string getWord(size_t& charI, const std::string& line)
 
     bool isInsideSingleQuote{};
     bool isInsideDoubleQuote{};
+    // Spaces and commas inside parentheses don't end the word, so expressions can contain them
+    int parenDepth{};
     while (charI < line.size())
     {
-        if (line.at(charI) == '\'' && charI > 0 && line.at(charI-1) != '\\')
+        if (line.at(charI) == '\'' && charI > 0 && line.at(charI-1) != '\\' && !isInsideDoubleQuote)
         {
             if (isInsideSingleQuote)
             {
                 word += line.at(charI++);
-                break;
+                isInsideSingleQuote = false;
+                continue;
             }
             isInsideSingleQuote = true;
         }
-        if (line.at(charI) == '"' && charI > 0 && line.at(charI-1) != '\\')
+        if (line.at(charI) == '"' && charI > 0 && line.at(charI-1) != '\\' && !isInsideSingleQuote)
         {
             if (isInsideDoubleQuote)
             {
@@ -239,9 +341,16 @@ static std::string getWord(size_t& charI, const std::string& line)
             }
             isInsideDoubleQuote = true;
         }
+        if (!isInsideSingleQuote && !isInsideDoubleQuote)
+        {
+            if (line.at(charI) == '(')
+                ++parenDepth;
+            else if (line.at(charI) == ')' && parenDepth > 0)
+                --parenDepth;
+        }
 
         // We break out if this is the end of the line or we found a space outside the quotes
-        if (charI >= line.length() || ((isSpace(line.at(charI)) && !isInsideSingleQuote && !isInsideDoubleQuote)))
+        if (charI >= line.length() || ((isSpace(line.at(charI)) && !isInsideSingleQuote && !isInsideDoubleQuote && !parenDepth)))
             break;
         word += line.at(charI++);
     }
@@ -254,7 +363,7 @@ static inline std::string getWord(const std::string& line)
     return getWord(_, line);
 }
 
-static std::map<std::string, std::string> getMacroDefs(const std::string& str)
+static std::map<std::string, std::string> getMacroDefs(const std::string& str, const std::vector<SourceLocation>& lineOrigins)
 {
     std::map<std::string, std::string> output;
 
@@ -302,7 +411,7 @@ static std::map<std::string, std::string> getMacroDefs(const std::string& str)
             auto foundMacro = output.find(macroName);
             if (foundMacro != output.end())
             {
-                Logger::warn << lineI << ": Macro redeclared: \"" << macroName << '"' << Logger::End;
+                Logger::warn << lineOrigins[lineI-1].toString() << ": Macro redeclared: \"" << macroName << '"' << Logger::End;
             }
             output.insert_or_assign(macroName, macroVal);
         }
@@ -310,15 +419,248 @@ static std::map<std::string, std::string> getMacroDefs(const std::string& str)
     return output;
 }
 
-std::string preprocessFile(const std::string& str, const::std::string& filename)
+/*
+ * Finds the file referenced by an `%include` directive.
+ * Returns the canonical path or an empty string if the file was not found.
+ */
+static std::string resolveIncludePath(
+        const std::string& target, const std::string& includerPath,
+        const std::vector<std::string>& includeDirs)
+{
+    namespace fs = std::filesystem;
+
+    auto tryPath{
+        [](const fs::path& path) -> std::string {
+            std::error_code ec;
+            if (!fs::is_regular_file(path, ec))
+                return "";
+            return fs::weakly_canonical(path, ec).string();
+        }
+    };
+
+    if (fs::path{target}.is_absolute())
+        return tryPath(target);
+
+    // First look next to the including file
+    std::string found = tryPath(fs::path{includerPath}.parent_path() / target);
+    if (!found.empty())
+        return found;
+
+    // Then in the include directories, in order
+    for (const auto& dir : includeDirs)
+    {
+        found = tryPath(fs::path{dir} / target);
+        if (!found.empty())
+            return found;
+    }
+    return "";
+}
+
+struct IncludeState
+{
+    const std::vector<std::string>& includeDirs;
+    IncludeCache* cache;
+    // Canonical paths of the files being expanded, the last one is the current file
+    std::vector<std::string> includeStack;
+    // Canonical paths of the files with a `%once` directive, they are not included again
+    std::set<std::string> oncePaths;
+    PreprocessedFile* output;
+};
+
+/*
+ * Directives that are handled by the parser and reference a file as their first argument.
+ */
+static bool isFileDirective(const std::string& directive)
+{
+    return directive.compare("%incbin") == 0
+        || directive.compare("%sprite") == 0
+        || directive.compare("%expect_screen") == 0;
+}
+
+/*
+ * Directives that are left in the source for the parser.
+ */
+static bool isParserDirective(const std::string& directive)
+{
+    return isFileDirective(directive)
+        || directive.compare("%macro") == 0
+        || directive.compare("%endmacro") == 0
+        || directive.compare("%trips") == 0
+        || directive.compare("%table") == 0
+        || directive.compare("%assert_at") == 0
+        || directive.compare("%rep") == 0
+        || directive.compare("%endrep") == 0
+        || directive.compare("%switch") == 0
+        || directive.compare("%case") == 0
+        || directive.compare("%default") == 0
+        || directive.compare("%endswitch") == 0
+        || directive.compare("%reg") == 0;
+}
+
+/*
+ * Removes the quotes from the path argument of a directive.
+ *
+ * Throws on error.
+ */
+static std::string unquotePath(const std::string& word)
+{
+    if (word.size() < 2 || word.front() != '"' || word.back() != '"')
+        throw std::runtime_error{"Expected a quoted file path, got: " + word};
+    return word.substr(1, word.size()-2);
+}
+
+/*
+ * Copies the lines to the output, replacing the `%include` directives with the included files.
+ * A file is included every time, unless it has a `%once` directive.
+ */
+static void expandIncludes(
+        const std::vector<std::string>& lines, const std::shared_ptr<const std::string>& filePath,
+        IncludeState& state)
+{
+    for (size_t lineI{}; lineI < lines.size(); ++lineI)
+    {
+        const std::string& line = lines[lineI];
+        const SourceLocation location{filePath, int(lineI+1), nullptr};
+
+        size_t charI{};
+        const std::string directive = (!line.empty() && line[0] == PREPRO_PREFIX_CHAR) ? getWord(charI, line) : "";
+        if (isFileDirective(directive))
+        {
+            std::string target;
+            try
+            {
+                target = unquotePath(getWord(charI, line));
+            }
+            catch (std::exception& e)
+            {
+                throw std::runtime_error{location.toString() + ": " + e.what()};
+            }
+
+            const std::string path = resolveIncludePath(target, *filePath, state.includeDirs);
+            if (path.empty())
+                throw std::runtime_error{location.toString() + ": File not found: \"" + target + '"'};
+            state.output->dependencies.push_back(path);
+
+            // Let the parser find the file regardless of the working directory
+            state.output->content += directive + " \"" + path + '"' + line.substr(charI) + '\n';
+            state.output->lineOrigins.push_back(location);
+            continue;
+        }
+        else if (directive.compare("%include") == 0)
+        {
+            std::string target = getWord(charI, line);
+            const std::string rest = getWord(charI, line);
+            if (target.size() < 2 || target.front() != '"' || target.back() != '"' || !(rest.empty() || isComment(rest)))
+                throw std::runtime_error{location.toString() + ": Expected a quoted file path: " + line};
+            target = target.substr(1, target.size()-2);
+
+            const std::string path = resolveIncludePath(target, *filePath, state.includeDirs);
+            if (path.empty())
+                throw std::runtime_error{location.toString() + ": Included file not found: \"" + target + '"'};
+
+            if (state.oncePaths.count(path))
+            {
+                Logger::dbg << location.toString() << ": File already included and has %once, skipping: " << path << Logger::End;
+                continue;
+            }
+            if (std::find(state.includeStack.begin(), state.includeStack.end(), path) != state.includeStack.end())
+                throw std::runtime_error{location.toString() + ": Recursive %include of \"" + target + "\", add %once to the file?"};
+
+            Logger::dbg << "Including file: " << path << Logger::End;
+            std::shared_ptr<const IncludeCache::File> file;
+            try
+            {
+                file = state.cache->get(path);
+            }
+            catch (std::exception& e)
+            {
+                throw std::runtime_error{location.toString() + ": " + e.what()};
+            }
+            state.output->dependencies.push_back(path);
+            state.includeStack.push_back(path);
+            expandIncludes(file->lines, file->path, state);
+            state.includeStack.pop_back();
+            continue;
+        }
+        else if (directive.compare("%once") == 0)
+        {
+            const std::string rest = getWord(charI, line);
+            if (!(rest.empty() || isComment(rest)))
+                throw std::runtime_error{location.toString() + ": %once takes no arguments: " + line};
+            state.oncePaths.insert(state.includeStack.back());
+            continue;
+        }
+
+        state.output->content += line;
+        state.output->content += '\n';
+        state.output->lineOrigins.push_back(location);
+    }
+}
+
+/*
+ * Replaces the defines in the line in the order of the map, so a value can use the defines after it.
+ * The names of the replaced defines are added to `usedNames` if it is not null.
+ *
+ * Throws if an empty define is used.
+ */
+static std::string expandDefinesInLine(std::string line, const defineMap_t& defines,
+        const std::string& filePath, std::vector<std::string>* usedNames)
+{
+    for (const auto& macro : defines)
+    {
+        const auto& from = macro.first;
+        const auto& to = macro.second;
+
+        size_t foundPos = line.find(from);
+        if (foundPos == std::string::npos)
+            continue;
+        if (to.empty())
+            throw std::runtime_error{filePath + ": Invalid use of empty macro \"" + from + '"'};
+        if (usedNames)
+            usedNames->push_back(from);
+        while (foundPos != std::string::npos)
+        {
+            Logger::dbg << "Replacing macro \"" << from << "\" with \"" << to << '"' << Logger::End;
+            line.replace(foundPos, from.size(), to);
+            foundPos = line.find(from);
+        }
+    }
+    return line;
+}
+
+SourceFiles readSourceFiles(
+        const std::string &str, const::std::string& filename,
+        const std::vector<std::string>& includeDirs, IncludeCache* includeCache)
 {
-    const auto macroDefs = getMacroDefs(str);
+    SourceFiles result;
+    result.filePath = filename;
+    PreprocessedFile included;
+
+    // Pull in the included files
+    {
+        std::vector<std::string> lines;
+        {
+            std::stringstream ss;
+            ss << str;
+            std::string line;
+            while (std::getline(ss, line))
+                lines.push_back(line);
+        }
+
+        IncludeState state{includeDirs, includeCache, {}, {}, &included};
+        {
+            std::error_code ec;
+            state.includeStack.push_back(std::filesystem::weakly_canonical(filename, ec).string());
+        }
+        expandIncludes(lines, std::make_shared<const std::string>(filename), state);
+    }
+    result.defines = getMacroDefs(included.content, included.lineOrigins);
 
     std::string output;
     // Remove preprocessor directives
     {
         std::stringstream ss;
-        ss << str;
+        ss << included.content;
         std::string line;
         size_t lineI{};
         while (std::getline(ss, line))
@@ -330,12 +672,18 @@ std::string preprocessFile(const std::string& str, const::std::string& filename)
                 continue;
             }
 
-            if (line[0] == PREPRO_PREFIX_CHAR)
+            // Lines starting with "%%" are local labels in macros
+            if (line[0] == PREPRO_PREFIX_CHAR && line.compare(0, 2, "%%") != 0)
             {
-                const std::string directive = getWord(line).substr(1);
-                if (directive.compare("define") != 0)
+                const std::string directive = getWord(line);
+                if (isParserDirective(directive))
+                {
+                    output += line + '\n';
+                    continue;
+                }
+                if (directive.compare("%define") != 0)
                 {
-                    throw std::runtime_error{filename + ':' + std::to_string(lineI) + ':' + "Invalid preprocessor directive: " + line};
+                    throw std::runtime_error{included.lineOrigins[lineI-1].toString() + ": Invalid preprocessor directive: " + line};
                 }
                 output += '\n';
                 continue;
@@ -344,239 +692,1547 @@ std::string preprocessFile(const std::string& str, const::std::string& filename)
         }
     }
     Logger::dbg << "Preprocessed file (stage 1):\n" << output << Logger::End;
+    included.content = std::move(output);
+    result.file = std::move(included);
 
-    // Replace macros with their value
-    for (const auto& macro : macroDefs)
+    // Expand the lines with the defines of the source once for all the builds
     {
-        const auto& from = macro.first;
-        const auto& to = macro.second;
-
-        size_t foundPos = output.find(from);
-        if (foundPos != std::string::npos && to.empty())
+        std::stringstream ss;
+        ss << result.file.content;
+        std::string line;
+        while (std::getline(ss, line))
+            result.lines.push_back(line);
+    }
+    result.expandedLines.resize(result.lines.size());
+    std::vector<std::string> usedNames;
+    for (size_t i{}; i < result.lines.size(); ++i)
+    {
+        usedNames.clear();
+        try
         {
-            throw std::runtime_error{filename + ": Invalid use of empty macro \"" + from + '"'};
+            result.expandedLines[i] = expandDefinesInLine(result.lines[i], result.defines, filename, &usedNames);
         }
-        while (foundPos != std::string::npos)
+        catch (std::runtime_error&)
         {
-            Logger::dbg << "Replacing macro \"" << from << "\" with \"" << to << '"' << Logger::End;
-            output.replace(foundPos, from.size(), to);
-            foundPos = output.find(from);
+            result.unexpandedLines.push_back(i);
+            continue;
         }
+        for (const std::string& name : usedNames)
+            result.defineUses[name].push_back(i);
     }
-    Logger::dbg << "Preprocessed file (stage 2):\n" << output << Logger::End;
-    return output;
+    return result;
 }
 
-
-void parseTokens(
-        const std::string& str, const::std::string& filename,
-        tokenList_t* tokenList, labelMap_t* labelMap)
+PreprocessedFile expandDefines(const SourceFiles& sources, const defineMap_t& overrides)
 {
-    std::stringstream ss;
-    ss << str;
-    size_t lineI{};
-    std::string line;
-    uint16_t byteOffset{};
-    while (std::getline(ss, line))
+    PreprocessedFile result;
+    result.lineOrigins = sources.file.lineOrigins;
+    result.dependencies = sources.file.dependencies;
+
+    defineMap_t macroDefs = sources.defines;
+    for (const auto& define : overrides)
+        macroDefs.insert_or_assign(define.first, define.second);
+
+    // Find the lines that the overrides change
+    std::set<size_t> changedLines(sources.unexpandedLines.begin(), sources.unexpandedLines.end());
+    auto addUses{[&](const std::string& name){
+        auto uses = sources.defineUses.find(name);
+        if (uses != sources.defineUses.end())
+            changedLines.insert(uses->second.begin(), uses->second.end());
+    }};
+    for (const auto& define : overrides)
     {
-        try
+        auto sourceDefine = sources.defines.find(define.first);
+        if (sourceDefine != sources.defines.end())
         {
-            ++lineI;
+            if (sourceDefine->second != define.second)
+                addUses(define.first);
+            continue;
+        }
 
-            if (line.empty())
-                continue;
+        // A new name can be in the text of a line or in the value of a define that the line uses
+        for (size_t i{}; i < sources.lines.size(); ++i)
+        {
+            if (sources.lines[i].find(define.first) != std::string::npos
+             || sources.expandedLines[i].find(define.first) != std::string::npos)
+                changedLines.insert(i);
+        }
+        for (const auto& other : sources.defines)
+        {
+            if (other.second.find(define.first) != std::string::npos)
+                addUses(other.first);
+        }
+    }
+    Logger::dbg << "Expanding " << changedLines.size() << " of " << sources.lines.size()
+        << " lines with the defines again" << Logger::End;
 
-            size_t charI{};
+    std::string output;
+    for (size_t i{}; i < sources.lines.size(); ++i)
+    {
+        if (changedLines.count(i))
+            output += expandDefinesInLine(sources.lines[i], macroDefs, sources.filePath, nullptr);
+        else
+            output += sources.expandedLines[i];
+        output += '\n';
+    }
+    Logger::dbg << "Preprocessed file (stage 2):\n" << output << Logger::End;
+    result.content = std::move(output);
+    return result;
+}
 
-            std::string word = getWord(charI, line);
+PreprocessedFile preprocessFile(
+        const std::string &str, const::std::string& filename,
+        const std::vector<std::string>& includeDirs, IncludeCache* includeCache,
+        const defineMap_t& overrides)
+{
+    return expandDefines(readSourceFiles(str, filename, includeDirs, includeCache), overrides);
+}
 
-            // TODO: Refactor this whole block
+/*
+ * Parses the arguments of an `%incbin "file"[, offset[, length]]` directive.
+ *
+ * Throws on error.
+ */
+static std::shared_ptr<IncbinInst> parseIncbin(size_t& charI, const std::string& line)
+{
+    auto inst = std::make_shared<IncbinInst>();
+    const std::string path = unquotePath(getWord(charI, line));
 
-            if (isComment(word))
-                continue;
-            Logger::dbg << "Word: " << '"' << word << '"' << Logger::End;
+    auto file = std::make_shared<MappedFile>();
+    file->open(path);
 
-            if (isLabelDeclaration(word))
-            {
-                Logger::dbg << "Found a label declaration: \"" << word.substr(0, word.length()-1)
-                    << "\", offset: 0x" << std::hex << byteOffset << std::dec << Logger::End;
+    std::vector<std::string> args;
+    while (true)
+    {
+        std::string word = getWord(charI, line);
+        if (word.empty() || isComment(word))
+            break;
+        args.push_back(std::move(word));
+    }
+    if (args.size() > 2)
+        throw std::runtime_error{"Too many arguments for %incbin"};
 
-                auto foundLabel = labelMap->find(word);
-                if (foundLabel != labelMap->end())
-                {
-                    throw std::runtime_error{"Label redeclared: \"" + word
-                        + "\", original offset: 0x" + intToHexStr(foundLabel->second) +
-                        ", new offset: 0x" + std::to_string(byteOffset)};
-                }
-                labelMap->insert({word.substr(0, word.length()-1), byteOffset});
-                continue;
-            }
+    inst->offset = args.size() > 0 ? stringToUint(args[0], UINT_MAX) : 0;
+    if (inst->offset > file->getSize())
+        throw std::out_of_range{"Offset is past the end of the file: \"" + path + '"'};
 
-            OpcodeEnum opcode = opcodeStrToEnum(word);
-            std::string lowerWord = strToLower(word);
-            if (opcode != OPCODE_INVALID)
-            {
-                Logger::dbg << "Found an opcode: " << word << " = " << opcode << Logger::End;
-                std::string operand0Str = getWord(charI, line);
-                std::string operand1Str = getWord(charI, line);
-                std::string operand2Str = getWord(charI, line);
-                Logger::dbg << "Operand 0: \"" << operand0Str
-                    << "\", operand 1: \"" << operand1Str
-                    << "\", operand 2: \"" << operand2Str
-                    << '"' << Logger::End;
-                auto token = std::make_shared<Opcode>();
-                token->opcode = opcode;
-
-                // Don't try to parse comment after opcode as operands
-                bool hasCommentStarted = false;
-
-                if (operand0Str.size())
-                {
-                    if (isComment(operand0Str))
-                    {
-                        hasCommentStarted = true;
-                    }
-                    else
-                    {
-                        processOperand(operand0Str, &token->operand0);
-                    }
-                }
+    inst->length = args.size() > 1 ? stringToUint(args[1], UINT_MAX) : file->getSize()-inst->offset;
+    if (inst->length > file->getSize()-inst->offset)
+        throw std::out_of_range{"Length is past the end of the file: \"" + path + '"'};
 
-                if (operand1Str.size() && !hasCommentStarted)
-                {
-                    if (isComment(operand1Str))
-                    {
-                        hasCommentStarted = true;
-                    }
-                    else
-                    {
-                        processOperand(operand1Str, &token->operand1);
-                    }
-                }
+    inst->file = std::move(file);
+    return inst;
+}
 
-                if (operand2Str.size() && !hasCommentStarted)
-                {
-                    if (isComment(operand2Str))
-                    {
-                        hasCommentStarted = true;
-                    }
-                    else
-                    {
-                        processOperand(operand2Str, &token->operand2);
-                    }
-                }
+/*
+ * Returns the name of the file without the directory and the extension,
+ * usable as a label name.
+ */
+static std::string getLabelNameFromPath(const std::string& path)
+{
+    std::string name = std::filesystem::path{path}.stem().string();
+    for (char& c : name)
+    {
+        if (!std::isalnum((unsigned char)c))
+            c = '_';
+    }
+    if (name.empty() || std::isdigit((unsigned char)name[0]))
+        name = '_' + name;
+    return name;
+}
 
-                // Possible variants:
-                // LD:
-                //   with F or B as first argument
-                //   or with K as second argument
-                if ((opcode != OPCODE_LD && (
-                    token->operand0.getType() == Parser::OpcodeOperand::Type::F
-                 || token->operand0.getType() == Parser::OpcodeOperand::Type::B
-                 || token->operand0.getType() == Parser::OpcodeOperand::Type::K
-                 || token->operand1.getType() == Parser::OpcodeOperand::Type::F
-                 || token->operand1.getType() == Parser::OpcodeOperand::Type::B
-                 || token->operand1.getType() == Parser::OpcodeOperand::Type::K
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::F
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::B
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::K))
-                 || (opcode == OPCODE_LD && (
-                    token->operand1.getType() == Parser::OpcodeOperand::Type::F
-                 || token->operand1.getType() == Parser::OpcodeOperand::Type::B
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::F
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::B
-                 || token->operand0.getType() == Parser::OpcodeOperand::Type::K
-                 || token->operand2.getType() == Parser::OpcodeOperand::Type::K)))
-                {
-                    throw std::runtime_error{"Invalid use of F/B/K operator"};
-                }
+/*
+ * Parses a `%sprite "file", width, height[, pack]` directive.
+ * Adds the data to the token list, with a `<file name>_<frame index>` label before each frame.
+ *
+ * Throws on error.
+ */
+static void parseSprite(size_t& charI, const std::string& line, tokenList_t* output)
+{
+    const std::string path = unquotePath(getWord(charI, line));
 
-                token->setLineNumber(lineI);
-                tokenList->push_back(std::move(token));
-                byteOffset += 2;
-                continue;
-            }
-            else if (lowerWord.compare("db") == 0) // Define byte
-            {
-                Logger::dbg << "Found a byte definition" << Logger::End;;
+    std::vector<std::string> args;
+    while (true)
+    {
+        std::string word = getWord(charI, line);
+        if (word.empty() || isComment(word))
+            break;
+        args.push_back(std::move(word));
+    }
+    if (args.size() < 2 || args.size() > 3)
+        throw std::runtime_error{"Expected %sprite \"file\", width, height[, pack]"};
+    const bool shouldPack = args.size() == 3;
+    if (shouldPack && strToLower(args[2]).compare("pack") != 0)
+        throw std::runtime_error{"Invalid %sprite option: " + args[2]};
 
-                auto def = std::make_shared<DbInst>();
-                std::string word;
-                while (true)
-                {
-                    word = getWord(charI, line);
-                    if (word.empty() || isComment(word))
-                        break;
+    NetpbmImage image;
+    image.open(path);
+    const SpriteSheet sheet = importSprites(image, stringToUint(args[0], 16), stringToUint(args[1], 16), shouldPack);
 
-                    Logger::dbg << "DB argument: " << word << Logger::End;
+    // Packed frames can start anywhere, so split the data where the labels are
+    std::vector<std::pair<size_t, size_t>> labelOffsets; // Offset, frame index
+    for (size_t i{}; i < sheet.frameOffsets.size(); ++i)
+        labelOffsets.emplace_back(sheet.frameOffsets[i], i);
+    std::sort(labelOffsets.begin(), labelOffsets.end());
 
-                    if (word.size() > 1 && word[0] == '"' && word[word.size()-1] == '"' && word[word.size()-2] != '\\')
-                    {
-                        for (size_t i{1}; i < word.size()-1; ++i)
-                        {
-                            if (word[i] == '\\') // Escaped character
-                            {
-                                try
-                                {
-                                    def->arguments.push_back(escapedCharToChar(word[++i], true));
-                                }
-                                catch (std::exception&)
-                                {
-                                    throw std::invalid_argument{"Invalid escape sequence"};
-                                }
-                            }
-                            else
-                            {
-                                def->arguments.push_back(word[i]);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        def->arguments.push_back(stringToUint(word, 255));
-                    }
-                }
+    const std::string labelPrefix = getLabelNameFromPath(path) + '_';
+    size_t dataOffset{};
+    for (size_t i{}; i <= labelOffsets.size(); ++i)
+    {
+        const size_t nextOffset = (i < labelOffsets.size() ? labelOffsets[i].first : sheet.data.size());
+        if (nextOffset > dataOffset)
+        {
+            auto def = std::make_shared<DbInst>();
+            def->arguments.assign(sheet.data.begin()+dataOffset, sheet.data.begin()+nextOffset);
+            output->push_back(std::move(def));
+            dataOffset = nextOffset;
+        }
+        if (i < labelOffsets.size())
+        {
+            auto label = std::make_shared<Label>();
+            label->name = labelPrefix + std::to_string(labelOffsets[i].second);
+            output->push_back(std::move(label));
+        }
+    }
+    Logger::log << "Imported " << sheet.frameOffsets.size() << " sprites into "
+        << sheet.data.size() << " bytes" << Logger::End;
+}
 
-                if (def->arguments.empty())
-                {
-                    Logger::warn << "DB without data" << Logger::End;
-                }
-                byteOffset += def->arguments.size();
-                tokenList->push_back(std::move(def));
-                continue;
-            }
-            else if (lowerWord.compare("dw") == 0) // Define word
-            {
-                Logger::dbg << "Found a word definition" << Logger::End;;
+// Protects against typos in the count of `%table`
+#define TABLE_MAX_COUNT 65536
+// The symbol of the index in the expression of `%table`
+#define TABLE_INDEX_SYMBOL "i"
 
-                auto def = std::make_shared<DwInst>();
-                std::string word;
-                while (true)
-                {
-                    word = getWord(charI, line);
-                    if (word.empty() || isComment(word))
-                        break;
-                    def->arguments.push_back(stringToUint(word, 0xffff));
-                }
+/*
+ * Parses a `%table name, count, expression` directive.
+ * Adds a label and the bytes of the expression for each index from 0 to count-1.
+ * The expression is the rest of the line, so it can contain spaces.
+ *
+ * Throws on error.
+ */
+static void parseTable(size_t& charI, const std::string& line, tokenList_t* output)
+{
+    const std::string name = getWord(charI, line);
+    const std::string countStr = getWord(charI, line);
+    if (name.empty() || isComment(name) || countStr.empty() || isComment(countStr))
+        throw std::runtime_error{"Expected %table name, count, expression"};
+    if (!isValidLabelName(name))
+        throw std::runtime_error{"Invalid label name: \"" + name + '"'};
+    const Expression countExpr = Expression::parse(countStr);
+    if (!countExpr.isConstant())
+        throw std::runtime_error{"The count of %table must be a constant, not \"" + countStr + '"'};
+    const int32_t count = countExpr.evaluateConstant();
+    if (count < 1 || count > TABLE_MAX_COUNT)
+        throw std::runtime_error{"The count of %table must be 1-" + std::to_string(TABLE_MAX_COUNT)};
 
-                if (def->arguments.empty())
-                {
-                    Logger::warn << "DW without data" << Logger::End;
-                }
-                byteOffset += def->arguments.size() * 2;
-                tokenList->push_back(std::move(def));
-                continue;
-            }
+    // The rest of the line without the comment
+    bool isInsideQuote{};
+    size_t exprEnd = charI;
+    for (; exprEnd < line.size() && (isInsideQuote || line[exprEnd] != ';'); ++exprEnd)
+    {
+        if (line[exprEnd] == '\'' && line[exprEnd-1] != '\\')
+            isInsideQuote = !isInsideQuote;
+    }
+    const size_t exprStart = line.find_first_not_of(" \t,", charI);
+    if (exprStart >= exprEnd)
+        throw std::runtime_error{"Expected %table name, count, expression"};
+    const Expression expr = Expression::parse(line.substr(exprStart, exprEnd-exprStart));
+    for (const std::string& symbol : expr.getSymbols())
+    {
+        if (symbol.compare(TABLE_INDEX_SYMBOL) != 0)
+        {
+            throw std::runtime_error{"The expression of %table can only use the index \"" TABLE_INDEX_SYMBOL
+                "\", not \"" + symbol + '"'};
+        }
+    }
+    if (expr.usesCurrentAddress())
+        throw std::runtime_error{"The expression of %table can't use $"};
 
-            throw std::runtime_error{"Syntax error: "+line};
+    auto label = std::make_shared<Label>();
+    label->name = name;
+    output->push_back(std::move(label));
+
+    auto def = std::make_shared<DbInst>();
+    def->arguments.resize(count);
+    for (int32_t index{}; index < count; ++index)
+    {
+        try
+        {
+            // The only symbol is the index
+            const int32_t value = expr.evaluate(
+                    [index](const std::string&, int32_t* value){ *value = index; return true; }, 0);
+            def->arguments[index] = expressionValueToUint(value, 0xff);
         }
         catch (std::exception& e)
         {
-            // Rethrow the exception with more info
-            throw std::runtime_error{filename + ':' + std::to_string(lineI) + ": " + e.what()};
+            throw std::runtime_error{"%table \"" + name + "\" at " TABLE_INDEX_SYMBOL " = " + std::to_string(index)
+                + ": " + e.what()};
         }
     }
+    output->push_back(std::move(def));
+    Logger::log << "Generated the table \"" << name << "\": " << count << " bytes" << Logger::End;
 }
 
-} // namespace Parser
+static std::shared_ptr<Opcode> parseOpcode(OpcodeEnum opcode, size_t& charI, const std::string& line)
+{
+    std::string operand0Str = getWord(charI, line);
+    std::string operand1Str = getWord(charI, line);
+    std::string operand2Str = getWord(charI, line);
+    Logger::dbg << "Operand 0: \"" << operand0Str
+        << "\", operand 1: \"" << operand1Str
+        << "\", operand 2: \"" << operand2Str
+        << '"' << Logger::End;
+    auto token = std::make_shared<Opcode>();
+    token->opcode = opcode;
+
+    // LD I, LONG addr
+    unsigned int operand1Limit = 0x0fff;
+    if (opcode == OPCODE_LD && strToLower(operand1Str).compare("long") == 0)
+    {
+        token->isLongAddress = true;
+        operand1Str = operand2Str;
+        operand2Str = getWord(charI, line);
+        operand1Limit = 0xffff;
+    }
+    // SAVE/LOAD Vx-Vy
+    if ((opcode == OPCODE_SAVE || opcode == OPCODE_LOAD) && !isComment(operand0Str))
+    {
+        const size_t dash = operand0Str.find('-');
+        if (dash != std::string::npos)
+        {
+            operand2Str = operand1Str;
+            operand1Str = operand0Str.substr(dash+1);
+            operand0Str = operand0Str.substr(0, dash);
+        }
+    }
+
+    // Don't try to parse comment after opcode as operands
+    bool hasCommentStarted = false;
+
+    if (operand0Str.size())
+    {
+        if (isComment(operand0Str))
+        {
+            hasCommentStarted = true;
+        }
+        else
+        {
+            processOperand(operand0Str, &token->operand0);
+        }
+    }
 
+    if (operand1Str.size() && !hasCommentStarted)
+    {
+        if (isComment(operand1Str))
+        {
+            hasCommentStarted = true;
+        }
+        else
+        {
+            processOperand(operand1Str, &token->operand1, operand1Limit);
+        }
+    }
+
+    if (operand2Str.size() && !hasCommentStarted)
+    {
+        if (isComment(operand2Str))
+        {
+            hasCommentStarted = true;
+        }
+        else
+        {
+            processOperand(operand2Str, &token->operand2);
+        }
+    }
+
+    // The operators can only be used by LD:
+    //   F, B and HF as the first operand,
+    //   K as the second operand,
+    //   R as the first or the second operand
+    auto isLdOperator{[](const OpcodeOperand& operand){
+        switch (operand.getType())
+        {
+        case OpcodeOperand::Type::F:
+        case OpcodeOperand::Type::B:
+        case OpcodeOperand::Type::K:
+        case OpcodeOperand::Type::HF:
+        case OpcodeOperand::Type::R:
+            return true;
+        default:
+            return false;
+        }
+    }};
+    const OpcodeOperand::Type type0 = token->operand0.getType();
+    const OpcodeOperand::Type type1 = token->operand1.getType();
+    if ((opcode != OPCODE_LD && (isLdOperator(token->operand0) || isLdOperator(token->operand1)))
+     || isLdOperator(token->operand2)
+     || (opcode == OPCODE_LD && (type0 == OpcodeOperand::Type::K
+        || type1 == OpcodeOperand::Type::F || type1 == OpcodeOperand::Type::B || type1 == OpcodeOperand::Type::HF)))
+    {
+        throw std::runtime_error{"Invalid use of F/B/K/HF/R operator"};
+    }
+    if (token->isLongAddress && (type0 != OpcodeOperand::Type::Register
+                || token->operand0.getAsRegister() != REGISTER_I || type1 == OpcodeOperand::Type::Empty))
+        throw std::runtime_error{"LONG can only be used as LD I, LONG addr"};
+    return token;
+}
+
+static std::shared_ptr<DbInst> parseDb(size_t& charI, const std::string& line)
+{
+    auto def = std::make_shared<DbInst>();
+    std::string word;
+    while (true)
+    {
+        word = getWord(charI, line);
+        if (word.empty() || isComment(word))
+            break;
+
+        Logger::dbg << "DB argument: " << word << Logger::End;
+
+        if (word.size() > 1 && word[0] == '"' && word[word.size()-1] == '"' && word[word.size()-2] != '\\')
+        {
+            for (size_t i{1}; i < word.size()-1; ++i)
+            {
+                if (word[i] == '\\') // Escaped character
+                {
+                    try
+                    {
+                        def->arguments.push_back(escapedCharToChar(word[++i], true));
+                    }
+                    catch (std::exception&)
+                    {
+                        throw std::invalid_argument{"Invalid escape sequence"};
+                    }
+                }
+                else
+                {
+                    def->arguments.push_back(word[i]);
+                }
+            }
+        }
+        else
+        {
+            processDataArgument(word, def.get());
+        }
+    }
+
+    if (def->arguments.empty())
+    {
+        Logger::warn << "DB without data" << Logger::End;
+    }
+    return def;
+}
+
+static std::shared_ptr<DwInst> parseDw(size_t& charI, const std::string& line)
+{
+    auto def = std::make_shared<DwInst>();
+    std::string word;
+    while (true)
+    {
+        word = getWord(charI, line);
+        if (word.empty() || isComment(word))
+            break;
+        processDataArgument(word, def.get());
+    }
+
+    if (def->arguments.empty())
+    {
+        Logger::warn << "DW without data" << Logger::End;
+    }
+    return def;
+}
+
+//------------------------------------ Macros ----------------------------------
+
+// Local labels are written as `%%name` in the macro body
+#define MACRO_LOCAL_LABEL_PREFIX "%%"
+// Local labels are renamed to this while the body is parsed,
+// each expansion replaces it with a unique prefix
+#define MACRO_LOCAL_LABEL_PLACEHOLDER "__local__"
+// Protects against macros expanding themselves
+#define MACRO_MAX_EXPANSION_DEPTH 64
+
+/*
+ * Thrown when the expansions are nested too deep.
+ * Passed up through the expansions as it is, so the error is reported once.
+ */
+class MacroDepthError final : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/*
+ * A parsed macro body, reused by the expansions with the same arguments.
+ */
+struct MacroExpansion
+{
+    tokenList_t tokens;
+    // The body line of each token, the same for every expansion
+    std::vector<std::shared_ptr<const MacroOrigin>> origins;
+    // The `%assert_at`s and `%expect_screen`s of the body, added again by every expansion
+    TestDirectives testDirectives;
+};
+
+struct Macro
+{
+    std::string name;
+    std::vector<std::string> params;
+    // The lines between `%macro` and `%endmacro`
+    std::vector<std::pair<std::string, SourceLocation>> body;
+    // The parsed body by the argument list of the expansion
+    std::map<std::vector<std::string>, MacroExpansion> expansionCache;
+
+    size_t expansionCount{};
+    size_t emittedBytes{};
+};
+
+// Protects against typos in the count of `%rep`
+#define REP_MAX_COUNT 65536
+
+struct Repetition
+{
+    unsigned int count{};
+    // The name of the iteration variable, empty if there is none
+    std::string variable;
+    // The lines between `%rep` and `%endrep`
+    std::vector<std::pair<std::string, SourceLocation>> body;
+    // The number of `%rep`s in the body that are not closed yet
+    int nestingDepth{};
+    // The location of the `%rep` line
+    SourceLocation location;
+};
+
+struct ParserState
+{
+    std::map<std::string, Macro> macros;
+    // The macro whose body we are reading or null
+    Macro* macroBeingDefined{};
+    // The `%rep` whose body we are reading, if any
+    std::optional<Repetition> repetitionBeingDefined;
+    // The `%switch` whose cases we are reading, if any
+    std::optional<SwitchStatement> switchBeingDefined;
+    // How many macro expansions we are inside of
+    int expansionDepth{};
+    // How many of those are parsing a body to put in the cache
+    int cachingDepth{};
+    // Used to give each expansion, repetition and switch unique local labels
+    size_t expansionCounter{};
+    // The names declared by `%reg`
+    std::set<std::string> virtualRegisters;
+    // The trip count set by `%trips` for the next label, 0 if none
+    unsigned int pendingTripCount{};
+    // Where the test directives go, null if they are ignored
+    TestDirectives* testDirectives{};
+    // The instructions parsed by the other builds, null if not shared
+    ParseCache* cache{};
+};
+
+static bool isWordChar(char c)
+{
+    return std::isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Replaces the whole-word occurences of the macro parameters with the arguments
+ * and the `%%name` local labels with the placeholder.
+ * The strings, the character literals and the comment are left as they are.
+ */
+static std::string substituteMacroParams(
+        const std::string& line, const std::vector<std::string>& params, const std::vector<std::string>& args)
+{
+    std::string output;
+    size_t i{};
+    while (i < line.size())
+    {
+        if (line[i] == '"' || line[i] == '\'')
+        {
+            // Copy the literal up to its closing quote, skipping the escaped characters
+            const char quote = line[i];
+            output += line[i++];
+            while (i < line.size() && line[i] != quote)
+            {
+                if (line[i] == '\\' && i+1 < line.size())
+                    output += line[i++];
+                output += line[i++];
+            }
+            if (i < line.size())
+                output += line[i++];
+            continue;
+        }
+        if (line.compare(i, 2, MACRO_LOCAL_LABEL_PREFIX) == 0)
+        {
+            output += MACRO_LOCAL_LABEL_PLACEHOLDER;
+            i += 2;
+            continue;
+        }
+        if (!isWordChar(line[i]))
+        {
+            // Don't touch the comments
+            if (line[i] == ';')
+                break;
+            output += line[i++];
+            continue;
+        }
+
+        size_t wordEnd = i;
+        while (wordEnd < line.size() && isWordChar(line[wordEnd]))
+            ++wordEnd;
+        const std::string word = line.substr(i, wordEnd-i);
+
+        auto found = std::find(params.begin(), params.end(), word);
+        output += (found != params.end() ? args[found-params.begin()] : word);
+        i = wordEnd;
+    }
+    return output;
+}
+
+/*
+ * Gives a local label of a macro body its final name, leaves the other names alone.
+ */
+static void renameLocalLabel(std::string& name, const std::string& prefix)
+{
+    if (name.compare(0, sizeof(MACRO_LOCAL_LABEL_PLACEHOLDER)-1, MACRO_LOCAL_LABEL_PLACEHOLDER) == 0)
+        name = prefix + name.substr(sizeof(MACRO_LOCAL_LABEL_PLACEHOLDER)-1);
+}
+
+static void renameLocalLabelsInExpression(Expression& expr, const std::string& prefix)
+{
+    for (size_t i{}; i < expr.getSymbols().size(); ++i)
+    {
+        std::string name = expr.getSymbols()[i];
+        renameLocalLabel(name, prefix);
+        expr.renameSymbol(i, name);
+    }
+}
+
+/*
+ * Gives the local labels in a copy of the macro body their final name.
+ */
+static void renameLocalLabels(Token* token, const std::string& prefix)
+{
+    if (auto label = dynamic_cast<Label*>(token))
+    {
+        renameLocalLabel(label->name, prefix);
+    }
+    else if (auto opcode = dynamic_cast<Opcode*>(token))
+    {
+        for (OpcodeOperand* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+        {
+            if (operand->getType() == OpcodeOperand::Type::LabelReference)
+            {
+                std::string name = operand->getAsLabel().name;
+                renameLocalLabel(name, prefix);
+                operand->setAsLabel(name);
+            }
+            else if (operand->getType() == OpcodeOperand::Type::VirtualRegister)
+            {
+                std::string name = operand->getAsVirtualRegister();
+                renameLocalLabel(name, prefix);
+                operand->setVirtualRegister(name);
+            }
+            else if (operand->getType() == OpcodeOperand::Type::Expression)
+            {
+                renameLocalLabelsInExpression(operand->getAsExpression(), prefix);
+            }
+        }
+    }
+    else if (auto db = dynamic_cast<DbInst*>(token))
+    {
+        for (auto& arg : db->deferredArguments)
+            renameLocalLabelsInExpression(arg.second, prefix);
+    }
+    else if (auto dw = dynamic_cast<DwInst*>(token))
+    {
+        for (auto& arg : dw->deferredArguments)
+            renameLocalLabelsInExpression(arg.second, prefix);
+    }
+}
+
+/*
+ * Adds the test directives of a macro or `%rep` body to `output` for one copy of the body,
+ * with the local labels renamed like in the tokens of the copy.
+ * `getLocation` returns the location of a copied directive from its location in the body.
+ * Does nothing if `output` is null.
+ */
+template <typename F>
+static void copyTestDirectives(const TestDirectives& body, const std::string& localPrefix, F getLocation,
+        TestDirectives* output)
+{
+    if (!output)
+        return;
+
+    for (const TestAssertion& assertion : body.assertions)
+    {
+        TestAssertion copy = assertion;
+        copy.location = getLocation(assertion.location);
+        renameLocalLabel(copy.labelName, localPrefix);
+        renameLocalLabelsInExpression(copy.value, localPrefix);
+        output->assertions.push_back(std::move(copy));
+    }
+    for (const ScreenExpectation& expectation : body.screenExpectations)
+    {
+        ScreenExpectation copy = expectation;
+        copy.location = getLocation(expectation.location);
+        output->screenExpectations.push_back(std::move(copy));
+    }
+}
+
+static void parseLine(const std::string& line, const SourceLocation& location, ParserState& state, tokenList_t* output);
+
+/*
+ * Expands a macro invocation.
+ *
+ * Throws on error.
+ */
+static void expandMacro(
+        Macro& macro, size_t& charI, const std::string& line, const SourceLocation& location,
+        ParserState& state, tokenList_t* output)
+{
+    std::vector<std::string> args;
+    while (true)
+    {
+        std::string word = getWord(charI, line);
+        if (word.empty() || isComment(word))
+            break;
+        args.push_back(std::move(word));
+    }
+    if (args.size() != macro.params.size())
+        throw std::runtime_error{"Macro \"" + macro.name + "\" expects " + std::to_string(macro.params.size())
+            + " arguments, got " + std::to_string(args.size())};
+    if (state.expansionDepth >= MACRO_MAX_EXPANSION_DEPTH)
+        throw MacroDepthError{"Macro expansion is more than " + std::to_string(MACRO_MAX_EXPANSION_DEPTH)
+            + " levels deep, is \"" + macro.name + "\" recursive?"};
+
+    auto cached = macro.expansionCache.find(args);
+    if (cached == macro.expansionCache.end())
+    {
+        Logger::dbg << "Parsing the body of macro \"" << macro.name << '"' << Logger::End;
+        MacroExpansion expansion;
+        // The test directives of the body are kept with the tokens and copied with them
+        TestDirectives* const outerTestDirectives = state.testDirectives;
+        state.testDirectives = &expansion.testDirectives;
+        ++state.expansionDepth;
+        ++state.cachingDepth;
+        for (const auto& bodyLine : macro.body)
+        {
+            try
+            {
+                parseLine(substituteMacroParams(bodyLine.first, macro.params, args), bodyLine.second, state,
+                        &expansion.tokens);
+            }
+            catch (MacroDepthError&)
+            {
+                --state.expansionDepth;
+                --state.cachingDepth;
+                state.testDirectives = outerTestDirectives;
+                throw;
+            }
+            catch (std::exception& e)
+            {
+                --state.expansionDepth;
+                --state.cachingDepth;
+                state.testDirectives = outerTestDirectives;
+                throw std::runtime_error{"In expansion of macro \"" + macro.name + "\": "
+                    + bodyLine.second.toString() + ": " + e.what()};
+            }
+        }
+        --state.expansionDepth;
+        --state.cachingDepth;
+        state.testDirectives = outerTestDirectives;
+        if (state.repetitionBeingDefined)
+        {
+            state.repetitionBeingDefined.reset();
+            throw std::runtime_error{"In expansion of macro \"" + macro.name + "\": Unterminated %rep"};
+        }
+        if (state.switchBeingDefined)
+        {
+            state.switchBeingDefined.reset();
+            throw std::runtime_error{"In expansion of macro \"" + macro.name + "\": Unterminated %switch"};
+        }
+        // The tokens have the location of their body line (and of the macros expanded in it)
+        for (const auto& token : expansion.tokens)
+            expansion.origins.push_back(std::make_shared<const MacroOrigin>(MacroOrigin{macro.name, token->getLocation()}));
+        cached = macro.expansionCache.emplace(args, std::move(expansion)).first;
+    }
+    else
+    {
+        Logger::dbg << "Reusing the parsed body of macro \"" << macro.name << '"' << Logger::End;
+    }
+
+    // While filling the cache the local labels get renamed again when the outer body is copied
+    const std::string localPrefix = (state.cachingDepth ? MACRO_LOCAL_LABEL_PLACEHOLDER : "__")
+        + macro.name + '_' + std::to_string(state.expansionCounter++) + "__";
+    const MacroExpansion& expansion = cached->second;
+    for (size_t i{}; i < expansion.tokens.size(); ++i)
+    {
+        auto copy = expansion.tokens[i]->clone();
+        copy->setLocation({location.filePath, location.lineNumber, expansion.origins[i]});
+        renameLocalLabels(copy.get(), localPrefix);
+        macro.emittedBytes += copy->getSize();
+        output->push_back(std::move(copy));
+    }
+    copyTestDirectives(expansion.testDirectives, localPrefix, [&](const SourceLocation& bodyLocation){
+        return SourceLocation{location.filePath, location.lineNumber,
+            std::make_shared<const MacroOrigin>(MacroOrigin{macro.name, bodyLocation})};
+    }, state.testDirectives);
+    ++macro.expansionCount;
+}
+
+/*
+ * Parses a `%macro name param...` line and starts reading the body.
+ *
+ * Throws on error.
+ */
+static void beginMacroDefinition(size_t& charI, const std::string& line, ParserState& state)
+{
+    if (state.expansionDepth)
+        throw std::runtime_error{"Macros can't be defined inside macros"};
+
+    const std::string name = getWord(charI, line);
+    if (name.empty() || !isValidLabelName(name))
+        throw std::runtime_error{"Invalid macro name: \"" + name + '"'};
+    if (opcodeStrToEnum(name) != OPCODE_INVALID || registerStrToEnum(name) != REGISTER_INVALID
+     || strToLower(name).compare("db") == 0 || strToLower(name).compare("dw") == 0)
+        throw std::runtime_error{"Macro name is reserved: \"" + name + '"'};
+    if (state.macros.find(name) != state.macros.end())
+        throw std::runtime_error{"Macro redefined: \"" + name + '"'};
+
+    Macro macro;
+    macro.name = name;
+    while (true)
+    {
+        std::string param = getWord(charI, line);
+        if (param.empty() || isComment(param))
+            break;
+        if (!isValidLabelName(param))
+            throw std::runtime_error{"Invalid macro parameter name: \"" + param + '"'};
+        macro.params.push_back(std::move(param));
+    }
+
+    Logger::dbg << "Found a macro definition: \"" << name << "\" with "
+        << macro.params.size() << " parameters" << Logger::End;
+    state.macroBeingDefined = &state.macros.emplace(name, std::move(macro)).first->second;
+}
+
+/*
+ * Returns true if the name can be used in the operands: a label name that is not
+ * a register, an opcode or an operator of `ld`, which would be parsed as those.
+ */
+static bool isValidOperandName(const std::string& name)
+{
+    const std::string lower = strToLower(name);
+    return isValidLabelName(name) && registerStrToEnum(name) == REGISTER_INVALID
+        && opcodeStrToEnum(name) == OPCODE_INVALID
+        && lower.compare("f") != 0 && lower.compare("b") != 0 && lower.compare("k") != 0
+        && lower.compare("hf") != 0 && lower.compare("r") != 0;
+}
+
+//---------------------------------- Virtual registers -------------------------
+
+/*
+ * Parses a `%reg name...` line and declares the virtual registers.
+ * Declaring a name again is allowed, macros can be expanded more than once.
+ *
+ * Throws on error.
+ */
+static void declareVirtualRegisters(size_t& charI, const std::string& line, ParserState& state)
+{
+    size_t count{};
+    while (true)
+    {
+        const std::string name = getWord(charI, line);
+        if (name.empty() || isComment(name))
+            break;
+        if (!isValidOperandName(name))
+            throw std::runtime_error{"Invalid virtual register name: \"" + name + '"'};
+        state.virtualRegisters.insert(name);
+        ++count;
+    }
+    if (!count)
+        throw std::runtime_error{"%reg expects register names"};
+}
+
+/*
+ * Turns the label references of the opcode that name virtual registers into virtual register operands.
+ * The targets of jumps and calls and the address of `ld i` are always labels.
+ */
+static void markVirtualRegisters(Opcode* opcode, const ParserState& state)
+{
+    if (state.virtualRegisters.empty() || opcode->opcode == OPCODE_JP || opcode->opcode == OPCODE_CALL
+     || opcode->opcode == OPCODE_SYS)
+        return;
+    for (OpcodeOperand* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+    {
+        if (operand->getType() == OpcodeOperand::Type::LabelReference
+         && state.virtualRegisters.count(operand->getAsLabel().name))
+        {
+            if (opcode->operand0.getType() == OpcodeOperand::Type::Register
+             && opcode->operand0.getAsRegister() == REGISTER_I)
+                continue;
+            operand->setVirtualRegister(operand->getAsLabel().name);
+        }
+    }
+}
+
+//---------------------------------- Repetitions -------------------------------
+
+/*
+ * Parses a `%rep count [variable]` line and starts reading the body.
+ *
+ * Throws on error.
+ */
+static void beginRepetition(size_t& charI, const std::string& line, const SourceLocation& location,
+        ParserState& state)
+{
+    const std::string countStr = getWord(charI, line);
+    if (countStr.empty() || isComment(countStr))
+        throw std::runtime_error{"%rep expects a count"};
+    const Expression countExpr = Expression::parse(countStr);
+    if (!countExpr.isConstant())
+    {
+        throw std::runtime_error{"The count of %rep must be a constant, not \"" + countStr
+            + "\" (the variable of an outer %rep can't be used)"};
+    }
+    const int32_t count = countExpr.evaluateConstant();
+    if (count < 0 || count > REP_MAX_COUNT)
+        throw std::runtime_error{"The count of %rep must be 0-" + std::to_string(REP_MAX_COUNT)};
+
+    Repetition repetition;
+    repetition.count = count;
+    repetition.location = location;
+    const std::string variable = getWord(charI, line);
+    if (!variable.empty() && !isComment(variable))
+    {
+        if (!isValidOperandName(variable))
+            throw std::runtime_error{"Invalid %rep variable name: \"" + variable + '"'};
+        repetition.variable = variable;
+
+        const std::string rest = getWord(charI, line);
+        if (!rest.empty() && !isComment(rest))
+            throw std::runtime_error{"Too many arguments for %rep"};
+    }
+    state.repetitionBeingDefined = std::move(repetition);
+}
+
+/*
+ * Replaces the iteration variable in a copy of a `%rep` body with its value.
+ * The expressions that become constant are folded, like when they are parsed.
+ *
+ * Throws if a value doesn't fit.
+ */
+static void replaceRepetitionVariable(Token* token, const std::string& name, int32_t value)
+{
+    auto replaceInOperand{[&](OpcodeOperand& operand, unsigned int limit){
+        if (operand.getType() == OpcodeOperand::Type::LabelReference && operand.getAsLabel().name.compare(name) == 0)
+        {
+            operand.setInt(value, limit);
+        }
+        else if (operand.getType() == OpcodeOperand::Type::Expression
+              && operand.getAsExpression().replaceSymbol(name, value) && operand.getAsExpression().isConstant())
+        {
+            operand.setInt(operand.getAsExpression().evaluateConstant(), limit);
+        }
+    }};
+
+    auto replaceInData{[&](auto* def, unsigned int limit){
+        auto& deferred = def->deferredArguments;
+        for (size_t i{}; i < deferred.size();)
+        {
+            if (deferred[i].second.replaceSymbol(name, value) && deferred[i].second.isConstant())
+            {
+                def->arguments[deferred[i].first] = expressionValueToUint(deferred[i].second.evaluateConstant(), limit);
+                deferred.erase(deferred.begin()+i);
+                continue;
+            }
+            ++i;
+        }
+    }};
+
+    if (auto opcode = dynamic_cast<Opcode*>(token))
+    {
+        replaceInOperand(opcode->operand0, 0x0fff);
+        replaceInOperand(opcode->operand1, (opcode->isLongAddress ? 0xffff : 0x0fff));
+        replaceInOperand(opcode->operand2, 0x0fff);
+    }
+    else if (auto db = dynamic_cast<DbInst*>(token))
+    {
+        replaceInData(db, 0xff);
+    }
+    else if (auto dw = dynamic_cast<DwInst*>(token))
+    {
+        replaceInData(dw, 0xffff);
+    }
+}
+
+/*
+ * Emits the body of a finished `%rep` `count` times.
+ * The body is parsed only once, the copies are made from the tokens.
+ *
+ * Throws on error.
+ */
+static void expandRepetition(const Repetition& repetition, ParserState& state, tokenList_t* output)
+{
+    // `%rep 0` disables the body, it doesn't have to be valid
+    if (!repetition.count)
+        return;
+
+    // Like in a macro body, the local labels keep the placeholder until they are copied
+    tokenList_t body;
+    TestDirectives bodyTestDirectives;
+    TestDirectives* const outerTestDirectives = state.testDirectives;
+    state.testDirectives = &bodyTestDirectives;
+    ++state.cachingDepth;
+    for (const auto& bodyLine : repetition.body)
+    {
+        try
+        {
+            parseLine(substituteMacroParams(bodyLine.first, {}, {}), bodyLine.second, state, &body);
+        }
+        catch (MacroDepthError&)
+        {
+            --state.cachingDepth;
+            state.testDirectives = outerTestDirectives;
+            throw;
+        }
+        catch (std::exception& e)
+        {
+            --state.cachingDepth;
+            state.testDirectives = outerTestDirectives;
+            throw std::runtime_error{"In %rep: " + bodyLine.second.toString() + ": " + e.what()};
+        }
+    }
+    --state.cachingDepth;
+    state.testDirectives = outerTestDirectives;
+    if (state.switchBeingDefined)
+    {
+        state.switchBeingDefined.reset();
+        throw std::runtime_error{"In %rep: Unterminated %switch"};
+    }
+
+    output->reserve(output->size() + body.size()*repetition.count);
+    for (unsigned int iteration{}; iteration < repetition.count; ++iteration)
+    {
+        const std::string localPrefix = (state.cachingDepth ? MACRO_LOCAL_LABEL_PLACEHOLDER : "__")
+            + std::string{"rep_"} + std::to_string(state.expansionCounter++) + "__";
+        for (const auto& token : body)
+        {
+            auto copy = token->clone();
+            renameLocalLabels(copy.get(), localPrefix);
+            if (!repetition.variable.empty())
+            {
+                try
+                {
+                    replaceRepetitionVariable(copy.get(), repetition.variable, iteration);
+                }
+                catch (std::exception& e)
+                {
+                    throw std::runtime_error{"In %rep: " + copy->getLocationStr() + ": " + repetition.variable
+                        + " = " + std::to_string(iteration) + ": " + e.what()};
+                }
+            }
+            output->push_back(std::move(copy));
+        }
+
+        const size_t firstAssertion = (state.testDirectives ? state.testDirectives->assertions.size() : 0);
+        copyTestDirectives(bodyTestDirectives, localPrefix, [](const SourceLocation& bodyLocation){
+            return bodyLocation;
+        }, state.testDirectives);
+        if (state.testDirectives && !repetition.variable.empty())
+        {
+            for (size_t i{firstAssertion}; i < state.testDirectives->assertions.size(); ++i)
+            {
+                TestAssertion& assertion = state.testDirectives->assertions[i];
+                if (assertion.value.replaceSymbol(repetition.variable, iteration))
+                    assertion.conditionStr += " with " + repetition.variable + " = " + std::to_string(iteration);
+            }
+        }
+    }
+    Logger::dbg << "Repeated " << body.size() << " tokens " << repetition.count << " times" << Logger::End;
+}
+
+//----------------------------------- Switches ---------------------------------
+
+/*
+ * Parses a `%switch vx [table|tree]` line and starts reading the cases.
+ *
+ * Throws on error.
+ */
+static void beginSwitch(size_t& charI, const std::string& line, const SourceLocation& location, ParserState& state)
+{
+    const std::string regStr = getWord(charI, line);
+    const RegisterEnum reg = registerStrToEnum(regStr);
+    // VF is used by the comparisons
+    if (!isVRegister(reg) || reg == REGISTER_VF)
+        throw std::runtime_error{"%switch expects a register from V0 to VE, got \"" + regStr + '"'};
+
+    SwitchStatement statement;
+    statement.reg = reg;
+    statement.location = location;
+    const std::string strategy = getWord(charI, line);
+    if (strToLower(strategy).compare("table") == 0)
+        statement.strategy = SwitchStrategy::JumpTable;
+    else if (strToLower(strategy).compare("tree") == 0)
+        statement.strategy = SwitchStrategy::SearchTree;
+    else if (!strategy.empty() && !isComment(strategy))
+        throw std::runtime_error{"Invalid %switch strategy: \"" + strategy + "\", expected \"table\" or \"tree\""};
+    state.switchBeingDefined = std::move(statement);
+}
+
+/*
+ * Parses a line between `%switch` and `%endswitch`, emits the dispatch code at `%endswitch`.
+ *
+ * Throws on error.
+ */
+static void parseSwitchLine(const std::string& word, size_t& charI, const std::string& line,
+        const SourceLocation& location, ParserState& state, tokenList_t* output)
+{
+    SwitchStatement& statement = *state.switchBeingDefined;
+    if (word.compare("%case") == 0)
+    {
+        const std::string valueStr = getWord(charI, line);
+        const std::string labelName = getWord(charI, line);
+        if (valueStr.empty() || isComment(valueStr) || labelName.empty() || isComment(labelName))
+            throw std::runtime_error{"%case expects a value and a label"};
+        const Expression valueExpr = Expression::parse(valueStr);
+        if (!valueExpr.isConstant())
+        {
+            throw std::runtime_error{"The value of %case must be a constant, not \"" + valueStr
+                + "\" (the variable of a %rep can't be used)"};
+        }
+        if (!isValidLabelName(labelName))
+            throw std::runtime_error{"Invalid label name: \"" + labelName + '"'};
+
+        SwitchCase switchCase;
+        switchCase.value = expressionValueToUint(valueExpr.evaluateConstant(), 0xff);
+        switchCase.labelName = labelName;
+        switchCase.location = location;
+        for (const SwitchCase& other : statement.cases)
+        {
+            if (other.value == switchCase.value)
+            {
+                throw std::runtime_error{"Duplicate %case value " + std::to_string(switchCase.value)
+                    + ", first used at " + other.location.toString()};
+            }
+        }
+        statement.cases.push_back(std::move(switchCase));
+    }
+    else if (word.compare("%default") == 0)
+    {
+        const std::string labelName = getWord(charI, line);
+        if (labelName.empty() || isComment(labelName) || !isValidLabelName(labelName))
+            throw std::runtime_error{"%default expects a label"};
+        if (!statement.defaultLabelName.empty())
+            throw std::runtime_error{"%default used twice in a %switch"};
+        statement.defaultLabelName = labelName;
+    }
+    else if (word.compare("%endswitch") == 0)
+    {
+        SwitchStatement finished = std::move(statement);
+        state.switchBeingDefined.reset();
+        if (finished.cases.empty())
+            throw std::runtime_error{"%switch without %case"};
+        std::sort(finished.cases.begin(), finished.cases.end(),
+                [](const SwitchCase& a, const SwitchCase& b){ return a.value < b.value; });
+        finished.endLocation = location;
+
+        // Like the local labels of macros, renamed again when the outer body is copied
+        const std::string labelPrefix = (state.cachingDepth ? MACRO_LOCAL_LABEL_PLACEHOLDER : "__")
+            + std::string{"switch_"} + std::to_string(state.expansionCounter++) + "__";
+        generateSwitch(finished, labelPrefix, output);
+    }
+    else if (!word.empty() && !isComment(word))
+    {
+        throw std::runtime_error{"Only %case and %default can be used inside %switch"};
+    }
+}
+
+//------------------------------------------------------------------------------
+
+static std::string trim(const std::string& str)
+{
+    const size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return "";
+    return str.substr(start, str.find_last_not_of(" \t")-start+1);
+}
+
+/*
+ * Parses the arguments of an `%assert_at label, register op value` directive.
+ *
+ * Throws on error.
+ */
+static TestAssertion parseAssertAt(size_t charI, const std::string& line, const SourceLocation& location)
+{
+    using Op = TestAssertion::Op;
+    static const std::pair<const char*, Op> ops[] = {
+        // The longer ones first, so `<=` is not found as `<`
+        {"==", Op::Equal}, {"!=", Op::NotEqual}, {"<=", Op::LessEqual}, {">=", Op::GreaterEqual},
+        {"<", Op::Less}, {">", Op::Greater},
+    };
+
+    std::string args = line.substr(charI);
+    args = trim(args.substr(0, args.find(';')));
+    const size_t comma = args.find(',');
+    if (comma == std::string::npos)
+        throw std::runtime_error{"Expected %assert_at label, register op value"};
+
+    TestAssertion assertion;
+    assertion.location = location;
+    assertion.labelName = trim(args.substr(0, comma));
+    if (!isValidLabelName(assertion.labelName))
+        throw std::runtime_error{"%assert_at: Invalid label name: \"" + assertion.labelName + '"'};
+
+    assertion.conditionStr = trim(args.substr(comma+1));
+    size_t opPos = std::string::npos;
+    size_t opSize{};
+    for (const auto& op : ops)
+    {
+        opPos = assertion.conditionStr.find(op.first);
+        if (opPos != std::string::npos)
+        {
+            assertion.op = op.second;
+            opSize = strlen(op.first);
+            break;
+        }
+    }
+    if (opPos == std::string::npos)
+        throw std::runtime_error{"%assert_at: Expected a comparison (==, !=, <, <=, >, >=): " + assertion.conditionStr};
+
+    const std::string regStr = trim(assertion.conditionStr.substr(0, opPos));
+    assertion.reg = registerStrToEnum(regStr);
+    if (assertion.reg == REGISTER_INVALID || assertion.reg == REGISTER_I_ADDR)
+        throw std::runtime_error{"%assert_at: Expected V0-VF, I, DT or ST, got: \"" + regStr + '"'};
+
+    const std::string valueStr = trim(assertion.conditionStr.substr(opPos+opSize));
+    if (valueStr.empty())
+        throw std::runtime_error{"%assert_at: Missing value: " + assertion.conditionStr};
+    assertion.value = Expression::parse(valueStr);
+    return assertion;
+}
+
+/*
+ * Parses the arguments of an `%expect_screen "file" after N frames` directive.
+ *
+ * Throws on error.
+ */
+static ScreenExpectation parseExpectScreen(size_t charI, const std::string& line, const SourceLocation& location)
+{
+    ScreenExpectation expectation;
+    expectation.location = location;
+    expectation.imagePath = unquotePath(getWord(charI, line));
+
+    const std::string after = getWord(charI, line);
+    const std::string frameStr = getWord(charI, line);
+    const std::string frames = strToLower(getWord(charI, line));
+    const std::string rest = getWord(charI, line);
+    if (strToLower(after).compare("after") != 0 || frameStr.empty()
+     || (frames.compare("frames") != 0 && frames.compare("frame") != 0) || !(rest.empty() || isComment(rest)))
+        throw std::runtime_error{"Expected %expect_screen \"file\" after N frames"};
+    expectation.frame = stringToUint(frameStr, UINT32_MAX);
+    return expectation;
+}
+
+/*
+ * Parses a line and adds the resulting tokens to the output.
+ *
+ * Throws on error.
+ */
+static void parseLine(const std::string& line, const SourceLocation& location, ParserState& state, tokenList_t* output)
+{
+    if (line.empty())
+        return;
+
+    size_t charI{};
+    std::string word = getWord(charI, line);
+
+    if (state.macroBeingDefined)
+    {
+        if (word.compare("%endmacro") == 0)
+            state.macroBeingDefined = nullptr;
+        else if (word.compare("%macro") == 0)
+            throw std::runtime_error{"Macros can't be defined inside macros"};
+        else
+            state.macroBeingDefined->body.emplace_back(line, location);
+        return;
+    }
+
+    if (state.repetitionBeingDefined)
+    {
+        Repetition& repetition = *state.repetitionBeingDefined;
+        if (word.compare("%macro") == 0)
+            throw std::runtime_error{"Macros can't be defined inside %rep"};
+        if (word.compare("%rep") == 0)
+        {
+            ++repetition.nestingDepth;
+        }
+        else if (word.compare("%endrep") == 0)
+        {
+            if (!repetition.nestingDepth)
+            {
+                const Repetition finished = std::move(repetition);
+                state.repetitionBeingDefined.reset();
+                // The copies keep the locations of the body lines
+                expandRepetition(finished, state, output);
+                return;
+            }
+            --repetition.nestingDepth;
+        }
+        repetition.body.emplace_back(line, location);
+        return;
+    }
+
+    if (state.switchBeingDefined)
+    {
+        // The generated tokens already have the location of their case
+        parseSwitchLine(word, charI, line, location, state, output);
+        return;
+    }
+
+    if (word.empty() || isComment(word))
+        return;
+    Logger::dbg << "Word: " << '"' << word << '"' << Logger::End;
+
+    const size_t firstNewToken = output->size();
+
+    if (state.pendingTripCount && !isLabelDeclaration(word))
+        throw std::runtime_error{"%trips must be followed by the label of a loop"};
+
+    if (isLabelDeclaration(word))
+    {
+        auto label = std::make_shared<Label>();
+        label->name = word.substr(0, word.length()-1);
+        label->tripCount = state.pendingTripCount;
+        state.pendingTripCount = 0;
+        output->push_back(std::move(label));
+    }
+    else if (word.compare("%trips") == 0) // Loop annotation for the cycle analysis
+    {
+        const std::string count = getWord(charI, line);
+        if (count.empty() || isComment(count))
+            throw std::runtime_error{"%trips expects a count"};
+        state.pendingTripCount = stringToUint(count, UINT16_MAX);
+        if (!state.pendingTripCount)
+            throw std::runtime_error{"%trips count must be positive"};
+        return;
+    }
+    else if (word.compare("%assert_at") == 0)
+    {
+        TestAssertion assertion = parseAssertAt(charI, line, location);
+        if (state.testDirectives)
+            state.testDirectives->assertions.push_back(std::move(assertion));
+        return;
+    }
+    else if (word.compare("%expect_screen") == 0)
+    {
+        ScreenExpectation expectation = parseExpectScreen(charI, line, location);
+        if (state.testDirectives)
+            state.testDirectives->screenExpectations.push_back(std::move(expectation));
+        return;
+    }
+    else if (word.compare("%incbin") == 0)
+    {
+        auto inst = parseIncbin(charI, line);
+        Logger::log << location.toString() << ": Embedding " << inst->length
+            << " bytes from \"" << inst->file->getFilePath() << '"' << Logger::End;
+        output->push_back(std::move(inst));
+    }
+    else if (word.compare("%sprite") == 0)
+    {
+        parseSprite(charI, line, output);
+    }
+    else if (word.compare("%table") == 0)
+    {
+        parseTable(charI, line, output);
+    }
+    else if (word.compare("%macro") == 0)
+    {
+        beginMacroDefinition(charI, line, state);
+    }
+    else if (word.compare("%endmacro") == 0)
+    {
+        throw std::runtime_error{"%endmacro without %macro"};
+    }
+    else if (word.compare("%rep") == 0)
+    {
+        beginRepetition(charI, line, location, state);
+    }
+    else if (word.compare("%endrep") == 0)
+    {
+        throw std::runtime_error{"%endrep without %rep"};
+    }
+    else if (word.compare("%reg") == 0)
+    {
+        declareVirtualRegisters(charI, line, state);
+    }
+    else if (word.compare("%switch") == 0)
+    {
+        beginSwitch(charI, line, location, state);
+    }
+    else if (word.compare("%case") == 0 || word.compare("%default") == 0 || word.compare("%endswitch") == 0)
+    {
+        throw std::runtime_error{word + " without %switch"};
+    }
+    else if (auto macro = state.macros.find(word); macro != state.macros.end())
+    {
+        expandMacro(macro->second, charI, line, location, state, output);
+        // The expanded tokens already have the right location
+        return;
+    }
+    else if (OpcodeEnum opcode = opcodeStrToEnum(word); opcode != OPCODE_INVALID)
+    {
+        Logger::dbg << "Found an opcode: " << word << " = " << opcode << Logger::End;
+        std::shared_ptr<Opcode> token;
+        if (state.cache)
+        {
+            // The operands are all that's left of the line
+            const std::string key = std::to_string(opcode) + ' ' + line.substr(charI);
+            if (auto cached = state.cache->find(key))
+            {
+                token = std::make_shared<Opcode>(*cached);
+            }
+            else
+            {
+                token = parseOpcode(opcode, charI, line);
+                state.cache->insert(key, std::make_shared<const Opcode>(*token));
+            }
+        }
+        else
+        {
+            token = parseOpcode(opcode, charI, line);
+        }
+        markVirtualRegisters(token.get(), state);
+        output->push_back(std::move(token));
+    }
+    else if (strToLower(word).compare("db") == 0) // Define byte
+    {
+        Logger::dbg << "Found a byte definition" << Logger::End;
+        output->push_back(parseDb(charI, line));
+    }
+    else if (strToLower(word).compare("dw") == 0) // Define word
+    {
+        Logger::dbg << "Found a word definition" << Logger::End;
+        output->push_back(parseDw(charI, line));
+    }
+    else
+    {
+        throw std::runtime_error{"Syntax error: "+line};
+    }
+
+    for (size_t i{firstNewToken}; i < output->size(); ++i)
+        (*output)[i]->setLocation(location);
+}
+
+std::shared_ptr<const Opcode> ParseCache::find(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto found = m_opcodes.find(key);
+    if (found == m_opcodes.end())
+    {
+        ++m_missCount;
+        return nullptr;
+    }
+    ++m_hitCount;
+    return found->second;
+}
+
+void ParseCache::insert(const std::string& key, std::shared_ptr<const Opcode> opcode)
+{
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_opcodes.emplace(key, std::move(opcode));
+}
+
+void parseTokens(
+        const PreprocessedFile& file,
+        tokenList_t* tokenList, labelMap_t* labelMap,
+        TestDirectives* testDirectives, ParseCache* cache)
+{
+    ParserState state;
+    state.testDirectives = testDirectives;
+    state.cache = cache;
+    size_t byteOffset{};
+
+    std::stringstream ss;
+    ss << file.content;
+    size_t lineI{};
+    std::string line;
+    while (std::getline(ss, line))
+    {
+        ++lineI;
+        const SourceLocation& location = file.lineOrigins[lineI-1];
+        try
+        {
+            const size_t firstNewToken = tokenList->size();
+            parseLine(line, location, state, tokenList);
+
+            // Lay out the new tokens
+            for (size_t i{firstNewToken}; i < tokenList->size(); ++i)
+            {
+                if (auto label = dynamic_cast<const Label*>((*tokenList)[i].get()))
+                {
+                    Logger::dbg << "Found a label declaration: \"" << label->name
+                        << "\", offset: 0x" << std::hex << byteOffset << std::dec << Logger::End;
+
+                    auto foundLabel = labelMap->find(label->name);
+                    if (foundLabel != labelMap->end())
+                    {
+                        throw std::runtime_error{"Label redeclared: \"" + label->name
+                            + "\", original offset: 0x" + intToHexStr(foundLabel->second) +
+                            ", new offset: 0x" + intToHexStr(byteOffset)};
+                    }
+                    if (byteOffset > UINT16_MAX)
+                    {
+                        throw std::runtime_error{"The label \"" + label->name
+                            + "\" is beyond the 64 KiB address space"};
+                    }
+                    labelMap->insert({label->name, (uint16_t)byteOffset});
+                }
+                byteOffset += (*tokenList)[i]->getSize();
+            }
+        }
+        catch (std::exception& e)
+        {
+            // Rethrow the exception with more info
+            throw std::runtime_error{location.toString() + ": " + e.what()};
+        }
+    }
+
+    if (state.macroBeingDefined)
+        throw std::runtime_error{"Unterminated macro definition: \"" + state.macroBeingDefined->name + '"'};
+    if (state.repetitionBeingDefined)
+        throw std::runtime_error{state.repetitionBeingDefined->location.toString() + ": Unterminated %rep"};
+    if (state.switchBeingDefined)
+        throw std::runtime_error{state.switchBeingDefined->location.toString() + ": Unterminated %switch"};
+    if (state.pendingTripCount)
+        throw std::runtime_error{"%trips at the end of the file"};
+
+    // Show which macros take up the most space
+    std::vector<const Macro*> macros;
+    for (const auto& macro : state.macros)
+        macros.push_back(&macro.second);
+    std::sort(macros.begin(), macros.end(),
+            [](const Macro* a, const Macro* b){ return a->emittedBytes > b->emittedBytes; });
+    for (const Macro* macro : macros)
+    {
+        Logger::log << "Macro \"" << macro->name << "\": " << macro->expansionCount << " expansions ("
+            << macro->expansionCache.size() << " parsed), " << macro->emittedBytes << " bytes" << Logger::End;
+    }
+}
+
+void layoutLabels(const tokenList_t& tokenList, labelMap_t* labelMap)
+{
+    labelMap->clear();
+    size_t byteOffset{};
+    for (const auto& token : tokenList)
+    {
+        if (auto label = dynamic_cast<const Label*>(token.get()))
+        {
+            if (byteOffset > UINT16_MAX)
+                throw std::runtime_error{"The label \"" + label->name + "\" is beyond the 64 KiB address space"};
+            labelMap->insert({label->name, (uint16_t)byteOffset});
+        }
+        byteOffset += token->getSize();
+    }
+}
+
+} // namespace Parser
@@ -1,18 +1,63 @@
 #pragma once
 
+#include <atomic>
 #include <cctype>
 #include <map>
 #include <stdint.h>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "Logger.h"
+#include "IncludeCache.h"
+#include "MappedFile.h"
+#include "expression.h"
 
 #define PREPRO_PREFIX_CHAR '%'
 
 namespace Parser
 {
 
+//------------------------------ Source location -------------------------------
+
+struct MacroOrigin;
+
+/*
+ * Tells which file and line something came from.
+ * The path is shared, so it can be stored for every line without copying it.
+ */
+struct SourceLocation
+{
+    std::shared_ptr<const std::string> filePath;
+    int lineNumber{};
+    // The line of the macro body, if the line is the call of a macro, null otherwise
+    std::shared_ptr<const MacroOrigin> macroOrigin;
+
+    // Returns "file:line", followed by ", in macro "name" at file:line" for each expanded macro
+    inline std::string toString() const;
+};
+
+struct MacroOrigin
+{
+    std::string macroName;
+    SourceLocation bodyLocation;
+};
+
+inline std::string SourceLocation::toString() const
+{
+    std::string output = (filePath ? *filePath : "?") + ':' + (lineNumber > 0 ? std::to_string(lineNumber) : "?");
+    for (const MacroOrigin* origin = macroOrigin.get(); origin; origin = origin->bodyLocation.macroOrigin.get())
+    {
+        const SourceLocation& body = origin->bodyLocation;
+        output += ", in macro \"" + origin->macroName + "\" at " + (body.filePath ? *body.filePath : "?") + ':'
+            + (body.lineNumber > 0 ? std::to_string(body.lineNumber) : "?");
+    }
+    return output;
+}
+
+//------------------------------------------------------------------------------
+
 /*
  * Base class for all the things that can appear in the assembly code.
  */
@@ -20,12 +65,32 @@ class Token
 {
 private:
     int m_lineNumber{};
+    std::shared_ptr<const std::string> m_filePath;
+    std::shared_ptr<const MacroOrigin> m_macroOrigin;
 
 public:
     virtual inline void setLineNumber(int value) { m_lineNumber = value; }
     virtual inline int getLineNumber() const { return m_lineNumber; }
     virtual inline std::string getLineNumberStr() const { return m_lineNumber > 0 ? std::to_string(m_lineNumber) : "?"; }
 
+    virtual inline void setFilePath(const std::shared_ptr<const std::string>& value) { m_filePath = value; }
+    virtual inline const std::shared_ptr<const std::string>& getFilePath() const { return m_filePath; }
+
+    inline void setLocation(const SourceLocation& loc)
+    {
+        setLineNumber(loc.lineNumber);
+        setFilePath(loc.filePath);
+        m_macroOrigin = loc.macroOrigin;
+    }
+    inline SourceLocation getLocation() const { return {m_filePath, m_lineNumber, m_macroOrigin}; }
+    // Returns "file:line", with the macro body lines if the token comes from a macro
+    inline std::string getLocationStr() const { return getLocation().toString(); }
+
+    // Returns the number of bytes the token occupies in the output
+    virtual size_t getSize() const = 0;
+    // Returns a deep copy of the token
+    virtual std::shared_ptr<Token> clone() const = 0;
+
     virtual inline ~Token(){}
 };
 
@@ -37,6 +102,9 @@ class LabelReference final : public Token
 {
 public:
     std::string name;
+
+    size_t getSize() const override { return 0; }
+    std::shared_ptr<Token> clone() const override { return std::make_shared<LabelReference>(*this); }
 };
 [[nodiscard]] inline bool isValidLabelName(const std::string& str)
 {
@@ -56,6 +124,20 @@ public:
 {
     return str[str.length()-1] == ':' && isValidLabelName(str.substr(0, str.size()-1));
 }
+
+/*
+ * Marks the position of a label in the token list.
+ */
+class Label final : public Token
+{
+public:
+    std::string name;
+    // How many times the loop starting at the label runs, set by `%trips`, 0 if not known
+    unsigned int tripCount{};
+
+    size_t getSize() const override { return 0; }
+    std::shared_ptr<Token> clone() const override { return std::make_shared<Label>(*this); }
+};
 //                          V - name     V - offset
 using labelMap_t = std::map<std::string, uint16_t>;
 
@@ -116,6 +198,18 @@ enum OpcodeEnum
     OPCODE_DRW,
     OPCODE_SKP,
     OPCODE_SKNP,
+    // SUPER-CHIP
+    OPCODE_SCD,
+    OPCODE_SCR,
+    OPCODE_SCL,
+    OPCODE_EXIT,
+    OPCODE_LOW,
+    OPCODE_HIGH,
+    // XO-CHIP
+    OPCODE_SAVE,
+    OPCODE_LOAD,
+    OPCODE_PLANE,
+    OPCODE_AUDIO,
     OPCODE_INVALID,
 };
 
@@ -141,6 +235,16 @@ constexpr const char* const opcodeNames[] = {
     "drw",
     "skp",
     "sknp",
+    "scd",
+    "scr",
+    "scl",
+    "exit",
+    "low",
+    "high",
+    "save",
+    "load",
+    "plane",
+    "audio",
 };
 
 [[nodiscard]] OpcodeEnum opcodeStrToEnum(std::string opcode);
@@ -228,16 +332,23 @@ public:
         Uint,           // Byte (8 bits), nibble (4 bits) or address (12 bits)
         Register,       // Register
         LabelReference, // A label is used
+        Expression,     // An expression that can only be calculated when the labels are known
         F,              // Used by LD
         B,              // Used by LD
         K,              // Used by LD
+        HF,             // Used by LD (SUPER-CHIP)
+        R,              // Used by LD (SUPER-CHIP)
+        VirtualRegister,// A register declared by `%reg`, replaced by a V register by `allocateRegisters()`
     };
 
 private:
     Type m_type = Type::Empty;
     uint16_t m_uint = 0;
-    RegisterEnum m_vRegister;
+    // The value was negative, `m_uint` has it in two's complement
+    bool m_isNegative = false;
+    RegisterEnum m_vRegister = REGISTER_INVALID;
     LabelReference m_label;
+    Expression m_expression;
 
 public:
     inline OpcodeOperand() {}
@@ -251,10 +362,15 @@ public:
         case Type::Uint: return "Integer";
         case Type::Register: return "Register";
         case Type::LabelReference: return "Label";
+        case Type::Expression: return "Expression";
         case Type::F: return "Sprite Operator (F)";
         case Type::B: return "BCD Operator (B)";
         case Type::K: return "Key Operator (K)";
+        case Type::HF: return "Big Sprite Operator (HF)";
+        case Type::R: return "Flag Registers Operator (R)";
+        case Type::VirtualRegister: return "Virtual Register";
         }
+        return "?";
     }
 
     inline uint16_t getAsUint() const
@@ -264,6 +380,9 @@ public:
         return m_uint;
     }
 
+    // True if the integer was a negative value, e.g. -1 is stored as 0xfff
+    inline bool isNegative() const { return m_isNegative; }
+
     inline RegisterEnum getAsRegister() const
     {
         if (m_type != Type::Register)
@@ -271,6 +390,13 @@ public:
         return m_vRegister;
     }
 
+    inline const std::string& getAsVirtualRegister() const
+    {
+        if (m_type != Type::VirtualRegister)
+            throw std::runtime_error{"Unexpected type of operand. Expected Virtual Register, got "+getTypeStr()};
+        return m_label.name;
+    }
+
     inline LabelReference getAsLabel() const
     {
         if (m_type != Type::LabelReference)
@@ -278,12 +404,37 @@ public:
         return m_label;
     }
 
-    inline void setUint(uint16_t value) { m_uint = value; m_type = Type::Uint; }
+    inline const Expression& getAsExpression() const
+    {
+        if (m_type != Type::Expression)
+            throw std::runtime_error{"Unexpected type of operand. Expected Expression, got "+getTypeStr()};
+        return m_expression;
+    }
+
+    inline Expression& getAsExpression()
+    {
+        if (m_type != Type::Expression)
+            throw std::runtime_error{"Unexpected type of operand. Expected Expression, got "+getTypeStr()};
+        return m_expression;
+    }
+
+    inline void setUint(uint16_t value) { m_uint = value; m_isNegative = false; m_type = Type::Uint; }
+    // Stores the value of an expression in a field of `limit`, throws if it doesn't fit
+    inline void setInt(int32_t value, unsigned int limit)
+    {
+        m_uint = expressionValueToUint(value, limit);
+        m_isNegative = value < 0;
+        m_type = Type::Uint;
+    }
+    inline void setExpression(const Expression& expr) { m_expression = expr; m_type = Type::Expression; }
     inline void setRegister(RegisterEnum reg) { m_vRegister = reg; m_type = Type::Register; }
     inline void setF() { m_type = Type::F; }
     inline void setB() { m_type = Type::B; }
     inline void setK() { m_type = Type::K; }
+    inline void setHF() { m_type = Type::HF; }
+    inline void setR() { m_type = Type::R; }
     inline void setAsLabel(const std::string& labelName) { m_label.name = labelName; m_type = Type::LabelReference; }
+    inline void setVirtualRegister(const std::string& name) { m_label.name = name; m_type = Type::VirtualRegister; }
 
     virtual inline ~OpcodeOperand(){}
 };
@@ -295,8 +446,13 @@ public:
     OpcodeOperand operand0;
     OpcodeOperand operand1;
     OpcodeOperand operand2;
+    // `ld i, long addr`: the 16-bit address is stored in a second word (XO-CHIP)
+    bool isLongAddress{};
 
     inline Opcode() {}
+
+    size_t getSize() const override { return isLongAddress ? 4 : 2; }
+    std::shared_ptr<Token> clone() const override { return std::make_shared<Opcode>(*this); }
 };
 
 //------------------------------------------------------------------------------
@@ -306,6 +462,11 @@ class DataStoreInst : public Token
 {
 public:
     std::vector<T> arguments;
+    // Arguments that can only be calculated when the labels are known: index in `arguments`, expression
+    std::vector<std::pair<size_t, Expression>> deferredArguments;
+
+    size_t getSize() const override { return arguments.size()*sizeof(T); }
+    std::shared_ptr<Token> clone() const override { return std::make_shared<DataStoreInst<T>>(*this); }
 };
 
 // Define Byte
@@ -313,27 +474,221 @@ using DbInst = DataStoreInst<uint8_t>;
 // Define Word
 using DwInst = DataStoreInst<uint16_t>;
 
+/*
+ * Binary data embedded from a file by `%incbin`.
+ * The bytes are copied from the mapped file to the output as-is.
+ */
+class IncbinInst final : public Token
+{
+public:
+    std::shared_ptr<const MappedFile> file;
+    size_t offset{};
+    size_t length{};
+
+    size_t getSize() const override { return length; }
+    std::shared_ptr<Token> clone() const override { return std::make_shared<IncbinInst>(*this); }
+};
+
 //------------------------------------------------------------------------------
 
 [[nodiscard]] inline bool isComment(const std::string& str) { return str[0] == ';'; }
 
+/*
+ * Converts an integer literal (decimal, 0x hexadecimal, 0 octal or 0b binary)
+ * or a character literal to an integer.
+ *
+ * Throws on error or if the value is larger than `limit`.
+ */
+unsigned int stringToUint(const std::string& str, unsigned int limit);
+
+/*
+ * Returns the next word of the line from `charI` and moves `charI` past it.
+ * Words are separated by whitespace and commas, except inside quotes and parentheses.
+ * Returns an empty string at the end of the line.
+ */
+std::string getWord(size_t& charI, const std::string& line);
+
 //------------------------------------------------------------------------------
 
 /*
- * Handles the preprocessor macros.
+ * The output of the preprocessor.
+ */
+struct PreprocessedFile
+{
+    // The preprocessed source code
+    std::string content;
+    // The origin of each line of `content`
+    std::vector<SourceLocation> lineOrigins;
+    // The files pulled in by `%include` and referenced by `%incbin` and `%sprite`, in the order they were found
+    std::vector<std::string> dependencies;
+};
+
+// `%define` name -> value
+using defineMap_t = std::map<std::string, std::string>;
+
+/*
+ * The input file with the included files, before the `%define`s are replaced.
+ * Doesn't depend on the defines given on the command line, so the builds with different
+ * defines can share it. The lines are also expanded with the defines of the source,
+ * so the builds only expand again the lines that their defines change.
+ */
+struct SourceFiles
+{
+    // The path of the input file
+    std::string filePath;
+    // The source code without the preprocessor directives, `%define`s not replaced
+    PreprocessedFile file;
+    // The `%define`s of the source
+    defineMap_t defines;
+    // The lines of `file.content`
+    std::vector<std::string> lines;
+    // The lines with the defines of the source replaced
+    std::vector<std::string> expandedLines;
+    // `%define` name -> the indices of the lines it was replaced in
+    std::map<std::string, std::vector<size_t>> defineUses;
+    // The lines that use an empty define, an error unless a define given on the command line replaces it
+    std::vector<size_t> unexpandedLines;
+};
+
+/*
+ * Reads the input file and the `%include`d files and collects the `%define`s.
+ * `%include`d files are looked up relative to the including file, then in `includeDirs`.
+ * A file is included every time it is `%include`d, unless it has a `%once` directive, then
+ * the further `%include`s of it are ignored. A file that includes itself is an error.
+ * The paths of the files referenced by other directives (`%incbin`, `%sprite`) are resolved
+ * the same way and replaced with the canonical path, the directives are left for the parser.
  *
  * Throws on error.
  */
-std::string preprocessFile(const std::string &str, const::std::string& filename);
+SourceFiles readSourceFiles(
+        const std::string &str, const::std::string& filename,
+        const std::vector<std::string>& includeDirs, IncludeCache* includeCache);
 
 /*
- * Transforms the string into a vector of tokens.
+ * Replaces the `%define`d names with their values. The values in `overrides`
+ * (given on the command line) replace the ones in the source, and define new names.
+ * Only the lines that use an overridden define, or contain the name of a new one, are expanded,
+ * the others are taken from `sources.expandedLines`.
+ *
+ * Throws on error.
+ */
+PreprocessedFile expandDefines(const SourceFiles& sources, const defineMap_t& overrides);
+
+/*
+ * Handles the preprocessor directives and macros, see `readSourceFiles` and `expandDefines`.
+ *
+ * Throws on error.
+ */
+PreprocessedFile preprocessFile(
+        const std::string &str, const::std::string& filename,
+        const std::vector<std::string>& includeDirs, IncludeCache* includeCache,
+        const defineMap_t& overrides={});
+
+//------------------------------ Test directives -------------------------------
+
+/*
+ * `%assert_at label, register op value`: checked every time the execution reaches the label.
+ */
+struct TestAssertion
+{
+    enum class Op
+    {
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+    };
+
+    SourceLocation location;
+    std::string labelName;
+    // V0-VF, I, DT or ST
+    RegisterEnum reg = REGISTER_INVALID;
+    Op op = Op::Equal;
+    // Can reference labels
+    Expression value;
+    // The condition as written, for the messages
+    std::string conditionStr;
+};
+
+/*
+ * `%expect_screen "file" after N frames`: the screen must match the image after N frames.
+ */
+struct ScreenExpectation
+{
+    SourceLocation location;
+    // A PBM or PGM image of the size of the screen
+    std::string imagePath;
+    uint64_t frame{};
+};
+
+/*
+ * The expectations of a test program, used by the test runner.
+ */
+struct TestDirectives
+{
+    std::vector<TestAssertion> assertions;
+    std::vector<ScreenExpectation> screenExpectations;
+};
+
+/*
+ * The parsed instructions of the source lines, shared by the parses of the builds
+ * of a program with different defines, so the lines that the defines don't change
+ * are only parsed once. Thread-safe.
+ */
+class ParseCache final
+{
+private:
+    std::mutex m_mutex;
+    // The text of the instruction -> the parsed instruction
+    std::unordered_map<std::string, std::shared_ptr<const Opcode>> m_opcodes;
+    std::atomic<size_t> m_hitCount{};
+    std::atomic<size_t> m_missCount{};
+
+public:
+    ParseCache() {}
+
+    // Returns the parsed instruction or null if it is not cached
+    std::shared_ptr<const Opcode> find(const std::string& key);
+    void insert(const std::string& key, std::shared_ptr<const Opcode> opcode);
+
+    size_t getHitCount() const { return m_hitCount; }
+    size_t getMissCount() const { return m_missCount; }
+};
+
+/*
+ * Transforms the preprocessed file into a vector of tokens.
+ * Expands the `%macro`s, their parsed bodies are cached by argument list,
+ * so repeated expansions are only copied, not parsed again.
+ * Expands the `%rep count [variable]` ... `%endrep` blocks the same way: the body is parsed once
+ * and copied `count` times, with the variable (0 to count-1) replaced in the operands and data
+ * of each copy. `%%name` labels are local to each copy.
+ * Replaces the `%switch vx` ... `%endswitch` blocks of `%case value, label` lines with
+ * the dispatch code, see `generateSwitch`.
+ * `%table name, count, expression` generates a labelled table of `count` bytes,
+ * the expression is evaluated with the index as `i`.
+ * `%reg name...` declares virtual registers, the operands with their names become
+ * `OpcodeOperand::Type::VirtualRegister`, see `allocateRegisters`.
+ * The test directives are stored in `testDirectives`, or checked and ignored if it is null.
+ * The ones in a macro or `%rep` body are added for every copy, with its local labels
+ * (and the value of the `%rep` variable).
+ * The instructions are looked up in and added to `cache` if it is not null.
  *
  * Throws on error.
  */
 void parseTokens(
-        const std::string& str, const::std::string& filename,
-        tokenList_t* tokenList, labelMap_t* labelMap);
+        const PreprocessedFile& file,
+        tokenList_t* tokenList, labelMap_t* labelMap,
+        TestDirectives* testDirectives=nullptr, ParseCache* cache=nullptr);
+
+/*
+ * Recalculates the offsets of the labels from the size of the tokens.
+ * Used after a pass changed the token list.
+ *
+ * Throws if a label is beyond the address space.
+ */
+void layoutLabels(const tokenList_t& tokenList, labelMap_t* labelMap);
 
 } // namespace Parser
 
@@ -0,0 +1,725 @@
+#include "register_allocator.h"
+#include "cfg.h"
+#include "instruction_info.h"
+#include "optimizer.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using Type = Parser::OpcodeOperand::Type;
+
+// The V registers the virtual registers can get, VF is left to the flags
+#define ALLOC_REGISTER_COUNT 15
+// The bits of a register set: V0-VF, I, then the virtual registers
+#define REGSET_I 16
+#define REGSET_FIRST_VIRTUAL 17
+// The label of the bytes the spilled registers are kept in
+#define SPILL_LABEL "__spill_slots"
+
+static constexpr size_t npos = SIZE_MAX;
+
+static inline Parser::Opcode* asOpcode(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<Parser::Opcode*>(token.get());
+}
+
+/*
+ * A set of V registers, I and virtual registers.
+ */
+class RegisterSet
+{
+private:
+    std::vector<uint64_t> m_words;
+    size_t m_size{};
+
+public:
+    explicit RegisterSet(size_t size=0)
+        : m_words((size+63)/64), m_size{size}
+    {
+    }
+
+    void set(size_t i) { m_words[i/64] |= uint64_t{1} << (i%64); }
+    void reset(size_t i) { m_words[i/64] &= ~(uint64_t{1} << (i%64)); }
+    bool test(size_t i) const { return m_words[i/64] & (uint64_t{1} << (i%64)); }
+
+    void setAll()
+    {
+        for (size_t i{}; i < m_size; ++i)
+            set(i);
+    }
+
+    RegisterSet& operator|=(const RegisterSet& other)
+    {
+        for (size_t i{}; i < m_words.size(); ++i)
+            m_words[i] |= other.m_words[i];
+        return *this;
+    }
+
+    void subtract(const RegisterSet& other)
+    {
+        for (size_t i{}; i < m_words.size(); ++i)
+            m_words[i] &= ~other.m_words[i];
+    }
+
+    bool operator==(const RegisterSet& other) const { return m_words == other.m_words; }
+    bool operator!=(const RegisterSet& other) const { return !(*this == other); }
+
+    template <typename Callback>
+    void forEach(Callback&& callback) const
+    {
+        for (size_t wordI{}; wordI < m_words.size(); ++wordI)
+        {
+            for (uint64_t word = m_words[wordI]; word; word &= word-1)
+                callback(wordI*64 + __builtin_ctzll(word));
+        }
+    }
+};
+
+/*
+ * What an instruction does with the registers.
+ */
+struct RegisterEffects
+{
+    RegisterSet reads;
+    // Every register the instruction may write
+    RegisterSet writes;
+    // The registers it writes on every interpreter
+    RegisterSet kills;
+    // `ld a, b`: the destination and the source don't interfere
+    size_t moveDest = npos;
+    size_t moveSource = npos;
+};
+
+class RegisterAllocator
+{
+private:
+    Parser::tokenList_t& m_tokens;
+    // The names of the virtual registers, their index is their bit in the sets minus `REGSET_FIRST_VIRTUAL`
+    std::vector<std::string> m_names;
+    std::map<std::string, size_t> m_indices;
+    size_t m_setSize{};
+
+    // The virtual registers that can't get a V register
+    std::vector<std::set<size_t>> m_interference;
+    // The V registers each virtual register can't get
+    std::vector<uint16_t> m_forbidden;
+    // The registers each virtual register is moved to or from
+    std::vector<std::set<size_t>> m_moves;
+    // The number of instructions that use each virtual register
+    std::vector<size_t> m_useCounts;
+
+    size_t m_spillCount{};
+
+    void collectVirtualRegisters();
+    RegisterEffects getEffects(const Parser::Opcode& opcode, bool hasKnownCallee) const;
+    std::vector<RegisterSet> computeLiveness(const ControlFlowGraph& cfg) const;
+    void buildInterference(const ControlFlowGraph& cfg, const std::vector<RegisterSet>& liveAfter);
+    std::vector<int> colorGraph() const;
+    void spill(size_t virtualI, const std::vector<RegisterSet>& liveAfter, const ControlFlowGraph& cfg);
+    void reportPressure(const ControlFlowGraph& cfg, const std::vector<RegisterSet>& liveAfter) const;
+    bool replaceRegisters(const std::vector<int>& colors, bool canResize);
+
+public:
+    explicit RegisterAllocator(Parser::tokenList_t& tokens)
+        : m_tokens{tokens}
+    {
+    }
+
+    /*
+     * Returns false if the code has no virtual registers, so nothing changed.
+     */
+    bool run();
+
+    size_t getSpillCount() const { return m_spillCount; }
+};
+
+/*
+ * Finds the virtual registers and checks where they are used.
+ */
+void RegisterAllocator::collectVirtualRegisters()
+{
+    for (const auto& token : m_tokens)
+    {
+        const Parser::Opcode* opcode = asOpcode(token);
+        if (!opcode)
+            continue;
+        for (const auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+        {
+            if (operand->getType() != Type::VirtualRegister)
+                continue;
+
+            // Those work on a range of registers starting at V0
+            const bool isRangeOperation = opcode->opcode == Parser::OPCODE_SAVE || opcode->opcode == Parser::OPCODE_LOAD
+                || operandToRegMask(opcode->operand0) == REGMASK_I || opcode->operand0.getType() == Type::R
+                || opcode->operand1.getType() == Type::R
+                || (opcode->operand0.getType() == Type::Register && opcode->operand0.getAsRegister() == Parser::REGISTER_I_ADDR)
+                || (opcode->operand1.getType() == Type::Register && opcode->operand1.getAsRegister() == Parser::REGISTER_I_ADDR);
+            if (isRangeOperation && operandToRegMask(opcode->operand0) != REGMASK_I)
+            {
+                throw std::runtime_error{token->getLocationStr() + ": The virtual register \""
+                    + operand->getAsVirtualRegister() + "\" can't be used here, the instruction works on"
+                    " a range of V registers starting at V0"};
+            }
+            if (m_indices.emplace(operand->getAsVirtualRegister(), m_names.size()).second)
+                m_names.push_back(operand->getAsVirtualRegister());
+        }
+    }
+
+    for (const auto& token : m_tokens)
+    {
+        auto label = dynamic_cast<const Parser::Label*>(token.get());
+        if (label && m_indices.count(label->name))
+        {
+            throw std::runtime_error{token->getLocationStr() + ": The label \"" + label->name
+                + "\" has the name of a virtual register"};
+        }
+    }
+    m_setSize = REGSET_FIRST_VIRTUAL + m_names.size();
+}
+
+RegisterEffects RegisterAllocator::getEffects(const Parser::Opcode& opcode, bool hasKnownCallee) const
+{
+    RegisterEffects output{RegisterSet{m_setSize}, RegisterSet{m_setSize}, RegisterSet{m_setSize}};
+    // The callee is part of the liveness, the call itself does nothing
+    if (hasKnownCallee)
+        return output;
+
+    // Put an unused V register in place of each virtual register to get the effects
+    Parser::Opcode copy = opcode;
+    uint16_t usedRegs = 1 | REGMASK_VF;
+    for (const auto* operand : {&opcode.operand0, &opcode.operand1, &opcode.operand2})
+        usedRegs |= operandToRegMask(*operand) & REGMASK_ALL_V;
+    // V register index -> virtual register index
+    size_t placeholders[16];
+    std::fill(std::begin(placeholders), std::end(placeholders), npos);
+    for (auto* operand : {&copy.operand0, &copy.operand1, &copy.operand2})
+    {
+        if (operand->getType() != Type::VirtualRegister)
+            continue;
+        const size_t virtualI = m_indices.at(operand->getAsVirtualRegister());
+        unsigned reg{};
+        while (reg < 16 && placeholders[reg] != virtualI && (usedRegs & REGMASK_V(reg)))
+            ++reg;
+        placeholders[reg] = virtualI;
+        usedRegs |= REGMASK_V(reg);
+        operand->setRegister(Parser::RegisterEnum(Parser::REGISTER_V0 + reg));
+    }
+
+    auto toSet{[&](uint32_t mask, RegisterSet* set){
+        for (unsigned reg{}; reg <= REGSET_I; ++reg)
+        {
+            if (!(mask & (1u << reg)))
+                continue;
+            set->set(reg < 16 && placeholders[reg] != npos ? REGSET_FIRST_VIRTUAL+placeholders[reg] : reg);
+        }
+    }};
+    const InstructionEffects effects = getInstructionEffects(copy);
+    toSet(effects.reads, &output.reads);
+    toSet(effects.writes, &output.writes);
+    toSet(getCertainWrites(effects), &output.kills);
+
+    // LD Vx, Vy
+    if (copy.opcode == Parser::OPCODE_LD && (operandToRegMask(copy.operand0) & REGMASK_ALL_V)
+     && (operandToRegMask(copy.operand1) & REGMASK_ALL_V) && operandToRegMask(copy.operand1) != REGMASK_I)
+    {
+        auto getBit{[&](const Parser::OpcodeOperand& operand) -> size_t {
+            const unsigned reg = Parser::vRegisterToNibble(operand.getAsRegister());
+            return placeholders[reg] != npos ? REGSET_FIRST_VIRTUAL+placeholders[reg] : reg;
+        }};
+        output.moveDest = getBit(copy.operand0);
+        output.moveSource = getBit(copy.operand1);
+    }
+    return output;
+}
+
+/*
+ * Returns the blocks of the subroutine starting at the block, without the called subroutines.
+ */
+static std::vector<size_t> getRoutineBlocks(const ControlFlowGraph& cfg, size_t entry)
+{
+    std::vector<bool> isVisited(cfg.getBlocks().size());
+    std::vector<size_t> output;
+    std::vector<size_t> worklist{entry};
+    while (!worklist.empty())
+    {
+        const size_t blockI = worklist.back();
+        worklist.pop_back();
+        if (isVisited[blockI])
+            continue;
+        isVisited[blockI] = true;
+        output.push_back(blockI);
+        for (const auto& edge : cfg.getBlocks()[blockI].successors)
+            worklist.push_back(edge.block);
+    }
+    return output;
+}
+
+/*
+ * Returns the registers live after each token.
+ * A call continues in the subroutine, and a `ret` at the return sites of the calls to its subroutine.
+ */
+std::vector<RegisterSet> RegisterAllocator::computeLiveness(const ControlFlowGraph& cfg) const
+{
+    const std::vector<BasicBlock>& blocks = cfg.getBlocks();
+
+    // The return sites of the `ret`s
+    std::vector<std::vector<size_t>> returnSites(blocks.size());
+    std::vector<bool> isCalledReturn(blocks.size());
+    std::map<size_t, std::vector<size_t>> calleeReturnSites;
+    for (const BasicBlock& block : blocks)
+    {
+        for (size_t callee : block.callees)
+            for (const auto& edge : block.successors)
+                calleeReturnSites[callee].push_back(edge.block);
+    }
+    for (const auto& [callee, sites] : calleeReturnSites)
+    {
+        for (size_t blockI : getRoutineBlocks(cfg, callee))
+        {
+            if (asOpcode(m_tokens[blocks[blockI].endToken-1])->opcode != Parser::OPCODE_RET)
+                continue;
+            returnSites[blockI].insert(returnSites[blockI].end(), sites.begin(), sites.end());
+            isCalledReturn[blockI] = true;
+        }
+    }
+
+    std::vector<RegisterSet> blockLiveIn(blocks.size(), RegisterSet{m_setSize});
+    auto getLiveOut{[&](size_t blockI){
+        const BasicBlock& block = blocks[blockI];
+        const Parser::Opcode& last = *asOpcode(m_tokens[block.endToken-1]);
+        RegisterSet live{m_setSize};
+        if (block.hasUnknownSuccessors || (last.opcode == Parser::OPCODE_RET && !isCalledReturn[blockI]))
+        {
+            live.setAll();
+            return live;
+        }
+        if (last.opcode == Parser::OPCODE_RET)
+        {
+            for (size_t site : returnSites[blockI])
+                live |= blockLiveIn[site];
+        }
+        else if (!block.callees.empty())
+        {
+            for (size_t callee : block.callees)
+                live |= blockLiveIn[callee];
+        }
+        else
+        {
+            for (const auto& edge : block.successors)
+                live |= blockLiveIn[edge.block];
+        }
+        return live;
+    }};
+
+    auto walkBlock{[&](size_t blockI, std::vector<RegisterSet>* liveAfter){
+        const BasicBlock& block = blocks[blockI];
+        RegisterSet live = getLiveOut(blockI);
+        for (size_t i{block.endToken}; i-- > block.firstToken;)
+        {
+            if (liveAfter)
+                (*liveAfter)[i] = live;
+            if (const Parser::Opcode* opcode = asOpcode(m_tokens[i]))
+            {
+                const RegisterEffects effects = getEffects(*opcode, !block.callees.empty() && i == block.endToken-1);
+                live.subtract(effects.kills);
+                live |= effects.reads;
+            }
+        }
+        return live;
+    }};
+
+    // Iterate backwards until nothing changes
+    bool hasChanged = true;
+    while (hasChanged)
+    {
+        hasChanged = false;
+        for (size_t blockI{blocks.size()}; blockI-- > 0;)
+        {
+            RegisterSet live = walkBlock(blockI, nullptr);
+            if (live != blockLiveIn[blockI])
+            {
+                blockLiveIn[blockI] = std::move(live);
+                hasChanged = true;
+            }
+        }
+    }
+
+    std::vector<RegisterSet> liveAfter(m_tokens.size(), RegisterSet{m_setSize});
+    for (size_t blockI{}; blockI < blocks.size(); ++blockI)
+        walkBlock(blockI, &liveAfter);
+    return liveAfter;
+}
+
+void RegisterAllocator::buildInterference(const ControlFlowGraph& cfg, const std::vector<RegisterSet>& liveAfter)
+{
+    m_interference.assign(m_names.size(), {});
+    m_forbidden.assign(m_names.size(), 0);
+    m_moves.assign(m_names.size(), {});
+    m_useCounts.assign(m_names.size(), 0);
+
+    auto addInterference{[this](size_t a, size_t b){
+        if (a == REGSET_I || b == REGSET_I || (a < REGSET_I && b < REGSET_I))
+            return;
+        if (a > b)
+            std::swap(a, b);
+        if (a < REGSET_I)
+        {
+            m_forbidden[b-REGSET_FIRST_VIRTUAL] |= REGMASK_V(a);
+        }
+        else
+        {
+            m_interference[a-REGSET_FIRST_VIRTUAL].insert(b-REGSET_FIRST_VIRTUAL);
+            m_interference[b-REGSET_FIRST_VIRTUAL].insert(a-REGSET_FIRST_VIRTUAL);
+        }
+    }};
+
+    for (const BasicBlock& block : cfg.getBlocks())
+    {
+        for (size_t i{block.firstToken}; i < block.endToken; ++i)
+        {
+            const Parser::Opcode* opcode = asOpcode(m_tokens[i]);
+            if (!opcode)
+                continue;
+            const RegisterEffects effects = getEffects(*opcode, !block.callees.empty() && i == block.endToken-1);
+            // A write interferes with everything that is live after it, except the source of a move
+            effects.writes.forEach([&](size_t written){
+                liveAfter[i].forEach([&](size_t live){
+                    if (live != written && !(written == effects.moveDest && live == effects.moveSource))
+                        addInterference(written, live);
+                });
+            });
+
+            if (effects.moveDest != npos && effects.moveDest != effects.moveSource)
+            {
+                if (effects.moveDest >= REGSET_FIRST_VIRTUAL)
+                    m_moves[effects.moveDest-REGSET_FIRST_VIRTUAL].insert(effects.moveSource);
+                if (effects.moveSource >= REGSET_FIRST_VIRTUAL)
+                    m_moves[effects.moveSource-REGSET_FIRST_VIRTUAL].insert(effects.moveDest);
+            }
+            RegisterSet used = effects.reads;
+            used |= effects.writes;
+            for (size_t virtualI{}; virtualI < m_names.size(); ++virtualI)
+            {
+                if (used.test(REGSET_FIRST_VIRTUAL+virtualI))
+                    ++m_useCounts[virtualI];
+            }
+        }
+    }
+}
+
+/*
+ * Returns the V register of each virtual register, -1 if it didn't get one.
+ * The registers with the fewest neighbours are put on the stack first (Chaitin-Briggs),
+ * the ones that were moved to or from a register get that register if it's free.
+ */
+std::vector<int> RegisterAllocator::colorGraph() const
+{
+    const size_t count = m_names.size();
+    std::vector<size_t> degrees(count);
+    for (size_t i{}; i < count; ++i)
+        degrees[i] = m_interference[i].size() + __builtin_popcount(m_forbidden[i] & 0x7fff);
+
+    std::vector<size_t> stack;
+    std::vector<bool> isRemoved(count);
+    for (size_t step{}; step < count; ++step)
+    {
+        // The first one that surely gets a register, or the most constrained one (optimistically)
+        size_t chosen = npos;
+        for (size_t i{}; i < count; ++i)
+        {
+            if (isRemoved[i])
+                continue;
+            if (degrees[i] < ALLOC_REGISTER_COUNT)
+            {
+                chosen = i;
+                break;
+            }
+            if (chosen == npos || degrees[i] > degrees[chosen])
+                chosen = i;
+        }
+        isRemoved[chosen] = true;
+        stack.push_back(chosen);
+        for (size_t neighbour : m_interference[chosen])
+            --degrees[neighbour];
+    }
+
+    std::vector<int> colors(count, -1);
+    while (!stack.empty())
+    {
+        const size_t virtualI = stack.back();
+        stack.pop_back();
+
+        uint16_t available = ~m_forbidden[virtualI] & 0x7fff;
+        for (size_t neighbour : m_interference[virtualI])
+        {
+            if (colors[neighbour] >= 0)
+                available &= ~REGMASK_V(colors[neighbour]);
+        }
+        if (!available)
+            continue;
+
+        int color = -1;
+        for (size_t partner : m_moves[virtualI])
+        {
+            const int partnerColor = (partner < REGSET_I ? (int)partner : colors[partner-REGSET_FIRST_VIRTUAL]);
+            if (partnerColor >= 0 && (available & REGMASK_V(partnerColor)))
+            {
+                color = partnerColor;
+                break;
+            }
+        }
+        // V0 is the last choice, it's needed by `jp v0` and the spills
+        for (int reg{1}; color < 0 && reg < 16; ++reg)
+        {
+            if (available & REGMASK_V(reg % 15))
+                color = reg % 15;
+        }
+        colors[virtualI] = color;
+    }
+    return colors;
+}
+
+/*
+ * Keeps the virtual register in memory and uses V0 for it around each instruction.
+ *
+ * Throws if V0 or I hold a value there or if the instruction is skipped.
+ */
+void RegisterAllocator::spill(size_t virtualI, const std::vector<RegisterSet>& liveAfter, const ControlFlowGraph& cfg)
+{
+    const std::string& name = m_names[virtualI];
+    const Parser::Expression slotAddress = Parser::Expression::parse(SPILL_LABEL "+" + std::to_string(m_spillCount));
+    const size_t bit = REGSET_FIRST_VIRTUAL+virtualI;
+
+    auto makeLoadI{[&](const Parser::Token& location){
+        auto opcode = std::make_shared<Parser::Opcode>();
+        opcode->opcode = Parser::OPCODE_LD;
+        opcode->operand0.setRegister(Parser::REGISTER_I);
+        opcode->operand1.setExpression(slotAddress);
+        opcode->setLocation(location.getLocation());
+        return opcode;
+    }};
+    auto makeTransfer{[&](const Parser::Token& location, bool isStore){
+        auto opcode = std::make_shared<Parser::Opcode>();
+        opcode->opcode = Parser::OPCODE_LD;
+        opcode->operand0.setRegister(isStore ? Parser::REGISTER_I_ADDR : Parser::REGISTER_V0);
+        opcode->operand1.setRegister(isStore ? Parser::REGISTER_V0 : Parser::REGISTER_I_ADDR);
+        opcode->setLocation(location.getLocation());
+        return opcode;
+    }};
+
+    Parser::tokenList_t output;
+    output.reserve(m_tokens.size());
+    size_t accessCount{};
+    for (size_t i{}; i < m_tokens.size(); ++i)
+    {
+        Parser::Opcode* opcode = asOpcode(m_tokens[i]);
+        const size_t blockI = cfg.getBlockOfToken(i);
+        if (!opcode || blockI == ControlFlowGraph::npos)
+        {
+            output.push_back(std::move(m_tokens[i]));
+            continue;
+        }
+        const BasicBlock& block = cfg.getBlocks()[blockI];
+        const RegisterEffects effects = getEffects(*opcode, !block.callees.empty() && i == block.endToken-1);
+        const bool isRead = effects.reads.test(bit);
+        const bool isWritten = effects.writes.test(bit);
+        if (!isRead && !isWritten)
+        {
+            output.push_back(std::move(m_tokens[i]));
+            continue;
+        }
+
+        const std::string error = opcode->getLocationStr() + ": Can't spill the virtual register \"" + name + "\"";
+        if (followsSkip(m_tokens, i))
+            throw std::runtime_error{error + ", the instruction is skipped conditionally"};
+        if (effects.reads.test(0) || effects.writes.test(0))
+            throw std::runtime_error{error + ", the instruction uses V0"};
+        RegisterSet liveBefore = liveAfter[i];
+        liveBefore.subtract(effects.kills);
+        liveBefore |= effects.reads;
+        if (isRead && (liveBefore.test(0) || liveBefore.test(REGSET_I)))
+            throw std::runtime_error{error + ", V0 or I is in use before the instruction"};
+        if (isWritten && (liveAfter[i].test(0) || liveAfter[i].test(REGSET_I)))
+            throw std::runtime_error{error + ", V0 or I is in use after the instruction"};
+
+        for (auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+        {
+            if (operand->getType() == Type::VirtualRegister && operand->getAsVirtualRegister().compare(name) == 0)
+                operand->setRegister(Parser::REGISTER_V0);
+        }
+        if (isRead)
+        {
+            output.push_back(makeLoadI(*opcode));
+            output.push_back(makeTransfer(*opcode, false));
+        }
+        output.push_back(std::move(m_tokens[i]));
+        if (isWritten)
+        {
+            output.push_back(makeLoadI(*opcode));
+            output.push_back(makeTransfer(*opcode, true));
+        }
+        ++accessCount;
+    }
+
+    m_tokens = std::move(output);
+
+    Logger::warn << "Out of registers, spilled the virtual register \"" << name << "\" to memory ("
+        << accessCount << " instructions use it)" << Logger::End;
+    ++m_spillCount;
+}
+
+void RegisterAllocator::reportPressure(const ControlFlowGraph& cfg, const std::vector<RegisterSet>& liveAfter) const
+{
+    const std::vector<BasicBlock>& blocks = cfg.getBlocks();
+    auto countLive{[](const RegisterSet& live){
+        size_t count{};
+        live.forEach([&count](size_t reg){
+            if (reg != REGSET_I && reg != 15)
+                ++count;
+        });
+        return count;
+    }};
+
+    std::vector<size_t> blockPressure(blocks.size());
+    for (size_t blockI{}; blockI < blocks.size(); ++blockI)
+    {
+        for (size_t i{blocks[blockI].firstToken}; i < blocks[blockI].endToken; ++i)
+            blockPressure[blockI] = std::max(blockPressure[blockI], countLive(liveAfter[i]));
+    }
+
+    std::set<size_t> entries;
+    if (!m_tokens.empty() && cfg.getBlockOfToken(0) != ControlFlowGraph::npos)
+        entries.insert(cfg.getBlockOfToken(0));
+    for (const BasicBlock& block : blocks)
+        entries.insert(block.callees.begin(), block.callees.end());
+
+    for (size_t entry : entries)
+    {
+        std::string name = "(start)";
+        if (auto label = dynamic_cast<const Parser::Label*>(m_tokens[blocks[entry].firstToken].get()))
+            name = label->name;
+        size_t pressure{};
+        for (size_t blockI : getRoutineBlocks(cfg, entry))
+            pressure = std::max(pressure, blockPressure[blockI]);
+        Logger::log << m_tokens[blocks[entry].firstToken]->getLocationStr() << ": Register pressure of \"" << name
+            << "\": " << pressure << " of " << ALLOC_REGISTER_COUNT << " registers" << Logger::End;
+    }
+}
+
+/*
+ * Puts the V registers in place of the virtual ones and removes the moves to the same register.
+ * Returns true if the size of the code changed.
+ */
+bool RegisterAllocator::replaceRegisters(const std::vector<int>& colors, bool canResize)
+{
+    for (size_t i{}; i < m_names.size(); ++i)
+    {
+        Logger::log << "Virtual register \"" << m_names[i] << "\": "
+            << Parser::registerNames[Parser::REGISTER_V0+colors[i]] << Logger::End;
+    }
+
+    size_t removedCount{};
+    for (size_t i{}; i < m_tokens.size(); ++i)
+    {
+        Parser::Opcode* opcode = asOpcode(m_tokens[i]);
+        if (!opcode)
+            continue;
+        bool hasVirtual = false;
+        for (auto* operand : {&opcode->operand0, &opcode->operand1, &opcode->operand2})
+        {
+            if (operand->getType() != Type::VirtualRegister)
+                continue;
+            operand->setRegister(Parser::RegisterEnum(Parser::REGISTER_V0
+                        + colors[m_indices.at(operand->getAsVirtualRegister())]));
+            hasVirtual = true;
+        }
+
+        if (hasVirtual && canResize && opcode->opcode == Parser::OPCODE_LD
+         && opcode->operand0.getType() == Type::Register && opcode->operand1.getType() == Type::Register
+         && opcode->operand0.getAsRegister() == opcode->operand1.getAsRegister() && !followsSkip(m_tokens, i))
+        {
+            Logger::log << opcode->getLocationStr() << ": Removed move to the same register" << Logger::End;
+            m_tokens[i] = nullptr;
+            ++removedCount;
+        }
+    }
+    if (removedCount)
+        m_tokens.erase(std::remove(m_tokens.begin(), m_tokens.end(), nullptr), m_tokens.end());
+    return removedCount;
+}
+
+bool RegisterAllocator::run()
+{
+    collectVirtualRegisters();
+    if (m_names.empty())
+        return false;
+
+    const bool canResize = !usesAbsoluteRomAddresses(m_tokens);
+    while (true)
+    {
+        const ControlFlowGraph cfg{m_tokens};
+        const std::vector<RegisterSet> liveAfter = computeLiveness(cfg);
+        buildInterference(cfg, liveAfter);
+        const std::vector<int> colors = colorGraph();
+
+        // Spill the register that is used the least of the ones without a V register
+        size_t spilled = npos;
+        for (size_t i{}; i < colors.size(); ++i)
+        {
+            if (colors[i] < 0 && (spilled == npos || m_useCounts[i] < m_useCounts[spilled]))
+                spilled = i;
+        }
+        if (spilled == npos)
+        {
+            reportPressure(cfg, liveAfter);
+            replaceRegisters(colors, canResize);
+            break;
+        }
+
+        if (!canResize)
+        {
+            throw std::runtime_error{"Out of registers for the virtual register \"" + m_names[spilled]
+                + "\", it can't be spilled because the code uses absolute ROM addresses"};
+        }
+        spill(spilled, liveAfter, cfg);
+        // Start again without it
+        m_names.erase(m_names.begin()+spilled);
+        m_indices.clear();
+        for (size_t i{}; i < m_names.size(); ++i)
+            m_indices.emplace(m_names[i], i);
+        m_setSize = REGSET_FIRST_VIRTUAL + m_names.size();
+        if (m_names.empty())
+            break;
+    }
+
+    if (m_spillCount)
+    {
+        // One byte for each, padded to keep the code after it aligned.
+        // The listing shows them with the last line.
+        const Parser::SourceLocation location = m_tokens.back()->getLocation();
+        auto label = std::make_shared<Parser::Label>();
+        label->name = SPILL_LABEL;
+        label->setLocation(location);
+        m_tokens.push_back(std::move(label));
+        auto slots = std::make_shared<Parser::DbInst>();
+        slots->arguments.resize((m_spillCount+1) & ~size_t{1});
+        slots->setLocation(location);
+        m_tokens.push_back(std::move(slots));
+        if (m_spillCount % 2)
+        {
+            Logger::warn << location.toString() << ": Added 1 padding byte after the " << m_spillCount
+                << " spill slots of \"" << SPILL_LABEL << "\" to keep the addresses after them aligned" << Logger::End;
+        }
+    }
+    return true;
+}
+
+size_t allocateRegisters(Parser::tokenList_t* tokens, Parser::labelMap_t* labels)
+{
+    RegisterAllocator allocator{*tokens};
+    if (allocator.run())
+        Parser::layoutLabels(*tokens, labels);
+    return allocator.getSpillCount();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stddef.h>
+
+/*
+ * Replaces the virtual registers declared by `%reg` with V registers.
+ *
+ * The liveness of the registers is calculated over the whole program, through the calls
+ * (the values live after a call are live in the subroutine), so two virtual registers
+ * share a V register if they are never live at the same time, e.g. the temporaries
+ * of subroutines that don't call each other. A virtual register doesn't get a V register
+ * that is used by the code written with V registers while the virtual one is live.
+ * VF is never used, it's overwritten by too many instructions.
+ * `ld a, b` gets the same register for `a` and `b` if possible and is removed then.
+ *
+ * If the registers run out, the virtual register with the fewest uses is spilled:
+ * it's kept in a byte after the code and loaded to V0 with `ld i, slot ; ld v0, [i]`
+ * before every instruction that reads it and stored after every one that writes it.
+ *
+ * Logs the register of every virtual register and the register pressure (the most
+ * registers live at the same time) of the main program and every subroutine.
+ * Lays out the labels again if the code changed.
+ *
+ * Throws if the virtual registers are used where they can't be replaced
+ * (e.g. `ld [i], vx`) or if a spill would overwrite V0 or I while they are used.
+ *
+ * Returns the number of spilled virtual registers.
+ */
+size_t allocateRegisters(Parser::tokenList_t* tokens, Parser::labelMap_t* labels);
@@ -0,0 +1,330 @@
+#include "rom_patch.h"
+#include "Logger.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <unordered_map>
+
+// The offset and the size of an IPS record
+#define IPS_RECORD_HEADER_SIZE 5
+// An RLE record: header, run length and value
+#define IPS_RLE_RECORD_SIZE 8
+#define IPS_MAX_RECORD_SIZE 0xffff
+// "EOF" as an offset would be read as the end marker, so the ROM must end before it
+#define IPS_MAX_ROM_SIZE 0x454f46
+
+// The shortest copies worth an action with an offset
+#define BPS_MIN_COPY_LENGTH 4
+// The bytes hashed to find the copies
+#define BPS_HASH_LENGTH 4
+// The most earlier positions checked for a copy, limits the time on repetitive ROMs
+#define BPS_MAX_CANDIDATES 256
+
+PatchFormat patchFormatFromPath(const std::string& filePath)
+{
+    const std::string extension = strToLower(std::filesystem::path{filePath}.extension().string());
+    if (extension.compare(".ips") == 0)
+        return PatchFormat::Ips;
+    if (extension.compare(".bps") == 0)
+        return PatchFormat::Bps;
+    throw std::runtime_error{"Unknown patch format, expected a .ips or .bps file: \"" + filePath + '"'};
+}
+
+//------------------------------------ IPS -------------------------------------
+
+static void appendBigEndian(std::vector<uint8_t>* output, uint32_t value, int byteCount)
+{
+    for (int i{byteCount-1}; i >= 0; --i)
+        output->push_back((value >> (i*8)) & 0xff);
+}
+
+static void appendIpsRecord(std::vector<uint8_t>* output, const std::vector<uint8_t>& rom, size_t offset, size_t size)
+{
+    appendBigEndian(output, offset, 3);
+    appendBigEndian(output, size, 2);
+    output->insert(output->end(), rom.begin()+offset, rom.begin()+offset+size);
+}
+
+static void appendIpsRleRecord(std::vector<uint8_t>* output, size_t offset, size_t size, uint8_t value)
+{
+    appendBigEndian(output, offset, 3);
+    appendBigEndian(output, 0, 2);
+    appendBigEndian(output, size, 2);
+    output->push_back(value);
+}
+
+/*
+ * Writes the records of a range of changed bytes, using RLE for the runs
+ * that are shorter that way.
+ */
+static void appendIpsRange(std::vector<uint8_t>* output, const std::vector<uint8_t>& rom, size_t begin, size_t end)
+{
+    size_t literalBegin = begin;
+    size_t i = begin;
+    while (i < end)
+    {
+        size_t runEnd = i+1;
+        while (runEnd < end && rom[runEnd] == rom[i] && runEnd-i < IPS_MAX_RECORD_SIZE)
+            ++runEnd;
+        // A run in the middle also costs the header of the record after it
+        const size_t runCost = IPS_RLE_RECORD_SIZE + (runEnd < end ? IPS_RECORD_HEADER_SIZE : 0);
+        if (runEnd-i > runCost || (i == literalBegin && runEnd-i > IPS_RLE_RECORD_SIZE))
+        {
+            if (i > literalBegin)
+                appendIpsRecord(output, rom, literalBegin, i-literalBegin);
+            appendIpsRleRecord(output, i, runEnd-i, rom[i]);
+            literalBegin = runEnd;
+        }
+        else if (runEnd-literalBegin > IPS_MAX_RECORD_SIZE)
+        {
+            appendIpsRecord(output, rom, literalBegin, i-literalBegin);
+            literalBegin = i;
+        }
+        i = runEnd;
+    }
+    if (end > literalBegin)
+        appendIpsRecord(output, rom, literalBegin, end-literalBegin);
+}
+
+std::vector<uint8_t> createIpsPatch(const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom)
+{
+    if (newRom.size() > IPS_MAX_ROM_SIZE)
+        throw std::runtime_error{"The ROM is too large for an IPS patch"};
+
+    std::vector<uint8_t> output{'P', 'A', 'T', 'C', 'H'};
+    auto isChanged{[&](size_t i){ return i >= oldRom.size() || oldRom[i] != newRom[i]; }};
+    size_t i{};
+    while (i < newRom.size())
+    {
+        if (!isChanged(i))
+        {
+            ++i;
+            continue;
+        }
+
+        // Extend the range over the gaps that are shorter than a new record
+        const size_t begin = i;
+        size_t end = i+1;
+        while (true)
+        {
+            while (end < newRom.size() && isChanged(end))
+                ++end;
+            size_t nextChange = end;
+            while (nextChange < newRom.size() && !isChanged(nextChange) && nextChange-end <= IPS_RECORD_HEADER_SIZE)
+                ++nextChange;
+            if (nextChange >= newRom.size() || !isChanged(nextChange) || nextChange-end >= IPS_RECORD_HEADER_SIZE)
+                break;
+            end = nextChange;
+        }
+        appendIpsRange(&output, newRom, begin, end);
+        i = end;
+    }
+
+    output.insert(output.end(), {'E', 'O', 'F'});
+    if (newRom.size() < oldRom.size())
+        appendBigEndian(&output, newRom.size(), 3);
+    return output;
+}
+
+//------------------------------------ BPS -------------------------------------
+
+enum class BpsAction
+{
+    SourceRead = 0, // Bytes of the old ROM at the same offset
+    TargetRead = 1, // Bytes stored in the patch
+    SourceCopy = 2, // Bytes of the old ROM from anywhere
+    TargetCopy = 3, // Bytes already written to the new ROM
+};
+
+static void appendBpsNumber(std::vector<uint8_t>* output, uint64_t value)
+{
+    while (true)
+    {
+        const uint8_t bits = value & 0x7f;
+        value >>= 7;
+        if (!value)
+        {
+            output->push_back(0x80 | bits);
+            break;
+        }
+        output->push_back(bits);
+        --value;
+    }
+}
+
+static void appendBpsAction(std::vector<uint8_t>* output, BpsAction action, size_t length)
+{
+    appendBpsNumber(output, ((uint64_t)(length-1) << 2) | (uint64_t)action);
+}
+
+static void appendBpsOffset(std::vector<uint8_t>* output, int64_t offset)
+{
+    appendBpsNumber(output, ((uint64_t)std::abs(offset) << 1) | (offset < 0));
+}
+
+static uint32_t calculateCrc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    for (size_t i{}; i < size; ++i)
+    {
+        crc ^= data[i];
+        for (int bit{}; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void appendLittleEndian32(std::vector<uint8_t>* output, uint32_t value)
+{
+    for (int i{}; i < 4; ++i)
+        output->push_back((value >> (i*8)) & 0xff);
+}
+
+/*
+ * Finds the longest earlier occurrence of the bytes at a position, using the positions
+ * of their first `BPS_HASH_LENGTH` bytes.
+ */
+class MatchFinder
+{
+private:
+    const std::vector<uint8_t>& m_data;
+    std::unordered_map<uint32_t, std::vector<size_t>> m_positions;
+
+    uint32_t getKey(const std::vector<uint8_t>& data, size_t pos) const
+    {
+        uint32_t key{};
+        for (size_t i{}; i < BPS_HASH_LENGTH; ++i)
+            key = (key << 8) | data[pos+i];
+        return key;
+    }
+
+public:
+    explicit MatchFinder(const std::vector<uint8_t>& data)
+        : m_data{data}
+    {
+    }
+
+    // Makes the position a candidate
+    void add(size_t pos)
+    {
+        if (pos+BPS_HASH_LENGTH <= m_data.size())
+            m_positions[getKey(m_data, pos)].push_back(pos);
+    }
+
+    /*
+     * Returns the position and the length of the longest match of `target` at `targetPos`,
+     * reading at most `limit` bytes of the data from the match (copies of the target can overlap
+     * the bytes they write).
+     */
+    std::pair<size_t, size_t> find(const std::vector<uint8_t>& target, size_t targetPos, size_t limit) const
+    {
+        std::pair<size_t, size_t> best{0, 0};
+        if (targetPos+BPS_HASH_LENGTH > target.size())
+            return best;
+        auto found = m_positions.find(getKey(target, targetPos));
+        if (found == m_positions.end())
+            return best;
+
+        const std::vector<size_t>& positions = found->second;
+        const size_t first = positions.size() > BPS_MAX_CANDIDATES ? positions.size()-BPS_MAX_CANDIDATES : 0;
+        for (size_t i{positions.size()}; i-- > first;)
+        {
+            const size_t pos = positions[i];
+            size_t length{};
+            while (targetPos+length < target.size() && pos+length < limit && m_data[pos+length] == target[targetPos+length])
+                ++length;
+            if (length > best.second)
+                best = {pos, length};
+        }
+        return best;
+    }
+};
+
+std::vector<uint8_t> createBpsPatch(const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom)
+{
+    std::vector<uint8_t> output{'B', 'P', 'S', '1'};
+    appendBpsNumber(&output, oldRom.size());
+    appendBpsNumber(&output, newRom.size());
+    appendBpsNumber(&output, 0); // No metadata
+
+    MatchFinder sourceFinder{oldRom};
+    for (size_t i{}; i < oldRom.size(); ++i)
+        sourceFinder.add(i);
+    MatchFinder targetFinder{newRom};
+
+    size_t sourceRelativeOffset{};
+    size_t targetRelativeOffset{};
+    size_t literalBegin{};
+    auto flushLiteral{[&](size_t end){
+        if (end > literalBegin)
+        {
+            appendBpsAction(&output, BpsAction::TargetRead, end-literalBegin);
+            output.insert(output.end(), newRom.begin()+literalBegin, newRom.begin()+end);
+        }
+    }};
+
+    size_t pos{};
+    while (pos < newRom.size())
+    {
+        size_t sameLength{};
+        while (pos+sameLength < std::min(oldRom.size(), newRom.size()) && oldRom[pos+sameLength] == newRom[pos+sameLength])
+            ++sameLength;
+        const auto sourceMatch = sourceFinder.find(newRom, pos, oldRom.size());
+        const auto targetMatch = targetFinder.find(newRom, pos, newRom.size());
+
+        size_t length{};
+        if (sameLength >= 2 && sameLength+1 >= std::max(sourceMatch.second, targetMatch.second))
+        {
+            flushLiteral(pos);
+            length = sameLength;
+            appendBpsAction(&output, BpsAction::SourceRead, length);
+        }
+        else if (sourceMatch.second >= BPS_MIN_COPY_LENGTH && sourceMatch.second >= targetMatch.second)
+        {
+            flushLiteral(pos);
+            length = sourceMatch.second;
+            appendBpsAction(&output, BpsAction::SourceCopy, length);
+            appendBpsOffset(&output, (int64_t)sourceMatch.first-(int64_t)sourceRelativeOffset);
+            sourceRelativeOffset = sourceMatch.first+length;
+        }
+        else if (targetMatch.second >= BPS_MIN_COPY_LENGTH)
+        {
+            flushLiteral(pos);
+            length = targetMatch.second;
+            appendBpsAction(&output, BpsAction::TargetCopy, length);
+            appendBpsOffset(&output, (int64_t)targetMatch.first-(int64_t)targetRelativeOffset);
+            targetRelativeOffset = targetMatch.first+length;
+        }
+        else
+        {
+            // Stored, unless a copy starts later
+            targetFinder.add(pos++);
+            continue;
+        }
+
+        for (size_t i{}; i < length; ++i)
+            targetFinder.add(pos+i);
+        pos += length;
+        literalBegin = pos;
+    }
+    flushLiteral(newRom.size());
+
+    appendLittleEndian32(&output, calculateCrc32(oldRom.data(), oldRom.size()));
+    appendLittleEndian32(&output, calculateCrc32(newRom.data(), newRom.size()));
+    appendLittleEndian32(&output, calculateCrc32(output.data(), output.size()));
+    return output;
+}
+
+std::vector<uint8_t> createPatch(PatchFormat format,
+        const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom)
+{
+    switch (format)
+    {
+    case PatchFormat::Ips: return createIpsPatch(oldRom, newRom);
+    case PatchFormat::Bps: return createBpsPatch(oldRom, newRom);
+    }
+    throw std::logic_error{"Invalid patch format"};
+}
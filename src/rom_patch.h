@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum class PatchFormat
+{
+    Ips, // International Patching System: records of bytes to write at offsets
+    Bps, // beat patch: copies from the old and the new ROM, with checksums
+};
+
+/*
+ * Returns the format of a patch file by its extension (.ips or .bps).
+ *
+ * Throws if the extension is neither.
+ */
+[[nodiscard]] PatchFormat patchFormatFromPath(const std::string& filePath);
+
+/*
+ * Creates an IPS patch that turns the old ROM into the new one.
+ * The differing ranges closer than a record header are merged, and the long runs
+ * of a byte are written as RLE records. A shorter new ROM is truncated with the
+ * length after the end marker (an extension most patchers support).
+ *
+ * Throws if the ROM is too large for the format.
+ */
+[[nodiscard]] std::vector<uint8_t> createIpsPatch(
+        const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom);
+
+/*
+ * Creates a BPS patch that turns the old ROM into the new one.
+ * At each position of the new ROM the longest of these is used: the bytes that are the same
+ * at the same position, a copy from anywhere in the old ROM or a copy of the already written
+ * part of the new ROM (which also covers runs). Otherwise the bytes are stored.
+ * So moved code is copied instead of stored, only the changed addresses in it are stored.
+ */
+[[nodiscard]] std::vector<uint8_t> createBpsPatch(
+        const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom);
+
+/*
+ * Creates a patch in the format.
+ */
+[[nodiscard]] std::vector<uint8_t> createPatch(PatchFormat format,
+        const std::vector<uint8_t>& oldRom, const std::vector<uint8_t>& newRom);
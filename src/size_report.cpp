@@ -0,0 +1,77 @@
+#include "size_report.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+SizeReport calculateSizeReport(const Parser::tokenList_t& tokens)
+{
+    SizeReport report;
+    report.labels.emplace_back();
+    for (const auto& token : tokens)
+    {
+        if (auto label = dynamic_cast<const Parser::Label*>(token.get()))
+        {
+            LabelSize size;
+            size.name = label->name;
+            size.location = label->getLocation();
+            report.labels.push_back(std::move(size));
+            continue;
+        }
+
+        const size_t bytes = token->getSize();
+        if (dynamic_cast<const Parser::Opcode*>(token.get()))
+        {
+            report.labels.back().codeBytes += bytes;
+            report.codeBytes += bytes;
+        }
+        else
+        {
+            report.labels.back().dataBytes += bytes;
+            report.dataBytes += bytes;
+        }
+    }
+
+    // Labels without bytes, e.g. the ones of a loop at the start of a function, are not interesting
+    report.labels.erase(std::remove_if(report.labels.begin(), report.labels.end(),
+                [](const LabelSize& label){ return label.getTotal() == 0; }),
+            report.labels.end());
+    std::stable_sort(report.labels.begin(), report.labels.end(), [](const LabelSize& a, const LabelSize& b){
+        return a.getTotal() > b.getTotal();
+    });
+    return report;
+}
+
+static std::string formatPercent(size_t value, size_t total)
+{
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << (total ? value*100.0/total : 0.0) << '%';
+    return ss.str();
+}
+
+void writeSizeReport(const SizeReport& report, size_t limit, std::ostream& output, size_t maxLabelCount)
+{
+    output << "ROM usage: " << report.getTotal() << " bytes";
+    if (limit)
+    {
+        output << " of " << limit << " (" << formatPercent(report.getTotal(), limit) << "), ";
+        if (report.getTotal() <= limit)
+            output << limit-report.getTotal() << " bytes free";
+        else
+            output << report.getTotal()-limit << " bytes over the limit";
+    }
+    output << "\n  code: " << report.codeBytes << " bytes, data: " << report.dataBytes << " bytes\n";
+
+    output << "    Bytes   Total%     Code     Data | Label\n";
+    for (size_t i{}; i < report.labels.size() && i < maxLabelCount; ++i)
+    {
+        const LabelSize& label = report.labels[i];
+        output << std::setw(9) << label.getTotal() << ' ' << std::setw(8)
+            << formatPercent(label.getTotal(), report.getTotal()) << ' ' << std::setw(8) << label.codeBytes << ' '
+            << std::setw(8) << label.dataBytes << " | "
+            << (label.name.empty() ? "(before the first label)" : label.name + " (" + label.location.toString() + ')')
+            << '\n';
+    }
+    if (report.labels.size() > maxLabelCount)
+        output << "  (" << report.labels.size()-maxLabelCount << " more labels)\n";
+}
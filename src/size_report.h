@@ -0,0 +1,45 @@
+#pragma once
+
+#include "parser.h"
+
+#include <iostream>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+ * The bytes between a label and the next one.
+ */
+struct LabelSize
+{
+    // Empty for the bytes before the first label
+    std::string name;
+    Parser::SourceLocation location;
+    size_t codeBytes{};
+    // `db`, `dw` and `%incbin` bytes
+    size_t dataBytes{};
+
+    size_t getTotal() const { return codeBytes+dataBytes; }
+};
+
+struct SizeReport
+{
+    // Sorted by total size, the largest first
+    std::vector<LabelSize> labels;
+    size_t codeBytes{};
+    size_t dataBytes{};
+
+    size_t getTotal() const { return codeBytes+dataBytes; }
+};
+
+/*
+ * Attributes the bytes of the program to the labels.
+ */
+[[nodiscard]] SizeReport calculateSizeReport(const Parser::tokenList_t& tokens);
+
+/*
+ * Writes the usage of the ROM space and the labels that use the most, at most `maxLabelCount` of them.
+ * `limit` is the available ROM space, 0 if unlimited.
+ */
+void writeSizeReport(const SizeReport& report, size_t limit, std::ostream& output,
+        size_t maxLabelCount=SIZE_MAX);
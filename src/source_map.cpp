@@ -0,0 +1,167 @@
+#include "source_map.h"
+#include "binary_generator.h"
+#include "InputFile.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+// The most bytes in a row of the listing
+#define LISTING_BYTES_PER_ROW 4
+
+/*
+ * Writes a row of the listing. `size` and `lineNumber` are 0 if the row has no bytes or no line.
+ */
+static void writeListingRow(std::ostream& stream, size_t offset, const uint8_t* bytes, size_t size,
+        int lineNumber, const std::string& text)
+{
+    std::stringstream bytesStr;
+    bytesStr << std::hex << std::setfill('0');
+    for (size_t i{}; i < size; ++i)
+        bytesStr << ((i && i % 2 == 0) ? " " : "") << std::setw(2) << +bytes[i];
+
+    std::stringstream row;
+    if (size)
+        row << std::hex << std::setfill('0') << std::setw(4) << ROM_LOAD_OFFSET+offset
+            << std::dec << std::setfill(' ');
+    else
+        row << "    ";
+    row << "  " << std::left << std::setw(LISTING_BYTES_PER_ROW*2+LISTING_BYTES_PER_ROW/2-1) << bytesStr.str()
+        << std::right << "  ";
+    if (lineNumber > 0)
+        row << std::setw(5) << lineNumber;
+    else
+        row << "     ";
+    row << "  " << text;
+
+    std::string rowStr = row.str();
+    rowStr.erase(rowStr.find_last_not_of(' ')+1);
+    stream << rowStr << '\n';
+}
+
+void writeListing(const SourceMap& map, const std::vector<uint8_t>& output, std::ostream& stream)
+{
+    std::map<std::string, std::vector<std::string>> fileLines;
+    auto getFileLines{[&](const std::string& filePath) -> const std::vector<std::string>& {
+        auto found = fileLines.find(filePath);
+        if (found != fileLines.end())
+            return found->second;
+
+        std::vector<std::string>& lines = fileLines[filePath];
+        try
+        {
+            InputFile file;
+            file.open(filePath);
+            std::istringstream lineStream{file.getContent()};
+            std::string line;
+            while (std::getline(lineStream, line))
+                lines.push_back(line);
+        }
+        catch (std::exception& e)
+        {
+            Logger::warn << e.what() << Logger::End;
+        }
+        return lines;
+    }};
+    auto getLine{[](const std::vector<std::string>& lines, int lineNumber){
+        return (lineNumber > 0 && (size_t)lineNumber <= lines.size()) ? lines[lineNumber-1] : std::string{};
+    }};
+
+    // File -> the last line written
+    std::map<std::string, int> lastLineNumbers;
+    std::string currentFilePath;
+    auto writeLinesUntil{[&](int lineNumber){
+        const std::vector<std::string>& lines = getFileLines(currentFilePath);
+        int& lastLineNumber = lastLineNumbers[currentFilePath];
+        for (int i = lastLineNumber+1; i < lineNumber && (size_t)i <= lines.size(); ++i)
+            writeListingRow(stream, 0, nullptr, 0, i, lines[i-1]);
+        lastLineNumber = std::max(lastLineNumber, lineNumber);
+    }};
+
+    stream << "ADDR  BYTES       LINE  SOURCE\n";
+    for (const SourceRange& range : map.ranges)
+    {
+        const std::string filePath = range.location.filePath ? *range.location.filePath : "?";
+        if (filePath != currentFilePath)
+        {
+            currentFilePath = filePath;
+            stream << "; ----- " << filePath << " -----\n";
+        }
+        writeLinesUntil(range.location.lineNumber);
+
+        const std::string text = getLine(getFileLines(filePath), range.location.lineNumber);
+        if (!range.embeddedFilePath.empty() && range.size > LISTING_BYTES_PER_ROW)
+        {
+            // The embedded files can be large, their bytes are in the file anyway
+            writeListingRow(stream, range.offset, output.data()+range.offset, LISTING_BYTES_PER_ROW,
+                    range.location.lineNumber, text);
+            writeListingRow(stream, 0, nullptr, 0, 0,
+                    "... (" + std::to_string(range.size) + " bytes from " + range.embeddedFilePath + ')');
+            continue;
+        }
+        for (size_t i{}; i < range.size; i += LISTING_BYTES_PER_ROW)
+        {
+            writeListingRow(stream, range.offset+i, output.data()+range.offset+i,
+                    std::min<size_t>(LISTING_BYTES_PER_ROW, range.size-i),
+                    (i ? 0 : range.location.lineNumber), (i ? "" : text));
+        }
+    }
+    if (!currentFilePath.empty())
+        writeLinesUntil(INT32_MAX);
+
+    stream << "\n; ----- Symbols -----\nADDR   SIZE  NAME\n";
+    for (const SymbolInfo& symbol : map.symbols)
+    {
+        stream << std::hex << std::setfill('0') << std::setw(4) << ROM_LOAD_OFFSET+symbol.offset
+            << std::dec << std::setfill(' ') << "  " << std::setw(5) << symbol.size << "  " << symbol.name << '\n';
+    }
+}
+
+void writeDebugMap(const SourceMap& map, std::ostream& stream)
+{
+    std::map<std::string, size_t> fileIndices;
+    for (const SourceRange& range : map.ranges)
+    {
+        const std::string filePath = range.location.filePath ? *range.location.filePath : "?";
+        if (fileIndices.emplace(filePath, fileIndices.size()).second)
+            stream << "file " << fileIndices.size()-1 << ' ' << filePath << '\n';
+    }
+
+    for (const SourceRange& range : map.ranges)
+    {
+        stream << "line " << std::hex << ROM_LOAD_OFFSET+range.offset << std::dec << ' ' << range.size << ' '
+            << fileIndices.at(range.location.filePath ? *range.location.filePath : "?") << ' '
+            << range.location.lineNumber << '\n';
+    }
+    for (const SymbolInfo& symbol : map.symbols)
+        stream << "symbol " << symbol.name << ' ' << std::hex << ROM_LOAD_OFFSET+symbol.offset << std::dec
+            << ' ' << symbol.size << '\n';
+}
+
+std::map<std::string, uint16_t> readDebugMapSymbols(const std::string& filePath)
+{
+    InputFile file;
+    file.open(filePath);
+
+    std::map<std::string, uint16_t> symbols;
+    std::istringstream stream{file.getContent()};
+    std::string line;
+    int lineNumber{};
+    while (std::getline(stream, line))
+    {
+        ++lineNumber;
+        std::istringstream lineStream{line};
+        std::string kind;
+        if (!(lineStream >> kind) || kind.compare("symbol") != 0)
+            continue;
+        std::string name;
+        unsigned int address{};
+        if (!(lineStream >> name >> std::hex >> address) || address > UINT16_MAX)
+            throw std::runtime_error{filePath + ':' + std::to_string(lineNumber) + ": Invalid symbol line"};
+        symbols[name] = address;
+    }
+    Logger::dbg << "Read " << symbols.size() << " symbols from \"" << filePath << '"' << Logger::End;
+    return symbols;
+}
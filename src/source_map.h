@@ -0,0 +1,66 @@
+#pragma once
+
+#include "parser.h"
+
+#include <iostream>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * The bytes of the output that one source line generated.
+ */
+struct SourceRange
+{
+    // Offset in the output
+    size_t offset{};
+    size_t size{};
+    Parser::SourceLocation location;
+    // The file the bytes are embedded from by `%incbin`, empty for the other lines
+    std::string embeddedFilePath;
+};
+
+struct SymbolInfo
+{
+    std::string name;
+    // Offset in the output
+    size_t offset{};
+    // The distance to the next label with a higher offset, or to the end of the output
+    size_t size{};
+};
+
+/*
+ * Maps the output back to the source, filled by `generateBinary` while it encodes.
+ */
+struct SourceMap
+{
+    // In the order of the output, consecutive tokens of the same line are merged
+    std::vector<SourceRange> ranges;
+    // In the order of the output
+    std::vector<SymbolInfo> symbols;
+};
+
+/*
+ * Writes the source lines next to their addresses and encoded bytes.
+ * The lines between two lines that generated output are included, so comments and labels are kept.
+ * Only the first row of the bytes embedded by `%incbin` is written, followed by their count.
+ */
+void writeListing(const SourceMap& map, const std::vector<uint8_t>& output, std::ostream& stream);
+
+/*
+ * Writes the map in a line based format for tools:
+ *   `file INDEX PATH`
+ *   `line ADDRESS SIZE FILE_INDEX LINE_NUMBER`
+ *   `symbol NAME ADDRESS SIZE`
+ * The addresses are hexadecimal, the other numbers are decimal.
+ */
+void writeDebugMap(const SourceMap& map, std::ostream& stream);
+
+/*
+ * Reads the symbols of a map written by `writeDebugMap`, returns the address of each.
+ *
+ * Throws on error.
+ */
+[[nodiscard]] std::map<std::string, uint16_t> readDebugMapSymbols(const std::string& filePath);
@@ -0,0 +1,100 @@
+#include "sprite_import.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Returns the rows of a frame, one byte per 8 pixels, most significant bit first.
+ */
+static std::vector<uint8_t> getFrameBytes(
+        const NetpbmImage& image, size_t frameX, size_t frameY, size_t frameWidth, size_t frameHeight)
+{
+    std::vector<uint8_t> bytes;
+    bytes.reserve(frameWidth/8*frameHeight);
+    for (size_t y{}; y < frameHeight; ++y)
+    {
+        for (size_t byteI{}; byteI < frameWidth/8; ++byteI)
+        {
+            uint8_t byte{};
+            for (size_t bit{}; bit < 8; ++bit)
+            {
+                if (image.getPixel(frameX+byteI*8+bit, frameY+y))
+                    byte |= 0x80 >> bit;
+            }
+            bytes.push_back(byte);
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Adds a frame to the sheet, reusing the data already in it where possible.
+ * Returns the offset of the frame.
+ */
+static size_t packFrame(std::vector<uint8_t>& data, const std::vector<uint8_t>& frame, size_t rowBytes)
+{
+    // The frame is already somewhere in the data
+    auto found = std::search(data.begin(), data.end(), frame.begin(), frame.end());
+    if (found != data.end())
+        return found-data.begin();
+
+    // Find the most rows the end of the data and the start of the frame have in common
+    size_t overlap = std::min(data.size(), frame.size()-rowBytes);
+    overlap -= overlap % rowBytes;
+    for (; overlap > 0; overlap -= rowBytes)
+    {
+        if (std::equal(frame.begin(), frame.begin()+overlap, data.end()-overlap))
+            break;
+    }
+
+    const size_t offset = data.size()-overlap;
+    data.insert(data.end(), frame.begin()+overlap, frame.end());
+    return offset;
+}
+
+SpriteSheet importSprites(const NetpbmImage& image, size_t frameWidth, size_t frameHeight, bool shouldPack)
+{
+    if (frameWidth == 8)
+    {
+        if (frameHeight < 1 || frameHeight > 15)
+            throw std::runtime_error{"8 pixel wide sprites must be 1 to 15 pixels tall"};
+    }
+    else if (frameWidth == 16)
+    {
+        if (frameHeight != 16)
+            throw std::runtime_error{"16 pixel wide sprites must be 16 pixels tall"};
+    }
+    else
+    {
+        throw std::runtime_error{"Sprites must be 8 or 16 pixels wide"};
+    }
+
+    if (image.getWidth() % frameWidth || image.getHeight() % frameHeight)
+        throw std::runtime_error{"Image size (" + std::to_string(image.getWidth()) + 'x' + std::to_string(image.getHeight())
+            + ") is not a multiple of the sprite size"};
+
+    const size_t rowBytes = frameWidth/8;
+    SpriteSheet sheet;
+    for (size_t frameY{}; frameY < image.getHeight(); frameY += frameHeight)
+    {
+        for (size_t frameX{}; frameX < image.getWidth(); frameX += frameWidth)
+        {
+            const auto frame = getFrameBytes(image, frameX, frameY, frameWidth, frameHeight);
+            if (shouldPack)
+            {
+                sheet.frameOffsets.push_back(packFrame(sheet.data, frame, rowBytes));
+            }
+            else
+            {
+                sheet.frameOffsets.push_back(sheet.data.size());
+                sheet.data.insert(sheet.data.end(), frame.begin(), frame.end());
+            }
+        }
+    }
+
+    Logger::dbg << "Imported " << sheet.frameOffsets.size() << " sprites from \"" << image.getFilePath()
+        << "\" to " << sheet.data.size() << " bytes" << Logger::End;
+    return sheet;
+}
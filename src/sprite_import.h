@@ -0,0 +1,24 @@
+#pragma once
+
+#include "NetpbmImage.h"
+#include <stdint.h>
+#include <vector>
+
+struct SpriteSheet
+{
+    // The sprite data, ready to be drawn with DRW
+    std::vector<uint8_t> data;
+    // The offset of each frame in `data`
+    std::vector<size_t> frameOffsets;
+};
+
+/*
+ * Slices the image into frames of `frameWidth`x`frameHeight` pixels, left to right, top to bottom.
+ * The frames must be 8 pixels wide (CHIP-8) or 16x16 pixels (SUPER-CHIP).
+ *
+ * If `shouldPack` is true, identical frames are only stored once and
+ * each frame shares its first rows with the end of the previous data where possible.
+ *
+ * Throws on error.
+ */
+SpriteSheet importSprites(const NetpbmImage& image, size_t frameWidth, size_t frameHeight, bool shouldPack);
@@ -0,0 +1,173 @@
+#include "stable_layout.h"
+#include "binary_generator.h"
+#include "instruction_info.h"
+#include "optimizer.h"
+#include "Logger.h"
+
+#include <set>
+
+using Type = Parser::OpcodeOperand::Type;
+
+// The labels generated by the assembler (macro locals, switches, spill slots) start with this
+#define GENERATED_LABEL_PREFIX "__"
+
+static inline const Parser::Opcode* asOpcode(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Opcode*>(token.get());
+}
+
+static inline const Parser::Label* asLabel(const std::shared_ptr<Parser::Token>& token)
+{
+    return dynamic_cast<const Parser::Label*>(token.get());
+}
+
+/*
+ * Returns the indices of the entries of the jump tables except the first ones,
+ * found like the control-flow graph does: the `jp`s after the label of a `jp v0`.
+ */
+static std::set<size_t> findInnerTableEntries(const Parser::tokenList_t& tokens)
+{
+    std::map<std::string, size_t> labelIndices;
+    for (size_t i{}; i < tokens.size(); ++i)
+    {
+        if (auto label = asLabel(tokens[i]))
+            labelIndices.emplace(label->name, i);
+    }
+
+    std::set<size_t> output;
+    for (const auto& token : tokens)
+    {
+        const Parser::Opcode* opcode = asOpcode(token);
+        if (!opcode || opcode->opcode != Parser::OPCODE_JP || opcode->operand0.getType() != Type::Register
+         || opcode->operand1.getType() != Type::LabelReference)
+            continue;
+        auto found = labelIndices.find(opcode->operand1.getAsLabel().name);
+        if (found == labelIndices.end())
+            continue;
+        bool isFirst = true;
+        for (size_t i{found->second}; i < tokens.size(); ++i)
+        {
+            if (asLabel(tokens[i]))
+                continue;
+            const Parser::Opcode* entry = asOpcode(tokens[i]);
+            if (!entry || entry->opcode != Parser::OPCODE_JP || entry->operand0.getType() != Type::LabelReference)
+                break;
+            if (!isFirst)
+                output.insert(i);
+            isFirst = false;
+        }
+    }
+    return output;
+}
+
+/*
+ * Returns true if padding can be put before the labels starting at `index`,
+ * i.e. the execution doesn't continue into it from the previous token.
+ */
+static bool canPadBefore(const Parser::tokenList_t& tokens, size_t index, const std::set<size_t>& innerTableEntries)
+{
+    size_t next = index;
+    while (next < tokens.size() && asLabel(tokens[next]))
+        ++next;
+    if (innerTableEntries.count(next))
+        return false;
+
+    size_t previous = index;
+    while (previous > 0 && asLabel(tokens[previous-1]))
+        --previous;
+    // The start of the program stays at the load address
+    if (previous == 0)
+        return false;
+    --previous;
+
+    const Parser::Opcode* opcode = asOpcode(tokens[previous]);
+    if (!opcode)
+        return next < tokens.size() && asOpcode(tokens[next]); // Data, then code
+    return (opcode->opcode == Parser::OPCODE_JP || opcode->opcode == Parser::OPCODE_RET
+         || opcode->opcode == Parser::OPCODE_EXIT)
+        && !followsSkip(tokens, previous);
+}
+
+size_t pinLabelAddresses(Parser::tokenList_t* tokens, Parser::labelMap_t* labels,
+        const std::map<std::string, uint16_t>& oldAddresses, size_t sizeBudget)
+{
+    if (usesAbsoluteRomAddresses(*tokens))
+    {
+        Logger::warn << "The label addresses can't be kept, the code uses absolute ROM addresses" << Logger::End;
+        return 0;
+    }
+    const std::set<size_t> innerTableEntries = findInnerTableEntries(*tokens);
+
+    // The indices to insert padding at and its size
+    std::vector<std::pair<size_t, size_t>> paddings;
+    size_t paddingSize{};
+    size_t keptCount{};
+    size_t movedCount{};
+    size_t offset{};
+    for (size_t i{}; i < tokens->size(); ++i)
+    {
+        const Parser::Label* label = asLabel((*tokens)[i]);
+        if (!label)
+        {
+            offset += (*tokens)[i]->getSize();
+            continue;
+        }
+
+        // The labels at the same address move together, the first one that was in the old build decides
+        const size_t runBegin = i;
+        std::string pinnedName;
+        size_t oldOffset{};
+        for (; i < tokens->size() && asLabel((*tokens)[i]); ++i)
+        {
+            const std::string& name = asLabel((*tokens)[i])->name;
+            auto found = oldAddresses.find(name);
+            if (found == oldAddresses.end() || name.compare(0, sizeof(GENERATED_LABEL_PREFIX)-1, GENERATED_LABEL_PREFIX) == 0)
+                continue;
+            if (pinnedName.empty() && found->second >= ROM_LOAD_OFFSET)
+            {
+                pinnedName = name;
+                oldOffset = found->second-ROM_LOAD_OFFSET;
+            }
+        }
+        --i;
+        if (pinnedName.empty())
+            continue;
+
+        if (oldOffset == offset)
+        {
+            ++keptCount;
+        }
+        else if (oldOffset > offset && (oldOffset-offset) % 2 == 0 && paddingSize+(oldOffset-offset) <= sizeBudget
+              && canPadBefore(*tokens, runBegin, innerTableEntries))
+        {
+            paddings.emplace_back(runBegin, oldOffset-offset);
+            paddingSize += oldOffset-offset;
+            offset = oldOffset;
+            ++keptCount;
+            ++movedCount;
+            Logger::log << (*tokens)[runBegin]->getLocationStr() << ": Moved \"" << pinnedName << "\" back to 0x"
+                << std::hex << ROM_LOAD_OFFSET+oldOffset << std::dec << " with " << paddings.back().second
+                << " bytes of padding" << Logger::End;
+        }
+    }
+
+    // Insert from the end, so the indices stay valid
+    for (auto it = paddings.rbegin(); it != paddings.rend(); ++it)
+    {
+        auto padding = std::make_shared<Parser::DbInst>();
+        padding->arguments.resize(it->second);
+        padding->setLocation((*tokens)[it->first]->getLocation());
+        tokens->insert(tokens->begin()+it->first, std::move(padding));
+    }
+    if (!paddings.empty())
+        Parser::layoutLabels(*tokens, labels);
+
+    Logger::log << "Kept " << keptCount << " labels at their old addresses ("
+        << movedCount << " moved back with " << paddingSize << " bytes of padding)" << Logger::End;
+    if (paddingSize)
+    {
+        Logger::warn << "Stable layout: added " << paddingSize << " bytes of padding to move " << movedCount
+            << " labels back to their old addresses" << Logger::End;
+    }
+    return paddingSize;
+}
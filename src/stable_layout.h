@@ -0,0 +1,25 @@
+#pragma once
+
+#include "parser.h"
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Keeps the labels at their addresses in a previous build (`oldAddresses`, read from its debug map)
+ * where possible, so a patch between the builds only has to contain the changed code.
+ *
+ * A label that is now lower than before is moved back with zero bytes before it, if nothing
+ * runs into them: after an unconditional jump, `ret` or `exit` that isn't skipped, or after data
+ * if code follows the label. Labels between the entries of a jump table and the labels generated
+ * by the assembler (starting with `__`) are not moved. A label that is higher than before
+ * (the code before it grew) can't be moved back, the labels after it can be pinned again.
+ * The padding takes at most `sizeBudget` bytes in total.
+ *
+ * Does nothing if the code uses absolute ROM addresses. Lays out the labels again if the code changed.
+ * Logs the labels that were kept at their addresses. Returns the number of padding bytes.
+ */
+size_t pinLabelAddresses(Parser::tokenList_t* tokens, Parser::labelMap_t* labels,
+        const std::map<std::string, uint16_t>& oldAddresses, size_t sizeBudget);
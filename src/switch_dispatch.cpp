@@ -0,0 +1,392 @@
+#include "switch_dispatch.h"
+#include "cycle_analysis.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <map>
+
+using Type = Parser::OpcodeOperand::Type;
+
+// The most values `jp v0` can reach, the offsets are doubled in a byte
+#define SWITCH_MAX_TABLE_SPAN 128
+// The table is only used if at least 1/N of its entries are cases
+#define SWITCH_MIN_TABLE_DENSITY 3
+// The largest leaf of the search tree that is tried
+#define SWITCH_MAX_LEAF_SIZE 16
+
+/*
+ * A candidate for the dispatch code.
+ */
+struct DispatchCode
+{
+    Parser::tokenList_t tokens;
+    size_t size{};
+    // The average cost of reaching a case, in microseconds on the VIP
+    uint64_t averageCost{};
+    std::string description;
+};
+
+static void emit(Parser::tokenList_t* output, std::shared_ptr<Parser::Opcode> opcode, const Parser::SourceLocation& location)
+{
+    opcode->setLocation(location);
+    output->push_back(std::move(opcode));
+}
+
+static std::shared_ptr<Parser::Opcode> makeRegByte(Parser::OpcodeEnum op, Parser::RegisterEnum reg, uint8_t value)
+{
+    auto opcode = std::make_shared<Parser::Opcode>();
+    opcode->opcode = op;
+    opcode->operand0.setRegister(reg);
+    opcode->operand1.setUint(value);
+    return opcode;
+}
+
+static std::shared_ptr<Parser::Opcode> makeRegReg(Parser::OpcodeEnum op, Parser::RegisterEnum reg0, Parser::RegisterEnum reg1)
+{
+    auto opcode = std::make_shared<Parser::Opcode>();
+    opcode->opcode = op;
+    opcode->operand0.setRegister(reg0);
+    opcode->operand1.setRegister(reg1);
+    return opcode;
+}
+
+static std::shared_ptr<Parser::Opcode> makeJump(const std::string& labelName)
+{
+    auto opcode = std::make_shared<Parser::Opcode>();
+    opcode->opcode = Parser::OPCODE_JP;
+    opcode->operand0.setAsLabel(labelName);
+    return opcode;
+}
+
+static void emitLabel(Parser::tokenList_t* output, const std::string& name, const Parser::SourceLocation& location)
+{
+    auto label = std::make_shared<Parser::Label>();
+    label->name = name;
+    label->setLocation(location);
+    output->push_back(std::move(label));
+}
+
+/*
+ * Runs the dispatch code with the value in the register, returns the cost until it jumps out.
+ * Only the instructions that the generators emit are handled.
+ */
+static uint64_t getDispatchCost(const Parser::tokenList_t& code, Parser::RegisterEnum reg, uint8_t value)
+{
+    std::map<std::string, size_t> labelIndices;
+    for (size_t i{}; i < code.size(); ++i)
+    {
+        if (auto label = dynamic_cast<const Parser::Label*>(code[i].get()))
+            labelIndices.emplace(label->name, i);
+    }
+
+    uint8_t regs[16]{};
+    regs[Parser::vRegisterToNibble(reg)] = value;
+    auto getReg{[&regs](const Parser::OpcodeOperand& operand) -> uint8_t& {
+        return regs[Parser::vRegisterToNibble(operand.getAsRegister())];
+    }};
+    auto getSource{[&](const Parser::OpcodeOperand& operand) -> uint8_t {
+        return operand.getType() == Type::Register ? getReg(operand) : operand.getAsUint();
+    }};
+
+    uint64_t cost{};
+    size_t i{};
+    while (i < code.size())
+    {
+        const auto* opcode = dynamic_cast<const Parser::Opcode*>(code[i].get());
+        if (!opcode)
+        {
+            ++i;
+            continue;
+        }
+        const CostRange instructionCost = getInstructionCost(*opcode, CostProfile::Vip);
+        cost += instructionCost.best;
+        ++i;
+
+        switch (opcode->opcode)
+        {
+        case Parser::OPCODE_LD:
+            getReg(opcode->operand0) = getSource(opcode->operand1);
+            break;
+
+        case Parser::OPCODE_ADD:
+        {
+            const unsigned sum = getReg(opcode->operand0) + getSource(opcode->operand1);
+            getReg(opcode->operand0) = sum;
+            if (opcode->operand1.getType() == Type::Register)
+                regs[0xf] = sum > 0xff;
+            break;
+        }
+
+        case Parser::OPCODE_SUB:
+        case Parser::OPCODE_SUBN:
+        {
+            uint8_t& dest = getReg(opcode->operand0);
+            const uint8_t x = (opcode->opcode == Parser::OPCODE_SUB ? dest : getReg(opcode->operand1));
+            const uint8_t y = (opcode->opcode == Parser::OPCODE_SUB ? getReg(opcode->operand1) : dest);
+            dest = x-y;
+            regs[0xf] = x >= y;
+            break;
+        }
+
+        case Parser::OPCODE_SE:
+        case Parser::OPCODE_SNE:
+            if ((getReg(opcode->operand0) == getSource(opcode->operand1)) == (opcode->opcode == Parser::OPCODE_SE))
+            {
+                cost += instructionCost.worst-instructionCost.best;
+                ++i;
+            }
+            break;
+
+        case Parser::OPCODE_JP:
+        {
+            if (opcode->operand0.getType() == Type::Register) // JP V0, table
+            {
+                // Every entry is a single `jp` after the label
+                i = labelIndices.at(opcode->operand1.getAsLabel().name)+1 + regs[0]/2;
+                break;
+            }
+            auto target = labelIndices.find(opcode->operand0.getAsLabel().name);
+            if (target == labelIndices.end()) // Reached a case
+                return cost;
+            i = target->second;
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+    return cost;
+}
+
+static size_t getCodeSize(const Parser::tokenList_t& code)
+{
+    size_t size{};
+    for (const auto& token : code)
+        size += token->getSize();
+    return size;
+}
+
+/*
+ * Fills in the size and the average cost of the cases.
+ */
+static void measureDispatch(DispatchCode* code, const SwitchStatement& statement)
+{
+    code->size = getCodeSize(code->tokens);
+    uint64_t totalCost{};
+    for (const SwitchCase& switchCase : statement.cases)
+        totalCost += getDispatchCost(code->tokens, statement.reg, switchCase.value);
+    code->averageCost = totalCost/statement.cases.size();
+}
+
+//--------------------------------- Jump table ---------------------------------
+
+/*
+ * Returns true if the values fit in a table.
+ */
+static bool canUseJumpTable(const SwitchStatement& statement)
+{
+    // The cases are sorted by value
+    return statement.cases.back().value - statement.cases.front().value < SWITCH_MAX_TABLE_SPAN;
+}
+
+static DispatchCode generateJumpTable(const SwitchStatement& statement, const std::string& labelPrefix)
+{
+    const std::string tableLabel = labelPrefix + "table";
+    const std::string endLabel = labelPrefix + "end";
+    const std::string& defaultLabel = statement.defaultLabelName.empty() ? endLabel : statement.defaultLabelName;
+    const uint8_t min = statement.cases.front().value;
+    const uint8_t span = statement.cases.back().value-min+1;
+
+    DispatchCode code;
+    Parser::tokenList_t& out = code.tokens;
+    // The offset of the value from the first entry
+    if (statement.reg != Parser::REGISTER_V0)
+        emit(&out, makeRegReg(Parser::OPCODE_LD, Parser::REGISTER_V0, statement.reg), statement.location);
+    if (min)
+        emit(&out, makeRegByte(Parser::OPCODE_ADD, Parser::REGISTER_V0, 0x100-min), statement.location);
+    // VF = 1 if the offset is in the table
+    emit(&out, makeRegByte(Parser::OPCODE_LD, Parser::REGISTER_VF, span-1), statement.location);
+    emit(&out, makeRegReg(Parser::OPCODE_SUB, Parser::REGISTER_VF, Parser::REGISTER_V0), statement.location);
+    emit(&out, makeRegByte(Parser::OPCODE_SE, Parser::REGISTER_VF, 1), statement.location);
+    emit(&out, makeJump(defaultLabel), statement.location);
+    // Every entry is a 2-byte `jp`
+    emit(&out, makeRegReg(Parser::OPCODE_ADD, Parser::REGISTER_V0, Parser::REGISTER_V0), statement.location);
+    auto jumpToTable = std::make_shared<Parser::Opcode>();
+    jumpToTable->opcode = Parser::OPCODE_JP;
+    jumpToTable->operand0.setRegister(Parser::REGISTER_V0);
+    jumpToTable->operand1.setAsLabel(tableLabel);
+    emit(&out, jumpToTable, statement.location);
+
+    emitLabel(&out, tableLabel, statement.location);
+    size_t caseI{};
+    for (unsigned offset{}; offset < span; ++offset)
+    {
+        const SwitchCase& switchCase = statement.cases[caseI];
+        if (switchCase.value == min+offset)
+        {
+            emit(&out, makeJump(switchCase.labelName), switchCase.location);
+            ++caseI;
+        }
+        else // The missing values are listed with the case before them
+        {
+            emit(&out, makeJump(defaultLabel), statement.cases[caseI-1].location);
+        }
+    }
+    if (statement.defaultLabelName.empty())
+        emitLabel(&out, endLabel, statement.endLocation);
+
+    measureDispatch(&code, statement);
+    code.description = "jump table of " + std::to_string(span) + " entries";
+    return code;
+}
+
+//-------------------------------- Search tree ---------------------------------
+
+class SearchTreeGenerator
+{
+private:
+    const SwitchStatement& m_statement;
+    const std::string& m_labelPrefix;
+    const size_t m_maxLeafSize;
+    const std::string m_endLabel;
+    Parser::tokenList_t* m_output;
+
+    const std::string& getDefaultLabel() const
+    {
+        return m_statement.defaultLabelName.empty() ? m_endLabel : m_statement.defaultLabelName;
+    }
+
+    /*
+     * Tests the cases one by one.
+     * `isLast` is true if the code after the leaf is the code after the dispatch.
+     */
+    void generateLeaf(size_t first, size_t end, unsigned lowerBound, unsigned upperBound, bool isLast)
+    {
+        // If every possible value has a case, the last one doesn't have to be tested
+        const bool isComplete = upperBound-lowerBound+1 == end-first;
+        for (size_t i{first}; i < end; ++i)
+        {
+            const SwitchCase& switchCase = m_statement.cases[i];
+            if (isComplete && i+1 == end)
+            {
+                emit(m_output, makeJump(switchCase.labelName), switchCase.location);
+                return;
+            }
+            emit(m_output, makeRegByte(Parser::OPCODE_SNE, m_statement.reg, switchCase.value), switchCase.location);
+            emit(m_output, makeJump(switchCase.labelName), switchCase.location);
+        }
+        if (!(isLast && m_statement.defaultLabelName.empty()))
+            emit(m_output, makeJump(getDefaultLabel()), m_statement.cases[end-1].location);
+    }
+
+    /*
+     * Generates the code for the cases from `first` to `end`,
+     * the value of the register is known to be in [lowerBound, upperBound].
+     */
+    void generateNode(size_t first, size_t end, unsigned lowerBound, unsigned upperBound, bool isLast)
+    {
+        if (end-first <= m_maxLeafSize)
+        {
+            generateLeaf(first, end, lowerBound, upperBound, isLast);
+            return;
+        }
+
+        const size_t middle = first+(end-first)/2;
+        const SwitchCase& pivot = m_statement.cases[middle];
+        const std::string upperLabel = m_labelPrefix + "ge_" + std::to_string(pivot.value);
+        // VF = 1 if the value >= pivot
+        emit(m_output, makeRegByte(Parser::OPCODE_LD, Parser::REGISTER_VF, pivot.value), pivot.location);
+        emit(m_output, makeRegReg(Parser::OPCODE_SUBN, Parser::REGISTER_VF, m_statement.reg), pivot.location);
+        emit(m_output, makeRegByte(Parser::OPCODE_SE, Parser::REGISTER_VF, 0), pivot.location);
+        emit(m_output, makeJump(upperLabel), pivot.location);
+        generateNode(first, middle, lowerBound, pivot.value-1u, false);
+        emitLabel(m_output, upperLabel, pivot.location);
+        generateNode(middle, end, pivot.value, upperBound, isLast);
+    }
+
+public:
+    SearchTreeGenerator(const SwitchStatement& statement, const std::string& labelPrefix, size_t maxLeafSize,
+            Parser::tokenList_t* output)
+        : m_statement{statement}, m_labelPrefix{labelPrefix}, m_maxLeafSize{maxLeafSize},
+        m_endLabel{labelPrefix + "end"}, m_output{output}
+    {
+    }
+
+    void generate()
+    {
+        generateNode(0, m_statement.cases.size(), 0, 0xff, true);
+        if (m_statement.defaultLabelName.empty())
+            emitLabel(m_output, m_endLabel, m_statement.endLocation);
+    }
+};
+
+/*
+ * Generates the search trees with every leaf size, returns the fastest one.
+ */
+static DispatchCode generateSearchTree(const SwitchStatement& statement, const std::string& labelPrefix)
+{
+    DispatchCode best;
+    const size_t maxLeafSize = std::min<size_t>(statement.cases.size(), SWITCH_MAX_LEAF_SIZE);
+    for (size_t leafSize{1}; leafSize <= maxLeafSize; ++leafSize)
+    {
+        DispatchCode code;
+        SearchTreeGenerator{statement, labelPrefix, leafSize, &code.tokens}.generate();
+        measureDispatch(&code, statement);
+        if (best.tokens.empty() || code.averageCost < best.averageCost
+         || (code.averageCost == best.averageCost && code.size < best.size))
+        {
+            code.description = (leafSize >= statement.cases.size()
+                    ? std::string{"chain of comparisons"}
+                    : "search tree with leaves of " + std::to_string(leafSize) + " cases");
+            best = std::move(code);
+        }
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+
+void generateSwitch(const SwitchStatement& statement, const std::string& labelPrefix, Parser::tokenList_t* output)
+{
+    DispatchCode tree = generateSearchTree(statement, labelPrefix);
+    const std::string location = statement.location.toString() + ": %switch " + Parser::registerNames[statement.reg];
+
+    DispatchCode chosen;
+    switch (statement.strategy)
+    {
+    case SwitchStrategy::Auto:
+    {
+        if (!canUseJumpTable(statement))
+        {
+            chosen = std::move(tree);
+            break;
+        }
+        DispatchCode table = generateJumpTable(statement, labelPrefix);
+        const size_t tableEntries = statement.cases.back().value - statement.cases.front().value + 1;
+        Logger::log << location << ": " << table.description << ": " << table.size << " bytes, "
+            << table.averageCost << " us on average; " << tree.description << ": " << tree.size << " bytes, "
+            << tree.averageCost << " us on average" << Logger::End;
+        const bool isDense = tableEntries <= statement.cases.size()*SWITCH_MIN_TABLE_DENSITY;
+        chosen = (isDense && table.averageCost < tree.averageCost ? std::move(table) : std::move(tree));
+        break;
+    }
+
+    case SwitchStrategy::JumpTable:
+        if (!canUseJumpTable(statement))
+        {
+            throw std::runtime_error{"The values of a jump table must be within "
+                + std::to_string(SWITCH_MAX_TABLE_SPAN) + " of each other"};
+        }
+        chosen = generateJumpTable(statement, labelPrefix);
+        break;
+
+    case SwitchStrategy::SearchTree:
+        chosen = std::move(tree);
+        break;
+    }
+
+    Logger::log << location << ": " << statement.cases.size() << " cases, using a " << chosen.description
+        << " (" << chosen.size << " bytes, " << chosen.averageCost << " us on average)" << Logger::End;
+    output->insert(output->end(), chosen.tokens.begin(), chosen.tokens.end());
+}
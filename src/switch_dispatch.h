@@ -0,0 +1,60 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum class SwitchStrategy
+{
+    Auto,       // Chosen by the cost model
+    JumpTable,  // `jp v0, table` into a table of jumps
+    SearchTree, // Comparisons of the sorted values, chains of `sne`/`jp` in the leaves
+};
+
+struct SwitchCase
+{
+    uint8_t value{};
+    std::string labelName;
+    // The location of the `%case` line
+    Parser::SourceLocation location;
+};
+
+/*
+ * A `%switch vx` ... `%endswitch` block.
+ */
+struct SwitchStatement
+{
+    Parser::RegisterEnum reg = Parser::REGISTER_INVALID;
+    SwitchStrategy strategy = SwitchStrategy::Auto;
+    std::vector<SwitchCase> cases;
+    // Where the other values go, the code after the dispatch if empty
+    std::string defaultLabelName;
+
+    // The locations of the `%switch` and `%endswitch` lines
+    Parser::SourceLocation location;
+    Parser::SourceLocation endLocation;
+};
+
+/*
+ * Generates the code that jumps to the label of the case with the value of the register.
+ * The tokens get the location of the `%switch` or `%case` line they implement, so the listing
+ * shows the layout: the table entries or the tests of each case are next to it.
+ *
+ * The jump table is
+ *     ld v0, vx  ; add v0, -min   ; the offset of the value
+ *     ld vf, max-min ; sub vf, v0 ; se vf, 1 ; jp default
+ *     add v0, v0 ; jp v0, table
+ *   table: jp case_min ... jp case_max (jp default for the missing values)
+ * and overwrites v0 and vf. It needs the original `jp v0` (without the jump quirk).
+ * The search tree splits the sorted values with `ld vf, pivot ; subn vf, vx ; se vf, 0 ; jp upper_half`
+ * and tests the values in the leaves with `sne vx, value ; jp case`. It overwrites vf if it splits.
+ *
+ * With `SwitchStrategy::Auto` the table is used if it's faster on average (with the VIP timings)
+ * and at least a third of its entries are cases. The size of the leaves is chosen the same way.
+ * The local labels are named `labelPrefix` + a suffix.
+ *
+ * Throws if the forced strategy can't be used.
+ */
+void generateSwitch(const SwitchStatement& statement, const std::string& labelPrefix, Parser::tokenList_t* output);
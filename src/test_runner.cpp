@@ -0,0 +1,388 @@
+#include "test_runner.h"
+#include "Interpreter.h"
+#include "NetpbmImage.h"
+#include "InputFile.h"
+#include "IncludeCache.h"
+#include "assembler.h"
+#include "inliner.h"
+#include "parser.h"
+#include "common.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+/*
+ * Checks the assertions when the execution reaches their labels.
+ */
+class AssertionChecker final : public ExecutionObserver
+{
+private:
+    struct Check
+    {
+        const Parser::TestAssertion* assertion{};
+        int32_t value{};
+        bool isReached{};
+        bool hasFailed{};
+    };
+
+    const Interpreter& m_interpreter;
+    std::vector<Check> m_checks;
+    // Address -> indices of the checks
+    std::vector<std::vector<size_t>> m_checksByAddress;
+    std::vector<std::string>* m_failures{};
+    uint64_t m_checkCount{};
+
+    uint16_t getRegisterValue(Parser::RegisterEnum reg) const
+    {
+        switch (reg)
+        {
+        case Parser::REGISTER_I: return m_interpreter.getI();
+        case Parser::REGISTER_DT: return m_interpreter.getDelayTimer();
+        case Parser::REGISTER_ST: return m_interpreter.getSoundTimer();
+        default: return m_interpreter.getV(Parser::vRegisterToNibble(reg));
+        }
+    }
+
+    static bool compare(int32_t a, Parser::TestAssertion::Op op, int32_t b)
+    {
+        using Op = Parser::TestAssertion::Op;
+        switch (op)
+        {
+        case Op::Equal: return a == b;
+        case Op::NotEqual: return a != b;
+        case Op::Less: return a < b;
+        case Op::LessEqual: return a <= b;
+        case Op::Greater: return a > b;
+        case Op::GreaterEqual: return a >= b;
+        }
+        return false;
+    }
+
+public:
+    /*
+     * Resolves the labels and the values of the assertions.
+     *
+     * Throws on error.
+     */
+    AssertionChecker(const Interpreter& interpreter, const Parser::TestDirectives& directives,
+            const Parser::labelMap_t& labels, std::vector<std::string>* failures)
+        : m_interpreter{interpreter}, m_checksByAddress(CHIP8_MEMORY_SIZE), m_failures{failures}
+    {
+        auto resolveLabel{[&](const std::string& name, int32_t* value){
+            auto found = labels.find(name);
+            if (found == labels.end())
+                return false;
+            *value = ROM_LOAD_OFFSET + found->second;
+            return true;
+        }};
+
+        for (const auto& assertion : directives.assertions)
+        {
+            try
+            {
+                int32_t address{};
+                if (!resolveLabel(assertion.labelName, &address))
+                    throw std::runtime_error{"Reference to undefined label: " + assertion.labelName};
+                Check check;
+                check.assertion = &assertion;
+                check.value = assertion.value.evaluate(resolveLabel, address);
+                m_checksByAddress[address % CHIP8_MEMORY_SIZE].push_back(m_checks.size());
+                m_checks.push_back(check);
+            }
+            catch (std::exception& e)
+            {
+                throw std::runtime_error{assertion.location.toString() + ": " + e.what()};
+            }
+        }
+    }
+
+    void onInstruction(uint16_t address, uint16_t) override
+    {
+        for (size_t checkI : m_checksByAddress[address])
+        {
+            Check& check = m_checks[checkI];
+            check.isReached = true;
+            ++m_checkCount;
+            const uint16_t actual = getRegisterValue(check.assertion->reg);
+            if (check.hasFailed || compare(actual, check.assertion->op, check.value))
+                continue;
+
+            // Only the first failure of each assertion is reported
+            check.hasFailed = true;
+            m_failures->push_back(check.assertion->location.toString() + ": Assertion failed at \""
+                    + check.assertion->labelName + "\" in frame " + std::to_string(m_interpreter.getFrameCount())
+                    + ": " + check.assertion->conditionStr + " (" + Parser::registerNames[check.assertion->reg]
+                    + " is " + std::to_string(actual) + ')');
+        }
+    }
+
+    void onCall(uint16_t) override {}
+    void onReturn() override {}
+
+    /*
+     * Reports the assertions that were never checked.
+     */
+    void reportUnreached()
+    {
+        for (const auto& check : m_checks)
+        {
+            if (!check.isReached)
+                m_failures->push_back(check.assertion->location.toString() + ": Assertion never reached: \""
+                        + check.assertion->labelName + "\", " + check.assertion->conditionStr);
+        }
+    }
+
+    uint64_t getCheckCount() const { return m_checkCount; }
+};
+
+/*
+ * Compares the screen with the expected image and reports the differences.
+ */
+static void checkScreen(const Interpreter& interpreter, const Parser::ScreenExpectation& expectation,
+        std::vector<std::string>* failures)
+{
+    const std::string prefix = expectation.location.toString() + ": ";
+    NetpbmImage image;
+    image.open(expectation.imagePath);
+    if (image.getWidth() != CHIP8_SCREEN_WIDTH || image.getHeight() != CHIP8_SCREEN_HEIGHT)
+    {
+        failures->push_back(prefix + "The expected screen \"" + expectation.imagePath + "\" is "
+                + std::to_string(image.getWidth()) + 'x' + std::to_string(image.getHeight()) + ", not "
+                + std::to_string(CHIP8_SCREEN_WIDTH) + 'x' + std::to_string(CHIP8_SCREEN_HEIGHT));
+        return;
+    }
+
+    size_t differenceCount{};
+    size_t firstX{};
+    size_t firstY{};
+    for (size_t y{}; y < CHIP8_SCREEN_HEIGHT; ++y)
+    {
+        for (size_t x{}; x < CHIP8_SCREEN_WIDTH; ++x)
+        {
+            if (interpreter.getPixel(x, y) != image.getPixel(x, y) && !differenceCount++)
+            {
+                firstX = x;
+                firstY = y;
+            }
+        }
+    }
+    if (differenceCount)
+    {
+        failures->push_back(prefix + "The screen after " + std::to_string(expectation.frame) + " frames differs from \""
+                + expectation.imagePath + "\" in " + std::to_string(differenceCount) + " pixels, first at ("
+                + std::to_string(firstX) + ", " + std::to_string(firstY) + ')');
+    }
+}
+
+/*
+ * Assembles and runs a test. The errors are reported as failures,
+ * the messages of the assembler are kept in the result.
+ */
+static TestResult runTest(const std::string& filePath, const Options& options,
+        const InlineProfile* inlineProfile, IncludeCache* includeCache)
+{
+    TestResult result;
+    result.filePath = filePath;
+    // The tests run in parallel, the messages are written by the caller
+    Logger::Capture capture;
+    const auto startTime = std::chrono::steady_clock::now();
+    try
+    {
+        // ----- Assemble -----
+        InputFile file;
+        file.open(filePath);
+        const Parser::PreprocessedFile preprocessed = Parser::preprocessFile(
+                file.getContent(), filePath, options.includeDirs, includeCache, options.defines);
+        Parser::TestDirectives directives;
+        const AssembledProgram assembled = assembleProgram(preprocessed, options, inlineProfile, &directives);
+        const ByteList& program = assembled.output;
+
+        // ----- Run -----
+        Interpreter interpreter{quirksFromStr(options.quirks), options.instructionsPerFrame, options.seed};
+        interpreter.loadRom(program.data(), program.size());
+        if (!options.keyScriptPath.empty())
+            interpreter.setKeyScript(loadKeyScript(options.keyScriptPath));
+        AssertionChecker checker{interpreter, directives, assembled.labels, &result.failures};
+        interpreter.setObserver(&checker);
+
+        std::vector<const Parser::ScreenExpectation*> screens;
+        for (const auto& expectation : directives.screenExpectations)
+            screens.push_back(&expectation);
+        std::stable_sort(screens.begin(), screens.end(),
+                [](const auto* a, const auto* b){ return a->frame < b->frame; });
+
+        try
+        {
+            Interpreter::StopReason reason = Interpreter::StopReason::FrameLimit;
+            for (const auto* screen : screens)
+            {
+                // After the program stopped, the screen doesn't change anymore
+                if (reason == Interpreter::StopReason::FrameLimit)
+                    reason = interpreter.run(options.instructionLimit, screen->frame);
+                if (reason == Interpreter::StopReason::InstructionLimit)
+                {
+                    result.failures.push_back(screen->location.toString() + ": The instruction limit was reached "
+                            "before frame " + std::to_string(screen->frame));
+                    continue;
+                }
+                checkScreen(interpreter, *screen, &result.failures);
+            }
+            // Give the assertions the rest of the run
+            if (reason == Interpreter::StopReason::FrameLimit)
+                interpreter.run(options.instructionLimit, options.frameLimit ? options.frameLimit : UINT64_MAX);
+            checker.reportUnreached();
+        }
+        catch (std::exception& e)
+        {
+            result.failures.push_back(std::string{"Runtime error in frame "}
+                    + std::to_string(interpreter.getFrameCount()) + ": " + e.what());
+        }
+        result.instructionCount = interpreter.getInstructionCount();
+        result.frameCount = interpreter.getFrameCount();
+        result.checkCount = checker.getCheckCount();
+    }
+    catch (std::exception& e)
+    {
+        result.failures.push_back(e.what());
+    }
+    result.hasPassed = result.failures.empty();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-startTime).count();
+    result.messages = capture.takeMessages();
+    return result;
+}
+
+std::vector<TestResult> runTests(
+        const std::vector<std::string>& filePaths, const Options& options, unsigned int jobCount)
+{
+    InlineProfile inlineProfile;
+    if (!options.inlineProfilePath.empty())
+        inlineProfile = loadInlineProfile(options.inlineProfilePath);
+    const InlineProfile* inlineProfilePtr = options.inlineProfilePath.empty() ? nullptr : &inlineProfile;
+
+    if (!jobCount)
+        jobCount = std::max(std::thread::hardware_concurrency(), 1u);
+    jobCount = std::min<size_t>(jobCount, filePaths.size());
+    Logger::log << "Running " << filePaths.size() << " tests on " << jobCount << " threads" << Logger::End;
+
+    std::vector<TestResult> results(filePaths.size());
+    std::atomic<size_t> nextTest{};
+    auto work{[&](){
+        // The cache is not shared between the threads
+        IncludeCache includeCache;
+        for (size_t i = nextTest++; i < filePaths.size(); i = nextTest++)
+            results[i] = runTest(filePaths[i], options, inlineProfilePtr, &includeCache);
+    }};
+
+    std::vector<std::thread> threads;
+    for (unsigned int i{1}; i < jobCount; ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& thread : threads)
+        thread.join();
+    return results;
+}
+
+static std::string escapeXml(const std::string& str)
+{
+    std::string output;
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '<': output += "&lt;"; break;
+        case '>': output += "&gt;"; break;
+        case '&': output += "&amp;"; break;
+        case '"': output += "&quot;"; break;
+        case '\'': output += "&apos;"; break;
+        default: output += c; break;
+        }
+    }
+    return output;
+}
+
+static std::string escapeJson(const std::string& str)
+{
+    std::string output;
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"': output += "\\\""; break;
+        case '\\': output += "\\\\"; break;
+        case '\n': output += "\\n"; break;
+        case '\t': output += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                std::stringstream ss;
+                ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << +(unsigned char)c;
+                output += ss.str();
+            }
+            else
+            {
+                output += c;
+            }
+            break;
+        }
+    }
+    return output;
+}
+
+void writeJUnitReport(const std::vector<TestResult>& results, std::ostream& output)
+{
+    const size_t failureCount = std::count_if(results.begin(), results.end(),
+            [](const TestResult& result){ return !result.hasPassed; });
+    double totalSeconds{};
+    for (const auto& result : results)
+        totalSeconds += result.seconds;
+
+    output << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<testsuites tests=\"" << results.size() << "\" failures=\"" << failureCount
+        << "\" time=\"" << totalSeconds << "\">\n"
+        << "  <testsuite name=\"chip8asm\" tests=\"" << results.size() << "\" failures=\"" << failureCount
+        << "\" time=\"" << totalSeconds << "\">\n";
+    for (const auto& result : results)
+    {
+        output << "    <testcase name=\"" << escapeXml(result.filePath) << "\" classname=\"chip8asm\" time=\""
+            << result.seconds << '"';
+        if (result.hasPassed)
+        {
+            output << "/>\n";
+            continue;
+        }
+        output << ">\n      <failure message=\"" << escapeXml(result.failures[0]) << "\">";
+        for (const auto& failure : result.failures)
+            output << escapeXml(failure) << '\n';
+        output << "</failure>\n    </testcase>\n";
+    }
+    output << "  </testsuite>\n</testsuites>\n";
+}
+
+void writeJsonReport(const std::vector<TestResult>& results, std::ostream& output)
+{
+    const size_t failureCount = std::count_if(results.begin(), results.end(),
+            [](const TestResult& result){ return !result.hasPassed; });
+
+    output << "{\n  \"tests\": " << results.size() << ",\n  \"failures\": " << failureCount
+        << ",\n  \"results\": [";
+    for (size_t i{}; i < results.size(); ++i)
+    {
+        const TestResult& result = results[i];
+        output << (i ? "," : "") << "\n    {\"file\": \"" << escapeJson(result.filePath) << '"'
+            << ", \"passed\": " << (result.hasPassed ? "true" : "false")
+            << ", \"time\": " << result.seconds
+            << ", \"instructions\": " << result.instructionCount
+            << ", \"frames\": " << result.frameCount
+            << ", \"checks\": " << result.checkCount
+            << ", \"failures\": [";
+        for (size_t j{}; j < result.failures.size(); ++j)
+            output << (j ? ", " : "") << '"' << escapeJson(result.failures[j]) << '"';
+        output << "]}";
+    }
+    output << "\n  ]\n}\n";
+}
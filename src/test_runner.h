@@ -0,0 +1,45 @@
+#pragma once
+
+#include "arguments.h"
+#include "Logger.h"
+
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct TestResult
+{
+    std::string filePath;
+    bool hasPassed{};
+    // The reasons of the failure, empty if passed
+    std::vector<std::string> failures;
+    double seconds{};
+    uint64_t instructionCount{};
+    uint64_t frameCount{};
+    // The number of times the `%assert_at`s were checked
+    uint64_t checkCount{};
+    // The messages of the assembler, written after the tests
+    std::vector<Logger::CapturedMessage> messages;
+};
+
+/*
+ * Assembles each test source and runs it in the interpreter with the options of the interpreter,
+ * checking its `%assert_at` and `%expect_screen` directives.
+ * The tests run in parallel on `jobCount` threads (0 for one per core).
+ * After the screen checks a test runs until it stops or reaches the limits of the options.
+ *
+ * Returns the results in the order of the files.
+ */
+[[nodiscard]] std::vector<TestResult> runTests(
+        const std::vector<std::string>& filePaths, const Options& options, unsigned int jobCount);
+
+/*
+ * Writes the results in the JUnit XML format.
+ */
+void writeJUnitReport(const std::vector<TestResult>& results, std::ostream& output);
+
+/*
+ * Writes the results as a JSON object.
+ */
+void writeJsonReport(const std::vector<TestResult>& results, std::ostream& output);
@@ -0,0 +1,25 @@
+# Disassembles disasm/roundtrip.asm for every target and checks that the source assembles to the same ROM.
+# Run with -DASSEMBLER=<chip8asm> -DWORK_DIR=<dir for the outputs> from tests/regression.
+
+foreach(target chip8 schip xochip)
+    execute_process(COMMAND ${ASSEMBLER} --target ${target} disasm/roundtrip.asm -o ${WORK_DIR}/roundtrip.ch8
+        RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "Failed to assemble disasm/roundtrip.asm for ${target}")
+    endif()
+    execute_process(COMMAND ${ASSEMBLER} --target ${target} --disasm ${WORK_DIR}/roundtrip.ch8
+        -o ${WORK_DIR}/roundtrip-${target}.asm RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "Failed to disassemble the ROM for ${target}")
+    endif()
+    execute_process(COMMAND ${ASSEMBLER} --target ${target} ${WORK_DIR}/roundtrip-${target}.asm
+        -o ${WORK_DIR}/roundtrip-${target}.ch8 RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "The disassembly for ${target} doesn't assemble")
+    endif()
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/roundtrip.ch8 ${WORK_DIR}/roundtrip-${target}.ch8
+        RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "The disassembly for ${target} assembles to a different ROM")
+    endif()
+endforeach()
@@ -0,0 +1,20 @@
+# Assembles patch/new.asm against patch/old.asm and compares the patches with the checked ones.
+# Run with -DASSEMBLER=<chip8asm> -DWORK_DIR=<dir for the outputs> from tests/regression.
+
+execute_process(COMMAND ${ASSEMBLER} patch/old.asm -o ${WORK_DIR}/old.ch8 RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "Failed to assemble patch/old.asm")
+endif()
+
+foreach(format ips bps)
+    execute_process(COMMAND ${ASSEMBLER} patch/new.asm -o ${WORK_DIR}/new.ch8
+        --patch-against ${WORK_DIR}/old.ch8 --patch-out ${WORK_DIR}/new.${format} RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "Failed to write the ${format} patch")
+    endif()
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/new.${format} patch/new.${format}
+        RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "The ${format} patch differs from patch/new.${format}")
+    endif()
+endforeach()
@@ -0,0 +1,30 @@
+# Assembles the variants of variants.txt and compares them with the builds of the same defines given by -D.
+# Run with -DASSEMBLER=<chip8asm> -DWORK_DIR=<dir for the outputs> from tests/regression.
+
+execute_process(COMMAND ${ASSEMBLER} defines.asm --variants variants.txt -o ${WORK_DIR}/defines.ch8
+    RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "Failed to assemble the variants")
+endif()
+execute_process(COMMAND ${ASSEMBLER} defines.asm -o ${WORK_DIR}/normal.ch8 RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "Failed to assemble defines.asm")
+endif()
+execute_process(COMMAND ${ASSEMBLER} defines.asm -D SPEED=7 -o ${WORK_DIR}/fast.ch8 RESULT_VARIABLE result)
+if(result)
+    message(FATAL_ERROR "Failed to assemble defines.asm with -D")
+endif()
+
+foreach(variant normal fast)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/defines-${variant}.ch8 ${WORK_DIR}/${variant}.ch8
+        RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "The variant \"${variant}\" differs from the build with -D")
+    endif()
+endforeach()
+# The define must have changed the program
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/normal.ch8 ${WORK_DIR}/fast.ch8
+    RESULT_VARIABLE result)
+if(NOT result)
+    message(FATAL_ERROR "-D SPEED=7 didn't change the program")
+endif()
@@ -0,0 +1,45 @@
+; The data must read the same with and without --pack-data (ctest runs both)
+
+main:
+    ld i, first
+    ld v3, [i]
+read_first:
+    ld i, same
+    ld v3, [i]
+read_same:
+    ld i, inside
+    ld v1, [i]
+read_inside:
+    ld i, overlapped
+    ld v3, [i]
+read_overlapped:
+    ld i, offset+2
+    ld v1, [i]
+read_offset:
+    jp read_offset
+
+first:
+    db 1, 2, 3, 4
+; Identical to `first`
+same:
+    db 1, 2, 3, 4
+; A part of `first`
+inside:
+    db 3, 4
+; Starts with the end of `first`
+overlapped:
+    db 3, 4, 5, 6
+; Read past the start, so it stays in place
+offset:
+    db 9, 8, 7, 6
+
+%assert_at read_first, v0 == 1
+%assert_at read_first, v3 == 4
+%assert_at read_same, v0 == 1
+%assert_at read_same, v3 == 4
+%assert_at read_inside, v0 == 3
+%assert_at read_inside, v1 == 4
+%assert_at read_overlapped, v0 == 3
+%assert_at read_overlapped, v3 == 6
+%assert_at read_offset, v0 == 7
+%assert_at read_offset, v1 == 6
@@ -0,0 +1,16 @@
+; %define, replaced by -D and by the defines of a variant (see variants.txt)
+
+%define SPEED 3
+%define DOUBLE_SPEED (SPEED*2)
+
+main:
+    ld v0, SPEED
+    ld v1, DOUBLE_SPEED
+    ld v2, 0
+    add v2, v0
+defined:
+    jp defined
+
+%assert_at defined, v0 == 3
+%assert_at defined, v1 == 6
+%assert_at defined, v2 == SPEED
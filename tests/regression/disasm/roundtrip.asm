@@ -0,0 +1,16 @@
+; Disassembled and assembled again by check_disasm.cmake, the ROM must stay the same
+
+main:
+    ld v0, 1
+    ld i, sprite
+    call draw
+    ; `drw v7, v7, 0` draws a 16x16 sprite on SUPER-CHIP, it is data for CHIP-8
+    db 0xd7, 0x70
+    jp main
+
+draw:
+    drw v0, v0, 4
+    ret
+
+sprite:
+    db 0xf0, 0x90, 0x90, 0xf0
@@ -0,0 +1,3 @@
+; A byte operand below -128
+main:
+    ld v0, -129
@@ -0,0 +1,3 @@
+; 4000 fits in the 12 bits of an operand, but not in a byte
+main:
+    ld v2, 4000
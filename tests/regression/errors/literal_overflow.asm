@@ -0,0 +1,3 @@
+; Wider than 32 bits, it must not wrap to 1
+main:
+    ld v0, 0x100000001
@@ -0,0 +1,3 @@
+; DRW draws at most 15 rows
+main:
+    drw v0, v1, 16
@@ -0,0 +1,3 @@
+; The result of the multiplication is larger than 32 bits
+main:
+    ld v0, 65536*65536
@@ -0,0 +1,2 @@
+; Includes itself without %once
+%include "recursive_include.asm"
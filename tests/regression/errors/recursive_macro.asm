@@ -0,0 +1,7 @@
+; Expands itself until the depth limit
+%macro forever
+    forever
+%endmacro
+
+main:
+    forever
@@ -0,0 +1,41 @@
+; The expression evaluator: precedence, functions, labels and `$`
+
+%define BASE 0x10
+
+main:
+    ld v0, 2+3*4
+    ld v1, (2+3)*4
+    ld v2, BASE<<2|1
+    ld v3, 100/7+100%7
+    ld v4, -1
+    ld v5, ~0x0f&0xff
+    ld v6, lo(0x1234)
+    ld v7, hi(0x1234)
+    ld v8, min(3,-2)+max(3,-2)
+    ld v9, clamp(300,0,255)
+    ld va, sin(64,256,100)
+    ld vb, cos(128,256,-100)
+    ld vc, lo(table+2)
+    ld vd, hi(table)
+    ld ve, lo($+1)
+values:
+    jp values
+
+table:
+    db 1, 2, 3, 4
+
+%assert_at values, v0 == 14
+%assert_at values, v1 == 20
+%assert_at values, v2 == 0x41
+%assert_at values, v3 == 16
+%assert_at values, v4 == 0xff
+%assert_at values, v5 == 0xf0
+%assert_at values, v6 == 0x34
+%assert_at values, v7 == 0x12
+%assert_at values, v8 == 1
+%assert_at values, v9 == 255
+%assert_at values, va == 100
+%assert_at values, vb == 100
+%assert_at values, vc == lo(table+2)
+%assert_at values, vd == 2
+%assert_at values, ve == lo(values-1)
@@ -0,0 +1,14 @@
+; %include: search paths, repeated includes and %once
+
+main:
+    ld v0, 0
+    ld v1, 0
+%include "include/constants.inc"
+%include "include/increment.inc"
+%include "include/increment.inc"
+%include "include/constants.inc"
+done:
+    jp done
+
+%assert_at done, v0 == 3*STEP
+%assert_at done, v1 == 1
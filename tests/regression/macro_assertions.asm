@@ -0,0 +1,22 @@
+; %assert_at in a macro body: checked at the local label of every expansion,
+; also of the ones copied from the cache and the ones in other macros.
+; ctest checks the number of checks, an assertion that is dropped doesn't fail.
+
+%macro expect reg, value
+%%here:
+    %assert_at %%here, reg == value
+%endmacro
+
+%macro set_and_expect reg, value
+    ld reg, value
+    expect reg, value
+%endmacro
+
+main:
+    set_and_expect v0, 5
+    expect v0, 5
+    expect v0, 5
+    set_and_expect v1, 6
+    set_and_expect v0, 7
+done:
+    jp done
@@ -0,0 +1,50 @@
+; Macros: parameters, local labels, nesting and literals in the body
+
+%macro set_pair a, b, value
+    ld a, value
+    ld b, value+1
+%endmacro
+
+%macro count_down reg
+    ld reg, 3
+%%loop:
+    add reg, -1
+    se reg, 0
+    jp %%loop
+%endmacro
+
+%macro twice reg
+    count_down reg
+    add reg, 10
+%endmacro
+
+; The parameters are not replaced in the strings and the character literals,
+; and a `;` in them doesn't start a comment
+%macro text n
+    db "n;n", n, 'n', 0
+%endmacro
+
+main:
+    set_pair v0, v1, 5
+    count_down v2
+    twice v3
+    twice v4
+checked:
+    ld i, message
+    ld v4, [i]
+loaded:
+    jp loaded
+
+message:
+    text 7
+
+%assert_at checked, v0 == 5
+%assert_at checked, v1 == 6
+%assert_at checked, v2 == 0
+%assert_at checked, v3 == 10
+%assert_at checked, v4 == 10
+%assert_at loaded, v0 == 'n'
+%assert_at loaded, v1 == 0x3b ; ';'
+%assert_at loaded, v2 == 'n'
+%assert_at loaded, v3 == 7
+%assert_at loaded, v4 == 'n'
@@ -0,0 +1,15 @@
+; old.asm with a changed byte, a changed sprite and a longer end
+
+main:
+    ld v0, 3
+    ld v1, 2
+    call draw
+    jp main
+
+draw:
+    ld i, sprite
+    drw v0, v1, 6
+    ret
+
+sprite:
+    db 0xf0, 0x90, 0x60, 0x60, 0x90, 0xf0
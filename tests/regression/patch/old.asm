@@ -0,0 +1,15 @@
+; The previous release, new.asm is patched against it by check_patch.cmake
+
+main:
+    ld v0, 1
+    ld v1, 2
+    call draw
+    jp main
+
+draw:
+    ld i, sprite
+    drw v0, v1, 4
+    ret
+
+sprite:
+    db 0xf0, 0x90, 0x90, 0xf0
@@ -0,0 +1,61 @@
+; Virtual registers: sharing V registers between temporaries and spilling when 16 are live
+
+main:
+    %reg r1 r2 r3 r4 r5 r6 r7 r8 r9 r10 r11 r12 r13 r14 r15 r16
+    ld ve, 0
+    ld r1, 1
+    ld r2, 2
+    ld r3, 3
+    ld r4, 4
+    ld r5, 5
+    ld r6, 6
+    ld r7, 7
+    ld r8, 8
+    ld r9, 9
+    ld r10, 10
+    ld r11, 11
+    ld r12, 12
+    ld r13, 13
+    ld r14, 14
+    ld r15, 15
+    ld r16, 16
+    ; All 16 are live here and VE is used, so some are spilled and loaded to V0
+    add ve, r1
+    add ve, r2
+    add ve, r3
+    add ve, r4
+    add ve, r5
+    add ve, r6
+    add ve, r7
+    add ve, r8
+    add ve, r9
+    add ve, r10
+    add ve, r11
+    add ve, r12
+    add ve, r13
+    add ve, r14
+    add ve, r15
+    add ve, r16
+    call scaled
+    call offset
+summed:
+    jp summed
+
+; The temporaries of the two subroutines may share a register
+scaled:
+    %reg twice
+    ld twice, ve
+    add twice, twice
+    ld vd, twice
+    ret
+
+offset:
+    %reg biased
+    ld biased, ve
+    add biased, 100
+    ld vc, biased
+    ret
+
+%assert_at summed, ve == 16*17/2
+%assert_at summed, vd == (16*17)%256 ; the add wraps
+%assert_at summed, vc == 16*17/2+100
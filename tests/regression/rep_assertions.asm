@@ -0,0 +1,13 @@
+; %assert_at in a %rep body: added for every copy, with the local labels of the copy
+; and the value of the variable. ctest checks the number of checks.
+
+main:
+    ld v0, 0
+%rep 3 n
+    add v0, 1
+%%counted:
+    %assert_at %%counted, v0 == n+1
+    %assert_at repeated, v0 > n
+%endrep
+repeated:
+    jp repeated
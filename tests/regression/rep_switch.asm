@@ -0,0 +1,63 @@
+; %rep with and without a variable, %switch as a jump table and as a search tree
+
+main:
+    ld v1, 0
+%rep 4 n
+    add v1, n+1
+%endrep
+%rep 3
+    add v2, 2
+%endrep
+%rep 0
+    this line is not parsed
+%endrep
+repeated:
+
+    ld v3, 0
+    ld v4, 0
+    ld v5, 0
+next_value:
+    %switch v3 table
+    %case 0 table_zero
+    %case 1 table_one
+    %case 3 table_three
+    %default table_other
+    %endswitch
+table_zero:
+    add v4, 1
+    jp table_end
+table_one:
+    add v4, 0x10
+    jp table_end
+table_three:
+    add v4, 0x40
+    jp table_end
+table_other:
+    add v5, 1
+table_end:
+    %switch v3 tree
+    %case 0 tree_small
+    %case 1 tree_small
+    %case 200 tree_large
+    %case 255 tree_large
+    %endswitch
+    jp tree_end
+tree_small:
+    add v6, 1
+    jp tree_end
+tree_large:
+    add v7, 1
+tree_end:
+    add v3, 1
+    se v3, 6
+    jp next_value
+done:
+    jp done
+
+%assert_at repeated, v1 == 1+2+3+4
+%assert_at repeated, v2 == 6
+; The values 0 to 5: 0, 1 and 3 have cases, 2, 4 and 5 go to the default
+%assert_at done, v4 == 0x51
+%assert_at done, v5 == 3
+%assert_at done, v6 == 2
+%assert_at done, v7 == 0